@@ -0,0 +1,474 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "files.h"
+#include "eval.h"
+#include "optimize.h"
+
+
+// results are lines of tab separated fields, the first line names them
+#define BENCH_HEADER "workload\tphase\tbytes\truns\tmin_ns\tmedian_ns\n"
+
+#define BENCH_MAX_RUNS 1000
+
+// phases this much slower are still within the noise of the timer and the scheduler
+#define BENCH_MIN_SLOWDOWN_NS 100000
+
+
+
+// GENERATED TEXT
+typedef struct{
+	char  *data;
+	size_t size;
+	size_t capacity;
+} BenchText;
+
+static void bench_printf(BenchText *text, const char *format, ...){
+	for (;;){
+		va_list args;
+		va_start(args, format);
+		size_t space = text->capacity - text->size;
+		int length = vsnprintf(text->data + text->size, space, format, args);
+		va_end(args);
+		assert(length >= 0);
+		if ((size_t)length < space){
+			text->size += length;
+			return;
+		}
+		text->capacity = util_max_usize(4096, 2*text->capacity + length);
+		text->data = realloc(text->data, text->capacity);
+		assert(text->data != NULL && "bench text allocation failrule");
+	}
+}
+
+// workloads are the same on every machine, so results of two builds can be compared
+static uint64_t bench_random(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+
+
+// WORKLOADS
+// every generator writes about scale*lines lines
+typedef struct{
+	const char *name;
+	void (*generate)(BenchText *text, size_t lines, uint64_t *seed);
+} BenchWorkload;
+
+
+// functions that call the ones defined before them
+static void bench_gen_definitions(BenchText *text, size_t lines, uint64_t *seed){
+	bench_printf(text, "f0 = (a, b) => a*b + 1\n");
+	for (size_t i=1; i!=lines; i+=1){
+		size_t callee = bench_random(seed) % i;
+		bench_printf(text, "f%zu = (a, b) => a < b ? f%zu(b, a) : a - b*%zu\n", i, callee, i % 97);
+	}
+	bench_printf(text, "f%zu(3, 4)\n", lines - 1);
+}
+
+// parentheses and conditionals nested below the lexer's limit of scopes
+static void bench_gen_nesting(BenchText *text, size_t lines, uint64_t *seed){
+	for (size_t i=0; i!=lines; i+=1){
+		size_t depth = 8 + bench_random(seed) % 48;
+		bench_printf(text, "n%zu = ", i % 64);
+		for (size_t j=0; j!=depth; j+=1) bench_printf(text, "(");
+		bench_printf(text, "%zu", i);
+		for (size_t j=depth; j!=0; j-=1){
+			bench_printf(text, " %s %zu)", j % 2 ? "+" : "*", j);
+			if (j % 5 == 0) bench_printf(text, " > %zu ? %zu : %zu", j, j, i);
+		}
+		bench_printf(text, "\n");
+	}
+}
+
+// long names that are looked up in a table of a few hundred variables
+static void bench_gen_identifiers(BenchText *text, size_t lines, uint64_t *seed){
+	const size_t VarCount = 256;
+	for (size_t i=0; i!=VarCount; i+=1){
+		bench_printf(text, "variable_with_a_long_name_%03zx = %zu\n", i, i);
+	}
+	for (size_t i=VarCount; i<lines; i+=1){
+		for (size_t j=0; j!=8; j+=1){
+			bench_printf(text, "%svariable_with_a_long_name_%03zx", j == 0 ? "" : j % 2 ? " + " : " - ",
+				(size_t)(bench_random(seed) % VarCount)
+			);
+		}
+		bench_printf(text, "\n");
+	}
+}
+
+// numbers in every base, reals and strings with escapes
+static void bench_gen_literals(BenchText *text, size_t lines, uint64_t *seed){
+	for (size_t i=0; i!=lines; i+=1){
+		uint64_t r = bench_random(seed);
+		bench_printf(text, "d = %lu; x = 0x%lx; o = 0o%lo; r = %lu.%03lu; s = \"literal %lu\\n\"; g = %lu_%03lu\n",
+			r % 100000, r >> 40, r & 0xffff, r % 1000, (r >> 10) % 1000, r % 7919, 1 + (r >> 20) % 999, (r >> 30) % 1000
+		);
+	}
+}
+
+// short statements between line and block comments
+static void bench_gen_comments(BenchText *text, size_t lines, uint64_t *seed){
+	bench_printf(text, "c = 0\n");
+	for (size_t i=0; i!=lines; i+=1){
+		switch (bench_random(seed) % 3){
+		case 0:
+			bench_printf(text, "// comment %zu that explains the statement below it in some detail\n", i);
+			break;
+		case 1:
+			bench_printf(text, "/* block comment %zu\n   spanning /* nested */ lines */ c = %zu\n", i, i);
+			break;
+		case 2:
+			bench_printf(text, "c = c + 1 // trailing comment of the statement %zu\n", i);
+			break;
+		}
+	}
+	bench_printf(text, "c\n");
+}
+
+// calls that go deep, like examples/ack
+static void bench_gen_recursion(BenchText *text, size_t lines, uint64_t *seed){
+	bench_printf(text,
+		"ack = (m, n) => m==0 ? n+1 : n==0 ? ack(m-1, 1) : ack(m-1, ack(m, n-1))\n"
+		"sum = (n) => n == 0 ? 0 : n + sum(n-1)\n"
+	);
+	for (size_t i=0; i<lines; i+=4000){
+		bench_printf(text, "ack(2, %lu)\n", 100 + bench_random(seed) % 100);
+		bench_printf(text, "sum(%lu)\n", 10000 + bench_random(seed) % 10000);
+	}
+}
+
+static const BenchWorkload BenchWorkloads[] = {
+	{ "definitions", bench_gen_definitions },
+	{ "nesting",     bench_gen_nesting },
+	{ "identifiers", bench_gen_identifiers },
+	{ "literals",    bench_gen_literals },
+	{ "comments",    bench_gen_comments },
+	{ "recursion",   bench_gen_recursion },
+};
+
+static BenchText bench_generate(const BenchWorkload *workload, size_t scale){
+	BenchText res = {0};
+	uint64_t seed = 0x9e3779b97f4a7c15u;
+	workload->generate(&res, 20000*scale, &seed);
+	return res;
+}
+
+
+
+// PHASES
+// every phase is timed on its own, the ones after it start from a fresh copy of its result
+enum BenchPhase{
+	BenchPhase_Read,
+	BenchPhase_Lex,
+	BenchPhase_Parse,
+	BenchPhase_Optimize,
+	BenchPhase_Eval,
+	BenchPhase_Count,
+};
+
+static const char *const BenchPhaseNames[] = { "read", "lex", "parse", "optimize", "eval" };
+
+typedef struct{
+	const char *workload;
+	const char *phase;
+	size_t   bytes;
+	size_t   runs;
+	uint64_t min_ns;
+	uint64_t median_ns;
+} BenchResult;
+
+
+static uint64_t bench_now(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec*1000000000u + t.tv_nsec;
+}
+
+static int bench_compare_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// returns false if the workload can't be compiled or evaluated
+static bool bench_run_phase(const char *path, enum BenchPhase phase, AstArray tokens, AstArray ast, uint64_t *ns){
+	uint64_t start = 0, stop = 0;
+	bool ok = true;
+	switch (phase){
+	case BenchPhase_Read:{
+		FILE *file = fopen(path, "r");
+		if (file == NULL) return false;
+		start = bench_now();
+		StringView text = read_file(file);
+		stop = bench_now();
+		fclose(file);
+		ok = text.data != NULL;
+		mem_free(text.data);
+		break;
+	}
+	case BenchPhase_Lex:{
+		FILE *file = fopen(path, "r");
+		if (file == NULL) return false;
+		StringView text = read_file(file);
+		fclose(file);
+		if (text.data == NULL) return false;
+		start = bench_now();
+		AstArray res = make_tokens(text.data);
+		stop = bench_now();
+		ok = res.data != NULL;
+		mem_free(res.data);
+		mem_free(text.data);
+		break;
+	}
+	case BenchPhase_Parse:{
+		AstArray res = ast_array_clone(tokens);
+		if (res.data == NULL) return false;
+		AstNode *buffer = res.data;
+		start = bench_now();
+		res = parse_tokens(res);
+		stop = bench_now();
+		ok = res.data != NULL;
+		mem_free(buffer);
+		break;
+	}
+	case BenchPhase_Optimize:{
+		AstArray res = ast_array_clone(ast);
+		if (res.data == NULL) return false;
+		OptimizeStats stats;
+		start = bench_now();
+		res = optimize_ast(res, &stats);
+		stop = bench_now();
+		mem_free(res.data);
+		break;
+	}
+	case BenchPhase_Eval:{
+		// values folded by the optimizer are released after every evaluation
+		AstArray res = ast_array_clone(ast);
+		if (res.data == NULL) return false;
+		OptimizeStats stats;
+		res = optimize_ast(res, &stats);
+		start = bench_now();
+		EvalError err = eval_ast(res);
+		output_flush();
+		stop = bench_now();
+		ok = err.msg == NULL;
+		if (!ok) fprintf(stderr, "error: \"%s\" at %u\n", err.msg, err.pos);
+		mem_free(res.data);
+		break;
+	}
+	default: return false;
+	}
+	*ns = stop - start;
+	return ok;
+}
+
+// the text is written to a file, so reading is measured like in intcalc
+static bool bench_workload(
+	const BenchWorkload *workload, size_t scale, size_t runs, const char *phases,
+	BenchResult *results, size_t *result_count
+){
+	BenchText text = bench_generate(workload, scale);
+	char path[] = "/tmp/intcalc_bench_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1){
+		free(text.data);
+		return false;
+	}
+	bool ok = write(fd, text.data, text.size) == (ssize_t)text.size;
+	close(fd);
+
+	AstArray tokens = {0}, ast = {0};
+	if (ok){
+		tokens = make_tokens(text.data);
+		ast = ast_array_clone(tokens);
+		if (ast.data != NULL) ast = parse_tokens(ast);
+		// the parser's end is its terminator, copies for other phases need it too
+		if (ast.data != NULL) ast.end += 1;
+		if (tokens.data == NULL || ast.data == NULL){
+			fprintf(stderr, "error: \"%s\" in workload %s\n",
+				tokens.data == NULL ? tokens.error : ast.error, workload->name
+			);
+			ok = false;
+		}
+	}
+
+	// runs compile into the arena like intcalc does, after the first run its pages are reused
+	MemArena arena = vmem_arena(vmem_default_reserve());
+	uint64_t times[BENCH_MAX_RUNS];
+	for (size_t phase=0; ok && phase!=BenchPhase_Count; phase+=1){
+		if (phases != NULL && strstr(phases, BenchPhaseNames[phase]) == NULL) continue;
+		for (size_t i=0; ok && i!=runs; i+=1){
+			global_mem_arena = &arena;
+			ok = bench_run_phase(path, phase, tokens, ast, times + i);
+			global_mem_arena = NULL;
+			mem_arena_reset(&arena);
+		}
+		if (!ok) break;
+		qsort(times, runs, sizeof(uint64_t), bench_compare_u64);
+		results[*result_count] = (BenchResult){
+			.workload = workload->name, .phase = BenchPhaseNames[phase],
+			.bytes = text.size, .runs = runs, .min_ns = times[0], .median_ns = times[runs/2],
+		};
+		*result_count += 1;
+		fprintf(stderr, "%-12s %-9s %12.3lf ms\n", workload->name, BenchPhaseNames[phase], times[runs/2]*0.000001);
+	}
+	vmem_arena_release(&arena);
+	unlink(path);
+	mem_free(tokens.data);
+	mem_free(ast.data);
+	free(text.data);
+	return ok;
+}
+
+
+
+// rows of the baseline that match a result by workload and phase, medians
+// slower by more than the threshold and by more than min_slowdown ns are
+// regressions when even the fastest run is slower than the baseline median,
+// returns their number
+// returns their number
+static size_t bench_compare(
+	const char *path, const BenchResult *results, size_t result_count, double threshold, uint64_t min_slowdown
+){
+	FILE *file = fopen(path, "r");
+	if (file == NULL){
+		fprintf(stderr, "error while reading the baseline: \"%s\"\n", path);
+		return 1;
+	}
+	size_t regressions = 0;
+	char  *line = NULL;
+	size_t capacity = 0;
+	while (getline(&line, &capacity, file) > 0){
+		char workload[64], phase[64];
+		size_t bytes, runs;
+		uint64_t min_ns, median_ns;
+		if (sscanf(line, "%63[^\t]\t%63[^\t]\t%zu\t%zu\t%lu\t%lu", workload, phase, &bytes, &runs, &min_ns, &median_ns) != 6)
+			continue; // header
+		for (size_t i=0; i!=result_count; i+=1){
+			const BenchResult *res = results + i;
+			if (strcmp(res->workload, workload) != 0 || strcmp(res->phase, phase) != 0) continue;
+			if (res->bytes != bytes){
+				fprintf(stderr, "%-12s %-9s workload differs from the baseline\n", workload, phase);
+				break;
+			}
+			double change = ((double)res->median_ns - (double)median_ns) / (double)median_ns;
+			bool regressed = change > threshold && res->median_ns > median_ns + min_slowdown && res->min_ns > median_ns;
+			regressions += regressed;
+			fprintf(stderr, "%-12s %-9s %12.3lf -> %12.3lf ms %+7.1lf%%%s\n", workload, phase,
+				median_ns*0.000001, res->median_ns*0.000001, 100*change, regressed ? "  REGRESSION" : ""
+			);
+			break;
+		}
+	}
+	free(line);
+	fclose(file);
+	return regressions;
+}
+
+
+
+int main(int argc, char **argv){
+	size_t scale = 1;
+	size_t runs = 5;
+	const char *only_workload = NULL;
+	const char *phases = NULL;
+	const char *generate = NULL;
+	const char *baseline = NULL;
+	double threshold = 0.1;
+	uint64_t min_slowdown = BENCH_MIN_SLOWDOWN_NS;
+	for (int i=1; i!=argc; i+=1){
+		const char *opt = argv[i];
+		if (opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0'){
+			fprintf(stderr, "unknown argument: %s\n", opt);
+			return 10;
+		}
+		if (opt[1] == 'h'){
+			printf(
+				"bench <options>\n  options:\n"
+				"  -h     print help\n"
+				"  -x <n> scale workloads by n, default 1\n"
+				"  -r <n> runs of every phase, the median is reported, default 5\n"
+				"  -w <w> run only workload w\n"
+				"  -p <p> run only phases named in p, e.g. lex,parse\n"
+				"  -g <w> write workload w to standard output and exit\n"
+				"  -c <f> compare with baseline file f, exit with 1 on a regression\n"
+				"  -t <n> slowdown in percent that counts as a regression, default 10\n"
+				"  -m <n> slowdown in microseconds that a regression needs at least, default 100\n"
+				"  results are written to standard output as tab separated values,\n"
+				"  a saved result is a baseline\n"
+				"  workloads:"
+			);
+			for (size_t j=0; j!=SIZE(BenchWorkloads); j+=1) printf(" %s", BenchWorkloads[j].name);
+			printf("\n  phases: read lex parse optimize eval\n");
+			return 0;
+		}
+		if (i+1 == argc){
+			fprintf(stderr, "option %s expects a value\n", opt);
+			return 10;
+		}
+		i += 1;
+		switch (opt[1]){
+		case 'x': scale = util_max_usize(1, strtoull(argv[i], NULL, 10)); break;
+		case 'r': runs = util_clamp_usize(strtoull(argv[i], NULL, 10), 1, BENCH_MAX_RUNS); break;
+		case 'w': only_workload = argv[i]; break;
+		case 'p': phases = argv[i]; break;
+		case 'g': generate = argv[i]; break;
+		case 'c': baseline = argv[i]; break;
+		case 't': threshold = strtod(argv[i], NULL) * 0.01; break;
+		case 'm': min_slowdown = (uint64_t)(strtod(argv[i], NULL) * 1000); break;
+		default:
+			fprintf(stderr, "unknown option: %s\n", opt);
+			return 10;
+		}
+	}
+
+	const char *name = generate != NULL ? generate : only_workload;
+	const BenchWorkload *workload = NULL;
+	for (size_t i=0; name!=NULL && i!=SIZE(BenchWorkloads); i+=1){
+		if (strcmp(BenchWorkloads[i].name, name) == 0) workload = BenchWorkloads + i;
+	}
+	if (name != NULL && workload == NULL){
+		fprintf(stderr, "unknown workload: %s\n", name);
+		return 10;
+	}
+	if (generate != NULL){
+		BenchText text = bench_generate(workload, scale);
+		fwrite(text.data, 1, text.size, stdout);
+		free(text.data);
+		return 0;
+	}
+
+	initialize_compiler_globals();
+	eval_init_builtins();
+	int null_fd = open("/dev/null", O_WRONLY);
+	output_init(null_fd, false);
+
+	BenchResult results[SIZE(BenchWorkloads) * BenchPhase_Count];
+	size_t result_count = 0;
+	int status = 0;
+	for (size_t i=0; i!=SIZE(BenchWorkloads); i+=1){
+		if (workload != NULL && workload != BenchWorkloads + i) continue;
+		if (!bench_workload(BenchWorkloads + i, scale, runs, phases, results, &result_count)){
+			fprintf(stderr, "workload %s failed\n", BenchWorkloads[i].name);
+			status = 1;
+		}
+	}
+	output_finish();
+	close(null_fd);
+
+	printf(BENCH_HEADER);
+	for (size_t i=0; i!=result_count; i+=1){
+		const BenchResult *res = results + i;
+		printf("%s\t%s\t%zu\t%zu\t%lu\t%lu\n",
+			res->workload, res->phase, res->bytes, res->runs, res->min_ns, res->median_ns
+		);
+	}
+	if (baseline != NULL && bench_compare(baseline, results, result_count, threshold, min_slowdown) != 0) status = 1;
+	return status;
+}
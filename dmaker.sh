@@ -3,7 +3,7 @@
 FILE=intcalc
 
 gcc ${FILE}.c -o ${FILE} -ggdb \
-	-Iinclude -lm \
+	-Iinclude -lm -lpthread \
 	-Wall -Wextra -Wno-attributes -Wno-unused-function -Wno-unused-variable \
 	-Wno-unused-label -Wno-unused-parameter -Wno-unused-but-set-variable \
 	-Wno-switch \
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "embed.h"
+
+
+// every thread compiles and calls its own program in its own context
+#define EMBED_TEST_THREADS 4
+#define EMBED_TEST_CALLS 10000
+
+
+
+// CHECKS
+typedef struct{
+	long   id;
+	size_t failures;
+} EmbedTest;
+
+static void embed_test_fail(EmbedTest *test, const char *format, ...){
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "context %ld: ", test->id);
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+	test->failures += 1;
+}
+
+static void embed_test_error(EmbedTest *test, const char *what, EvalError err, const char *expected){
+	if (expected == NULL && err.msg != NULL){
+		embed_test_fail(test, "%s: unexpected error: %s", what, err.msg);
+	} else if (expected != NULL && (err.msg == NULL || strcmp(err.msg, expected) != 0)){
+		embed_test_fail(test, "%s: expected the error \"%s\", got \"%s\"", what, expected, err.msg ? err.msg : "none");
+	}
+}
+
+static void embed_test_integer(EmbedTest *test, const char *what, Value value, int64_t expected){
+	if (value.type != DT_Integer || value.data.integer != expected){
+		embed_test_fail(test, "%s: expected %ld, got %ld", what, expected, value.data.integer);
+	}
+}
+
+
+
+// WORKER
+static void *embed_test_worker(void *arg){
+	EmbedTest *test = arg;
+	long id = test->id;
+	char text[256];
+	snprintf(text, sizeof(text),
+		"k%ld = %ld; s = \"hello\"; f = (x, y) => x*y + k%ld; g = (n) => n < 2 ? n : g(n-1) + g(n-2);"
+		" c = g(10) + k%ld; h = (x) => x + c; s; f(2, 3); [1,2,3] * 2;\n",
+		id, id, id, id
+	);
+	EvalError err;
+	EmbedContext *context = embed_context_new();
+	EmbedProgram *program = embed_compile(context, text, &err);
+	embed_test_error(test, "compile", err, NULL);
+	if (program == NULL){
+		embed_context_free(context);
+		return NULL;
+	}
+	EmbedEvaluator *evaluator = embed_evaluator_new(context);
+
+	// whole program, its output is captured by the evaluator
+	embed_test_error(test, "run", embed_run(evaluator, program), NULL);
+	char expected[64];
+	snprintf(expected, sizeof(expected), "hello\n%ld\n[2, 4, 6]\n", 6 + id);
+	size_t size;
+	const char *output = embed_output(evaluator, &size);
+	if (size != strlen(expected) || memcmp(output, expected, size) != 0){
+		embed_test_fail(test, "run: unexpected output \"%.*s\"", (int)size, output);
+	}
+
+	// repeated calls with native arguments
+	EmbedFunction f = embed_function(program, "f"), g = embed_function(program, "g");
+	int64_t sum = 0;
+	Value res;
+	for (int64_t i=0; i!=EMBED_TEST_CALLS; i+=1){
+		Value args[2] = { {DT_Integer, {.integer = i}}, {DT_Integer, {.integer = 3}} };
+		err = embed_call(evaluator, program, f, args, 2, &res);
+		if (err.msg != NULL) break;
+		sum += res.data.integer;
+	}
+	embed_test_error(test, "f", err, NULL);
+	embed_test_integer(test, "f", (Value){ DT_Integer, {.integer = sum} },
+		3*EMBED_TEST_CALLS*(EMBED_TEST_CALLS-1)/2 + EMBED_TEST_CALLS*id
+	);
+	Value n = { DT_Integer, {.integer = 20} };
+	embed_test_error(test, "g", embed_call(evaluator, program, g, &n, 1, &res), NULL);
+	embed_test_integer(test, "g", res, 6765);
+	// variable computed by the program when it was compiled
+	embed_test_error(test, "h", embed_call(evaluator, program, embed_function(program, "h"), &n, 1, &res), NULL);
+	embed_test_integer(test, "h", res, 20 + 55 + id);
+
+	// errors
+	Value big[2] = { {DT_Integer, {.integer = (int64_t)1 << 60}}, {DT_Integer, {.integer = 8}} };
+	err = embed_call(evaluator, program, f, big, 2, &res);
+	embed_test_error(test, "large result", err, "result has no native type");
+	err = embed_call(evaluator, program, f, big, 1, &res);
+	embed_test_error(test, "arity", err, "wrong number of arguments");
+	err = embed_call(evaluator, program, embed_function(program, "missing"), big, 2, &res);
+	embed_test_error(test, "missing function", err, "function doesn't exist");
+	EmbedProgram *invalid = embed_compile(context, "1 + ;", &err);
+	if (invalid != NULL || err.msg == NULL) embed_test_fail(test, "invalid program: compiled");
+	embed_program_free(invalid);
+	EmbedProgram *failing = embed_compile(context, "z = 0; q = (x) => x; r = 1/z;", &err);
+	if (failing != NULL) embed_test_fail(test, "failing program: compiled");
+	embed_test_error(test, "failing program", err, "division by zero");
+	embed_program_free(failing);
+
+	embed_evaluator_free(evaluator);
+	embed_program_free(program);
+	embed_context_free(context);
+	return NULL;
+}
+
+
+
+// MAIN
+int main(void){
+	pthread_t threads[EMBED_TEST_THREADS];
+	EmbedTest tests[EMBED_TEST_THREADS];
+	for (long i=0; i!=EMBED_TEST_THREADS; i+=1){
+		tests[i] = (EmbedTest){ .id = i };
+		int err = pthread_create(threads+i, NULL, embed_test_worker, tests+i);
+		assert(err == 0 && "thread creation failrule");
+	}
+	size_t failures = 0;
+	for (size_t i=0; i!=EMBED_TEST_THREADS; i+=1){
+		pthread_join(threads[i], NULL);
+		failures += tests[i].failures;
+	}
+	if (failures != 0){
+		fprintf(stderr, "%zu checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
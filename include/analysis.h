@@ -0,0 +1,367 @@
+#pragma once
+
+#include "parser.h"
+
+
+
+// AST TRAVERSAL HELPERS
+static size_t ast_node_size(const AstNode *node){
+	size_t size = AstNodeSizes[node->type];
+	if (node->type == Ast_Function) size += node->count;
+	return size;
+}
+
+static bool ast_is_literal(enum AstType type){
+	return type==Ast_Integer || type==Ast_Real || type==Ast_True || type==Ast_False;
+}
+
+// marks every node that can be reached by a jump, those are merge points
+// of the control flow and values before them cannot be treated as operands
+static uint8_t *ast_jump_targets(AstArray ast){
+	size_t size = ast.end - ast.data + 1;
+	uint8_t *res = mem_calloc(size, 1);
+	assert(res != NULL && "jump target allocation failrule");
+	for (size_t i=1;;){
+		AstNode node = ast.data[i];
+		if (node.type == Ast_Terminator) break;
+		if (node.type == Ast_Conditional) res[i + 1 + node.count] = 1;
+		if (node.type == Ast_Jump)        res[i + 1 + node.pos]   = 1;
+		i += ast_node_size(ast.data + i);
+	}
+	return res;
+}
+
+
+
+// NAME USAGE ANALYSIS
+// evaluation uses dynamic scoping, so an identifier inside of a function body
+// can only be resolved ahead of time if its name is bound exactly once at the
+// top level and it never appears as a parameter name
+typedef struct{
+	uint32_t value_index; // index of bound function or literal, 0 if unknown
+	uint16_t bind_count;
+	uint16_t param_count;
+	bool     top_level;
+} NameUsage;
+
+typedef struct{
+	NameUsage *names;
+	size_t     name_count; // name ids below it have a usage
+	uint8_t   *jump_targets;
+	uint32_t  *funcs; // indexes of all function nodes
+	size_t     func_count;
+} AstInfo;
+
+
+static AstInfo ast_info_new(AstArray ast){
+	AstInfo info = {0};
+	info.name_count = global_names.size + 1;
+	info.names = mem_calloc(info.name_count, sizeof(NameUsage));
+	info.funcs = mem_alloc((ast.end - ast.data)*sizeof(uint32_t));
+	assert(info.names != NULL && info.funcs != NULL && "ast info allocation failrule");
+	info.jump_targets = ast_jump_targets(ast);
+
+	// ends of enclosing functions and conditionals, functions also keep their start
+	uint32_t scope_ends[512];
+	uint32_t scope_funcs[SIZE(scope_ends)];
+	size_t scope_count = 0;
+	uint32_t closed_func = 0; // start of the most recently closed function
+	uint32_t closed_func_end = 0;
+	uint32_t prev = 0;
+
+	for (uint32_t i=1;;){
+		AstNode node = ast.data[i];
+		if (node.type == Ast_Terminator) break;
+		while (scope_count != 0 && i >= scope_ends[scope_count-1]) scope_count -= 1;
+
+		switch (node.type){
+		case Ast_Function:{
+			info.funcs[info.func_count] = i; info.func_count += 1;
+			Data *params = (Data *)(ast.data + i + 2);
+			for (size_t j=0; j!=node.count; j+=1){
+				info.names[params[j].name_id].param_count += 1;
+			}
+			uint32_t end = i + ast.data[i+1].data.funcnodeinfo.node_size;
+			assert(scope_count != SIZE(scope_ends));
+			scope_ends[scope_count] = end + 1;
+			scope_funcs[scope_count] = i;
+			scope_count += 1;
+			break;
+		}
+		case Ast_EndScope:
+			if (scope_count != 0 && scope_ends[scope_count-1] == i+1){
+				closed_func = scope_funcs[scope_count-1];
+				closed_func_end = i;
+			}
+			break;
+		case Ast_Conditional:{
+			AstNode *jump = ast.data + i + node.count;
+			assert(scope_count != SIZE(scope_ends));
+			scope_ends[scope_count] = i + node.count + 1 + jump->pos;
+			scope_funcs[scope_count] = 0;
+			scope_count += 1;
+			break;
+		}
+		case Ast_Variable:{
+			NameUsage *usage = info.names + ast.data[i+1].data.name_id;
+			usage->bind_count += (usage->bind_count != UINT16_MAX);
+			usage->top_level = scope_count == 0;
+			usage->value_index = 0;
+			if (info.jump_targets[i] || prev == 0) break;
+			if (ast_is_literal(ast.data[prev].type)){
+				usage->value_index = prev;
+			} else if (closed_func_end == prev){
+				usage->value_index = closed_func;
+			}
+			break;
+		}
+		default: break;
+		}
+		prev = i;
+		i += ast_node_size(ast.data + i);
+	}
+	return info;
+}
+
+static void ast_info_free(AstInfo *info){
+	mem_free(info->names);
+	mem_free(info->jump_targets);
+	mem_free(info->funcs);
+	*info = (AstInfo){0};
+}
+
+// returns the index of the value that the name refers to at the top level, 0 if unknown
+static uint32_t ast_info_global_value(const AstInfo *info, NameId name_id){
+	NameUsage usage = info->names[name_id];
+	if (usage.bind_count != 1 || !usage.top_level) return 0;
+	return usage.value_index;
+}
+
+// returns the index of the value that the name refers to everywhere, 0 if unknown
+static uint32_t ast_info_stable_value(const AstInfo *info, NameId name_id){
+	if (info->names[name_id].param_count != 0) return 0;
+	return ast_info_global_value(info, name_id);
+}
+
+
+
+// PURITY ANALYSIS
+// the only side effect is printing at the top level, so a function is pure if
+// its body doesn't define anything and every name it uses is either its
+// parameter or a stable global which refers to a literal or another pure function
+static bool function_has_param(const AstNode *func, NameId name_id){
+	const Data *params = (const Data *)(func + 2);
+	for (size_t i=0; i!=func->count; i+=1){
+		if (params[i].name_id == name_id) return true;
+	}
+	return false;
+}
+
+static bool function_body_is_simple(AstArray ast, const AstInfo *info, uint32_t f){
+	AstNode *func = ast.data + f;
+	uint32_t end = f + (func+1)->data.funcnodeinfo.node_size;
+	for (uint32_t i=f+2+func->count; i!=end; i+=ast_node_size(ast.data + i)){
+		AstNode node = ast.data[i];
+		switch (node.type){
+		case Ast_Semicolon:
+		case Ast_Variable:
+		case Ast_Function:
+			return false;
+		case Ast_Identifier:{
+			NameId name_id = ast.data[i+1].data.name_id;
+			if (function_has_param(func, name_id)) break;
+			if (ast_info_stable_value(info, name_id) == 0) return false;
+			break;
+		}
+		default: break;
+		}
+	}
+	return true;
+}
+
+static bool function_calls_impure(AstArray ast, const AstInfo *info, uint32_t f){
+	AstNode *func = ast.data + f;
+	uint32_t end = f + (func+1)->data.funcnodeinfo.node_size;
+	for (uint32_t i=f+2+func->count; i!=end; i+=ast_node_size(ast.data + i)){
+		if (ast.data[i].type != Ast_Identifier) continue;
+		NameId name_id = ast.data[i+1].data.name_id;
+		if (function_has_param(func, name_id)) continue;
+		uint32_t value = ast_info_stable_value(info, name_id);
+		if (ast.data[value].type != Ast_Function) continue;
+		if (!(ast.data[value+1].data.funcnodeinfo.flags & FuncFlag_Pure)) return true;
+	}
+	return false;
+}
+
+static size_t mark_pure_functions(AstArray ast, const AstInfo *info){
+	for (size_t i=0; i!=info->func_count; i+=1){
+		uint32_t f = info->funcs[i];
+		if (function_body_is_simple(ast, info, f)){
+			ast.data[f+1].data.funcnodeinfo.flags |= FuncFlag_Pure;
+		}
+	}
+	// propagate impurity through calls until nothing changes
+	for (bool changed=true; changed;){
+		changed = false;
+		for (size_t i=0; i!=info->func_count; i+=1){
+			uint32_t f = info->funcs[i];
+			FunctionNodeInfo *fi = &ast.data[f+1].data.funcnodeinfo;
+			if ((fi->flags & FuncFlag_Pure) && function_calls_impure(ast, info, f)){
+				fi->flags &= ~FuncFlag_Pure;
+				changed = true;
+			}
+		}
+	}
+	size_t res = 0;
+	for (size_t i=0; i!=info->func_count; i+=1){
+		res += (ast.data[info->funcs[i]+1].data.funcnodeinfo.flags & FuncFlag_Pure) != 0;
+	}
+	return res;
+}
+
+
+
+// FORK POINTS
+// operands of a binary operator that are both calls of pure functions don't
+// depend on each other, so the left call can be evaluated by another thread
+// while the right one is evaluated, operands are found by following the
+// starts of postfix subtrees like the evaluation stack would hold them
+typedef struct{
+	uint32_t start;
+	bool     pure_call;
+} ForkOperand;
+
+typedef struct{
+	uint32_t false_index;
+	uint32_t end_index;
+	uint32_t start;      // start of the condition
+	size_t   stack_size; // operands below the conditional
+} ForkBranch;
+
+static bool fork_is_pure_call(AstArray ast, const AstInfo *info, uint32_t callee, uint32_t next, uint32_t arg_count){
+	if (ast.data[callee].type != Ast_Identifier || next != callee + 2) return false;
+	uint32_t value = ast_info_stable_value(info, ast.data[callee+1].data.name_id);
+	if (ast.data[value].type != Ast_Function || ast.data[value].count != arg_count) return false;
+	return (ast.data[value+1].data.funcnodeinfo.flags & FuncFlag_Pure) != 0;
+}
+
+// marks forks in nodes from begin to end, nested functions are skipped,
+// gives up on the rest of the range at any node it doesn't understand
+static size_t mark_forks_in(AstArray ast, const AstInfo *info, uint32_t begin, uint32_t end, ForkOperand *stack){
+	ForkBranch branches[64];
+	size_t branch_count = 0;
+	size_t stack_size = 0;
+	size_t res = 0;
+#define FORK_POP(n) do{ if (stack_size < (n)) return res; stack_size -= (n); } while (0)
+#define FORK_PUSH(p_start, p_pure) do{ \
+		stack[stack_size] = (ForkOperand){ (p_start), (p_pure) }; \
+		stack_size += 1; \
+	} while (0)
+
+	for (uint32_t i=begin; i<end;){
+		// both branches of a conditional leave one value where the condition was
+		while (branch_count != 0 && branches[branch_count-1].end_index == i){
+			branch_count -= 1;
+			if (stack_size != branches[branch_count].stack_size + 1) return res;
+			stack[stack_size-1] = (ForkOperand){ branches[branch_count].start, false };
+		}
+		AstNode node = ast.data[i];
+		switch (node.type){
+		case Ast_Nop: break;
+		case Ast_Identifier:
+		case Ast_Integer:
+		case Ast_Real:
+		case Ast_String:
+		case Ast_True:
+		case Ast_False:
+			FORK_PUSH(i, false);
+			break;
+		case Ast_Function:
+			FORK_PUSH(i, false);
+			i += 1 + ast.data[i+1].data.funcnodeinfo.node_size;
+			continue;
+		case Ast_Variable:
+		case Ast_Minus:
+		case Ast_AbsValue:
+		case Ast_LogicNot:
+		case Ast_Factorial:
+			if (stack_size == 0) return res;
+			stack[stack_size-1].pure_call = false;
+			break;
+		case Ast_Semicolon:
+			FORK_POP(1);
+			break;
+		case Ast_Call:{
+			FORK_POP((size_t)node.count + 1);
+			uint32_t callee = stack[stack_size].start;
+			uint32_t next = node.count != 0 ? stack[stack_size+1].start : i;
+			FORK_PUSH(callee, fork_is_pure_call(ast, info, callee, next, node.count));
+			break;
+		}
+		case Ast_Subscript:
+		case Ast_Array:
+		case Ast_Set:
+		case Ast_Dict:{
+			size_t count = node.count + (node.type == Ast_Subscript);
+			FORK_POP(count);
+			FORK_PUSH(count != 0 ? stack[stack_size].start : i, false);
+			break;
+		}
+		case Ast_Conditional:{
+			FORK_POP(1);
+			uint32_t jump = i + node.count;
+			if (jump >= end || ast.data[jump].type != Ast_Jump || branch_count == SIZE(branches)) return res;
+			branches[branch_count] = (ForkBranch){
+				.false_index = jump + 1,
+				.end_index   = jump + 1 + ast.data[jump].pos,
+				.start       = stack[stack_size].start,
+				.stack_size  = stack_size,
+			};
+			branch_count += 1;
+			break;
+		}
+		case Ast_Jump:{
+			if (branch_count == 0) return res;
+			ForkBranch br = branches[branch_count-1];
+			if (br.false_index != i+1 || stack_size != br.stack_size + 1) return res;
+			stack_size -= 1;
+			break;
+		}
+		default:
+			if (node.type < Ast_LogicOr || Ast_Pipe < node.type) return res;
+			FORK_POP(2);
+			ForkOperand lhs = stack[stack_size], rhs = stack[stack_size+1];
+			if (
+				node.type != Ast_Pipe && lhs.pure_call && rhs.pure_call &&
+				ast.data[rhs.start-1].type == Ast_Call
+			){
+				ast.data[rhs.start-1].flags |= AstFlag_Fork;
+				ast.data[i].flags |= AstFlag_Join;
+				res += 1;
+			}
+			FORK_PUSH(lhs.start, false);
+			break;
+		}
+		i += ast_node_size(ast.data + i);
+	}
+	return res;
+#undef FORK_POP
+#undef FORK_PUSH
+}
+
+// pure functions have to be marked first
+static size_t mark_fork_points(AstArray ast, const AstInfo *info){
+	size_t size = ast.end - ast.data;
+	ForkOperand *stack = malloc(size*sizeof(ForkOperand));
+	assert(stack != NULL && "fork analysis allocation failrule");
+	uint32_t end = 1;
+	while (ast.data[end].type != Ast_Terminator) end += ast_node_size(ast.data + end);
+	size_t res = mark_forks_in(ast, info, 1, end, stack);
+	for (size_t i=0; i!=info->func_count; i+=1){
+		uint32_t f = info->funcs[i];
+		AstNode *func = ast.data + f;
+		res += mark_forks_in(ast, info, f + 2 + func->count, f + (func+1)->data.funcnodeinfo.node_size, stack);
+	}
+	free(stack);
+	return res;
+}
@@ -0,0 +1,464 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "parser.h"
+#include "value.h"
+#include "output.h"
+
+#ifdef __AVX__
+	#include <immintrin.h>
+#endif
+
+#define ARRAY_CHUNK_SIZE ((size_t)64 << 10)
+
+// results larger than this are reported as errors instead of exhausting memory
+#ifndef ARRAY_MAX_LENGTH
+	#define ARRAY_MAX_LENGTH ((size_t)1 << 28)
+#endif
+
+
+
+// ARRAYS
+// contiguous arrays of integers, reals or booleans, every element takes 8 bytes
+// so all element types share one layout, booleans are stored as 0 or 1
+typedef struct{
+	uint32_t length;
+	uint8_t  type;    // element type, DT_Null for an empty array
+	int64_t  items[]; // reals are accessed through array_reals
+} Array;
+
+static inline double *array_reals(const Array *arr){
+	return (double *)arr->items;
+}
+
+
+
+// ARRAY HEAP
+// same scheme as the bigint heap, arrays live until the end of evaluation
+typedef struct ArrayChunk{
+	struct ArrayChunk *next;
+	size_t size;
+	size_t capacity;
+	int64_t data[];
+} ArrayChunk;
+
+static _Thread_local struct{
+	ArrayChunk *chunks;
+	size_t allocations;
+	size_t bytes;
+} global_array_heap;
+
+
+// other objects that live as long as arrays are allocated here too
+static int64_t *array_heap_alloc(size_t words){
+	ArrayChunk *chunk = global_array_heap.chunks;
+	if (chunk == NULL || chunk->capacity - chunk->size < words){
+		size_t capacity = util_max_usize(ARRAY_CHUNK_SIZE / sizeof(int64_t), words);
+		chunk = mem_alloc(sizeof(ArrayChunk) + capacity*sizeof(int64_t));
+		assert(chunk != NULL && "array allocation failrule");
+		chunk->size = 0;
+		chunk->capacity = capacity;
+		// a dedicated chunk of an oversized array goes behind the current one
+		if (global_array_heap.chunks != NULL && capacity > ARRAY_CHUNK_SIZE / sizeof(int64_t)){
+			chunk->next = global_array_heap.chunks->next;
+			global_array_heap.chunks->next = chunk;
+		} else{
+			chunk->next = global_array_heap.chunks;
+			global_array_heap.chunks = chunk;
+		}
+	}
+	int64_t *res = chunk->data + chunk->size;
+	chunk->size += words;
+	global_array_heap.bytes += words*sizeof(int64_t);
+	return res;
+}
+
+static Array *array_alloc(size_t length, enum DataType type){
+	Array *res = (Array *)array_heap_alloc(1 + length); // header takes one word
+	global_array_heap.allocations += 1;
+	res->length = length;
+	res->type = length == 0 ? DT_Null : type;
+	return res;
+}
+
+static void array_heap_release(void){
+	ArrayChunk *chunk = global_array_heap.chunks;
+	while (chunk != NULL){
+		ArrayChunk *next = chunk->next;
+		mem_free(chunk);
+		chunk = next;
+	}
+	global_array_heap.chunks = NULL;
+}
+
+
+
+// ELEMENT-WISE KERNELS
+// operands are read as x[i & xm], a mask of zero repeats the first four
+// elements, that is how a scalar operand is broadcast without a branch,
+// vector loops are followed by a scalar tail for the remaining elements
+#if defined(__AVX2__)
+	typedef __m256i ArrayVecI;
+	#define ARRAY_INT_LANES 4
+	#define vi_load(p)     _mm256_loadu_si256((const __m256i *)(p))
+	#define vi_store(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+	#define vi_set1(x)     _mm256_set1_epi64x(x)
+	#define vi_add         _mm256_add_epi64
+	#define vi_sub         _mm256_sub_epi64
+	#define vi_and         _mm256_and_si256
+	#define vi_or          _mm256_or_si256
+	#define vi_xor         _mm256_xor_si256
+	#define vi_cmpeq       _mm256_cmpeq_epi64
+	#define vi_cmpgt       _mm256_cmpgt_epi64
+	#define vi_signs(v)    _mm256_movemask_pd(_mm256_castsi256_pd(v))
+#elif defined(__AVX__)
+	// avx has no 256 bit integer instructions, their vex encoded 128 bit forms are used
+	typedef __m128i ArrayVecI;
+	#define ARRAY_INT_LANES 2
+	#define vi_load(p)     _mm_loadu_si128((const __m128i *)(p))
+	#define vi_store(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+	#define vi_set1(x)     _mm_set1_epi64x(x)
+	#define vi_add         _mm_add_epi64
+	#define vi_sub         _mm_sub_epi64
+	#define vi_and         _mm_and_si128
+	#define vi_or          _mm_or_si128
+	#define vi_xor         _mm_xor_si128
+	#define vi_cmpeq       _mm_cmpeq_epi64
+	#define vi_cmpgt       _mm_cmpgt_epi64
+	#define vi_signs(v)    _mm_movemask_pd(_mm_castsi128_pd(v))
+#endif
+
+#ifdef __AVX__
+	#define ARRAY_VECTOR(...) __VA_ARGS__
+#else
+	#define ARRAY_VECTOR(...)
+#endif
+
+
+// r[i] = op(x[i], y[i]) for reals, comparisons store booleans,
+// returns false on division by zero
+static bool array_kernel_real(
+	AstNode node, int64_t *r, const double *x, size_t xm, const double *y, size_t ym, size_t n
+){
+	int64_t flip = (node.flags & AstFlag_Negate) != 0;
+	bool zero = false;
+	size_t i = 0;
+	ARRAY_VECTOR(
+		const __m256d one   = _mm256_castsi256_pd(_mm256_set1_epi64x(1));
+		const __m256d flipv = _mm256_castsi256_pd(_mm256_set1_epi64x(flip));
+		__m256d zerov = _mm256_setzero_pd();
+	)
+#define ARRAY_LOOP(vec_expr, scalar_expr) \
+	ARRAY_VECTOR( \
+		for (; i+4 <= n; i+=4){ \
+			__m256d a = _mm256_loadu_pd(x + (i & xm)); \
+			__m256d b = _mm256_loadu_pd(y + (i & ym)); \
+			_mm256_storeu_pd((double *)r + i, (vec_expr)); \
+		} \
+	) \
+	for (; i!=n; i+=1){ \
+		double a = x[i & xm]; \
+		double b = y[i & ym]; \
+		scalar_expr; \
+	} \
+	break;
+#define ARRAY_CMP(pred) _mm256_xor_pd(_mm256_and_pd(_mm256_cmp_pd(a, b, pred), one), flipv)
+
+	switch (node.type){
+	case Ast_Add:      ARRAY_LOOP(_mm256_add_pd(a, b), ((double *)r)[i] = a + b)
+	case Ast_Subtract: ARRAY_LOOP(_mm256_sub_pd(a, b), ((double *)r)[i] = a - b)
+	case Ast_Multiply: ARRAY_LOOP(_mm256_mul_pd(a, b), ((double *)r)[i] = a * b)
+	case Ast_Divide:
+		ARRAY_LOOP(
+			(zerov = _mm256_or_pd(zerov, _mm256_cmp_pd(b, _mm256_setzero_pd(), _CMP_EQ_OQ)),
+			_mm256_div_pd(a, b)),
+			(zero |= b == 0.0, ((double *)r)[i] = a / b)
+		)
+	case Ast_Less:    ARRAY_LOOP(ARRAY_CMP(_CMP_LT_OQ), r[i] = (a <  b) ^ flip)
+	case Ast_Greater: ARRAY_LOOP(ARRAY_CMP(_CMP_GT_OQ), r[i] = (a >  b) ^ flip)
+	case Ast_Equal:   ARRAY_LOOP(ARRAY_CMP(_CMP_EQ_OQ), r[i] = (a == b) ^ flip)
+	default: assert(false && "unhandled array operator");
+	}
+	ARRAY_VECTOR( zero |= _mm256_movemask_pd(zerov) != 0; )
+	return !zero;
+#undef ARRAY_LOOP
+#undef ARRAY_CMP
+}
+
+// same for integers, there is no vector 64 bit multiplication or division
+// so those stay scalar, returns an error message or NULL
+static const char *array_kernel_int(
+	AstNode node, int64_t *r, const int64_t *x, size_t xm, const int64_t *y, size_t ym, size_t n
+){
+	int64_t flip = (node.flags & AstFlag_Negate) != 0;
+	bool overflow = false;
+	size_t i = 0;
+	ARRAY_VECTOR(
+		const ArrayVecI one   = vi_set1(1);
+		const ArrayVecI flipv = vi_set1(flip);
+		ArrayVecI ov = vi_set1(0);
+	)
+#define ARRAY_LOOP(vec_expr, scalar_expr) \
+	ARRAY_VECTOR( \
+		for (; i+ARRAY_INT_LANES <= n; i+=ARRAY_INT_LANES){ \
+			ArrayVecI a = vi_load(x + (i & xm)); \
+			ArrayVecI b = vi_load(y + (i & ym)); \
+			vi_store(r + i, (vec_expr)); \
+		} \
+	) \
+	for (; i!=n; i+=1){ \
+		int64_t a = x[i & xm]; \
+		int64_t b = y[i & ym]; \
+		scalar_expr; \
+	} \
+	break;
+#define ARRAY_CMP(expr) vi_xor(vi_and((expr), one), flipv)
+
+	// overflow happened when the sign of the result differs from both operands
+	// for addition or from the first operand and its opposite for subtraction
+	switch (node.type){
+	case Ast_Add:
+		ARRAY_LOOP(
+			({ ArrayVecI c = vi_add(a, b); ov = vi_or(ov, vi_and(vi_xor(a, c), vi_xor(b, c))); c; }),
+			overflow |= __builtin_add_overflow(a, b, r+i)
+		)
+	case Ast_Subtract:
+		ARRAY_LOOP(
+			({ ArrayVecI c = vi_sub(a, b); ov = vi_or(ov, vi_and(vi_xor(a, b), vi_xor(a, c))); c; }),
+			overflow |= __builtin_sub_overflow(a, b, r+i)
+		)
+	case Ast_Less:    ARRAY_LOOP(ARRAY_CMP(vi_cmpgt(b, a)), r[i] = (a <  b) ^ flip)
+	case Ast_Greater: ARRAY_LOOP(ARRAY_CMP(vi_cmpgt(a, b)), r[i] = (a >  b) ^ flip)
+	case Ast_Equal:   ARRAY_LOOP(ARRAY_CMP(vi_cmpeq(a, b)), r[i] = (a == b) ^ flip)
+	case Ast_Multiply:
+		for (; i!=n; i+=1){
+			overflow |= __builtin_mul_overflow(x[i & xm], y[i & ym], r+i);
+		}
+		break;
+	case Ast_Divide:
+		for (; i!=n; i+=1){
+			int64_t a = x[i & xm];
+			int64_t b = y[i & ym];
+			if (b == 0) return "division by zero";
+			if (b == -1 && a == INT64_MIN){ overflow = true; break; }
+			r[i] = a / b;
+		}
+		break;
+	default: assert(false && "unhandled array operator");
+	}
+	ARRAY_VECTOR( overflow |= vi_signs(ov) != 0; )
+	return overflow ? "integer overflow in array operation" : NULL;
+#undef ARRAY_LOOP
+#undef ARRAY_CMP
+}
+
+// booleans are 0 or 1, so bitwise operations work on whole vectors of them
+static void array_kernel_bool(
+	AstNode node, int64_t *r, const int64_t *x, size_t xm, const int64_t *y, size_t ym, size_t n
+){
+	int64_t flip = (node.flags & AstFlag_Negate) != 0;
+	// equality is xor negated
+	if (node.type == Ast_Equal) flip ^= 1;
+	size_t i = 0;
+	ARRAY_VECTOR(
+		const __m256d flipv = _mm256_castsi256_pd(_mm256_set1_epi64x(flip));
+	)
+#define ARRAY_LOOP(vec_op, scalar_op) \
+	ARRAY_VECTOR( \
+		for (; i+4 <= n; i+=4){ \
+			__m256d a = _mm256_loadu_pd((const double *)x + (i & xm)); \
+			__m256d b = _mm256_loadu_pd((const double *)y + (i & ym)); \
+			_mm256_storeu_pd((double *)r + i, _mm256_xor_pd(vec_op(a, b), flipv)); \
+		} \
+	) \
+	for (; i!=n; i+=1){ \
+		r[i] = (x[i & xm] scalar_op y[i & ym]) ^ flip; \
+	} \
+	break;
+
+	switch (node.type){
+	case Ast_LogicOr:  ARRAY_LOOP(_mm256_or_pd,  |)
+	case Ast_LogicAnd: ARRAY_LOOP(_mm256_and_pd, &)
+	case Ast_Equal:    ARRAY_LOOP(_mm256_xor_pd, ^)
+	default: assert(false && "unhandled array operator");
+	}
+#undef ARRAY_LOOP
+}
+
+
+
+// OPERATIONS
+static const char *array_from_values(const PackedValue *values, size_t count, Value *res){
+	enum DataType type = count == 0 ? DT_Null : value_packed_type(values[0]);
+	if (type != DT_Null && type != DT_Integer && type != DT_Real && type != DT_Bool)
+		return "array element has unsupported type";
+	Array *arr = array_alloc(count, type);
+	for (size_t i=0; i!=count; i+=1){
+		Value item = value_unpack(values[i]);
+		if (item.type != type) return "array elements have different types";
+		arr->items[i] = type == DT_Bool ? item.data.boolean : item.data.integer;
+	}
+	*res = (Value){ .type = DT_Array, .data.ptr = arr };
+	return NULL;
+}
+
+static const char *array_subscript(Value array, Value index, Value *res){
+	if (array.type != DT_Array)
+		return "subscripted value is not an array";
+	if (index.type != DT_Integer)
+		return "array index is not an integer";
+	const Array *arr = array.data.ptr;
+	if ((uint64_t)index.data.integer >= arr->length)
+		return "array index is out of bounds";
+	int64_t item = arr->items[index.data.integer];
+	*res = (Value){ .type = arr->type };
+	if (arr->type == DT_Bool){
+		res->data.boolean = item;
+	} else{
+		res->data.integer = item;
+	}
+	return NULL;
+}
+
+// linear search, vector loops compare eight elements before they branch
+static bool array_contains(const Array *arr, Value key){
+	if (key.type != arr->type) return false;
+	size_t n = arr->length;
+	size_t i = 0;
+	if (arr->type == DT_Real){
+		const double *x = array_reals(arr);
+		double k = key.data.real;
+		ARRAY_VECTOR(
+			const __m256d kv = _mm256_set1_pd(k);
+			for (; i+8 <= n; i+=8){
+				__m256d a = _mm256_cmp_pd(_mm256_loadu_pd(x + i),     kv, _CMP_EQ_OQ);
+				__m256d b = _mm256_cmp_pd(_mm256_loadu_pd(x + i + 4), kv, _CMP_EQ_OQ);
+				if (_mm256_movemask_pd(_mm256_or_pd(a, b)) != 0) return true;
+			}
+		)
+		for (; i!=n; i+=1){
+			if (x[i] == k) return true;
+		}
+		return false;
+	}
+	const int64_t *x = arr->items;
+	int64_t k = arr->type == DT_Bool ? key.data.boolean : key.data.integer;
+	ARRAY_VECTOR(
+		const ArrayVecI kv = vi_set1(k);
+		for (; i + 4*ARRAY_INT_LANES <= n; i += 4*ARRAY_INT_LANES){
+			ArrayVecI a = vi_or(
+				vi_cmpeq(vi_load(x + i), kv),
+				vi_cmpeq(vi_load(x + i + ARRAY_INT_LANES), kv)
+			);
+			ArrayVecI b = vi_or(
+				vi_cmpeq(vi_load(x + i + 2*ARRAY_INT_LANES), kv),
+				vi_cmpeq(vi_load(x + i + 3*ARRAY_INT_LANES), kv)
+			);
+			if (vi_signs(vi_or(a, b)) != 0) return true;
+		}
+	)
+	for (; i!=n; i+=1){
+		if (x[i] == k) return true;
+	}
+	return false;
+}
+
+static Value array_concat(const Array *lhs, const Array *rhs){
+	Array *arr = array_alloc(
+		(size_t)lhs->length + rhs->length, lhs->length != 0 ? lhs->type : rhs->type
+	);
+	memcpy(arr->items, lhs->items, lhs->length*sizeof(int64_t));
+	memcpy(arr->items + lhs->length, rhs->items, rhs->length*sizeof(int64_t));
+	return (Value){ .type = DT_Array, .data.ptr = arr };
+}
+
+// element-wise operators, one of the operands may be a scalar
+static const char *array_binary_op(AstNode node, Value lhs, Value rhs, Value *res_ptr){
+	if (node.type == Ast_Concat){
+		if (lhs.type != DT_Array || rhs.type != DT_Array)
+			return "only arrays can be concatenated with arrays";
+		const Array *a = lhs.data.ptr, *b = rhs.data.ptr;
+		if (a->type != b->type && a->type != DT_Null && b->type != DT_Null)
+			return "opperator's arguments have different types";
+		if ((size_t)a->length + b->length > ARRAY_MAX_LENGTH)
+			return "array is too large";
+		*res_ptr = array_concat(a, b);
+		return NULL;
+	}
+	// scalar operand is repeated so that vector loads can read it
+	int64_t lhs_items[4], rhs_items[4];
+	const int64_t *x = lhs_items, *y = rhs_items;
+	size_t xm = 0, ym = 0;
+	size_t n = 0;
+	enum DataType xt = lhs.type, yt = rhs.type;
+	if (lhs.type == DT_Array){
+		const Array *arr = lhs.data.ptr;
+		x = arr->items; xm = SIZE_MAX; n = arr->length; xt = arr->type;
+	} else{
+		for (size_t i=0; i!=4; i+=1) lhs_items[i] = xt == DT_Bool ? lhs.data.boolean : lhs.data.integer;
+	}
+	if (rhs.type == DT_Array){
+		const Array *arr = rhs.data.ptr;
+		if (lhs.type == DT_Array && arr->length != n)
+			return "arrays have different lengths";
+		y = arr->items; ym = SIZE_MAX; n = arr->length; yt = arr->type;
+	} else{
+		for (size_t i=0; i!=4; i+=1) rhs_items[i] = yt == DT_Bool ? rhs.data.boolean : rhs.data.integer;
+	}
+
+	// empty arrays take the type of the other operand
+	if (xt == DT_Null) xt = yt;
+	if (yt == DT_Null) yt = xt;
+	if (xt != yt)
+		return "opperator's arguments have different types";
+	bool compare = node.type == Ast_Less || node.type == Ast_Greater || node.type == Ast_Equal;
+	Array *arr = array_alloc(n, compare ? DT_Bool : xt);
+	if (n == 0) goto Done;
+
+	switch (xt){
+	case DT_Real:
+		if (node.type == Ast_LogicOr || node.type == Ast_LogicAnd || node.type == Ast_Power) break;
+		if (!array_kernel_real(node, arr->items, (const double *)x, xm, (const double *)y, ym, n))
+			return "division by zero";
+		goto Done;
+	case DT_Integer:{
+		if (node.type == Ast_LogicOr || node.type == Ast_LogicAnd || node.type == Ast_Power) break;
+		const char *msg = array_kernel_int(node, arr->items, x, xm, y, ym, n);
+		if (msg != NULL) return msg;
+		goto Done;
+	}
+	case DT_Bool:
+		if (node.type != Ast_LogicOr && node.type != Ast_LogicAnd && node.type != Ast_Equal) break;
+		array_kernel_bool(node, arr->items, x, xm, y, ym, n);
+		goto Done;
+	default: break;
+	}
+	return "argument's type is not supported by this operator";
+Done:
+	*res_ptr = (Value){ .type = DT_Array, .data.ptr = arr };
+	return NULL;
+}
+
+
+
+// PRINTING
+static void array_output(const Array *arr){
+	output_char('[');
+	for (size_t i=0; i!=arr->length; i+=1){
+		if (i != 0) output_bytes(", ", 2);
+		switch (arr->type){
+		case DT_Integer: output_i64(arr->items[i]); break;
+		case DT_Real:    output_f64(array_reals(arr)[i]); break;
+		case DT_Bool:
+			if (arr->items[i]){
+				output_bytes("true", 4);
+			} else{
+				output_bytes("false", 5);
+			}
+			break;
+		default: break;
+		}
+	}
+	output_char(']');
+}
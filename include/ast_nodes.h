@@ -23,6 +23,9 @@
 /* OPENING SYMBOLS */ \
 	X(OpenPar,  140,  0, 1, 1), \
 	X(AbsValue, 140,  0, 1, 1), \
+	X(Array,    255,  0, 1, 1), \
+	X(Set,      255,  0, 1, 1), \
+	X(Dict,     255,  0, 1, 1), \
 	X(Function, 255, 20, 1, 2), \
 \
 /* TERNARY OPERATION */ \
@@ -34,6 +37,7 @@
 	X(Less,         66, 66, 1, 1), \
 	X(Greater,      66, 66, 1, 1), \
 	X(Contains,     68, 68, 1, 1), \
+	X(Range,        70, 70, 1, 1), \
 \
 	X(Concat,       54, 54, 1, 1), \
 \
@@ -0,0 +1,433 @@
+#pragma once
+
+#include <ctype.h>
+
+#include "analysis.h"
+#include "optimize.h"
+#include "eval.h"
+
+// tuples that are evaluated together
+#ifndef BATCH_LANES
+	#define BATCH_LANES 1024
+#endif
+
+#define BATCH_READ_SIZE  ((size_t)64 << 10)
+#define BATCH_MAX_NUMBER 64 // longest number in text input
+
+
+
+// BATCH INPUT
+// arguments are whitespace separated numbers or booleans, or with binary
+// input 64 bit integers in the byte order of the machine, values fill the
+// tuples one after another, so line breaks don't matter
+typedef struct{
+	int    fd;
+	bool   binary;
+	bool   eof;
+	size_t pos;
+	size_t size;
+	char   data[BATCH_READ_SIZE];
+} BatchInput;
+
+
+// returns false at the end of input
+static bool batch_refill(BatchInput *in){
+	if (in->eof) return false;
+	size_t keep = in->size - in->pos;
+	memmove(in->data, in->data + in->pos, keep);
+	in->pos = 0;
+	in->size = keep;
+	for (;;){
+		ssize_t got = read(in->fd, in->data + in->size, BATCH_READ_SIZE - in->size);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0){
+			in->eof = true;
+			return keep != 0;
+		}
+		in->size += got;
+		return true;
+	}
+}
+
+// numbers are read like literals of the script, a sign may precede them
+static const char *batch_parse_number(const char *text, size_t length, Value *res){
+	if (length == 4 && memcmp(text, "true", 4) == 0){
+		*res = (Value){ .type = DT_Bool, .data.boolean = true };
+		return NULL;
+	}
+	if (length == 5 && memcmp(text, "false", 5) == 0){
+		*res = (Value){ .type = DT_Bool, .data.boolean = false };
+		return NULL;
+	}
+	char buf[BATCH_MAX_NUMBER + 1];
+	memcpy(buf, text, length);
+	buf[length] = '\0';
+	bool negative = buf[0] == '-';
+	const char *src = buf + (buf[0] == '-' || buf[0] == '+');
+	if (*src < '0' || '9' < *src) return "invalid number";
+	Data data;
+	enum AstType type = parse_number(&data, &src);
+	if (src != buf + length) return "invalid number";
+	if (type == Ast_Real){
+		*res = (Value){ .type = DT_Real, .data.real = negative ? -data.real : data.real };
+	} else{
+		*res = (Value){ .type = DT_Integer, .data.integer = negative ? (int64_t)(0 - (uint64_t)data.integer) : data.integer };
+	}
+	return NULL;
+}
+
+// returns an error message, *end is set when the input ended before the value
+static const char *batch_read_value(BatchInput *in, Value *res, bool *end){
+	*end = false;
+	if (in->binary){
+		while (in->size - in->pos < sizeof(int64_t)){
+			if (batch_refill(in)) continue;
+			*end = in->size == in->pos;
+			return *end ? NULL : "input ends inside of a number";
+		}
+		res->type = DT_Integer;
+		memcpy(&res->data.integer, in->data + in->pos, sizeof(int64_t));
+		in->pos += sizeof(int64_t);
+		return NULL;
+	}
+	for (;;){
+		while (in->pos != in->size && isspace((unsigned char)in->data[in->pos])) in->pos += 1;
+		if (in->pos != in->size) break;
+		if (!batch_refill(in)){
+			*end = true;
+			return NULL;
+		}
+	}
+	// whole number has to be in the buffer, it can only be cut by its end
+	size_t length = 0;
+	for (;;){
+		while (in->pos + length != in->size && !isspace((unsigned char)in->data[in->pos + length])){
+			length += 1;
+			if (length > BATCH_MAX_NUMBER) return "number is too long";
+		}
+		if (in->pos + length != in->size || !batch_refill(in)) break;
+	}
+	const char *msg = batch_parse_number(in->data + in->pos, length, res);
+	in->pos += length;
+	return msg;
+}
+
+
+
+// VECTOR EVALUATION
+// straight line bodies of integer and real arithmetic are evaluated for all
+// tuples of a chunk at once, every node computes a column of values with the
+// element-wise kernels of arrays, a column of a literal repeats four values
+typedef struct{
+	enum DataType  type;
+	const int64_t *items;
+	size_t         mask; // 0 when all lanes hold the same value
+} BatchColumn;
+
+typedef struct{
+	size_t tuples;
+	size_t vector_chunks;
+	size_t scalar_chunks;
+} BatchStats;
+
+static BatchStats global_batch_stats;
+
+
+static bool batch_param_index(const AstNode *func, NameId name_id, size_t *res){
+	const Data *params = (const Data *)(func + 2);
+	for (size_t i=func->count; i!=0;){
+		i -= 1;
+		if (params[i].name_id == name_id){
+			*res = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// body without branches and calls that only uses operators that arrays have
+static bool batch_body_is_straight(AstArray ast, const AstInfo *info, uint32_t f){
+	const AstNode *func = ast.data + f;
+	uint32_t end = f + (func+1)->data.funcnodeinfo.node_size;
+	for (uint32_t i=f+2+func->count; i!=end; i+=ast_node_size(ast.data + i)){
+		switch (ast.data[i].type){
+		case Ast_Identifier:{
+			NameId name_id = ast.data[i+1].data.name_id;
+			size_t param;
+			if (batch_param_index(func, name_id, &param)) break;
+			if (!ast_is_literal(ast.data[ast_info_stable_value(info, name_id)].type)) return false;
+			break;
+		}
+		case Ast_Nop:
+		case Ast_Integer:
+		case Ast_Real:
+		case Ast_True:
+		case Ast_False:
+		case Ast_Minus:
+		case Ast_LogicNot:
+		case Ast_Add:
+		case Ast_Subtract:
+		case Ast_Multiply:
+		case Ast_Divide:
+		case Ast_Less:
+		case Ast_Greater:
+		case Ast_Equal:
+		case Ast_LogicOr:
+		case Ast_LogicAnd:
+			break;
+		default: return false;
+		}
+	}
+	return true;
+}
+
+// returns false if the chunk has to be evaluated by the interpreter, that also
+// finds errors, big integers and operands of different types
+static bool batch_eval_vector(
+	AstArray ast, const AstInfo *info, uint32_t f, const PackedValue *args, size_t lanes,
+	int64_t *scratch, BatchColumn *stack, BatchColumn *res
+){
+	const AstNode *func = ast.data + f;
+	size_t arity = func->count;
+	uint32_t begin = f + 2 + func->count;
+	uint32_t end = f + (func+1)->data.funcnodeinfo.node_size;
+	size_t stack_size = 0;
+
+	// arguments are transposed into columns that follow the columns of nodes
+	int64_t *param_items = scratch + (size_t)(end - begin)*BATCH_LANES;
+	enum DataType param_types[arity];
+	for (size_t p=0; p!=arity; p+=1){
+		int64_t *column = param_items + p*BATCH_LANES;
+		param_types[p] = value_packed_type(args[p]);
+		if (param_types[p] != DT_Integer && param_types[p] != DT_Real && param_types[p] != DT_Bool) return false;
+		for (size_t i=0; i!=lanes; i+=1){
+			Value arg = value_unpack(args[i*arity + p]);
+			if (arg.type != param_types[p]) return false;
+			column[i] = arg.type == DT_Bool ? arg.data.boolean : arg.data.integer;
+		}
+	}
+
+	for (uint32_t i=begin; i!=end; i+=ast_node_size(ast.data + i)){
+		AstNode node = ast.data[i];
+		int64_t *out = scratch + (size_t)(i - begin)*BATCH_LANES;
+		Value literal;
+		switch (node.type){
+		case Ast_Nop: break;
+		case Ast_Identifier:{
+			NameId name_id = ast.data[i+1].data.name_id;
+			size_t param;
+			if (batch_param_index(func, name_id, &param)){
+				stack[stack_size] = (BatchColumn){ param_types[param], param_items + param*BATCH_LANES, SIZE_MAX };
+				stack_size += 1;
+				break;
+			}
+			literal = literal_value(ast.data + ast_info_stable_value(info, name_id));
+			goto PushLiteral;
+		}
+		case Ast_Integer:
+		case Ast_Real:
+		case Ast_True:
+		case Ast_False:
+			literal = literal_value(ast.data + i);
+		PushLiteral:
+			for (size_t k=0; k!=4; k+=1){
+				out[k] = literal.type == DT_Bool ? literal.data.boolean : literal.data.integer;
+			}
+			stack[stack_size] = (BatchColumn){ literal.type, out, 0 };
+			stack_size += 1;
+			break;
+		case Ast_Minus:
+		case Ast_LogicNot:{
+			BatchColumn *x = stack + stack_size - 1;
+			size_t n = x->mask == 0 ? 4 : lanes;
+			if (node.type == Ast_LogicNot){
+				if (x->type != DT_Bool) return false;
+				for (size_t k=0; k!=n; k+=1) out[k] = x->items[k] ^ 1;
+			} else if (x->type == DT_Integer){
+				bool overflow = false;
+				for (size_t k=0; k!=n; k+=1){
+					overflow |= x->items[k] == INT64_MIN;
+					out[k] = -(uint64_t)x->items[k];
+				}
+				if (overflow) return false;
+			} else if (x->type == DT_Real){
+				for (size_t k=0; k!=n; k+=1) ((double *)out)[k] = -((const double *)x->items)[k];
+			} else{
+				return false;
+			}
+			x->items = out;
+			break;
+		}
+		default:{
+			// binary operators take the kernels that array operators would
+			stack_size -= 1;
+			BatchColumn *x = stack + stack_size - 1;
+			const BatchColumn *y = stack + stack_size;
+			if (x->type != y->type) return false;
+			size_t mask = x->mask | y->mask;
+			size_t n = mask == 0 ? 4 : lanes;
+			bool logic = node.type == Ast_LogicOr || node.type == Ast_LogicAnd;
+			bool compare = node.type == Ast_Less || node.type == Ast_Greater || node.type == Ast_Equal;
+			switch (x->type){
+			case DT_Real:
+				if (logic) return false;
+				if (!array_kernel_real(node, out, (const double *)x->items, x->mask, (const double *)y->items, y->mask, n))
+					return false;
+				break;
+			case DT_Integer:
+				if (logic) return false;
+				if (array_kernel_int(node, out, x->items, x->mask, y->items, y->mask, n) != NULL) return false;
+				break;
+			case DT_Bool:
+				if (!logic && node.type != Ast_Equal) return false;
+				array_kernel_bool(node, out, x->items, x->mask, y->items, y->mask, n);
+				break;
+			default: return false;
+			}
+			*x = (BatchColumn){ compare ? DT_Bool : x->type, out, mask };
+			break;
+		}
+		}
+	}
+	if (stack_size != 1) return false;
+	*res = stack[0];
+	return true;
+}
+
+
+
+// BATCH EVALUATION
+// one function of the script is applied to every tuple of arguments read
+// from the input and the results are written like results of statements,
+// the script is evaluated once before without writing its results, the
+// function sees the parameters and the variables defined at the top level
+enum BatchErrorKind{
+	BatchError_Script, // error position is in the script
+	BatchError_Load,   // script failed before the first tuple, position is in it
+	BatchError_Input,
+	BatchError_Setup,  // function can't be used
+};
+
+typedef struct{
+	EvalError error;
+	enum BatchErrorKind kind;
+	size_t tuple; // index of the tuple that failed
+} BatchStatus;
+
+
+static void batch_free(AstInfo *info, BatchInput *in, PackedValue *args, PackedValue *results,
+	PackedValue *env_values, NameId *env_names, int64_t *scratch, BatchColumn *stack
+){
+	ast_info_free(info);
+	mem_free(in);
+	mem_free(args);
+	mem_free(results);
+	mem_free(env_values);
+	mem_free(env_names);
+	mem_free(scratch);
+	mem_free(stack);
+}
+
+BatchStatus eval_batch(AstArray nodes, const char *name, int fd, bool binary){
+	BatchStatus res = { .kind = BatchError_Setup };
+	// the name has to exist before the name usage table is made
+	NameId name_id = get_name_id(name, strlen(name));
+	AstInfo info = ast_info_new(nodes);
+	uint32_t f = ast_info_global_value(&info, name_id);
+	if (nodes.data[f].type != Ast_Function){
+		ast_info_free(&info);
+		res.error.msg = "batch function has to be defined once at the top level";
+		return res;
+	}
+	const AstNode *func = nodes.data + f;
+	size_t arity = func->count;
+	if (arity == 0){
+		ast_info_free(&info);
+		res.error.msg = "batch function has no parameters";
+		return res;
+	}
+
+	size_t env_count = 0;
+	PackedValue *env_values = NULL;
+	NameId      *env_names  = NULL;
+	BatchInput  *in = mem_alloc(sizeof(BatchInput));
+	PackedValue *args = mem_alloc(BATCH_LANES*arity*sizeof(PackedValue));
+	PackedValue *results = mem_alloc(BATCH_LANES*sizeof(PackedValue));
+	assert(in && args && results && "batch allocation failrule");
+	*in = (BatchInput){ .fd = fd, .binary = binary };
+	EvalHeaps env_heaps;
+	res.error = eval_environment(nodes, &env_values, &env_names, &env_count, &env_heaps);
+	res.kind = res.error.msg != NULL ? BatchError_Load : BatchError_Input;
+
+	int64_t *scratch = NULL;
+	BatchColumn *stack = NULL;
+	if (res.error.msg != NULL) goto Done;
+	if (batch_body_is_straight(nodes, &info, f)){
+		size_t body_size = (func+1)->data.funcnodeinfo.node_size - 1 - arity;
+		scratch = mem_alloc((body_size + arity)*BATCH_LANES*sizeof(int64_t));
+		stack = mem_alloc(body_size*sizeof(BatchColumn));
+		assert(scratch != NULL && stack != NULL && "batch allocation failrule");
+	}
+
+	// tuples before a broken one are still evaluated
+	const char *input_error = NULL;
+	for (bool input_ended=false; !input_ended;){
+		size_t lanes = 0;
+		while (lanes != BATCH_LANES && !input_ended){
+			for (size_t p=0; p!=arity; p+=1){
+				Value arg;
+				input_error = batch_read_value(in, &arg, &input_ended);
+				if (input_error == NULL && input_ended && p != 0) input_error = "input ends inside of a tuple";
+				if (input_error != NULL) input_ended = true;
+				if (input_ended) break;
+				args[lanes*arity + p] = value_pack(arg);
+			}
+			lanes += !input_ended;
+		}
+		if (lanes == 0) break;
+
+		BatchColumn column;
+		if (scratch != NULL && batch_eval_vector(nodes, &info, f, args, lanes, scratch, stack, &column)){
+			for (size_t i=0; i!=lanes; i+=1){
+				Value value = { .type = column.type, .data.integer = column.items[i & column.mask] };
+				if (column.type == DT_Bool) value.data = (Data){ .boolean = value.data.integer != 0 };
+				eval_output_value(nodes, value);
+			}
+			global_batch_stats.vector_chunks += 1;
+		} else{
+			EvalScope scope = {
+				.env_values = env_values, .env_names = env_names, .env_count = env_count,
+				.keep_heaps = true, .func = f, .args = args, .call_count = lanes, .results = results,
+			};
+			EvalError err = eval_scope(nodes, &scope);
+			size_t written = 0;
+			while (written != scope.calls_done){
+				if (!eval_output_value(nodes, value_unpack(results[written]))){
+					err = (EvalError){ "expression has invalid data type", func->pos };
+					break;
+				}
+				written += 1;
+			}
+			// results were written, nothing made by the chunk is needed anymore
+			value_heap_release();
+			bigint_heap_release();
+			array_heap_release();
+			string_heap_release(&global_string_heap);
+			global_batch_stats.scalar_chunks += 1;
+			if (err.msg != NULL){
+				res.error = err;
+				res.kind = BatchError_Script;
+				res.tuple += written;
+				goto Done;
+			}
+		}
+		res.tuple += lanes;
+		global_batch_stats.tuples += lanes;
+	}
+	res.error.msg = input_error;
+Done:
+	eval_heaps_free(env_heaps);
+	eval_stacks_release();
+	batch_free(&info, in, args, results, env_values, env_names, scratch, stack);
+	return res;
+}
@@ -0,0 +1,584 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "parser.h"
+#include "format.h"
+
+// operands shorter than this many limbs are multiplied by the schoolbook method
+#ifndef BIGINT_KARATSUBA_THRESHOLD
+	#define BIGINT_KARATSUBA_THRESHOLD 32
+#endif
+
+// results larger than this are reported as errors instead of exhausting memory
+#ifndef BIGINT_MAX_LIMBS
+	#define BIGINT_MAX_LIMBS ((size_t)1 << 24)
+#endif
+
+#define BIGINT_CHUNK_SIZE ((size_t)64 << 10)
+
+// largest power of 10 that fits into a limb
+#define BIGINT_DECIMAL_BASE   10000000000000000000u
+#define BIGINT_DECIMAL_DIGITS 19
+
+
+
+// ARBITRARY PRECISION INTEGERS
+// integers stay in int64_t as long as they fit, operations that overflow
+// produce a BigInt, results that fit again are turned back to DT_Integer,
+// so a DT_BigInt value is always outside of the int64_t range
+typedef struct{
+	uint32_t size;     // limbs in use, the highest one is never zero
+	bool     negative;
+	uint64_t limbs[];  // magnitude, least significant limb first
+} BigInt;
+
+typedef unsigned __int128 BigUint128;
+typedef __int128          BigInt128;
+
+
+
+// BIGINT HEAP
+// results are never freed one by one, whole heap is released at the end of
+// evaluation, or back to a mark like the value heap, temporaries of a single
+// operation are allocated on their own
+typedef struct BigChunk{
+	struct BigChunk *next;
+	size_t size;
+	size_t capacity;
+	uint64_t data[];
+} BigChunk;
+
+static _Thread_local struct{
+	BigChunk *chunks;
+	BigChunk *spare; // chunk of the default size that a reset released
+	size_t allocations;
+	size_t bytes;
+} global_bigint_heap;
+
+
+static BigInt *bigint_alloc(size_t limb_count){
+	size_t words = 1 + limb_count; // header takes one word
+	BigChunk *chunk = global_bigint_heap.chunks;
+	if (chunk == NULL || chunk->capacity - chunk->size < words){
+		size_t capacity = util_max_usize(BIGINT_CHUNK_SIZE / sizeof(uint64_t), words);
+		if (global_bigint_heap.spare != NULL && capacity == global_bigint_heap.spare->capacity){
+			chunk = global_bigint_heap.spare;
+			global_bigint_heap.spare = NULL;
+		} else{
+			chunk = mem_alloc(sizeof(BigChunk) + capacity*sizeof(uint64_t));
+		}
+		assert(chunk != NULL && "bigint allocation failrule");
+		chunk->size = 0;
+		chunk->capacity = capacity;
+		// a dedicated chunk of an oversized number goes behind the current one
+		if (global_bigint_heap.chunks != NULL && capacity > BIGINT_CHUNK_SIZE / sizeof(uint64_t)){
+			chunk->next = global_bigint_heap.chunks->next;
+			global_bigint_heap.chunks->next = chunk;
+		} else{
+			chunk->next = global_bigint_heap.chunks;
+			global_bigint_heap.chunks = chunk;
+		}
+	}
+	BigInt *res = (BigInt *)(chunk->data + chunk->size);
+	chunk->size += words;
+	global_bigint_heap.allocations += 1;
+	global_bigint_heap.bytes += words*sizeof(uint64_t);
+	res->size = 0;
+	res->negative = false;
+	return res;
+}
+
+static void bigint_heap_release(void){
+	BigChunk *chunk = global_bigint_heap.chunks;
+	while (chunk != NULL){
+		BigChunk *next = chunk->next;
+		mem_free(chunk);
+		chunk = next;
+	}
+	mem_free(global_bigint_heap.spare);
+	global_bigint_heap.chunks = NULL;
+	global_bigint_heap.spare = NULL;
+}
+
+static HeapMark bigint_heap_mark(void){
+	BigChunk *chunk = global_bigint_heap.chunks;
+	return (HeapMark){
+		.chunk = chunk, .size = chunk != NULL ? chunk->size : 0, .next = chunk != NULL ? chunk->next : NULL,
+	};
+}
+
+static void bigint_heap_reset(HeapMark mark){
+	while (global_bigint_heap.chunks != mark.chunk){
+		BigChunk *chunk = global_bigint_heap.chunks;
+		global_bigint_heap.chunks = chunk->next;
+		if (global_bigint_heap.spare == NULL && chunk->capacity == BIGINT_CHUNK_SIZE / sizeof(uint64_t)){
+			global_bigint_heap.spare = chunk;
+		} else{
+			mem_free(chunk);
+		}
+	}
+	BigChunk *chunk = mark.chunk;
+	if (chunk == NULL) return;
+	// oversized chunks that went behind the marked one
+	while (chunk->next != mark.next){
+		BigChunk *big = chunk->next;
+		chunk->next = big->next;
+		mem_free(big);
+	}
+	chunk->size = mark.size;
+}
+
+static uint64_t *bigint_scratch(size_t limb_count){
+	uint64_t *res = mem_calloc(util_max_usize(limb_count, 1), sizeof(uint64_t));
+	assert(res != NULL && "bigint allocation failrule");
+	return res;
+}
+
+
+
+// MAGNITUDE OPERATIONS
+// work on little endian limb arrays, sizes may include leading zero limbs
+static size_t mag_trim(const uint64_t *a, size_t n){
+	while (n != 0 && a[n-1] == 0) n -= 1;
+	return n;
+}
+
+static int mag_cmp(const uint64_t *a, size_t an, const uint64_t *b, size_t bn){
+	an = mag_trim(a, an);
+	bn = mag_trim(b, bn);
+	if (an != bn) return an < bn ? -1 : 1;
+	for (size_t i=an; i!=0; i-=1){
+		if (a[i-1] != b[i-1]) return a[i-1] < b[i-1] ? -1 : 1;
+	}
+	return 0;
+}
+
+// r = a + b, r needs max(an, bn) + 1 limbs and may alias a
+static size_t mag_add(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn){
+	if (an < bn){
+		const uint64_t *t = a; a = b; b = t;
+		size_t tn = an; an = bn; bn = tn;
+	}
+	uint64_t carry = 0;
+	for (size_t i=0; i!=an; i+=1){
+		BigUint128 sum = (BigUint128)a[i] + (i < bn ? b[i] : 0) + carry;
+		r[i] = (uint64_t)sum;
+		carry = (uint64_t)(sum >> 64);
+	}
+	r[an] = carry;
+	return an + 1;
+}
+
+// r = a - b where a >= b, r needs an limbs and may alias a
+static size_t mag_sub(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn){
+	uint64_t borrow = 0;
+	for (size_t i=0; i!=an; i+=1){
+		uint64_t bi = i < bn ? b[i] : 0;
+		uint64_t d = a[i] - bi - borrow;
+		borrow = (a[i] < bi) || (a[i] - bi < borrow);
+		r[i] = d;
+	}
+	return an;
+}
+
+// adds b into a at offset, carry is propagated through the rest of a
+static void mag_add_into(uint64_t *a, size_t an, const uint64_t *b, size_t bn){
+	uint64_t carry = 0;
+	size_t i = 0;
+	for (; i!=bn; i+=1){
+		BigUint128 sum = (BigUint128)a[i] + b[i] + carry;
+		a[i] = (uint64_t)sum;
+		carry = (uint64_t)(sum >> 64);
+	}
+	for (; carry != 0 && i!=an; i+=1){
+		a[i] += 1;
+		carry = a[i] == 0;
+	}
+}
+
+// r = a * m + carry, r needs an + 1 limbs and may alias a
+static size_t mag_mul_small(uint64_t *r, const uint64_t *a, size_t an, uint64_t m, uint64_t carry){
+	for (size_t i=0; i!=an; i+=1){
+		BigUint128 p = (BigUint128)a[i] * m + carry;
+		r[i] = (uint64_t)p;
+		carry = (uint64_t)(p >> 64);
+	}
+	r[an] = carry;
+	return an + 1;
+}
+
+// q = a / d, returns the remainder, q may alias a
+static uint64_t mag_div_small(uint64_t *q, const uint64_t *a, size_t an, uint64_t d){
+	BigUint128 rem = 0;
+	for (size_t i=an; i!=0; i-=1){
+		BigUint128 cur = (rem << 64) | a[i-1];
+		q[i-1] = (uint64_t)(cur / d);
+		rem = cur % d;
+	}
+	return (uint64_t)rem;
+}
+
+// r = a * b, r has to be zeroed and needs an + bn limbs
+static void mag_mul_school(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn){
+	for (size_t i=0; i!=an; i+=1){
+		uint64_t carry = 0;
+		for (size_t j=0; j!=bn; j+=1){
+			BigUint128 p = (BigUint128)a[i] * b[j] + r[i+j] + carry;
+			r[i+j] = (uint64_t)p;
+			carry = (uint64_t)(p >> 64);
+		}
+		r[i+bn] = carry;
+	}
+}
+
+static void mag_mul(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn);
+
+// a = a1*B^h + a0 and b = b1*B^h + b0, then
+// a*b = a1*b1*B^2h + ((a0+a1)*(b0+b1) - a0*b0 - a1*b1)*B^h + a0*b0
+static void mag_mul_karatsuba(
+	uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn
+){
+	size_t h = util_max_usize(an, bn) / 2;
+	const uint64_t *a0 = a, *a1 = a + h;
+	const uint64_t *b0 = b, *b1 = b + h;
+	size_t a0n = mag_trim(a0, h), a1n = an - h;
+	size_t b0n = mag_trim(b0, h), b1n = bn - h;
+
+	// low and high products go straight to their place in the result
+	mag_mul(r, a0, a0n, b0, b0n);
+	mag_mul(r + 2*h, a1, a1n, b1, b1n);
+
+	uint64_t *sa = bigint_scratch(util_max_usize(h, a1n) + 1);
+	uint64_t *sb = bigint_scratch(util_max_usize(h, b1n) + 1);
+	size_t san = mag_trim(sa, mag_add(sa, a0, a0n, a1, a1n));
+	size_t sbn = mag_trim(sb, mag_add(sb, b0, b0n, b1, b1n));
+	size_t mn = san + sbn;
+	uint64_t *mid = bigint_scratch(mn);
+	mag_mul(mid, sa, san, sb, sbn);
+	mag_sub(mid, mid, mn, r, a0n + b0n);
+	mag_sub(mid, mid, mn, r + 2*h, a1n + b1n);
+	mag_add_into(r + h, an + bn - h, mid, mag_trim(mid, mn));
+	mem_free(sa);
+	mem_free(sb);
+	mem_free(mid);
+}
+
+static void mag_mul(uint64_t *r, const uint64_t *a, size_t an, const uint64_t *b, size_t bn){
+	memset(r, 0, (an + bn)*sizeof(uint64_t));
+	an = mag_trim(a, an);
+	bn = mag_trim(b, bn);
+	if (an < bn){
+		const uint64_t *t = a; a = b; b = t;
+		size_t tn = an; an = bn; bn = tn;
+	}
+	if (bn < BIGINT_KARATSUBA_THRESHOLD){
+		mag_mul_school(r, a, an, b, bn);
+		return;
+	}
+	if (2*bn > an){
+		mag_mul_karatsuba(r, a, an, b, bn);
+		return;
+	}
+	// unbalanced operands are multiplied by slices of the shorter length
+	uint64_t *part = bigint_scratch(2*bn);
+	for (size_t i=0; i<an; i+=bn){
+		size_t n = util_min_usize(bn, an - i);
+		mag_mul(part, a + i, n, b, bn);
+		mag_add_into(r + i, an + bn - i, part, n + bn);
+	}
+	mem_free(part);
+}
+
+// q = a / b for b with at least two limbs (Knuth, algorithm D), q needs an - bn + 1 limbs
+static void mag_div(uint64_t *q, const uint64_t *a, size_t an, const uint64_t *b, size_t bn){
+	uint32_t s = util_leading_zeros_u64(b[bn-1]);
+	uint64_t *v = bigint_scratch(bn);
+	uint64_t *u = bigint_scratch(an + 1);
+	for (size_t i=bn-1; i!=0; i-=1){
+		v[i] = s ? (b[i] << s) | (b[i-1] >> (64 - s)) : b[i];
+	}
+	v[0] = b[0] << s;
+	u[an] = s ? a[an-1] >> (64 - s) : 0;
+	for (size_t i=an-1; i!=0; i-=1){
+		u[i] = s ? (a[i] << s) | (a[i-1] >> (64 - s)) : a[i];
+	}
+	u[0] = a[0] << s;
+
+	for (size_t j=an-bn+1; j!=0; j-=1){
+		size_t k = j - 1;
+		BigUint128 num = ((BigUint128)u[k+bn] << 64) | u[k+bn-1];
+		BigUint128 qhat = num / v[bn-1];
+		BigUint128 rhat = num % v[bn-1];
+		while (
+			(qhat >> 64) != 0 ||
+			qhat * v[bn-2] > ((rhat << 64) | u[k+bn-2])
+		){
+			qhat -= 1;
+			rhat += v[bn-1];
+			if ((rhat >> 64) != 0) break;
+		}
+		// multiply and subtract
+		BigInt128 borrow = 0;
+		BigInt128 t;
+		for (size_t i=0; i!=bn; i+=1){
+			BigUint128 p = qhat * v[i];
+			t = (BigInt128)u[i+k] - borrow - (BigInt128)(uint64_t)p;
+			u[i+k] = (uint64_t)t;
+			borrow = (BigInt128)(p >> 64) - (t >> 64);
+		}
+		t = (BigInt128)u[k+bn] - borrow;
+		u[k+bn] = (uint64_t)t;
+		q[k] = (uint64_t)qhat;
+		if (t < 0){
+			// estimate was one too large, add the divisor back
+			q[k] -= 1;
+			uint64_t carry = 0;
+			for (size_t i=0; i!=bn; i+=1){
+				BigUint128 sum = (BigUint128)u[i+k] + v[i] + carry;
+				u[i+k] = (uint64_t)sum;
+				carry = (uint64_t)(sum >> 64);
+			}
+			u[k+bn] += carry;
+		}
+	}
+	mem_free(u);
+	mem_free(v);
+}
+
+
+
+// SIGNED OPERATIONS
+// integers and big integers are both viewed as sign and magnitude
+typedef struct{
+	const uint64_t *limbs;
+	size_t size;
+	bool negative;
+} BigView;
+
+static BigView bigint_view(Value value, uint64_t *storage){
+	if (value.type == DT_BigInt){
+		const BigInt *big = value.data.ptr;
+		return (BigView){ big->limbs, big->size, big->negative };
+	}
+	int64_t n = value.data.integer;
+	*storage = n < 0 ? (uint64_t)0 - (uint64_t)n : (uint64_t)n;
+	return (BigView){ storage, *storage != 0, n < 0 };
+}
+
+// turns a magnitude into a value, demoting it to an integer when it fits
+static Value bigint_make(const uint64_t *limbs, size_t size, bool negative){
+	size = mag_trim(limbs, size);
+	if (size == 0) return (Value){ .type = DT_Integer, .data.integer = 0 };
+	if (size == 1){
+		uint64_t m = limbs[0];
+		if (!negative && m <= (uint64_t)INT64_MAX){
+			return (Value){ .type = DT_Integer, .data.integer = (int64_t)m };
+		}
+		if (negative && m <= (uint64_t)INT64_MAX + 1){
+			return (Value){ .type = DT_Integer, .data.integer = (int64_t)((uint64_t)0 - m) };
+		}
+	}
+	BigInt *big = bigint_alloc(size);
+	memcpy(big->limbs, limbs, size*sizeof(uint64_t));
+	big->size = size;
+	big->negative = negative;
+	return (Value){ .type = DT_BigInt, .data.ptr = big };
+}
+
+static Value bigint_from_i128(BigInt128 n){
+	BigUint128 m = n < 0 ? (BigUint128)0 - (BigUint128)n : (BigUint128)n;
+	uint64_t limbs[2] = { (uint64_t)m, (uint64_t)(m >> 64) };
+	return bigint_make(limbs, 2, n < 0);
+}
+
+static Value bigint_negate(Value value){
+	uint64_t storage;
+	BigView v = bigint_view(value, &storage);
+	return bigint_make(v.limbs, v.size, !v.negative && v.size != 0);
+}
+
+static Value bigint_abs(Value value){
+	uint64_t storage;
+	BigView v = bigint_view(value, &storage);
+	return bigint_make(v.limbs, v.size, false);
+}
+
+static int bigint_cmp(Value lhs, Value rhs){
+	uint64_t sl, sr;
+	BigView a = bigint_view(lhs, &sl);
+	BigView b = bigint_view(rhs, &sr);
+	if (a.negative != b.negative) return a.negative ? -1 : 1;
+	int res = mag_cmp(a.limbs, a.size, b.limbs, b.size);
+	return a.negative ? -res : res;
+}
+
+static const char *bigint_add(Value lhs, Value rhs, bool subtract, Value *res){
+	uint64_t sl, sr;
+	BigView a = bigint_view(lhs, &sl);
+	BigView b = bigint_view(rhs, &sr);
+	b.negative ^= subtract;
+	size_t size = util_max_usize(a.size, b.size) + 1;
+	if (size > BIGINT_MAX_LIMBS) return "integer is too large";
+	uint64_t *r = bigint_scratch(size);
+	bool negative = a.negative;
+	if (a.negative == b.negative){
+		mag_add(r, a.limbs, a.size, b.limbs, b.size);
+	} else if (mag_cmp(a.limbs, a.size, b.limbs, b.size) >= 0){
+		mag_sub(r, a.limbs, a.size, b.limbs, b.size);
+	} else{
+		mag_sub(r, b.limbs, b.size, a.limbs, a.size);
+		negative = b.negative;
+	}
+	*res = bigint_make(r, size, negative);
+	mem_free(r);
+	return NULL;
+}
+
+static const char *bigint_mul(Value lhs, Value rhs, Value *res){
+	uint64_t sl, sr;
+	BigView a = bigint_view(lhs, &sl);
+	BigView b = bigint_view(rhs, &sr);
+	size_t size = a.size + b.size;
+	if (size > BIGINT_MAX_LIMBS) return "integer is too large";
+	uint64_t *r = bigint_scratch(size);
+	mag_mul(r, a.limbs, a.size, b.limbs, b.size);
+	*res = bigint_make(r, size, a.negative != b.negative);
+	mem_free(r);
+	return NULL;
+}
+
+// quotient is truncated towards zero like integer division
+static const char *bigint_div(Value lhs, Value rhs, Value *res){
+	uint64_t sl, sr;
+	BigView a = bigint_view(lhs, &sl);
+	BigView b = bigint_view(rhs, &sr);
+	if (b.size == 0) return "division by zero";
+	bool negative = a.negative != b.negative;
+	if (mag_cmp(a.limbs, a.size, b.limbs, b.size) < 0){
+		*res = (Value){ .type = DT_Integer, .data.integer = 0 };
+		return NULL;
+	}
+	uint64_t *q = bigint_scratch(a.size);
+	if (b.size == 1){
+		mag_div_small(q, a.limbs, a.size, b.limbs[0]);
+	} else{
+		mag_div(q, a.limbs, a.size, b.limbs, b.size);
+	}
+	*res = bigint_make(q, a.size, negative);
+	mem_free(q);
+	return NULL;
+}
+
+static const char *bigint_pow(Value base, uint64_t exp, Value *res){
+	uint64_t storage;
+	BigView b = bigint_view(base, &storage);
+	if (b.size == 0 || (b.size == 1 && b.limbs[0] == 1)){
+		*res = bigint_make(b.limbs, b.size, b.negative && (exp & 1));
+		return NULL;
+	}
+	size_t bits = 64*b.size - util_leading_zeros_u64(b.limbs[b.size-1]);
+	if (exp > 64*BIGINT_MAX_LIMBS || bits * exp > 64*BIGINT_MAX_LIMBS) return "integer is too large";
+	size_t capacity = (bits * exp) / 64 + 2;
+	uint64_t *acc = bigint_scratch(capacity);
+	uint64_t *sq  = bigint_scratch(capacity);
+	uint64_t *tmp = bigint_scratch(2*capacity);
+	acc[0] = 1;
+	size_t acc_n = 1;
+	memcpy(sq, b.limbs, b.size*sizeof(uint64_t));
+	size_t sq_n = b.size;
+	for (uint64_t e=exp;;){
+		if (e & 1){
+			mag_mul(tmp, acc, acc_n, sq, sq_n);
+			acc_n = mag_trim(tmp, acc_n + sq_n);
+			memcpy(acc, tmp, acc_n*sizeof(uint64_t));
+		}
+		e >>= 1;
+		if (e == 0) break;
+		mag_mul(tmp, sq, sq_n, sq, sq_n);
+		sq_n = mag_trim(tmp, 2*sq_n);
+		memcpy(sq, tmp, sq_n*sizeof(uint64_t));
+	}
+	*res = bigint_make(acc, acc_n, b.negative && (exp & 1));
+	mem_free(acc);
+	mem_free(sq);
+	mem_free(tmp);
+	return NULL;
+}
+
+// product of integers in [lo, hi], halves are multiplied so operands stay balanced
+static void bigint_range_product(uint64_t lo, uint64_t hi, uint64_t **res, size_t *res_n){
+	if (hi - lo < 16){
+		size_t cap = hi - lo + 2;
+		uint64_t *r = bigint_scratch(cap);
+		r[0] = 1;
+		size_t n = 1;
+		for (uint64_t i=lo; i<=hi; i+=1) n = mag_trim(r, mag_mul_small(r, r, n, i, 0));
+		*res = r;
+		*res_n = n;
+		return;
+	}
+	uint64_t mid = lo + (hi - lo) / 2;
+	uint64_t *a, *b;
+	size_t an, bn;
+	bigint_range_product(lo, mid, &a, &an);
+	bigint_range_product(mid + 1, hi, &b, &bn);
+	uint64_t *r = bigint_scratch(an + bn);
+	mag_mul(r, a, an, b, bn);
+	mem_free(a);
+	mem_free(b);
+	*res = r;
+	*res_n = mag_trim(r, an + bn);
+}
+
+static const char *bigint_factorial(uint64_t n, Value *res){
+	// log2(n!) < n*log2(n)
+	if (n > 64*BIGINT_MAX_LIMBS || n * util_bitwidth_u64(n) > 64*BIGINT_MAX_LIMBS)
+		return "integer is too large";
+	if (n < 2){
+		*res = (Value){ .type = DT_Integer, .data.integer = 1 };
+		return NULL;
+	}
+	uint64_t *r;
+	size_t rn;
+	bigint_range_product(2, n, &r, &rn);
+	*res = bigint_make(r, rn, false);
+	mem_free(r);
+	return NULL;
+}
+
+
+
+// DECIMAL FORMATTING
+// the number is split into 19 digit chunks by dividing by 10^19,
+// chunks are then written by the integer formatting kernel
+static size_t bigint_format_bound(const BigInt *big){
+	// every limb holds less than 20 decimal digits
+	return (size_t)big->size * 20 + 2;
+}
+
+static size_t bigint_format(char *dest, const BigInt *big){
+	uint64_t *mag = bigint_scratch(big->size);
+	uint64_t *chunks = bigint_scratch(big->size * 20 / BIGINT_DECIMAL_DIGITS + 2);
+	memcpy(mag, big->limbs, big->size*sizeof(uint64_t));
+	size_t n = big->size;
+	size_t chunk_count = 0;
+	while (n != 0){
+		chunks[chunk_count] = mag_div_small(mag, mag, n, BIGINT_DECIMAL_BASE);
+		chunk_count += 1;
+		n = mag_trim(mag, n);
+	}
+	char *it = dest;
+	if (big->negative){ *it = '-'; it += 1; }
+	it += format_u64(it, chunks[chunk_count-1]);
+	for (size_t i=chunk_count-1; i!=0; i-=1){
+		char digits[FORMAT_MAX_NUMBER];
+		size_t len = format_u64(digits, chunks[i-1]);
+		memset(it, '0', BIGINT_DECIMAL_DIGITS - len);
+		memcpy(it + BIGINT_DECIMAL_DIGITS - len, digits, len);
+		it += BIGINT_DECIMAL_DIGITS;
+	}
+	mem_free(mag);
+	mem_free(chunks);
+	return it - dest;
+}
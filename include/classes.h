@@ -1,7 +1,10 @@
 #pragma once
 
+#include <pthread.h>
+
 #include "utils.h"
 #include "structs.h"
+#include "memstat.h"
 
 
 
@@ -37,10 +40,73 @@ struct GlobalNameData{
 };
 
 
-static struct GlobalNameSet  global_name_set;
-static struct GlobalNameData global_names;
+// names of the thread's current context, contexts of the embedding api have
+// their own tables, everything else shares the default one
+typedef struct{
+	struct GlobalNameSet  set;
+	struct GlobalNameData names;
+} NameTable;
+
+static NameTable global_default_names;
+static _Thread_local NameTable *global_name_table = &global_default_names;
+
+#define global_name_set (global_name_table->set)
+#define global_names    (global_name_table->names)
+
+static _Thread_local size_t hash_colissions = 0; 
+
+// entries are placed again, so the old table isn't copied
+static void name_set_resize(size_t new_hs_capacity){
+	struct GlobalNameSet name_set = global_name_set;
+	struct NameEntry *new_hs_data = mem_calloc(new_hs_capacity, sizeof(struct NameEntry));
+	if (new_hs_data == NULL){
+		assert(false && "name allocation failrule");
+	}
+	// reindex old hash table
+	size_t elem_index_mask = new_hs_capacity - 1;
+	for (size_t i=0; i!=name_set.capacity; i+=1){
+		struct NameEntry old_set_entry = name_set.data[i];
+		if (old_set_entry.name_id != 0){
+			size_t elem_index = old_set_entry.hash & elem_index_mask;
+			for (size_t i=0;; i+=1){
+				struct NameEntry entry = new_hs_data[elem_index];
+				if (entry.length == 0) break; // add elem to new table
+				elem_index = (elem_index + i + 1) & elem_index_mask;
+			}
+			new_hs_data[elem_index] = old_set_entry;
+		}
+	}
+	mem_count_grow(name_set.size*sizeof(struct NameEntry));
+	mem_free(name_set.data);
+	global_name_set.data     = new_hs_data;
+	global_name_set.capacity = new_hs_capacity;
+}
+
+static void name_data_resize(size_t new_names_capacity){
+	struct GlobalNameData names = global_names;
+	uint8_t *new_names_data = mem_alloc(new_names_capacity);
+	assert(new_names_data != NULL && "name allocation failrule");
+	memcpy(new_names_data, names.data, names.size);
+	mem_count_grow(names.size);
+	mem_free(names.data);
+	global_names.data     = new_names_data;
+	global_names.capacity = new_names_capacity;
+}
 
-static size_t hash_colissions = 0; 
+// makes room for name_bytes more bytes of name data and for name_count more
+// names in the set, tables at least double, so growing them stays amortized
+static void reserve_compiler_names(size_t name_bytes, size_t name_count){
+	size_t names_size = global_names.size + name_bytes;
+	if (names_size > global_names.capacity){
+		name_data_resize(util_max_usize(names_size, 2*global_names.capacity));
+	}
+	size_t set_size = global_name_set.size + name_count;
+	if (4*set_size >= 3*global_name_set.capacity){
+		size_t capacity = 2*global_name_set.capacity;
+		while (4*set_size >= 3*capacity) capacity *= 2;
+		name_set_resize(capacity);
+	}
+}
 
 static NameId get_name_id(const char *str, uint8_t length){
 	assert(util_is_power2_u32(global_name_set.capacity));
@@ -68,14 +134,8 @@ static NameId get_name_id(const char *str, uint8_t length){
 	NameId result = names.size + 1;
 	size_t new_names_size = names.size + length + 1;
 	if (new_names_size > names.capacity){
-		size_t   new_names_capacity = 2*names.capacity;
-		uint8_t *new_names_data = malloc(new_names_capacity);
-		assert(new_names_data != NULL && "name allocation failrule");
-		memcpy(new_names_data, names.data, names.size);
-		free(names.data);
-		names.data     = new_names_data;
-		names.capacity = new_names_capacity;
-		global_names = names;
+		name_data_resize(2*names.capacity);
+		names = global_names;
 	}
 	names.data[names.size] = length;
 	memcpy(names.data+names.size+1, str, length);
@@ -91,30 +151,7 @@ static NameId get_name_id(const char *str, uint8_t length){
 	global_name_set.size = name_set.size;
 	
 	UNLIKELY if (4*name_set.size >= 3*name_set.capacity){
-		// resize hash table
-		size_t new_hs_capacity = 2*name_set.capacity;
-		struct NameEntry *new_hs_data = malloc(new_hs_capacity*sizeof(struct NameEntry));
-		if (new_hs_data == NULL){
-			assert(false && "name allocation failrule");
-		}
-		memset(new_hs_data, 0, new_hs_capacity*sizeof(struct NameEntry));
-		// reindex old hash table
-		size_t elem_index_mask = new_hs_capacity - 1;
-		for (size_t i=0; i!=name_set.capacity; i+=1){
-			struct NameEntry old_set_entry = name_set.data[i];
-			if (old_set_entry.name_id != 0){
-				size_t elem_index = old_set_entry.hash & elem_index_mask;
-				for (size_t i=0;; i+=1){
-					struct NameEntry entry = new_hs_data[elem_index];
-					if (entry.length == 0) break; // add elem to new table
-					elem_index = (elem_index + i + 1) & elem_index_mask;
-				}
-				new_hs_data[elem_index] = old_set_entry;
-			}
-		}
-		free(name_set.data);
-		global_name_set.data     = new_hs_data;
-		global_name_set.capacity = new_hs_capacity;
+		name_set_resize(2*name_set.capacity);
 	}
 	return result;
 }
@@ -129,18 +166,32 @@ static void initialize_compiler_globals(void){
 	global_name_set.capacity = 128;
 	global_name_set.size = 0;
 	size_t name_set_bytes = global_name_set.capacity*sizeof(struct NameEntry);
-	global_name_set.data = malloc(name_set_bytes);
+	global_name_set.data = mem_calloc(name_set_bytes, 1);
 	assert(global_name_set.data != NULL);
-	memset(global_name_set.data, 0, name_set_bytes);
 	
 	// name data 
 	global_names.capacity = global_name_set.capacity*(1+8);
 	global_names.size = 0;
-	global_names.data = malloc(global_names.capacity);
+	global_names.data = mem_alloc(global_names.capacity);
 	assert(global_names.data != NULL);
 
-	// keywords & directires
-	init_keyword_names();
+	// keywords & directires, the table is shared by all contexts
+	static pthread_once_t keywords_once = PTHREAD_ONCE_INIT;
+	pthread_once(&keywords_once, init_keyword_names);
+}
+
+// empties the tables of the thread's current context, their memory is kept
+static void reset_compiler_globals(void){
+	memset(global_name_set.data, 0, global_name_set.capacity*sizeof(struct NameEntry));
+	global_name_set.size = 0;
+	global_names.size = 0;
+}
+
+static void free_compiler_globals(void){
+	mem_free(global_name_set.data);
+	mem_free(global_names.data);
+	global_name_set = (struct GlobalNameSet){0};
+	global_names = (struct GlobalNameData){0};
 }
 
 
@@ -0,0 +1,568 @@
+#pragma once
+
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "optimize.h"
+#include "eval.h"
+#include "workpool.h"
+
+// requests are read whole, larger ones close the connection
+#ifndef DAEMON_MAX_REQUEST
+	#define DAEMON_MAX_REQUEST ((size_t)16 << 20)
+#endif
+
+#define DAEMON_BACKLOG 64
+
+// bytes read from a connection at once
+#define DAEMON_READ_SIZE ((size_t)64 << 10)
+
+// bytes of the header of a response, status, output size and message size
+#define DAEMON_RESPONSE_HEADER 12
+
+enum DaemonStatus{
+	DaemonStatus_Ok    = 0,
+	DaemonStatus_Error = 1, // output of the statements before the error is still sent
+};
+
+
+
+// DAEMON
+// the script is compiled and evaluated once, then requests are read from
+// a unix socket, a request is a script of its own that sees the variables
+// defined at the top level of the loaded one, its own definitions only live
+// until it ends, constants that the optimizer put into the script's
+// functions can't be shadowed by them,
+// the main thread polls the connections and reads what they send, a
+// connection with a complete request becomes a task of the work pool that
+// answers it and every other complete one, its socket is not polled until
+// then, so requests of a connection are answered in order and idle clients
+// don't hold a worker
+//   request:  u32 size, text of the script
+//   response: u32 status, u32 output size, u32 message size, output, message
+// numbers are little endian, the message is empty unless the status is an error
+typedef struct{
+	AstArray     nodes;
+	uint32_t     script_size; // nodes before the terminator of the script
+	uint32_t     text_size;   // positions of requests start after the script's text
+	const char  *text;
+	PackedValue *env_values;
+	NameId      *env_names;
+	size_t       env_count;
+	bool         optimize;
+
+	WorkPool pool;
+	// compiling a request adds to the name table, that evaluation reads,
+	// it is only reallocated while no request is evaluated
+	pthread_mutex_t  compile_mutex;
+	pthread_rwlock_t names_lock;
+
+	pthread_mutex_t mutex;  // guards the states of the connections
+	pthread_cond_t  cond;
+	int wake[2];            // pipe that tells the main thread a connection is idle again
+	struct DaemonConnection **connections; // only changed by the main thread
+	size_t connection_count;
+	size_t connection_capacity;
+} DaemonServer;
+
+// the main thread appends to the data while the connection is idle,
+// the task takes the complete requests from its start while it's busy
+typedef struct DaemonConnection{
+	PoolTask      task;
+	DaemonServer *server;
+	int           fd;
+	char         *data; // one byte more is allocated, so a request can be terminated
+	size_t        size;
+	size_t        capacity;
+	bool          busy;
+	bool          failed;
+} DaemonConnection;
+
+static struct{
+	_Atomic size_t connections;
+	_Atomic size_t requests;
+	_Atomic size_t errors;
+} global_daemon_stats;
+
+// copy of the script's nodes that requests are appended to, one per thread
+static _Thread_local AstArray global_daemon_nodes;
+
+static volatile sig_atomic_t global_daemon_stop;
+
+
+static void daemon_on_signal(int signal){
+	(void)signal;
+	global_daemon_stop = 1;
+}
+
+static void daemon_put_u32(char *dest, uint32_t n){
+	for (size_t i=0; i!=4; i+=1) dest[i] = (char)(n >> 8*i);
+}
+
+static uint32_t daemon_get_u32(const char *src){
+	uint32_t res = 0;
+	for (size_t i=0; i!=4; i+=1) res |= (uint32_t)(uint8_t)src[i] << 8*i;
+	return res;
+}
+
+// returns false when the connection was closed before all bytes came
+static bool daemon_read_all(int fd, char *data, size_t size){
+	while (size != 0){
+		ssize_t got = read(fd, data, size);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return false;
+		data += got;
+		size -= got;
+	}
+	return true;
+}
+
+static bool daemon_send_all(int fd, const char *data, size_t size){
+	while (size != 0){
+		ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		data += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool daemon_address(const char *path, struct sockaddr_un *res){
+	*res = (struct sockaddr_un){ .sun_family = AF_UNIX };
+	size_t length = strlen(path);
+	if (length >= sizeof(res->sun_path)) return false;
+	memcpy(res->sun_path, path, length + 1);
+	return true;
+}
+
+
+
+// LOADING THE SCRIPT
+// variables defined at the top level are kept for the requests, their values
+// stay in the heaps of the main thread
+static EvalError daemon_load(DaemonServer *server){
+	EvalError res = eval_definitions(
+		server->nodes, server->script_size, &server->env_values, &server->env_names, &server->env_count
+	);
+	output_flush();
+	return res;
+}
+
+
+
+// REQUESTS
+// a new name adds its length and one byte to the name data, the data is grown
+// before compiling by more than make_tokens reserves, so it doesn't move while
+// other requests read it
+static void daemon_reserve_names(DaemonServer *server, size_t size){
+	if (global_names.capacity - global_names.size >= 2*size + 2) return;
+	size_t capacity = global_names.capacity;
+	while (capacity - global_names.size < 2*size + 2) capacity *= 2;
+	uint8_t *data = mem_alloc(capacity);
+	assert(data != NULL && "name allocation failrule");
+	pthread_rwlock_wrlock(&server->names_lock);
+	memcpy(data, global_names.data, global_names.size);
+	mem_count_grow(global_names.size);
+	mem_free(global_names.data);
+	global_names.data = data;
+	global_names.capacity = capacity;
+	pthread_rwlock_unlock(&server->names_lock);
+}
+
+// literals of the request are kept in *literals until its evaluation ends
+static EvalError daemon_compile(DaemonServer *server, const char *text, size_t size, StringHeap *literals){
+	EvalError res = {0};
+	pthread_mutex_lock(&server->compile_mutex);
+	daemon_reserve_names(server, size);
+	StringHeap script_literals = global_literal_heap;
+	global_literal_heap = (StringHeap){0};
+
+	AstArray ast = make_tokens(text);
+	AstNode *buffer = ast.data;
+	if (ast.data != NULL) ast = parse_tokens(ast);
+	if (ast.data == NULL){
+		mem_free(buffer);
+		res = (EvalError){ ast.error, server->text_size + ast.position };
+		goto Done;
+	}
+	if (server->optimize){
+		OptimizeStats stats;
+		ast = optimize_ast(ast, &stats);
+	}
+	ast_shift_positions(ast, server->text_size);
+
+	// the request goes where the script ends, so indices of the script's functions stay valid
+	uint32_t length = ast_terminator(ast);
+	AstArray *dest = &global_daemon_nodes;
+	size_t capacity = dest->maxptr - dest->data;
+	if (capacity < server->script_size + length){
+		mem_free(dest->data);
+		capacity = util_max_usize(2*capacity, server->script_size + length);
+		*dest = ast_array_new(util_max_usize(capacity, 32));
+		memcpy(dest->data, server->nodes.data, server->script_size*sizeof(AstNode));
+		mem_count_grow(server->script_size*sizeof(AstNode));
+	}
+	memcpy(dest->data + server->script_size, ast.data + 1, length*sizeof(AstNode));
+	dest->end = dest->data + server->script_size + length;
+	mem_free(ast.data);
+Done:
+	*literals = global_literal_heap;
+	global_literal_heap = script_literals;
+	pthread_mutex_unlock(&server->compile_mutex);
+	return res;
+}
+
+// message is written like the first line of a reported error
+static size_t daemon_format_error(DaemonServer *server, const char *text, EvalError err, char *dest, size_t capacity){
+	bool in_script = err.pos < server->text_size;
+	if (!in_script){
+		err.pos -= server->text_size;
+	} else{
+		text = server->text;
+	}
+	size_t row = 0, col = 0;
+	for (size_t i=0; i!=err.pos && text[i]!='\0'; i+=1){
+		col += 1;
+		if (text[i] == '\n' || text[i] == '\v'){
+			row += 1;
+			col = 0;
+		}
+	}
+	int length = snprintf(dest, capacity, "error: \"%s\"%s -> row: %zu, column: %zu\n",
+		err.msg, in_script ? " in the script" : "", row, col
+	);
+	return util_min_usize(length < 0 ? 0 : length, capacity - 1);
+}
+
+static bool daemon_answer(DaemonServer *server, int fd, const char *text, size_t size){
+	StringHeap literals;
+	EvalError err = daemon_compile(server, text, size, &literals);
+	if (err.msg == NULL){
+		EvalScope scope = {
+			.start = server->script_size,
+			.env_values = server->env_values, .env_names = server->env_names, .env_count = server->env_count,
+		};
+		pthread_rwlock_rdlock(&server->names_lock);
+		err = eval_scope(global_daemon_nodes, &scope);
+		pthread_rwlock_unlock(&server->names_lock);
+	}
+	string_heap_release(&literals);
+	atomic_fetch_add_explicit(&global_daemon_stats.requests, 1, memory_order_relaxed);
+
+	char message[512];
+	size_t message_size = 0;
+	if (err.msg != NULL){
+		message_size = daemon_format_error(server, text, err, message, sizeof(message));
+		atomic_fetch_add_explicit(&global_daemon_stats.errors, 1, memory_order_relaxed);
+	}
+	size_t output_size;
+	char *output = output_take(&output_size);
+	char header[DAEMON_RESPONSE_HEADER];
+	daemon_put_u32(header + 0, err.msg == NULL ? DaemonStatus_Ok : DaemonStatus_Error);
+	daemon_put_u32(header + 4, (uint32_t)output_size);
+	daemon_put_u32(header + 8, (uint32_t)message_size);
+	bool res = daemon_send_all(fd, header, sizeof(header))
+		&& daemon_send_all(fd, output, output_size)
+		&& daemon_send_all(fd, message, message_size);
+	free(output);
+	return res;
+}
+
+// size of the first request in the data if all of it came, otherwise 0
+static size_t daemon_complete_request(const char *data, size_t size){
+	if (size < 4) return 0;
+	size_t request = 4 + (size_t)daemon_get_u32(data);
+	return size >= request ? request : 0;
+}
+
+static void daemon_serve_requests(PoolTask *task){
+	DaemonConnection *conn = (DaemonConnection *)task;
+	DaemonServer *server = conn->server;
+	size_t offset = 0;
+	bool ok = true;
+	for (size_t size; ok && (size = daemon_complete_request(conn->data + offset, conn->size - offset));){
+		// text is terminated for the lexer, the byte after it is kept
+		char *text = conn->data + offset + 4;
+		char next = text[size-4];
+		text[size-4] = '\0';
+		ok = daemon_answer(server, conn->fd, text, size-4);
+		text[size-4] = next;
+		offset += size;
+	}
+	memmove(conn->data, conn->data + offset, conn->size - offset);
+	conn->size -= offset;
+	pthread_mutex_lock(&server->mutex);
+	conn->busy = false;
+	conn->failed = !ok;
+	pthread_cond_broadcast(&server->cond);
+	pthread_mutex_unlock(&server->mutex);
+	char byte = 0;
+	while (write(server->wake[1], &byte, 1) < 0 && errno == EINTR);
+}
+
+// reads what the client sent, returns false when the connection ends
+static bool daemon_receive(DaemonConnection *conn){
+	if (conn->capacity - conn->size < DAEMON_READ_SIZE){
+		conn->capacity = util_max_usize(2*conn->capacity, conn->size + DAEMON_READ_SIZE);
+		conn->data = realloc(conn->data, conn->capacity + 1);
+		assert(conn->data != NULL && "daemon allocation failrule");
+	}
+	ssize_t got = read(conn->fd, conn->data + conn->size, DAEMON_READ_SIZE);
+	if (got < 0 && (errno == EINTR || errno == EAGAIN)) return true;
+	if (got <= 0) return false;
+	conn->size += got;
+	return conn->size < 4 || daemon_get_u32(conn->data) <= DAEMON_MAX_REQUEST;
+}
+
+static void daemon_close(DaemonConnection *conn){
+	close(conn->fd);
+	free(conn->data);
+	free(conn);
+}
+
+static void daemon_thread_begin(WorkPool *pool){
+	(void)pool;
+	output_init_capture();
+}
+
+static void daemon_thread_end(WorkPool *pool){
+	(void)pool;
+	output_finish();
+	eval_stacks_release();
+	mem_free(global_daemon_nodes.data);
+	global_daemon_nodes = (AstArray){0};
+}
+
+
+
+// SERVING
+typedef struct{
+	EvalError error;
+	bool      setup; // error isn't in the script
+} DaemonResult;
+
+
+// only sockets are removed, so a wrong path can't delete a file
+static bool daemon_unlink_socket(const char *path){
+	struct stat s;
+	if (lstat(path, &s) != 0) return errno == ENOENT;
+	if (!S_ISSOCK(s.st_mode)) return false;
+	return unlink(path) == 0;
+}
+
+static const char *daemon_listen(const char *path, int *res){
+	struct sockaddr_un address;
+	if (!daemon_address(path, &address)) return "socket path is too long";
+	// socket left behind by an earlier daemon is replaced
+	if (!daemon_unlink_socket(path)) return "socket path is taken by something else than a socket";
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return "socket can't be created";
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0){
+		close(fd);
+		return "socket can't be bound to the path";
+	}
+	if (listen(fd, DAEMON_BACKLOG) != 0){
+		close(fd);
+		daemon_unlink_socket(path);
+		return "socket can't accept connections";
+	}
+	*res = fd;
+	return NULL;
+}
+
+// serves until the process gets SIGINT or SIGTERM
+DaemonResult eval_daemon(
+	AstArray nodes, const char *text, size_t text_size, const char *path, size_t thread_count, bool optimize
+){
+	DaemonResult res = {0};
+	DaemonServer server = {
+		.nodes = nodes, .text = text, .optimize = optimize,
+		.script_size = ast_terminator(nodes), .text_size = text_size + 1, .wake = { -1, -1 },
+	};
+	vmem_default_reserve();
+	res.error = daemon_load(&server);
+	if (res.error.msg != NULL) goto Done;
+
+	int listener;
+	res.error.msg = daemon_listen(path, &listener);
+	res.setup = true;
+	if (res.error.msg != NULL) goto Done;
+
+	// workers never see the signals, the main thread only while it waits
+	sigset_t stop_signals, wait_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+	sigdelset(&wait_mask, SIGINT);
+	sigdelset(&wait_mask, SIGTERM);
+	struct sigaction action = { .sa_handler = daemon_on_signal };
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	pthread_mutex_init(&server.compile_mutex, NULL);
+	pthread_rwlockattr_t lock_attr;
+	pthread_rwlockattr_init(&lock_attr);
+	pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&server.names_lock, &lock_attr);
+	pthread_rwlockattr_destroy(&lock_attr);
+	pthread_mutex_init(&server.mutex, NULL);
+	pthread_cond_init(&server.cond, NULL);
+	global_string_interning = false;
+	server.pool = (WorkPool){ .thread_begin = daemon_thread_begin, .thread_end = daemon_thread_end };
+	if (!pool_start(&server.pool, thread_count)){
+		res.error.msg = "no worker thread could be started";
+	}
+
+	if (res.error.msg == NULL && pipe2(server.wake, O_CLOEXEC | O_NONBLOCK) != 0){
+		res.error.msg = "wake up pipe can't be created";
+	}
+
+	// the listener, the wake up pipe and the idle connections
+	struct pollfd *polled = NULL;
+	DaemonConnection **polled_conns = NULL;
+	size_t polled_capacity = 0;
+	while (res.error.msg == NULL && !global_daemon_stop){
+		if (polled_capacity < 2 + server.connection_count){
+			polled_capacity = util_max_usize(64, 2*(2 + server.connection_count));
+			polled = realloc(polled, polled_capacity*sizeof(struct pollfd));
+			polled_conns = realloc(polled_conns, polled_capacity*sizeof(DaemonConnection *));
+			assert(polled != NULL && polled_conns != NULL && "daemon allocation failrule");
+		}
+		polled[0] = (struct pollfd){ .fd = listener, .events = POLLIN };
+		polled[1] = (struct pollfd){ .fd = server.wake[0], .events = POLLIN };
+		size_t polled_count = 2;
+		// connections that ended or failed are closed once they're idle
+		pthread_mutex_lock(&server.mutex);
+		for (size_t i=0; i<server.connection_count;){
+			DaemonConnection *conn = server.connections[i];
+			if (conn->busy){ i += 1; continue; }
+			if (conn->failed){
+				daemon_close(conn);
+				server.connection_count -= 1;
+				server.connections[i] = server.connections[server.connection_count];
+				continue;
+			}
+			polled[polled_count] = (struct pollfd){ .fd = conn->fd, .events = POLLIN };
+			polled_conns[polled_count] = conn;
+			polled_count += 1;
+			i += 1;
+		}
+		pthread_mutex_unlock(&server.mutex);
+
+		if (ppoll(polled, polled_count, NULL, &wait_mask) <= 0) continue;
+		if (polled[1].revents & POLLIN){
+			char bytes[64];
+			while (read(server.wake[0], bytes, sizeof(bytes)) > 0);
+		}
+		for (size_t i=2; i!=polled_count; i+=1){
+			if (polled[i].revents == 0) continue;
+			DaemonConnection *conn = polled_conns[i];
+			bool ok = daemon_receive(conn);
+			pthread_mutex_lock(&server.mutex);
+			conn->failed = !ok;
+			conn->busy = ok && daemon_complete_request(conn->data, conn->size) != 0;
+			pthread_mutex_unlock(&server.mutex);
+			if (conn->busy) pool_submit(&server.pool, &conn->task);
+		}
+		if (polled[0].revents & POLLIN){
+			int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0) continue;
+			DaemonConnection *conn = malloc(sizeof(DaemonConnection));
+			assert(conn != NULL && "daemon allocation failrule");
+			*conn = (DaemonConnection){ .task.run = daemon_serve_requests, .server = &server, .fd = fd };
+			if (server.connection_count == server.connection_capacity){
+				server.connection_capacity = util_max_usize(64, 2*server.connection_capacity);
+				server.connections = realloc(server.connections, server.connection_capacity*sizeof(DaemonConnection *));
+				assert(server.connections != NULL && "daemon allocation failrule");
+			}
+			pthread_mutex_lock(&server.mutex);
+			server.connections[server.connection_count] = conn;
+			server.connection_count += 1;
+			pthread_mutex_unlock(&server.mutex);
+			atomic_fetch_add_explicit(&global_daemon_stats.connections, 1, memory_order_relaxed);
+		}
+	}
+	free(polled);
+	free(polled_conns);
+
+	// requests that are being answered are finished first
+	close(listener);
+	daemon_unlink_socket(path);
+	pthread_mutex_lock(&server.mutex);
+	for (size_t i=0; i!=server.connection_count; i+=1){
+		while (server.connections[i]->busy) pthread_cond_wait(&server.cond, &server.mutex);
+		daemon_close(server.connections[i]);
+	}
+	server.connection_count = 0;
+	pthread_mutex_unlock(&server.mutex);
+	if (server.wake[0] != -1){
+		close(server.wake[0]);
+		close(server.wake[1]);
+	}
+	pool_stop(&server.pool);
+	global_string_interning = true;
+	pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
+	pthread_cond_destroy(&server.cond);
+	pthread_mutex_destroy(&server.mutex);
+	pthread_rwlock_destroy(&server.names_lock);
+	pthread_mutex_destroy(&server.compile_mutex);
+Done:
+	eval_stacks_release();
+	free(server.connections);
+	mem_free(server.env_values);
+	mem_free(server.env_names);
+	return res;
+}
+
+
+
+// CLIENT
+// sends a script to a daemon, writes the output and reports the error, returns the exit code
+static int daemon_request(const char *path, const char *text, size_t size){
+	struct sockaddr_un address;
+	if (!daemon_address(path, &address)){
+		fprintf(stderr, "error: \"socket path is too long\"\n");
+		return 30;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0){
+		fprintf(stderr, "error: \"can't connect to the daemon at %s\"\n", path);
+		if (fd >= 0) close(fd);
+		return 30;
+	}
+	char header[DAEMON_RESPONSE_HEADER];
+	daemon_put_u32(header, (uint32_t)size);
+	char *body = NULL;
+	int res = 30;
+	if (size > DAEMON_MAX_REQUEST){
+		fprintf(stderr, "error: \"request is too large\"\n");
+		goto Done;
+	}
+	if (!daemon_send_all(fd, header, 4) || !daemon_send_all(fd, text, size)
+		|| !daemon_read_all(fd, header, sizeof(header))){
+		fprintf(stderr, "error: \"connection to the daemon was closed\"\n");
+		goto Done;
+	}
+	uint32_t status = daemon_get_u32(header);
+	size_t output_size  = daemon_get_u32(header + 4);
+	size_t message_size = daemon_get_u32(header + 8);
+	body = malloc(output_size + message_size + 1);
+	assert(body != NULL && "daemon allocation failrule");
+	if (!daemon_read_all(fd, body, output_size + message_size)){
+		fprintf(stderr, "error: \"connection to the daemon was closed\"\n");
+		goto Done;
+	}
+	output_write_all(STDOUT_FILENO, body, output_size);
+	output_write_all(STDERR_FILENO, body + output_size, message_size);
+	res = status == DaemonStatus_Ok ? 0 : 1;
+Done:
+	free(body);
+	close(fd);
+	return res;
+}
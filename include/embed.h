@@ -0,0 +1,256 @@
+#pragma once
+
+#include "optimize.h"
+#include "eval.h"
+
+
+
+// EMBEDDING API
+// a context owns the name table of everything compiled in it, a program is
+// compiled once and then evaluated any number of times by evaluators, which
+// keep their stacks and output buffer from one evaluation to the next,
+// objects of one context are used by one thread at a time, while different
+// contexts can be used by different threads at once
+//
+//   EmbedContext   *ctx  = embed_context_new();
+//   EmbedProgram   *prog = embed_compile(ctx, "f = (x, y) => x*y + 1;", &err);
+//   EmbedEvaluator *ev   = embed_evaluator_new(ctx);
+//   EmbedFunction   f    = embed_function(prog, "f");
+//   Value args[2] = { {DT_Integer, {.integer = 6}}, {DT_Integer, {.integer = 7}} }, res;
+//   err = embed_call(ev, prog, f, args, 2, &res);
+typedef struct{
+	NameTable names;
+} EmbedContext;
+
+typedef struct{
+	EmbedContext *context;
+	AstArray      nodes;
+	char         *text;     // literals without escapes point into it
+	StringHeap    literals;
+	PackedValue  *env_values; // variables defined at the top level
+	NameId       *env_names;
+	size_t        env_count;
+	EvalHeaps     env_heaps;  // values of the variables
+} EmbedProgram;
+
+typedef struct{
+	uint32_t index; // node of the function, 0 if the program has none of that name
+	uint32_t arity;
+} EmbedFunction;
+
+typedef struct{
+	EmbedContext *context;
+	EvalStacks    stacks;
+	OutputBuffer  output; // output of the last evaluation
+	PackedValue  *args;
+	size_t        arg_capacity;
+} EmbedEvaluator;
+
+// state of the calling thread that an evaluation replaces
+typedef struct{
+	NameTable   *names;
+	OutputBuffer output;
+} EmbedThreadState;
+
+
+// tables that every thread reads are made by the first context
+static void embed_init_shared(void){
+	format_init_tables();
+	vmem_page_size();
+}
+
+static EmbedContext *embed_context_new(void){
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, embed_init_shared);
+	EmbedContext *res = malloc(sizeof(EmbedContext));
+	assert(res != NULL && "embedding allocation failrule");
+	*res = (EmbedContext){0};
+	NameTable *names = global_name_table;
+	global_name_table = &res->names;
+	initialize_compiler_globals();
+	eval_init_builtins();
+	global_name_table = names;
+	return res;
+}
+
+// programs and evaluators of the context have to be freed first
+static void embed_context_free(EmbedContext *context){
+	NameTable *names = global_name_table;
+	global_name_table = &context->names;
+	free_compiler_globals();
+	global_name_table = names;
+	free(context);
+}
+
+
+
+// PROGRAMS
+static void embed_release_heaps(void){
+	value_heap_release();
+	bigint_heap_release();
+	array_heap_release();
+	string_heap_release(&global_string_heap);
+}
+
+static void embed_program_free(EmbedProgram *program){
+	if (program == NULL) return;
+	mem_free(program->nodes.data);
+	free(program->text);
+	string_heap_release(&program->literals);
+	eval_heaps_free(program->env_heaps);
+	mem_free(program->env_values);
+	mem_free(program->env_names);
+	free(program);
+}
+
+// returns NULL and sets *err if the text can't be compiled or its top level
+// statements fail, they are evaluated once without output
+static EmbedProgram *embed_compile(EmbedContext *context, const char *text, EvalError *err){
+	EmbedProgram *res = malloc(sizeof(EmbedProgram));
+	assert(res != NULL && "embedding allocation failrule");
+	*res = (EmbedProgram){ .context = context, .text = strdup(text) };
+	assert(res->text != NULL && "embedding allocation failrule");
+	*err = (EvalError){0};
+
+	NameTable *names = global_name_table;
+	StringHeap literals = global_literal_heap;
+	global_name_table = &context->names;
+	global_literal_heap = (StringHeap){0};
+
+	AstArray ast = make_tokens(res->text);
+	AstNode *buffer = ast.data;
+	if (ast.data != NULL) ast = parse_tokens(ast);
+	if (ast.data == NULL){
+		mem_free(buffer);
+		*err = (EvalError){ ast.error, ast.position };
+	} else{
+		OptimizeStats stats;
+		ast = optimize_ast(ast, &stats);
+		res->nodes = ast;
+		*err = eval_environment(ast, &res->env_values, &res->env_names, &res->env_count, &res->env_heaps);
+		eval_stacks_release();
+	}
+	// folding may leave values behind, the program only refers to literals
+	embed_release_heaps();
+	res->literals = global_literal_heap;
+	global_literal_heap = literals;
+	global_name_table = names;
+	if (err->msg != NULL){
+		embed_program_free(res);
+		return NULL;
+	}
+	return res;
+}
+
+// the function has to be bound once at the top level of the program
+static EmbedFunction embed_function(const EmbedProgram *program, const char *name){
+	size_t length = strlen(name);
+	if (length == 0 || length > 255) return (EmbedFunction){0};
+	NameTable *names = global_name_table;
+	global_name_table = &program->context->names;
+	NameId name_id = get_name_id(name, length);
+	global_name_table = names;
+	for (size_t i=0; i!=program->env_count; i+=1){
+		if (program->env_names[i] != name_id) continue;
+		Value value = value_unpack(program->env_values[i]);
+		if (value.type != DT_Function) break;
+		uint32_t index = value.data.funcinfo.index;
+		return (EmbedFunction){ .index = index, .arity = program->nodes.data[index].count };
+	}
+	return (EmbedFunction){0};
+}
+
+
+
+// EVALUATORS
+static EmbedEvaluator *embed_evaluator_new(EmbedContext *context){
+	EmbedEvaluator *res = malloc(sizeof(EmbedEvaluator));
+	assert(res != NULL && "embedding allocation failrule");
+	*res = (EmbedEvaluator){
+		.context = context,
+		.stacks = eval_stacks_get(),
+		.output = { .fd = -1, .capture = true, .data = malloc(OUTPUT_BUFFER_SIZE) },
+	};
+	assert(res->output.data != NULL && "embedding allocation failrule");
+	return res;
+}
+
+static void embed_evaluator_free(EmbedEvaluator *evaluator){
+	if (evaluator == NULL) return;
+	eval_stacks_free(evaluator->stacks);
+	free(evaluator->output.data);
+	free(evaluator->output.captured);
+	free(evaluator->args);
+	free(evaluator);
+}
+
+// text written by the last evaluation, it is valid until the next one
+static const char *embed_output(const EmbedEvaluator *evaluator, size_t *size){
+	*size = evaluator->output.captured_size;
+	return evaluator->output.captured;
+}
+
+static EmbedThreadState embed_begin(EmbedEvaluator *evaluator){
+	EmbedThreadState res = { global_name_table, global_output };
+	global_name_table = &evaluator->context->names;
+	global_output = evaluator->output;
+	global_output.size = 0;
+	global_output.captured_size = 0;
+	return res;
+}
+
+static void embed_end(EmbedEvaluator *evaluator, EmbedThreadState state){
+	output_flush();
+	evaluator->output = global_output;
+	global_output = state.output;
+	global_name_table = state.names;
+}
+
+// evaluates every statement of the program
+static EvalError embed_run(EmbedEvaluator *evaluator, const EmbedProgram *program){
+	EmbedThreadState state = embed_begin(evaluator);
+	EvalScope scope = { .stacks = &evaluator->stacks };
+	EvalError res = eval_scope(program->nodes, &scope);
+	embed_end(evaluator, state);
+	return res;
+}
+
+// arguments and the result are integers, reals or booleans, the function sees
+// its parameters and the variables defined at the top level
+static EvalError embed_call(
+	EmbedEvaluator *evaluator, const EmbedProgram *program, EmbedFunction func,
+	const Value *args, size_t arg_count, Value *res
+){
+	if (func.index == 0) return (EvalError){ "function doesn't exist", 0 };
+	uint32_t pos = program->nodes.data[func.index].pos;
+	if (arg_count != func.arity) return (EvalError){ "wrong number of arguments", pos };
+	if (evaluator->arg_capacity < arg_count){
+		evaluator->arg_capacity = util_max_usize(2*evaluator->arg_capacity, arg_count);
+		evaluator->args = realloc(evaluator->args, evaluator->arg_capacity*sizeof(PackedValue));
+		assert(evaluator->args != NULL && "embedding allocation failrule");
+	}
+	for (size_t i=0; i!=arg_count; i+=1){
+		if (args[i].type != DT_Integer && args[i].type != DT_Real && args[i].type != DT_Bool)
+			return (EvalError){ "argument has no native type", pos };
+	}
+
+	EmbedThreadState state = embed_begin(evaluator);
+	// large integers are boxed into the heap that the call releases
+	for (size_t i=0; i!=arg_count; i+=1) evaluator->args[i] = value_pack(args[i]);
+	PackedValue result;
+	EvalScope scope = {
+		.env_values = program->env_values, .env_names = program->env_names, .env_count = program->env_count,
+		.keep_heaps = true, .func = func.index, .args = evaluator->args, .call_count = 1,
+		.results = &result, .stacks = &evaluator->stacks,
+	};
+	EvalError err = eval_scope(program->nodes, &scope);
+	if (err.msg == NULL){
+		*res = value_unpack(result);
+		if (res->type != DT_Integer && res->type != DT_Real && res->type != DT_Bool){
+			err = (EvalError){ "result has no native type", pos };
+		}
+	}
+	embed_release_heaps();
+	embed_end(evaluator, state);
+	return err;
+}
@@ -1,6 +1,18 @@
+#pragma once
+
 #include <math.h>
 
 #include "parser.h"
+#include "value.h"
+#include "bigint.h"
+#include "array.h"
+#include "pipeline.h"
+#include "vmem.h"
+#include "output.h"
+#include "memo.h"
+#include "jit.h"
+#include "profile.h"
+#include "workpool.h"
 
 
 
@@ -14,57 +26,724 @@ typedef struct{
 	uint32_t pos;
 } EvalError;
 
+// part of the program that is evaluated, zeroed scope evaluates all of it
+typedef struct{
+	uint32_t start; // index of the first node, 0 for the beginning
+	uint32_t stop;  // evaluation ends when a statement ends right before this node
+	// variables that are visible below the ones defined during evaluation
+	const PackedValue *env_values;
+	const NameId      *env_names;
+	size_t             env_count;
+	bool keep_heaps;   // values made by the evaluation are used after it ends
+	bool export_defs;  // stores the last top level variable that was defined
+	NameId      def_name;
+	PackedValue def_value;
+	// nonzero function is called with every tuple of arguments instead of evaluating statements
+	uint32_t func;
+	uint32_t depth; // calls below the function, forking stops at a cutoff depth
+	const PackedValue *args;
+	size_t       call_count;
+	PackedValue *results;   // value returned by each call
+	size_t       calls_done;
+	struct EvalStacks *stacks; // stacks owned by the caller, NULL takes spare ones of the thread
+	// top level variables stay on the caller's stacks for its next evaluation
+	bool   keep_vars;
+	size_t kept_vars;
+} EvalScope;
 
+// builtins are the first names of every name table, so their ids are the same in all of them
+static NameId global_builtin_names[SIZE(StageBuiltins)];
 
-EvalError eval_ast(AstArray nodes){
-	static const size_t StackCapacity = (1 << 16);
-	static const size_t VarsCapacity  = (1 << 16);
+static void eval_builtin_ids(void){
+	NameId id = 1;
+	for (size_t i=0; i!=SIZE(StageBuiltins); i+=1){
+		global_builtin_names[i] = id;
+		id += strlen(StageBuiltins[i].name) + 1;
+	}
+}
+
+// called right after the name table is initialized
+static void eval_init_builtins(void){
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, eval_builtin_ids);
+	for (size_t i=0; i!=SIZE(StageBuiltins); i+=1){
+		const char *name = StageBuiltins[i].name;
+		NameId id = get_name_id(name, strlen(name));
+		assert(id == global_builtin_names[i] && "builtins have to be the first names of a table");
+		(void)id;
+	}
+}
+
+
+
+// OPERATORS
+// shared by the evaluator and constant folding, return an error message or NULL,
+// integer operations check for overflow and continue with big integers
+static const char *eval_int_factorial(int64_t n, Value *res){
+	int64_t fact = 1;
+	for (int64_t i=2; i<=n; i+=1){
+		if (__builtin_mul_overflow(fact, i, &fact)) return bigint_factorial(n, res);
+	}
+	*res = (Value){ .type = DT_Integer, .data.integer = fact };
+	return NULL;
+}
+
+// negative exponents truncate the result towards zero like division
+static const char *eval_int_power(Value base, int64_t exp, Value *res){
+	if (exp < 0){
+		uint64_t storage;
+		BigView b = bigint_view(base, &storage);
+		if (b.size == 0) return "division by zero";
+		int64_t n = 0;
+		if (b.size == 1 && b.limbs[0] == 1) n = b.negative && (exp & 1) ? -1 : 1;
+		*res = (Value){ .type = DT_Integer, .data.integer = n };
+		return NULL;
+	}
+	if (base.type == DT_BigInt) return bigint_pow(base, exp, res);
+	int64_t x = base.data.integer;
+	int64_t acc = 1;
+	for (uint64_t e=exp;;){
+		if ((e & 1) && __builtin_mul_overflow(acc, x, &acc)) return bigint_pow(base, exp, res);
+		e >>= 1;
+		if (e == 0) break;
+		if (__builtin_mul_overflow(x, x, &x)) return bigint_pow(base, exp, res);
+	}
+	*res = (Value){ .type = DT_Integer, .data.integer = acc };
+	return NULL;
+}
+
+// operators of integers where at least one of them is big or the result overflows
+static const char *eval_bigint_op(AstNode node, Value lhs, Value rhs, Value *res_ptr){
+	bool lhs_int = lhs.type == DT_Integer || lhs.type == DT_BigInt;
+	bool rhs_int = rhs.type == DT_Integer || rhs.type == DT_BigInt;
+	if (!lhs_int || !rhs_int)
+		return "opperator's arguments have different types";
+	Value res = { .type = DT_Bool };
+	switch (node.type){
+	case Ast_Add:      return bigint_add(lhs, rhs, false, res_ptr);
+	case Ast_Subtract: return bigint_add(lhs, rhs, true, res_ptr);
+	case Ast_Multiply: return bigint_mul(lhs, rhs, res_ptr);
+	case Ast_Divide:   return bigint_div(lhs, rhs, res_ptr);
+	case Ast_Equal:    res.data.boolean = bigint_cmp(lhs, rhs) == 0; break;
+	case Ast_Less:     res.data.boolean = bigint_cmp(lhs, rhs) <  0; break;
+	case Ast_Greater:  res.data.boolean = bigint_cmp(lhs, rhs) >  0; break;
+	default: return "argument's type is not supported by this operator";
+	}
+	if (node.flags & AstFlag_Negate) res.data.boolean = !res.data.boolean;
+	*res_ptr = res;
+	return NULL;
+}
+
+static inline const char *eval_unary_op(AstNode node, Value arg, Value *res_ptr){
+	Value res = arg;
+	switch (node.type){
+	case Ast_Minus:
+		switch (arg.type){
+		case DT_Real:    res.data.real    = -arg.data.real;    break;
+		case DT_Integer:
+			if (__builtin_sub_overflow(0, arg.data.integer, &res.data.integer))
+				res = bigint_negate(arg);
+			break;
+		case DT_BigInt:  res = bigint_negate(arg); break;
+		default: return "invalid argument's type for unary minus";
+		}
+		break;
+	case Ast_AbsValue:
+		switch (arg.type){
+		case DT_Array:
+			res = (Value){ .type = DT_Integer, .data.integer = ((Array *)arg.data.ptr)->length };
+			break;
+		case DT_Sequence: return sequence_length(arg.data.ptr, res_ptr);
+		case DT_Set:
+		case DT_Dict:
+			res = (Value){ .type = DT_Integer, .data.integer = ((Table *)arg.data.ptr)->count };
+			break;
+		case DT_String:
+			res = (Value){ .type = DT_Integer, .data.integer = ((String *)arg.data.ptr)->length };
+			break;
+		case DT_Real:    res.data.real    = fabs(arg.data.real);   break;
+		case DT_Integer:
+			if (arg.data.integer < 0 && __builtin_sub_overflow(0, arg.data.integer, &res.data.integer))
+				res = bigint_abs(arg);
+			break;
+		case DT_BigInt:  res = bigint_abs(arg); break;
+		default: return "invalid argument's type for absolute value";
+		}
+		break;
+	case Ast_LogicNot:
+		switch (arg.type){
+		case DT_Bool: res.data.boolean = !arg.data.boolean; break;
+		default: return "invalid argument's type for logic not minus";
+		}
+		break;
+	case Ast_Factorial:
+		switch (arg.type){
+		case DT_Real:
+			if (arg.data.real <= -1.0)
+				return "cannot take factorial of value less or equal to -1";
+			res.data.real = tgamma(arg.data.real + 1.0);
+			break;
+		case DT_Integer:
+			if (arg.data.integer < 0)
+				return "cannot take factorial of negative value";
+			return eval_int_factorial(arg.data.integer, res_ptr);
+		case DT_BigInt:
+			if (((BigInt *)arg.data.ptr)->negative)
+				return "cannot take factorial of negative value";
+			return "integer is too large";
+		default: return "invalid argument's type for logic not minus";
+		}
+		break;
+	default: return "eval_error: unhandled unary operator";
+	}
+	*res_ptr = res;
+	return NULL;
+}
+
+static inline const char *eval_power_op(Value lhs, Value rhs, Value *res_ptr){
+	Value res = { .type = lhs.type };
+	switch (rhs.type){
+	case DT_Integer:{
+		switch (lhs.type){
+		case DT_Integer:
+		case DT_BigInt:
+			return eval_int_power(lhs, rhs.data.integer, res_ptr);
+		case DT_Real:
+			res.data.real = util_ipow_f64(lhs.data.real, rhs.data.integer);
+			break;
+		default: goto PowerOpTypeError;
+		}
+		break;
+	}
+	case DT_Real:{
+		switch (lhs.type){
+		case DT_Integer:
+			if (res.data.integer < 0) goto PowerNegativeBaseError;
+			res.data.real = pow((double)lhs.data.integer, rhs.data.real);
+			res.type = DT_Real;
+			break;
+		case DT_Real:
+			if (res.data.real < 0.0) goto PowerNegativeBaseError;
+			res.data.real = pow(lhs.data.real, rhs.data.real);
+			break;
+		default: goto PowerOpTypeError;
+		}
+		break;
+	}
+	case DT_BigInt:
+		if (lhs.type == DT_Integer || lhs.type == DT_BigInt) return "integer is too large";
+		goto PowerOpTypeError;
+	default:
+	PowerOpTypeError:
+		return "argument's type is not supported by power operator";
+	PowerNegativeBaseError:
+		return "power operator's base cannot be negative";
+	}
+	*res_ptr = res;
+	return NULL;
+}
+
+// x @= c tells whether x is a key of a table, an element of an array or an integer
+// in a range, every element of an array on the left is looked up in a table
+static inline const char *eval_contains_op(AstNode node, Value lhs, Value rhs, Value *res_ptr){
+	bool negate = (node.flags & AstFlag_Negate) != 0;
+	bool found;
+	if (lhs.type == DT_Array && rhs.type != DT_Set && rhs.type != DT_Dict)
+		return "only tables can be searched for elements of an array";
+	switch (rhs.type){
+	case DT_Set:
+	case DT_Dict:
+		if (lhs.type == DT_Array){
+			*res_ptr = table_contains_array(rhs.data.ptr, lhs.data.ptr, negate);
+			return NULL;
+		}
+		found = table_contains(rhs.data.ptr, lhs);
+		break;
+	case DT_Array:
+		found = array_contains(rhs.data.ptr, lhs);
+		break;
+	case DT_Sequence:{
+		const Sequence *seq = rhs.data.ptr;
+		if (seq->stage_count != 0)
+			return "sequence with stages can't be searched";
+		found = lhs.type == DT_Integer && seq->first <= lhs.data.integer && lhs.data.integer <= seq->last;
+		break;
+	}
+	default: return "only tables, arrays and ranges can contain values";
+	}
+	*res_ptr = (Value){ .type = DT_Bool, .data.boolean = found != negate };
+	return NULL;
+}
+
+static inline const char *eval_binary_op(AstNode node, Value lhs, Value rhs, Value *res_ptr){
+	if (node.type == Ast_Range) return sequence_range(lhs, rhs, res_ptr);
+	if (node.type == Ast_Contains) return eval_contains_op(node, lhs, rhs, res_ptr);
+	if (lhs.type == DT_Array || rhs.type == DT_Array) return array_binary_op(node, lhs, rhs, res_ptr);
+	if (lhs.type == DT_String || rhs.type == DT_String) return string_binary_op(node, lhs, rhs, res_ptr);
+	if (node.type == Ast_Power) return eval_power_op(lhs, rhs, res_ptr);
+	if (lhs.type == DT_BigInt || rhs.type == DT_BigInt) return eval_bigint_op(node, lhs, rhs, res_ptr);
+	Value res = { .type = lhs.type };
+	if (lhs.type != rhs.type)
+		return "opperator's arguments have different types";
+	switch (lhs.type){
+	case DT_Real:{
+		switch (node.type){
+		case Ast_Add:      res.data.real = lhs.data.real + rhs.data.real; break;
+		case Ast_Subtract: res.data.real = lhs.data.real - rhs.data.real; break;
+		case Ast_Multiply: res.data.real = lhs.data.real * rhs.data.real; break;
+		case Ast_Divide:   
+			if (rhs.data.real == 0.0) return "division by zero";
+			res.data.real = lhs.data.real / rhs.data.real;
+			break;
+		case Ast_Equal:
+			res.data.boolean = lhs.data.real == rhs.data.real; res.type = DT_Bool;
+			break;
+		case Ast_Less:
+			res.data.boolean = lhs.data.real < rhs.data.real; res.type = DT_Bool;
+			break;
+		case Ast_Greater:
+			res.data.boolean = lhs.data.real > rhs.data.real; res.type = DT_Bool;
+			break;
+		default: goto BinOpTypeError;
+		}
+		break;
+	}
+	case DT_Integer:{
+		switch (node.type){
+		case Ast_Add:
+			if (__builtin_add_overflow(lhs.data.integer, rhs.data.integer, &res.data.integer))
+				return eval_bigint_op(node, lhs, rhs, res_ptr);
+			break;
+		case Ast_Subtract:
+			if (__builtin_sub_overflow(lhs.data.integer, rhs.data.integer, &res.data.integer))
+				return eval_bigint_op(node, lhs, rhs, res_ptr);
+			break;
+		case Ast_Multiply:
+			if (__builtin_mul_overflow(lhs.data.integer, rhs.data.integer, &res.data.integer))
+				return eval_bigint_op(node, lhs, rhs, res_ptr);
+			break;
+		case Ast_Divide:   
+			if (rhs.data.integer == 0) return "division by zero";
+			if (rhs.data.integer == -1 && lhs.data.integer == INT64_MIN)
+				return eval_bigint_op(node, lhs, rhs, res_ptr);
+			res.data.integer = lhs.data.integer / rhs.data.integer;
+			break;
+		case Ast_Equal:
+			res.data.boolean = lhs.data.integer == rhs.data.integer; res.type = DT_Bool;
+			break;
+		case Ast_Less:
+			res.data.boolean = lhs.data.integer < rhs.data.integer; res.type = DT_Bool;
+			break;
+		case Ast_Greater:
+			res.data.boolean = lhs.data.integer > rhs.data.integer; res.type = DT_Bool;
+			break;
+		default: goto BinOpTypeError;
+		}
+		break;
+	}
+	case DT_Bool:{
+		switch (node.type){
+		case Ast_LogicOr:  res.data.boolean = lhs.data.boolean||rhs.data.boolean; break;
+		case Ast_LogicAnd: res.data.boolean = lhs.data.boolean&&rhs.data.boolean; break;
+		case Ast_Equal:    res.data.boolean = lhs.data.boolean==rhs.data.boolean; break;
+		default: goto BinOpTypeError;
+		}
+		break;
+	}
+	default:
+	BinOpTypeError:
+		return "argument's type is not supported by this operator";
+	}
+	if (node.flags & AstFlag_Negate){
+		assert(res.type == DT_Bool);
+		res.data.boolean = !res.data.boolean;
+	}
+	*res_ptr = res;
+	return NULL;
+}
+
+
+// integer operators working directly on packed values, they skip unpacking
+// in the common case, returns false if the generic path has to be taken
+static inline bool eval_packed_int_op(
+	AstNode node, PackedValue lhs, PackedValue rhs, PackedValue *res_ptr
+){
+#if VALUE_NANBOX
+	if (!value_is_small_int(lhs) || !value_is_small_int(rhs)) return false;
+	int64_t x = value_small_int(lhs);
+	int64_t y = value_small_int(rhs);
+	Value res = { .type = DT_Integer };
+	switch (node.type){
+	// small integers cannot overflow when added or subtracted
+	case Ast_Add:      res.data.integer = x + y; break;
+	case Ast_Subtract: res.data.integer = x - y; break;
+	case Ast_Multiply:
+		if (__builtin_mul_overflow(x, y, &res.data.integer)) return false;
+		break;
+	case Ast_Less:    res = (Value){ .type = DT_Bool, .data.boolean = x <  y }; goto Compared;
+	case Ast_Greater: res = (Value){ .type = DT_Bool, .data.boolean = x >  y }; goto Compared;
+	case Ast_Equal:   res = (Value){ .type = DT_Bool, .data.boolean = x == y }; goto Compared;
+	Compared:
+		if (node.flags & AstFlag_Negate) res.data.boolean = !res.data.boolean;
+		break;
+	default: return false;
+	}
+	*res_ptr = value_pack(res);
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+
+// writes a result of a top level expression, returns false if it has no text form
+static bool eval_output_value(AstArray nodes, Value top){
+	switch (top.type){
+	case DT_Null: break;
+	case DT_Real:
+		output_f64(top.data.real);
+		output_char('\n');
+		break;
+	case DT_Integer:
+		output_i64(top.data.integer);
+		output_char('\n');
+		break;
+	case DT_BigInt:{
+		const BigInt *big = top.data.ptr;
+		size_t bound = bigint_format_bound(big);
+		if (bound <= OUTPUT_BUFFER_SIZE){
+			output_commit(bigint_format(output_reserve(bound), big));
+		} else{
+			char *text = mem_alloc(bound);
+			assert(text != NULL && "output allocation failrule");
+			output_bytes(text, bigint_format(text, big));
+			mem_free(text);
+		}
+		output_char('\n');
+		break;
+	}
+	case DT_Array:
+		array_output(top.data.ptr);
+		output_char('\n');
+		break;
+	case DT_String:
+		string_output(top.data.ptr);
+		output_char('\n');
+		break;
+	case DT_Sequence:
+		sequence_output(top.data.ptr);
+		output_char('\n');
+		break;
+	case DT_Stage:
+		stage_output(top.data.ptr);
+		output_char('\n');
+		break;
+	case DT_Set:
+	case DT_Dict:
+		table_output(top.data.ptr);
+		output_char('\n');
+		break;
+	case DT_Bool:
+		if (top.data.boolean){
+			output_bytes("true\n", 5);
+		} else{
+			output_bytes("false\n", 6);
+		}
+		break;
+	case DT_Function:
+		if (top.data.funcinfo.name_id != 0){
+			output_bytes("function \"", 10);
+			const uint8_t *name = global_names.data + top.data.funcinfo.name_id;	
+			size_t name_len = *(name-1);
+			output_bytes((const char *)name, name_len);
+			output_bytes("\"\n", 2);
+		} else{
+			output_bytes("function at ", 12);
+			output_i64((nodes.data + top.data.funcinfo.index)->pos);
+			output_char('\n');
+		}
+		break;
+	default: return false;
+	}
+	return true;
+}
+
+
+
+// EVALUATION STACKS
+// reserving and releasing address space costs a few system calls, so stacks
+// of finished evaluations are kept by their thread for the next ones
+#define EVAL_SPARE_STACKS 8
+
+typedef struct EvalStacks{
+	VmemBlock values;
+	VmemBlock vars;
+	VmemBlock names;
+	VmemBlock frames;
+	VmemBlock pipes;
+} EvalStacks;
+
+static _Thread_local struct{
+	EvalStacks items[EVAL_SPARE_STACKS];
+	size_t     count;
+} global_spare_stacks;
+
+
+static EvalStacks eval_stacks_get(void){
+	if (global_spare_stacks.count != 0){
+		global_spare_stacks.count -= 1;
+		return global_spare_stacks.items[global_spare_stacks.count];
+	}
+	size_t reserve = vmem_default_reserve();
+	return (EvalStacks){
+		.values = vmem_reserve(reserve),
+		.vars   = vmem_reserve(reserve),
+		.names  = vmem_reserve(reserve / 2),
+		.frames = vmem_reserve(reserve / 2),
+		.pipes  = vmem_reserve(reserve / 8),
+	};
+}
 
+static void eval_stacks_free(EvalStacks stacks){
+	vmem_release(stacks.values);
+	vmem_release(stacks.vars);
+	vmem_release(stacks.names);
+	vmem_release(stacks.frames);
+	vmem_release(stacks.pipes);
+}
+
+static void eval_stacks_put(EvalStacks stacks){
+	bool complete = stacks.values.data != NULL && stacks.vars.data != NULL
+		&& stacks.names.data != NULL && stacks.frames.data != NULL && stacks.pipes.data != NULL;
+	if (!complete || global_spare_stacks.count == EVAL_SPARE_STACKS){
+		eval_stacks_free(stacks);
+		return;
+	}
+	global_spare_stacks.items[global_spare_stacks.count] = stacks;
+	global_spare_stacks.count += 1;
+}
+
+static void eval_stacks_release(void){
+	while (global_spare_stacks.count != 0){
+		global_spare_stacks.count -= 1;
+		eval_stacks_free(global_spare_stacks.items[global_spare_stacks.count]);
+	}
+}
+
+
+
+// FORK JOIN
+// call marked by mark_fork_points is evaluated by a task of the pool while the
+// evaluation continues with its right sibling, the operator then waits for it,
+// tasks call the function on their own stacks with only the global variables
+// and the arguments, that is all a pure function can see
+#ifndef EVAL_MAX_FORKS
+	#define EVAL_MAX_FORKS 64 // tasks that one evaluation waits for at the same time
+#endif
+
+typedef struct{
+	PoolTask  task;
+	AstArray  nodes;
+	EvalScope scope;
+	EvalError error;
+	PackedValue result;
+	Value     value; // result unpacked, a thread that helped with the task reuses its cells
+	uint32_t  slot; // stack index of the call's result
+	_Atomic bool done;
+	PackedValue args[];
+} ForkTask;
+
+static struct{
+	WorkPool *pool;   // calls aren't forked without a pool
+	uint32_t  cutoff; // calls at this depth are evaluated right away
+	_Atomic size_t forks;
+	_Atomic size_t helped; // tasks run by threads that waited for a join
+	size_t steals;
+} global_fork;
+
+EvalError eval_scope(AstArray nodes, EvalScope *scope);
+
+
+static void fork_run(PoolTask *task){
+	ForkTask *fork = (ForkTask *)task;
+	fork->error = eval_scope(fork->nodes, &fork->scope);
+	if (fork->error.msg == NULL) fork->value = value_unpack(fork->result);
+	atomic_store_explicit(&fork->done, true, memory_order_release);
+}
+
+// returns NULL if the call has to be evaluated right away, the variables
+// of the environment have to stay unchanged until the task is joined
+static ForkTask *fork_spawn(
+	AstArray nodes, uint32_t func, const PackedValue *args, size_t arg_count,
+	const PackedValue *env_values, const NameId *env_names, size_t env_count, uint32_t depth
+){
+	// functions in arguments could look up variables of the caller
+	for (size_t i=0; i!=arg_count; i+=1){
+		enum DataType type = value_packed_type(args[i]);
+		if (type == DT_Function || type == DT_Stage) return NULL;
+	}
+	ForkTask *fork = mem_alloc(sizeof(ForkTask) + arg_count*sizeof(PackedValue));
+	assert(fork != NULL && "fork allocation failrule");
+	memcpy(fork->args, args, arg_count*sizeof(PackedValue));
+	fork->task.run = fork_run;
+	fork->nodes = nodes;
+	fork->scope = (EvalScope){
+		.env_values = env_values, .env_names = env_names, .env_count = env_count,
+		.keep_heaps = true, .func = func, .depth = depth,
+		.args = fork->args, .call_count = 1, .results = &fork->result,
+	};
+	fork->error = (EvalError){0};
+	fork->value = (Value){ .type = DT_Null };
+	atomic_init(&fork->done, false);
+	PoolWorker *self = pool_current_worker;
+	if (self != NULL && self->pool == global_fork.pool){
+		if (!pool_push(&fork->task)){
+			mem_free(fork);
+			return NULL;
+		}
+	} else{
+		pool_submit(global_fork.pool, &fork->task);
+	}
+	atomic_fetch_add_explicit(&global_fork.forks, 1, memory_order_relaxed);
+	return fork;
+}
+
+static EvalError fork_join(ForkTask *fork, PackedValue *res){
+	while (!atomic_load_explicit(&fork->done, memory_order_acquire)){
+		if (pool_help(global_fork.pool)){
+			atomic_fetch_add_explicit(&global_fork.helped, 1, memory_order_relaxed);
+		} else{
+			sched_yield();
+		}
+	}
+	EvalError err = fork->error;
+	*res = value_pack(fork->value);
+	mem_free(fork);
+	return err;
+}
+
+
+
+// arguments are variables named by the parameters, returns the new variable count
+static inline size_t eval_bind_params(
+	PackedValue *vars, NameId *var_names, size_t var_count, const AstNode *func, const PackedValue *args
+){
+	const Data *param_names = (const Data *)(func + 2);
+	for (size_t i=0; i!=func->count; i+=1){
+		vars[var_count] = args[i];
+		var_names[var_count] = param_names[i].name_id;
+		var_count += 1;
+	}
+	return var_count;
+}
+
+// instantiated for every kind of profiling, so evaluation that isn't profiled doesn't test for it
+static inline __attribute__((always_inline)) EvalError eval_scope_body(
+	AstArray nodes, EvalScope *scope, const bool profile, const bool sample
+){
 	EvalError res_error = {0};
+	const size_t profile_base = profile ? global_profiler.frame_count : 0;
+	ForkTask *forks[EVAL_MAX_FORKS]; // not joined yet, the last one is the innermost
+	size_t fork_count = 0;
 #define RETURN_ERROR(msg, pos) \
 	do{ res_error = (EvalError){(msg), (pos)}; goto ReturnError; } while (0)
 
-	Value *stack = malloc(StackCapacity*sizeof(Value));
+	// stacks are only limited by memory, pages are committed as they are used
+	EvalStacks stacks = scope->stacks != NULL ? *scope->stacks : eval_stacks_get();
+	const size_t StackCapacity = stacks.values.size / sizeof(PackedValue);
+	const size_t VarsCapacity  = util_min_usize(
+		stacks.vars.size / sizeof(PackedValue), stacks.names.size / sizeof(NameId)
+	);
+	const size_t FrameCapacity = stacks.frames.size / sizeof(CallFrame);
+	const size_t PipeCapacity  = stacks.pipes.size / sizeof(PipeRun);
+
+	PackedValue *stack = stacks.values.data;
 	size_t stack_size = 0;
-	Value *vars = malloc(VarsCapacity*sizeof(Value));
-	size_t var_count = 0;
-	if (stack == NULL || vars == NULL) RETURN_ERROR("eval_error: allocation failrule", 0);
+	PackedValue *vars = stacks.vars.data;
+	NameId *var_names = stacks.names.data;
+	size_t var_count = scope->keep_vars ? scope->kept_vars : 0;
+	CallFrame *frames = stacks.frames.data;
+	size_t frame_count = 0;
+	PipeRun *runs = stacks.pipes.data;
+	size_t run_count = 0;
+	if (stack == NULL || vars == NULL || var_names == NULL || frames == NULL || runs == NULL)
+		RETURN_ERROR("eval_error: allocation failrule", 0);
+
+	// builtins are variables below everything else, so they can be shadowed
+	for (size_t i=0; scope->kept_vars==0 && i!=SIZE(StageBuiltins); i+=1){
+		vars[var_count] = value_pack(stage_builtin(i));
+		var_names[var_count] = global_builtin_names[i];
+		var_count += 1;
+	}
+	if (VarsCapacity - var_count < scope->env_count)
+		RETURN_ERROR("eval_error: too many variables were defined", 0);
+	for (size_t i=0; i!=scope->env_count; i+=1){
+		vars[var_count] = scope->env_values[i];
+		var_names[var_count] = scope->env_names[i];
+		var_count += 1;
+	}
+	const AstNode *stop = scope->stop != 0 ? nodes.data + scope->stop : NULL;
+	AstNode *ast = nodes.data + (scope->start != 0 ? scope->start : 1);
+	const AstNode *scope_func = nodes.data + scope->func;
+	const size_t call_vars = var_count; // variables below the arguments of scope's function
+	scope->calls_done = 0;
+	if (scope->func != 0){
+		if (scope->call_count == 0) goto ReturnError;
+		if (VarsCapacity - var_count < scope_func->count)
+			RETURN_ERROR("eval_error: too many variables were defined", scope_func->pos);
+		var_count = eval_bind_params(vars, var_names, var_count, scope_func, scope->args);
+		ast = nodes.data + scope->func + 2 + scope_func->count;
+	}
 	
-#define PUSH_VALUE(p_data, p_type) do{ \
+#define PUSH_PACKED(p_value) do{ \
 		if (stack_size==StackCapacity) RETURN_ERROR("evaluation stack overflow", node.pos); \
-		stack[stack_size] = (Value){ .type = (p_type), .data = (p_data) }; \
+		stack[stack_size] = (p_value); \
 		stack_size += 1; \
 	} while (0)
+#define PUSH_VALUE(p_data, p_type) \
+	PUSH_PACKED(value_pack((Value){ .type = (p_type), .data = (p_data) }))
 	
-	AstNode *ast = nodes.data + 1;
+	if (sample){
+		global_sampler.nodes = nodes.data;
+		global_sampler.frames = frames;
+		global_sampler.frame_count = 0;
+	}
 	for (;;){
+		if (sample) global_sampler.ast = ast;
 		AstNode node = *ast;
 		ast += 1;
 		switch (node.type){
-		case Ast_Terminator: return res_error;
+		case Ast_Terminator: goto ReturnError;
 		case Ast_Variable:{
 			if (var_count == VarsCapacity)
 				RETURN_ERROR("eval_error: too many variables were defined", node.pos);
-			Value top = stack[stack_size-1];
-			top.name_id = ast->data.name_id;
-			if (top.type == DT_Function && top.data.funcinfo.name_id == 0){
-				top.data.funcinfo.name_id = ast->data.name_id;
+			PackedValue top = stack[stack_size-1];
+			if (value_packed_type(top) == DT_Function){
+				Value func = value_unpack(top);
+				if (func.data.funcinfo.name_id == 0){
+					func.data.funcinfo.name_id = ast->data.name_id;
+					top = value_pack(func);
+				}
 			}
-			vars[var_count] = top; var_count += 1;
+			vars[var_count] = top;
+			var_names[var_count] = ast->data.name_id;
+			var_count += 1;
 			ast += 1;
-			stack[stack_size-1].type = DT_Null;
+			stack[stack_size-1] = value_pack((Value){ .type = DT_Null });
 			break;
 		}
 		case Ast_Identifier:{
+			NameId name_id = ast->data.name_id;
 			size_t i = var_count;
 			while (i != 0){
 				i -= 1;
-				if (vars[i].name_id == ast->data.name_id) goto IdentifierWasFound;
+				if (var_names[i] == name_id) goto IdentifierWasFound;
 			}
 			RETURN_ERROR("indentifier not found", node.pos);
 		IdentifierWasFound:
 			ast += 1;
-			PUSH_VALUE(vars[i].data, vars[i].type);
+			PUSH_PACKED(vars[i]);
 			break;
 		}
 		case Ast_Function:
@@ -79,13 +758,17 @@ EvalError eval_ast(AstArray nodes){
 			PUSH_VALUE(ast->data, DT_Integer);	
 			ast += 1;
 			break;
+		case Ast_String:
+			PUSH_VALUE(ast->data, DT_String);
+			ast += 1;
+			break;
 		case Ast_True:
 		case Ast_False:
 			PUSH_VALUE((Data){ .boolean = (node.type == Ast_True) }, DT_Bool);
 			break;
 		case Ast_Conditional:{
 			stack_size -= 1;
-			Value arg = stack[stack_size];
+			Value arg = value_unpack(stack[stack_size]);
 			if (arg.type != DT_Bool)
 				RETURN_ERROR("condition doesn't have boolean type", node.pos);
 			if (!arg.data.boolean){ ast += node.count; }
@@ -95,244 +778,340 @@ EvalError eval_ast(AstArray nodes){
 			ast += node.pos;
 			break;
 		}
-		case Ast_Minus:{
-			Value arg = stack[stack_size-1];
-			Value res = arg;
-			switch (arg.type){
-			case DT_Real:    res.data.real    = -arg.data.real;    break;
-			case DT_Integer: res.data.integer = -arg.data.integer; break;
-			default: RETURN_ERROR("invalid argument's type for unary minus", node.pos);
-			}
-			stack[stack_size-1] = res;
-			break;
-		}
-		case Ast_AbsValue:{
-			Value arg = stack[stack_size-1];
-			Value res = arg;
-			switch (arg.type){
-			case DT_Real:    res.data.real    = fabs(arg.data.real);   break;
-			case DT_Integer: res.data.integer = abs(arg.data.integer); break;
-			default: RETURN_ERROR("invalid argument's type for absolute value", node.pos);
-			}
-			stack[stack_size-1] = res;
-			break;
-		}
-		case Ast_LogicNot:{
-			Value arg = stack[stack_size-1];
-			Value res = arg;
-			switch (arg.type){
-			case DT_Bool: res.data.boolean = !arg.data.boolean; break;
-			default: RETURN_ERROR("invalid argument's type for logic not minus", node.pos);
-			}
-			stack[stack_size-1] = res;
-			break;
-		}
+		case Ast_Minus:
+		case Ast_AbsValue:
+		case Ast_LogicNot:
 		case Ast_Factorial:{
-			Value arg = stack[stack_size-1];
-			Value res = arg;
-			switch (arg.type){
-			case DT_Real:
-				if (arg.data.real <= -1.0)
-					RETURN_ERROR("cannot take factorial of value less or equal to -1", node.pos);
-				res.data.real = tgamma(arg.data.real + 1.0);
-				break;
-			case DT_Integer:
-				if (arg.data.integer < 0)
-					RETURN_ERROR("cannot take factorial of negative value", node.pos);
-				res.data.integer = 1;
-				for (size_t i=2; i<=arg.data.integer; i+=1){ res.data.integer *= i; }
-				break;
-			default: RETURN_ERROR("invalid argument's type for logic not minus", node.pos);
-			}
-			stack[stack_size-1] = res;
+			Value res;
+			const char *msg = eval_unary_op(node, value_unpack(stack[stack_size-1]), &res);
+			if (msg != NULL) RETURN_ERROR(msg, node.pos);
+			stack[stack_size-1] = value_pack(res);
 			break;
 		}
 		case Ast_Call:
 		CallFunction:{
-			Value *params = stack + stack_size - node.count;
-			Value func_value = params[-1];
+			PackedValue *params = stack + stack_size - node.count;
+			Value func_value = value_unpack(params[-1]);
+			if (func_value.type == DT_Stage){
+				Value res;
+				const char *msg = stage_apply(func_value.data.ptr, params, node.count, &res);
+				if (msg != NULL) RETURN_ERROR(msg, node.pos);
+				stack_size -= node.count;
+				stack[stack_size-1] = value_pack(res);
+				goto CallWasEvaluated;
+			}
+			if (func_value.type != DT_Function)
+				RETURN_ERROR("called value is not a function", node.pos);
 			AstNode *func = nodes.data + func_value.data.funcinfo.index;
 			if (node.count != func->count)
 				RETURN_ERROR("wrong number of arguments", node.pos);
-			Value callinfo = {.type=DT_CallInfo, .data.callinfo={ast-nodes.data, var_count}};
-			Data *param_names = (Data *)(func + 2);
-			for (size_t i=0; i!=node.count; i+=1){
-				if (var_count == VarsCapacity)
-					RETURN_ERROR("evaluation stack overflow", node.pos);
-				vars[var_count] = params[i];
-				vars[var_count].name_id = param_names[i].name_id;
-				var_count += 1;
+			if (
+				(node.flags & AstFlag_Fork) && global_fork.pool != NULL &&
+				scope->depth + frame_count < global_fork.cutoff && fork_count != EVAL_MAX_FORKS
+			){
+				// variables below the outermost call are the global ones
+				size_t globals_end = frame_count != 0 ? frames[0].vars_size : var_count;
+				size_t first = SIZE(StageBuiltins);
+				ForkTask *fork = fork_spawn(
+					nodes, func_value.data.funcinfo.index, params, node.count,
+					vars + first, var_names + first, globals_end - first, scope->depth + frame_count + 1
+				);
+				if (fork != NULL){
+					stack_size -= node.count;
+					stack[stack_size-1] = value_pack((Value){ .type = DT_Null });
+					fork->slot = stack_size - 1;
+					forks[fork_count] = fork; fork_count += 1;
+					goto CallWasEvaluated;
+				}
 			}
-			stack_size -= node.count;
-			stack[stack_size-1] = callinfo;
+			CallFrame frame = { .ast_index = ast-nodes.data, .vars_size = var_count };
+			frame.value_used = value_heap_used();
+			if (memo_enabled() && ((func+1)->data.funcnodeinfo.flags & FuncFlag_Pure)){
+				Value memo_res;
+				switch (memo_lookup(func_value.data.funcinfo.index, params, node.count, &memo_res)){
+				case Memo_Hit:
+					if (profile){
+						profile_enter(func_value.data.funcinfo.index, func_value.data.funcinfo.name_id);
+						profile_leave();
+					}
+					stack_size -= node.count;
+					stack[stack_size-1] = value_pack(memo_res);
+					goto CallWasEvaluated;
+				case Memo_Miss:
+					// result is stored when the call returns
+					frame.memo_func = func_value.data.funcinfo.index;
+					break;
+				case Memo_Skip: break;
+				}
+			}
+			uint32_t meta = (func+1)->data.funcnodeinfo.meta;
+			if (meta != 0 && jit_enabled()){
+				Value jit_res;
+				if (jit_try_call(meta, params, node.count, &jit_res)){
+					if (frame.memo_func != 0){
+						memo_insert(frame.memo_func, params, node.count, jit_res);
+					}
+					stack_size -= node.count;
+					stack[stack_size-1] = value_pack(jit_res);
+					goto CallWasEvaluated;
+				}
+			}
+			if (frame_count == FrameCapacity || VarsCapacity - var_count < node.count)
+				RETURN_ERROR("evaluation stack overflow", node.pos);
+			var_count = eval_bind_params(vars, var_names, var_count, func, params);
+			// function and its arguments are replaced by the result on return
+			stack_size -= node.count + 1;
+			frames[frame_count] = frame; frame_count += 1;
 			ast = func + 2 + func->count;
+			if (profile) profile_enter(func_value.data.funcinfo.index, func_value.data.funcinfo.name_id);
+			if (sample) global_sampler.frame_count = frame_count;
+		CallWasEvaluated:
+			// calls made by a pipeline return to it
+			if (ast == nodes.data) goto PipelineResume;
 			break;
 		}
 		case Ast_EndScope:{
-			assert(stack[stack_size-2].type == DT_CallInfo);
-			CallInfo callinfo = stack[stack_size-2].data.callinfo;
-			stack[stack_size-2] = stack[stack_size-1]; stack_size -= 1;
-			var_count = callinfo.vars_size;
-			ast = nodes.data + callinfo.ast_index;
+			if (frame_count == 0){
+				// end of the function that the scope calls, next arguments follow
+				assert(scope->func != 0);
+				stack_size -= 1;
+				scope->results[scope->calls_done] = stack[stack_size];
+				scope->calls_done += 1;
+				if (scope->calls_done == scope->call_count) goto ReturnError;
+				var_count = eval_bind_params(
+					vars, var_names, call_vars, scope_func,
+					scope->args + scope->calls_done*scope_func->count
+				);
+				ast = nodes.data + scope->func + 2 + scope_func->count;
+				break;
+			}
+			frame_count -= 1;
+			if (profile) profile_leave();
+			if (sample) global_sampler.frame_count = frame_count;
+			CallFrame frame = frames[frame_count];
+			if (frame.memo_func != 0){
+				size_t arg_count = nodes.data[frame.memo_func].count;
+				Value res = value_unpack(stack[stack_size-1]);
+				memo_insert(frame.memo_func, vars + frame.vars_size, arg_count, res);
+			}
+			value_heap_return(frame.value_used, stack + stack_size-1);
+			var_count = frame.vars_size;
+			ast = nodes.data + frame.ast_index;
+			if (frame.ast_index == 0) goto PipelineResume;
+			break;
+		}
+		case Ast_Array:{
+			Value res;
+			const char *msg = array_from_values(stack + stack_size - node.count, node.count, &res);
+			if (msg != NULL) RETURN_ERROR(msg, node.pos);
+			stack_size -= node.count;
+			PUSH_VALUE(res.data, res.type);
+			break;
+		}
+		case Ast_Set:
+		case Ast_Dict:{
+			Value res;
+			const char *msg = table_from_values(
+				node.type == Ast_Set ? DT_Set : DT_Dict, stack + stack_size - node.count, node.count, &res
+			);
+			if (msg != NULL) RETURN_ERROR(msg, node.pos);
+			stack_size -= node.count;
+			PUSH_VALUE(res.data, res.type);
+			break;
+		}
+		case Ast_Subscript:{
+			if (node.count != 1)
+				RETURN_ERROR("arrays have only one dimension", node.pos);
+			stack_size -= 1;
+			Value res;
+			Value container = value_unpack(stack[stack_size-1]);
+			Value index = value_unpack(stack[stack_size]);
+			const char *msg = container.type == DT_Dict
+				? table_subscript(container, index, &res)
+				: array_subscript(container, index, &res);
+			if (msg != NULL) RETURN_ERROR(msg, node.pos);
+			stack[stack_size-1] = value_pack(res);
 			break;
 		}
 		case Ast_Pipe:{
-			Value func = stack[stack_size-1];
+			PackedValue func = stack[stack_size-1];
+			if (value_packed_type(func) == DT_Stage){
+				const Stage *stage = value_unpack(func).data.ptr;
+				Value source = value_unpack(stack[stack_size-2]);
+				stack_size -= 1;
+				if (!stage_is_terminal(stage)){
+					Value res;
+					const char *msg = sequence_append(source, stage, &res);
+					if (msg != NULL) RETURN_ERROR(msg, node.pos);
+					stack[stack_size-1] = value_pack(res);
+					break;
+				}
+				if (!stage_is_complete(stage))
+					RETURN_ERROR("builtin is missing its arguments", node.pos);
+				if (run_count == PipeCapacity)
+					RETURN_ERROR("evaluation stack overflow", node.pos);
+				PipeRun *run = runs + run_count;
+				*run = (PipeRun){
+					.terminal = stage, .ast_index = ast - nodes.data, .pos = node.pos,
+				};
+				const char *msg = sequence_from(source, &run->seq);
+				if (msg != NULL) RETURN_ERROR(msg, node.pos);
+				pipe_run_mark(run);
+				if (stage->kind == Stage_Fold){
+					run->acc = stage->args[1];
+					run->has_acc = true;
+				} else if (stage->kind == Stage_Set || stage->kind == Stage_Dict){
+					Table *table = table_new(stage->kind == Stage_Set ? DT_Set : DT_Dict, 0);
+					run->acc = value_pack((Value){ .type = table->type, .data.ptr = table });
+					run->has_acc = true;
+				}
+				stack_size -= 1;
+				run_count += 1;
+				goto PipelineNext;
+			}
 			stack[stack_size-1] = stack[stack_size-2];
 			stack[stack_size-2] = func;
 			node.count = 1;
 			goto CallFunction;
 		}
-		case Ast_Add:
-		case Ast_Subtract:
-		case Ast_Multiply:
-		case Ast_Divide:
-		case Ast_LogicOr:
-		case Ast_LogicAnd:
-		case Ast_Less:
-		case Ast_Greater:
-		case Ast_Equal:{
-			Value lhs = stack[stack_size-2];
-			Value rhs = stack[stack_size-1];
-			Value res = { .type = lhs.type };
-			stack_size -= 1;
-			if (lhs.type != rhs.type)
-				RETURN_ERROR("opperator's arguments have different types", node.pos);
-			switch (lhs.type){
-			case DT_Real:{
-				switch (node.type){
-				case Ast_Add:      res.data.real = lhs.data.real + rhs.data.real; break;
-				case Ast_Subtract: res.data.real = lhs.data.real - rhs.data.real; break;
-				case Ast_Multiply: res.data.real = lhs.data.real * rhs.data.real; break;
-				case Ast_Divide:   
-					if (rhs.data.real == 0.0) RETURN_ERROR("division by zero", node.pos);
-					res.data.real = lhs.data.real / rhs.data.real;
-					break;
-				case Ast_Equal:
-					res.data.boolean = lhs.data.real == rhs.data.real; res.type = DT_Bool;
-					break;
-				case Ast_Less:
-					res.data.boolean = lhs.data.real < rhs.data.real; res.type = DT_Bool;
-					break;
-				case Ast_Greater:
-					res.data.boolean = lhs.data.real > rhs.data.real; res.type = DT_Bool;
-					break;
-				default: goto BinOpTypeError;
+		PipelineNext:{
+			// elements go through the stages until one of them calls a function
+			PipeRun *run = runs + run_count - 1;
+			const Sequence *seq = run->seq;
+			PackedValue func;
+			for (;;){
+				if (run->stage == 0){
+					if (run->stop || run->next == seq->length) goto PipelineDone;
+					pipe_run_release(run);
+					run->value = sequence_element(seq, run->next);
+					run->next += 1;
 				}
-				break;
-			}
-			case DT_Integer:{
-				switch (node.type){
-				case Ast_Add:      res.data.integer = lhs.data.integer+rhs.data.integer; break;
-				case Ast_Subtract: res.data.integer = lhs.data.integer-rhs.data.integer; break;
-				case Ast_Multiply: res.data.integer = lhs.data.integer*rhs.data.integer; break;
-				case Ast_Divide:   
-					if (rhs.data.integer == 0) RETURN_ERROR("division by zero", node.pos);
-					res.data.integer = lhs.data.integer / rhs.data.integer;
-					break;
-				case Ast_Equal:
-					res.data.boolean = lhs.data.integer == rhs.data.integer; res.type = DT_Bool;
-					break;
-				case Ast_Less:
-					res.data.boolean = lhs.data.integer < rhs.data.integer; res.type = DT_Bool;
-					break;
-				case Ast_Greater:
-					res.data.boolean = lhs.data.integer > rhs.data.integer; res.type = DT_Bool;
-					break;
-				default: goto BinOpTypeError;
+				if (run->stage == seq->stage_count){
+					enum StageKind kind = run->terminal->kind;
+					if (kind == Stage_Fold || kind == Stage_Dict){
+						func = run->terminal->args[0];
+						break;
+					}
+					if (kind == Stage_Set){
+						Table *table = value_unpack(run->acc).data.ptr;
+						Value null = { .type = DT_Null };
+						const char *msg = table_insert(table, value_unpack(run->value), value_pack(null));
+						if (msg != NULL) RETURN_ERROR(msg, run->pos);
+						run->stage = 0;
+						continue;
+					}
+					AstNode add = { .type = Ast_Add, .pos = run->pos };
+					if (!run->has_acc){
+						run->acc = run->value;
+						run->has_acc = true;
+					} else if (!eval_packed_int_op(add, run->acc, run->value, &run->acc)){
+						Value res;
+						const char *msg = eval_binary_op(
+							add, value_unpack(run->acc), value_unpack(run->value), &res
+						);
+						if (msg != NULL) RETURN_ERROR(msg, run->pos);
+						run->acc = value_pack(res);
+					}
+					run->stage = 0;
+					continue;
 				}
-				break;
-			}
-			case DT_Bool:{
-				switch (node.type){
-				case Ast_LogicOr:  res.data.boolean = lhs.data.boolean||rhs.data.boolean; break;
-				case Ast_LogicAnd: res.data.boolean = lhs.data.boolean&&rhs.data.boolean; break;
-				case Ast_Equal:    res.data.boolean = lhs.data.boolean==rhs.data.boolean; break;
-				default: goto BinOpTypeError;
+				const Stage *stage = seq->stages[run->stage];
+				if (stage->kind == Stage_Take){
+					int64_t limit = value_unpack(stage->args[0]).data.integer;
+					if (run->taken[run->stage] == limit){
+						run->stop = true;
+						run->stage = 0;
+						continue;
+					}
+					run->taken[run->stage] += 1;
+					run->stop |= run->taken[run->stage] == limit;
+					run->stage += 1;
+					continue;
 				}
+				func = stage->args[0];
 				break;
 			}
-			default:
-			BinOpTypeError:
-				RETURN_ERROR("argument's type is not supported by this operator", node.pos);
-			}
-			if (node.flags & AstFlag_Negate){
-				assert(res.type == DT_Bool);
-				res.data.boolean = !res.data.boolean;
+			// fold's function also gets the accumulator
+			bool fold = run->stage == seq->stage_count && run->terminal->kind == Stage_Fold;
+			if (StackCapacity - stack_size < 3)
+				RETURN_ERROR("evaluation stack overflow", run->pos);
+			stack[stack_size] = func; stack_size += 1;
+			if (fold){ stack[stack_size] = run->acc; stack_size += 1; }
+			stack[stack_size] = run->value; stack_size += 1;
+			node = (AstNode){ .type = Ast_Call, .count = 1 + fold, .pos = run->pos };
+			// return address of the call is 0, that brings the result back here
+			ast = nodes.data;
+			goto CallFunction;
+		}
+		PipelineResume:{
+			PipeRun *run = runs + run_count - 1;
+			stack_size -= 1;
+			PackedValue res = stack[stack_size];
+			if (run->stage == run->seq->stage_count){
+				if (run->terminal->kind == Stage_Dict){
+					Table *table = value_unpack(run->acc).data.ptr;
+					const char *msg = table_insert(table, value_unpack(run->value), res);
+					if (msg != NULL) RETURN_ERROR(msg, run->pos);
+				} else{
+					run->acc = res;
+				}
+				run->stage = 0;
+			} else if (run->seq->stages[run->stage]->kind == Stage_Map){
+				run->value = res;
+				run->stage += 1;
+			} else{
+				Value keep = value_unpack(res);
+				if (keep.type != DT_Bool)
+					RETURN_ERROR("filter's function has to return a boolean", run->pos);
+				run->stage = keep.data.boolean ? run->stage + 1 : 0;
 			}
-			stack[stack_size-1] = res;
+			goto PipelineNext;
+		}
+		PipelineDone:{
+			PipeRun *run = runs + run_count - 1;
+			PackedValue res = run->has_acc
+				? run->acc
+				: value_pack((Value){ .type = DT_Integer, .data.integer = 0 });
+			ast = nodes.data + run->ast_index;
+			node.pos = run->pos;
+			run_count -= 1;
+			PUSH_PACKED(res);
 			break;
 		}
+		case Ast_Add:
+		case Ast_Subtract:
+		case Ast_Multiply:
+		case Ast_Divide:
+		case Ast_LogicOr:
+		case Ast_LogicAnd:
+		case Ast_Less:
+		case Ast_Greater:
+		case Ast_Equal:
+		case Ast_Concat:
+		case Ast_Contains:
+		case Ast_Range:
 		case Ast_Power:{
-			Value lhs = stack[stack_size-2];
-			Value rhs = stack[stack_size-1];
 			stack_size -= 1;
-			Value res = { .type = lhs.type };
-			switch (rhs.type){
-			case DT_Integer:{
-				switch (lhs.type){
-				case DT_Integer:
-					res.data.integer = util_ipow_u64(lhs.data.integer, rhs.data.integer);
-					break;
-				case DT_Real:
-					res.data.real = util_ipow_f64(lhs.data.real, rhs.data.integer);
-					break;
-				default: goto PowerOpTypeError;
-				}
-				break;
+			if ((node.flags & AstFlag_Join) && fork_count != 0 && forks[fork_count-1]->slot == stack_size-1){
+				fork_count -= 1;
+				EvalError err = fork_join(forks[fork_count], stack + stack_size-1);
+				if (err.msg != NULL) RETURN_ERROR(err.msg, err.pos);
 			}
-			case DT_Real:{
-				switch (lhs.type){
-				case DT_Integer:
-					if (res.data.integer < 0) goto PowerNegativeBaseError;
-					res.data.real = pow((double)lhs.data.integer, rhs.data.real);
-					res.type = DT_Real;
-					break;
-				case DT_Real:
-					if (res.data.real < 0.0) goto PowerNegativeBaseError;
-					res.data.real = pow(lhs.data.real, rhs.data.real);
-					break;
-				default: goto PowerOpTypeError;
-				}
+			if (eval_packed_int_op(node, stack[stack_size-1], stack[stack_size], stack+stack_size-1))
 				break;
-			}
-			default:
-			PowerOpTypeError:
-				RETURN_ERROR("argument's type is not supported by power operator", node.pos);
-			PowerNegativeBaseError:
-				RETURN_ERROR("power operator's base cannot be negative", node.pos);
-			}
-			stack[stack_size-1] = res;
+			Value res;
+			const char *msg = eval_binary_op(
+				node, value_unpack(stack[stack_size-1]), value_unpack(stack[stack_size]), &res
+			);
+			if (msg != NULL) RETURN_ERROR(msg, node.pos);
+			stack[stack_size-1] = value_pack(res);
 			break;
 		}
 		case Ast_Semicolon:
 			stack_size -= 1;
-			Value top = stack[stack_size];
-			switch (top.type){
-			case DT_Null: break;
-			case DT_Real:
-				printf("%lf\n", top.data.real);
-				break;
-			case DT_Integer:
-				printf("%li\n", top.data.integer);
-				break;
-			case DT_Bool:
-				printf("%s\n", top.data.boolean ? "true" : "false");
-				break;
-			case DT_Function:
-				if (top.data.funcinfo.name_id != 0){
-					printf("function \"");
-					const uint8_t *name = global_names.data + top.data.funcinfo.name_id;	
-					size_t name_len = *(name-1);
-					for (size_t i=0; i!=name_len; i+=1){ putchar(name[i]); }
-					printf("\"\n");
-				} else{
-					printf("function at %u\n", (nodes.data + top.data.funcinfo.index)->pos);
-				}
-				break;
-			default:
+			if (!eval_output_value(nodes, value_unpack(stack[stack_size])))
 				RETURN_ERROR("expression has invalid data type", node.pos);
-			}
+			if (ast == stop) goto ReturnError;
 			break;
 		default:
 			RETURN_ERROR("eval_error: unhandled ast node", node.pos);
@@ -341,5 +1120,164 @@ EvalError eval_ast(AstArray nodes){
 
 #undef RETURN_ERROR
 ReturnError:
+	// forks that an error left behind, the earliest one would fail first
+	while (fork_count != 0){
+		fork_count -= 1;
+		PackedValue ignored;
+		EvalError err = fork_join(forks[fork_count], &ignored);
+		if (err.msg != NULL) res_error = err;
+	}
+	if (scope->export_defs && res_error.msg == NULL){
+		size_t first = SIZE(StageBuiltins) + scope->env_count;
+		scope->def_name = 0;
+		if (var_count > first){
+			scope->def_name  = var_names[var_count-1];
+			scope->def_value = vars[var_count-1];
+		}
+	}
+	// calls that an error interrupted end with it
+	while (profile && global_profiler.frame_count > profile_base) profile_leave();
+	if (sample) global_sampler.ast = NULL;
+	if (scope->keep_vars){
+		// variables of calls that an error interrupted are dropped
+		scope->kept_vars = frame_count != 0 ? frames[0].vars_size : var_count;
+	}
+	if (scope->stacks == NULL) eval_stacks_put(stacks);
+	if (!scope->keep_heaps){
+		value_heap_release();
+		bigint_heap_release();
+		array_heap_release();
+		string_heap_release(&global_string_heap);
+	}
 	return res_error;
 }
+
+static EvalError eval_scope_plain(AstArray nodes, EvalScope *scope){
+	return eval_scope_body(nodes, scope, false, false);
+}
+
+static EvalError eval_scope_profiled(AstArray nodes, EvalScope *scope){
+	return eval_scope_body(nodes, scope, true, false);
+}
+
+static EvalError eval_scope_sampled(AstArray nodes, EvalScope *scope){
+	return eval_scope_body(nodes, scope, false, true);
+}
+
+EvalError eval_scope(AstArray nodes, EvalScope *scope){
+	if (profile_enabled()) return eval_scope_profiled(nodes, scope);
+	if (sampler_enabled()) return eval_scope_sampled(nodes, scope);
+	return eval_scope_plain(nodes, scope);
+}
+
+EvalError eval_ast(AstArray nodes){
+	EvalScope scope = {0};
+	EvalError res = eval_scope(nodes, &scope);
+	eval_stacks_release();
+	return res;
+}
+
+
+
+// TOP LEVEL DEFINITIONS
+// statements before stop are evaluated one by one, so the variable each of
+// them defines can be kept, the environment starts empty and grows
+static EvalError eval_definitions(
+	AstArray nodes, uint32_t stop, PackedValue **env_values, NameId **env_names, size_t *env_count
+){
+	const AstNode *data = nodes.data;
+	size_t env_capacity = 0;
+	uint32_t start = 1;
+	for (uint32_t i=1; start!=stop;){
+		AstNode node = data[i];
+		if (node.type == Ast_Function){
+			i += 1 + data[i+1].data.funcnodeinfo.node_size;
+			continue;
+		}
+		i += AstNodeSizes[node.type];
+		// last statement may end without a semicolon
+		if (node.type != Ast_Semicolon && node.type != Ast_Terminator) continue;
+		if (node.type == Ast_Terminator){
+			i -= AstNodeSizes[node.type];
+			if (i == start) break;
+		}
+
+		EvalScope scope = {
+			.start = start, .stop = node.type == Ast_Semicolon ? i : 0, .keep_heaps = true, .export_defs = true,
+			.env_values = *env_values, .env_names = *env_names, .env_count = *env_count,
+		};
+		EvalError err = eval_scope(nodes, &scope);
+		if (err.msg != NULL) return err;
+		start = i;
+		if (scope.def_name == 0) continue;
+		size_t slot = 0;
+		while (slot != *env_count && (*env_names)[slot] != scope.def_name) slot += 1;
+		if (slot == env_capacity){
+			env_capacity = util_max_usize(64, 2*env_capacity);
+			*env_values = mem_realloc(*env_values, env_capacity*sizeof(PackedValue));
+			*env_names  = mem_realloc(*env_names,  env_capacity*sizeof(NameId));
+			assert(*env_values && *env_names && "environment allocation failrule");
+		}
+		(*env_values)[slot] = scope.def_value;
+		(*env_names)[slot]  = scope.def_name;
+		*env_count += slot == *env_count;
+	}
+	return (EvalError){0};
+}
+
+// heaps that values of the definitions live in, they are taken from the
+// thread, so releasing its heaps after an evaluation doesn't free them
+typedef struct{
+	ValueChunk  *values;
+	size_t       value_count;
+	BigChunk    *bigints;
+	ArrayChunk  *arrays;
+	StringChunk *strings;
+} EvalHeaps;
+
+static EvalHeaps eval_heaps_take(void){
+	EvalHeaps res = {
+		global_value_heap.chunks, global_value_heap.used,
+		global_bigint_heap.chunks, global_array_heap.chunks, global_string_heap.chunks,
+	};
+	global_value_heap.chunks  = NULL;
+	global_value_heap.used    = 0;
+	global_bigint_heap.chunks = NULL;
+	global_array_heap.chunks  = NULL;
+	global_string_heap.chunks = NULL;
+	return res;
+}
+
+static void eval_heaps_put(EvalHeaps heaps){
+	global_value_heap.chunks  = heaps.values;
+	global_value_heap.used    = heaps.value_count;
+	global_bigint_heap.chunks = heaps.bigints;
+	global_array_heap.chunks  = heaps.arrays;
+	global_string_heap.chunks = heaps.strings;
+}
+
+static void eval_heaps_free(EvalHeaps heaps){
+	EvalHeaps current = eval_heaps_take();
+	eval_heaps_put(heaps);
+	value_heap_release();
+	bigint_heap_release();
+	array_heap_release();
+	string_heap_release(&global_string_heap);
+	eval_heaps_put(current);
+}
+
+// the definitions are evaluated without output into heaps of their own,
+// a function that is called without evaluating the program sees them
+static EvalError eval_environment(
+	AstArray nodes, PackedValue **env_values, NameId **env_names, size_t *env_count, EvalHeaps *heaps
+){
+	EvalHeaps current = eval_heaps_take();
+	OutputBuffer output = global_output;
+	output_init_discard();
+	EvalError res = eval_definitions(nodes, ast_terminator(nodes), env_values, env_names, env_count);
+	output_finish();
+	global_output = output;
+	*heaps = eval_heaps_take();
+	eval_heaps_put(current);
+	return res;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "utils.h"
+#include "memstat.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -36,9 +37,14 @@ StringView mmap_file(const char *path){
 
 
 
+// regular files tell their size, so they are read without growing the text
 StringView read_file(FILE *input){
 	size_t capacity = FILES_EXPECTED_LENGTH;
-	StringView res = {malloc(capacity), 0};
+	struct stat s;
+	if (fstat(fileno(input), &s) == 0 && S_ISREG(s.st_mode)){
+		capacity = util_max_usize(capacity, (size_t)s.st_size + 1);
+	}
+	StringView res = {mem_alloc(capacity), 0};
 	if (res.data == NULL) return res;
 	
 	for (;;){
@@ -46,9 +52,9 @@ StringView read_file(FILE *input){
 		UNLIKELY if (c == EOF) break;
 
 		if (res.size == capacity-1){
-			char *new_data = realloc(res.data, res.size*2);
+			char *new_data = mem_realloc(res.data, res.size*2);
 			if (new_data == NULL){
-				free(res.data);
+				mem_free(res.data);
 				res.data = new_data;
 				break;
 			}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "utils.h"
+
+// longest number that the formatting functions produce, "-2.2250738585072014e-308"
+#define FORMAT_MAX_NUMBER 32
+
+
+
+// INTEGER FORMATTING
+// digits are written two at a time from the end, the length is known up front
+static const char format_digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static size_t format_u64(char *dest, uint64_t n){
+	size_t len = n == 0 ? 1 : util_digitwidth_u64(n);
+	char *it = dest + len;
+	while (n >= 100){
+		size_t pair = (n % 100) * 2;
+		n /= 100;
+		it -= 2;
+		memcpy(it, format_digit_pairs + pair, 2);
+	}
+	if (n >= 10){
+		it -= 2;
+		memcpy(it, format_digit_pairs + n*2, 2);
+	} else{
+		it -= 1;
+		*it = (char)('0' + n);
+	}
+	return len;
+}
+
+static size_t format_i64(char *dest, int64_t n){
+	if (n >= 0) return format_u64(dest, (uint64_t)n);
+	*dest = '-';
+	return 1 + format_u64(dest + 1, (uint64_t)0 - (uint64_t)n);
+}
+
+
+
+// SHORTEST ROUND-TRIP DOUBLE FORMATTING
+// Ryu algorithm by Ulf Adams: the interval of decimals that round to the
+// double is scaled by a 125 bit approximation of a power of 5 and digits are
+// removed while both of its ends still differ, the power tables are
+// computed exactly on first use instead of being embedded
+#define FORMAT_MANTISSA_BITS   52
+#define FORMAT_EXPONENT_BITS   11
+#define FORMAT_EXPONENT_BIAS   1023
+#define FORMAT_POW5_BITCOUNT   125
+#define FORMAT_POW5_TABLE_SIZE 326
+#define FORMAT_POW5_INV_TABLE_SIZE 342
+
+static uint64_t format_pow5_split[FORMAT_POW5_TABLE_SIZE][2];
+static uint64_t format_pow5_inv_split[FORMAT_POW5_INV_TABLE_SIZE][2];
+static bool format_tables_ready = false;
+
+
+// ceil(log2(5^e)), number of bits of 5^e
+static inline int32_t format_pow5_bits(int32_t e){
+	return (int32_t)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+// floor(log10(2^e))
+static inline uint32_t format_log10_pow2(int32_t e){
+	return ((uint32_t)e * 78913) >> 18;
+}
+
+// floor(log10(5^e))
+static inline uint32_t format_log10_pow5(int32_t e){
+	return ((uint32_t)e * 732923) >> 20;
+}
+
+
+// little endian big number, large enough for 2^(bits of 5^341 + 125)
+#define FORMAT_BIG_LIMBS 32
+
+static void format_big_mul(uint32_t *limbs, uint32_t factor){
+	uint64_t carry = 0;
+	for (size_t i=0; i!=FORMAT_BIG_LIMBS; i+=1){
+		carry += (uint64_t)limbs[i] * factor;
+		limbs[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+}
+
+static void format_big_div(uint32_t *limbs, uint32_t divisor){
+	uint64_t rem = 0;
+	for (size_t i=FORMAT_BIG_LIMBS; i!=0; i-=1){
+		rem = (rem << 32) | limbs[i-1];
+		limbs[i-1] = (uint32_t)(rem / divisor);
+		rem %= divisor;
+	}
+}
+
+// extracts 128 bits starting at bit shift
+static void format_big_window(const uint32_t *limbs, int32_t shift, uint64_t *res){
+	uint32_t window[4] = {0};
+	size_t limb = shift / 32;
+	uint32_t bit = shift % 32;
+	for (size_t i=0; i!=4; i+=1){
+		uint64_t lo = limb+i   < FORMAT_BIG_LIMBS ? limbs[limb+i]   : 0;
+		uint64_t hi = limb+i+1 < FORMAT_BIG_LIMBS ? limbs[limb+i+1] : 0;
+		window[i] = (uint32_t)(((hi << 32) | lo) >> bit);
+	}
+	res[0] = (uint64_t)window[1] << 32 | window[0];
+	res[1] = (uint64_t)window[3] << 32 | window[2];
+}
+
+static void format_init_tables(void){
+	if (format_tables_ready) return;
+	uint32_t pow5[FORMAT_BIG_LIMBS] = {1};
+	for (int32_t i=0; i!=FORMAT_POW5_TABLE_SIZE; i+=1){
+		// 5^i with its highest bit moved to bit 124
+		int32_t shift = format_pow5_bits(i) - FORMAT_POW5_BITCOUNT;
+		if (shift >= 0){
+			format_big_window(pow5, shift, format_pow5_split[i]);
+		} else{
+			unsigned __int128 value = 0;
+			for (size_t j=4; j!=0; j-=1) value = (value << 32) | pow5[j-1];
+			value <<= -shift;
+			format_pow5_split[i][0] = (uint64_t)value;
+			format_pow5_split[i][1] = (uint64_t)(value >> 64);
+		}
+		format_big_mul(pow5, 5);
+	}
+	for (int32_t i=0; i!=FORMAT_POW5_INV_TABLE_SIZE; i+=1){
+		// floor(2^(bits of 5^i - 1 + 125) / 5^i) + 1
+		uint32_t big[FORMAT_BIG_LIMBS] = {0};
+		int32_t j = format_pow5_bits(i) - 1 + FORMAT_POW5_BITCOUNT;
+		big[j / 32] = 1u << (j % 32);
+		int32_t e = i;
+		for (; e >= 13; e -= 13) format_big_div(big, 1220703125u); // 5^13
+		format_big_div(big, util_ipow_u32(5, e));
+		format_big_window(big, 0, format_pow5_inv_split[i]);
+		format_pow5_inv_split[i][0] += 1;
+		format_pow5_inv_split[i][1] += format_pow5_inv_split[i][0] == 0;
+	}
+	format_tables_ready = true;
+}
+
+
+static inline uint64_t format_mul_shift(uint64_t m, const uint64_t *mul, int32_t j){
+	unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+	unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+	return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+
+static inline uint32_t format_pow5_factor(uint64_t value){
+	uint32_t count = 0;
+	while (value % 5 == 0){ value /= 5; count += 1; }
+	return count;
+}
+
+// shortest decimal digits and exponent, value = digits * 10^exponent
+static void format_f64_decimal(uint64_t mantissa, uint32_t exponent, uint64_t *digits, int32_t *exp10){
+	int32_t e2;
+	uint64_t m2;
+	if (exponent == 0){
+		e2 = 1 - FORMAT_EXPONENT_BIAS - FORMAT_MANTISSA_BITS - 2;
+		m2 = mantissa;
+	} else{
+		e2 = (int32_t)exponent - FORMAT_EXPONENT_BIAS - FORMAT_MANTISSA_BITS - 2;
+		m2 = ((uint64_t)1 << FORMAT_MANTISSA_BITS) | mantissa;
+	}
+	bool accept_bounds = (m2 & 1) == 0;
+
+	// interval of numbers that round to the double is (mm, mp) with mv in it
+	uint64_t mv = 4 * m2;
+	uint32_t mm_shift = mantissa != 0 || exponent <= 1;
+	uint64_t vr, vp, vm;
+	int32_t e10;
+	bool vm_trailing_zeros = false;
+	bool vr_trailing_zeros = false;
+	if (e2 >= 0){
+		uint32_t q = format_log10_pow2(e2) - (e2 > 3);
+		e10 = (int32_t)q;
+		int32_t k = FORMAT_POW5_BITCOUNT + format_pow5_bits(q) - 1;
+		int32_t i = -e2 + (int32_t)q + k;
+		const uint64_t *mul = format_pow5_inv_split[q];
+		vr = format_mul_shift(4*m2, mul, i);
+		vp = format_mul_shift(4*m2 + 2, mul, i);
+		vm = format_mul_shift(4*m2 - 1 - mm_shift, mul, i);
+		if (q <= 21){
+			if (mv % 5 == 0){
+				vr_trailing_zeros = format_pow5_factor(mv) >= q;
+			} else if (accept_bounds){
+				vm_trailing_zeros = format_pow5_factor(mv - 1 - mm_shift) >= q;
+			} else{
+				vp -= format_pow5_factor(mv + 2) >= q;
+			}
+		}
+	} else{
+		uint32_t q = format_log10_pow5(-e2) - (-e2 > 1);
+		e10 = (int32_t)q + e2;
+		int32_t i = -e2 - (int32_t)q;
+		int32_t k = format_pow5_bits(i) - FORMAT_POW5_BITCOUNT;
+		int32_t j = (int32_t)q - k;
+		const uint64_t *mul = format_pow5_split[i];
+		vr = format_mul_shift(4*m2, mul, j);
+		vp = format_mul_shift(4*m2 + 2, mul, j);
+		vm = format_mul_shift(4*m2 - 1 - mm_shift, mul, j);
+		if (q <= 1){
+			// mv has at least q trailing zero bits, so vr has q trailing zeros
+			vr_trailing_zeros = true;
+			if (accept_bounds){
+				vm_trailing_zeros = mm_shift == 1;
+			} else{
+				vp -= 1;
+			}
+		} else if (q < 63){
+			vr_trailing_zeros = (mv & (((uint64_t)1 << q) - 1)) == 0;
+		}
+	}
+
+	// remove digits while the interval still holds more than one number
+	int32_t removed = 0;
+	uint8_t last_removed = 0;
+	uint64_t output;
+	if (vm_trailing_zeros || vr_trailing_zeros){
+		// rare case that needs exact rounding
+		while (vp / 10 > vm / 10){
+			vm_trailing_zeros &= vm % 10 == 0;
+			vr_trailing_zeros &= last_removed == 0;
+			last_removed = vr % 10;
+			vr /= 10; vp /= 10; vm /= 10;
+			removed += 1;
+		}
+		if (vm_trailing_zeros){
+			while (vm % 10 == 0){
+				vr_trailing_zeros &= last_removed == 0;
+				last_removed = vr % 10;
+				vr /= 10; vp /= 10; vm /= 10;
+				removed += 1;
+			}
+		}
+		if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0){
+			last_removed = 4; // round half to even
+		}
+		output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+	} else{
+		bool round_up = false;
+		while (vp / 100 > vm / 100){
+			round_up = vr % 100 >= 50;
+			vr /= 100; vp /= 100; vm /= 100;
+			removed += 2;
+		}
+		while (vp / 10 > vm / 10){
+			round_up = vr % 10 >= 5;
+			vr /= 10; vp /= 10; vm /= 10;
+			removed += 1;
+		}
+		output = vr + (vr == vm || round_up);
+	}
+	*digits = output;
+	*exp10 = e10 + removed;
+}
+
+
+// numbers in [1e-5, 1e21) are written positionally and always have a decimal
+// point, so they read back as reals, others use exponent notation
+static size_t format_f64(char *dest, double x){
+	union{ double f; uint64_t n; } u = { .f = x };
+	bool sign = u.n >> 63;
+	uint64_t mantissa = u.n & (((uint64_t)1 << FORMAT_MANTISSA_BITS) - 1);
+	uint32_t exponent = (u.n >> FORMAT_MANTISSA_BITS) & ((1u << FORMAT_EXPONENT_BITS) - 1);
+
+	char *it = dest;
+	if (sign){ *it = '-'; it += 1; }
+	if (exponent == (1u << FORMAT_EXPONENT_BITS) - 1){
+		memcpy(it, mantissa != 0 ? "nan" : "inf", 3);
+		return it + 3 - dest;
+	}
+	if (exponent == 0 && mantissa == 0){
+		memcpy(it, "0.0", 3);
+		return it + 3 - dest;
+	}
+
+	format_init_tables();
+	uint64_t digits;
+	int32_t exp10;
+	format_f64_decimal(mantissa, exponent, &digits, &exp10);
+	char buf[24];
+	int32_t len = (int32_t)format_u64(buf, digits);
+	int32_t point = len + exp10; // position of decimal point within digits
+
+	if (point > -5 && point <= 21){
+		if (point <= 0){
+			memcpy(it, "0.", 2); it += 2;
+			memset(it, '0', -point); it += -point;
+			memcpy(it, buf, len); it += len;
+		} else if (point >= len){
+			memcpy(it, buf, len); it += len;
+			memset(it, '0', point - len); it += point - len;
+			memcpy(it, ".0", 2); it += 2;
+		} else{
+			memcpy(it, buf, point); it += point;
+			*it = '.'; it += 1;
+			memcpy(it, buf + point, len - point); it += len - point;
+		}
+	} else{
+		*it = buf[0]; it += 1;
+		if (len > 1){
+			*it = '.'; it += 1;
+			memcpy(it, buf + 1, len - 1); it += len - 1;
+		}
+		int32_t e = point - 1;
+		memcpy(it, e < 0 ? "e-" : "e+", 2); it += 2;
+		it += format_u64(it, e < 0 ? -e : e);
+	}
+	return it - dest;
+}
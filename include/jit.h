@@ -0,0 +1,646 @@
+#pragma once
+
+#include "analysis.h"
+#include "value.h"
+
+#include <sys/mman.h>
+
+#ifndef JIT_CALL_THRESHOLD
+	#define JIT_CALL_THRESHOLD 32
+#endif
+
+// after this many bailouts a function is left to the interpreter, calls that
+// bail out near the end of a deep recursion would otherwise repeat the work
+#ifndef JIT_MAX_BAILOUTS
+	#define JIT_MAX_BAILOUTS 4
+#endif
+
+// functions with more parameters are not compiled
+#define JIT_MAX_ARGS 128
+
+#ifndef JIT_STACK_SIZE
+	#define JIT_STACK_SIZE ((size_t)256 << 20)
+#endif
+
+// space kept below the stack limit for temporaries of a single frame
+#define JIT_STACK_MARGIN ((size_t)64 << 10)
+#define JIT_MAX_TEMPS    (JIT_STACK_MARGIN / 16)
+
+
+
+// X86-64 JIT COMPILER FOR PURE INTEGER FUNCTIONS
+// functions are compiled from postfix nodes with the top of the value stack
+// kept in rax and the rest on the native stack, parameters are read relative
+// to rbp, every value is either an integer or a boolean known at compile time
+//
+// register usage:
+//   rax, rcx, rdx, r11 - scratch
+//   r13 - lowest allowed native stack address
+//   r14 - native stack pointer to restore on bailout
+//
+// generated code never has side effects, so on any failed guard the whole
+// native computation is abandoned and the call is evaluated again by eval_ast
+
+enum JitType{
+	JT_Unknown = 0, // return type of function that is still being inferred
+	JT_Int,
+	JT_Bool,
+	JT_Func, // compile time reference to a function, has no runtime value
+	JT_Error,
+};
+
+typedef struct{
+	void    *code;
+	uint32_t func_index;
+	uint32_t calls;
+	uint32_t bailouts;
+	uint32_t batch_offset; // offset of code inside of currently compiled batch
+	uint8_t  ret_type;
+	bool     failed;
+	bool     in_batch;
+} JitFunction;
+
+typedef struct{
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+} JitBuffer;
+
+typedef struct{
+	uint32_t site;   // offset of rel32 operand
+	uint32_t target; // function meta index, 0 for the bailout stub
+} JitPatch;
+
+typedef int (*JitEnterFn)(
+	void *fn, const int64_t *args, size_t argc, int64_t *res, void *stack_top, void *stack_limit
+);
+
+static struct{
+	JitFunction *funcs;
+	size_t       func_count;
+	AstArray     ast;
+	AstInfo      info;
+
+	JitEnterFn enter;
+	void      *bailout;
+	VmemBlock  stack;
+
+	JitBuffer  buf;
+	JitPatch  *patches;
+	size_t     patch_count;
+	size_t     patch_capacity;
+
+	size_t compiled;
+	size_t failed;
+	size_t native_calls;
+	size_t guard_fails;
+	size_t bailouts;
+	size_t code_bytes;
+} global_jit;
+
+
+
+// CODE EMISSION
+static void jit_emit(const uint8_t *bytes, size_t size){
+	JitBuffer *buf = &global_jit.buf;
+	if (buf->size + size > buf->capacity){
+		size_t new_capacity = util_max_usize(2*buf->capacity, 4096);
+		while (new_capacity < buf->size + size) new_capacity *= 2;
+		buf->data = realloc(buf->data, new_capacity);
+		assert(buf->data != NULL && "jit buffer allocation failrule");
+		buf->capacity = new_capacity;
+	}
+	memcpy(buf->data + buf->size, bytes, size);
+	buf->size += size;
+}
+
+#define JIT_EMIT(...) do{ \
+		static const uint8_t JitBytes[] = { __VA_ARGS__ }; \
+		jit_emit(JitBytes, sizeof(JitBytes)); \
+	} while (0)
+
+static void jit_emit32(uint32_t value){ jit_emit((const uint8_t *)&value, 4); }
+static void jit_emit64(uint64_t value){ jit_emit((const uint8_t *)&value, 8); }
+
+static void jit_add_patch(uint32_t target){
+	if (global_jit.patch_count == global_jit.patch_capacity){
+		global_jit.patch_capacity = util_max_usize(2*global_jit.patch_capacity, 64);
+		global_jit.patches = realloc(
+			global_jit.patches, global_jit.patch_capacity*sizeof(JitPatch)
+		);
+		assert(global_jit.patches != NULL && "jit patch allocation failrule");
+	}
+	global_jit.patches[global_jit.patch_count] = (JitPatch){global_jit.buf.size, target};
+	global_jit.patch_count += 1;
+	jit_emit32(0);
+}
+
+static void jit_patch_rel32(uint32_t site, uint32_t target){
+	int32_t rel = (int32_t)target - (int32_t)(site + 4);
+	memcpy(global_jit.buf.data + site, &rel, 4);
+}
+
+static void *jit_place_code(const uint8_t *code, size_t size){
+	size_t page = 4096;
+	size_t map_size = util_alignsize(size, page);
+	uint8_t *mem = mmap(0, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) return NULL;
+	memcpy(mem, code, size);
+	if (mprotect(mem, map_size, PROT_READ|PROT_EXEC) != 0){
+		munmap(mem, map_size);
+		return NULL;
+	}
+	return mem;
+}
+
+
+static bool jit_init(AstArray ast, AstInfo info){
+	global_jit.ast  = ast;
+	global_jit.info = info;
+
+	// assign runtime data to every pure function
+	global_jit.funcs = calloc(info.func_count + 1, sizeof(JitFunction));
+	assert(global_jit.funcs != NULL && "jit allocation failrule");
+	global_jit.func_count = 1;
+	for (size_t i=0; i!=info.func_count; i+=1){
+		FunctionNodeInfo *fi = &ast.data[info.funcs[i]+1].data.funcnodeinfo;
+		if (!(fi->flags & FuncFlag_Pure) || ast.data[info.funcs[i]].count > JIT_MAX_ARGS) continue;
+		fi->meta = global_jit.func_count;
+		global_jit.funcs[global_jit.func_count].func_index = info.funcs[i];
+		global_jit.func_count += 1;
+	}
+
+	global_jit.stack = vmem_reserve(util_min_usize(JIT_STACK_SIZE, vmem_default_reserve()));
+	if (global_jit.stack.size <= JIT_STACK_MARGIN) return false;
+
+	// int enter(fn, args, argc, res, stack_top, stack_limit)
+	global_jit.buf.size = 0;
+	JIT_EMIT(
+		0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, // push rbx..r15
+		0x49, 0x89, 0xcc,       // mov r12, rcx
+		0x4d, 0x89, 0xcd,       // mov r13, r9
+		0x49, 0x89, 0xe6,       // mov r14, rsp
+		0x4c, 0x89, 0xc4,       // mov rsp, r8
+		0x31, 0xc0,             // xor eax, eax
+		0x48, 0x39, 0xd0,       // loop: cmp rax, rdx
+		0x74, 0x08,             // je done
+		0xff, 0x34, 0xc6,       // push qword [rsi + rax*8]
+		0x48, 0xff, 0xc0,       // inc rax
+		0xeb, 0xf3,             // jmp loop
+		0xff, 0xd7,             // done: call rdi
+		0x49, 0x89, 0x04, 0x24, // mov [r12], rax
+		0x31, 0xc0,             // xor eax, eax
+		0x4c, 0x89, 0xf4,       // restore: mov rsp, r14
+		0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, // pop r15..rbx
+		0xc3,                   // ret
+	);
+	size_t bailout_offset = global_jit.buf.size;
+	JIT_EMIT(
+		0xb8, 0x01, 0x00, 0x00, 0x00, // mov eax, 1
+		0xeb, 0xeb,                   // jmp restore
+	);
+	uint8_t *code = jit_place_code(global_jit.buf.data, global_jit.buf.size);
+	if (code == NULL) return false;
+	global_jit.enter   = (JitEnterFn)code;
+	global_jit.bailout = code + bailout_offset;
+	return true;
+}
+
+static bool jit_enabled(void){
+	return global_jit.enter != NULL;
+}
+
+
+
+// COMPILATION
+typedef struct{
+	uint8_t  type;
+	uint32_t meta; // callee for JT_Func
+} JitValue;
+
+typedef struct{
+	uint32_t false_index;
+	uint32_t end_index;
+	uint32_t jz_site;
+	uint32_t jmp_site;
+	uint32_t stack_size;
+	uint32_t depth;
+	uint8_t  true_type;
+} JitBranch;
+
+static uint8_t jit_unify(uint8_t a, uint8_t b){
+	if (a == JT_Unknown) return b;
+	if (b == JT_Unknown || a == b) return a;
+	return JT_Error;
+}
+
+
+// compiles one function body, when emit is false only the types are checked
+static uint8_t jit_compile_body(uint32_t meta, bool emit){
+	AstArray ast = global_jit.ast;
+	uint32_t f = global_jit.funcs[meta].func_index;
+	AstNode *func = ast.data + f;
+	size_t param_count = func->count;
+	uint32_t end = f + (func+1)->data.funcnodeinfo.node_size;
+
+	JitValue stack[JIT_MAX_TEMPS];
+	size_t stack_size = 0;
+	size_t depth = 0; // number of runtime values
+	JitBranch branches[256];
+	size_t branch_count = 0;
+
+#define JIT_CODE(...) do{ if (emit) JIT_EMIT(__VA_ARGS__); } while (0)
+#define JIT_FAIL() return JT_Error
+#define PUSH_TOS() do{ if (depth != 0) JIT_CODE(0x50); } while (0) // push rax
+#define PUSH_TYPE(p_type, p_meta) do{ \
+		if (stack_size == SIZE(stack)) JIT_FAIL(); \
+		stack[stack_size] = (JitValue){(p_type), (p_meta)}; \
+		stack_size += 1; \
+		depth += (p_type) != JT_Func; \
+	} while (0)
+
+	if (emit){
+		JIT_EMIT(0x4c, 0x39, 0xec, 0x0f, 0x82); // cmp rsp, r13; jb bailout
+		jit_add_patch(0);
+		JIT_EMIT(0x55, 0x48, 0x89, 0xe5);       // push rbp; mov rbp, rsp
+	}
+
+	for (uint32_t i=f+2+param_count;;){
+		while (branch_count != 0 && branches[branch_count-1].end_index == i){
+			JitBranch br = branches[branch_count-1];
+			branch_count -= 1;
+			if (stack_size != br.stack_size + 1) JIT_FAIL();
+			uint8_t t = jit_unify(stack[stack_size-1].type, br.true_type);
+			if (t == JT_Error || t == JT_Func) JIT_FAIL();
+			stack[stack_size-1].type = t;
+			if (emit) jit_patch_rel32(br.jmp_site, global_jit.buf.size);
+		}
+		if (i == end) break;
+
+		AstNode node = ast.data[i];
+		Data data = ast.data[i+1].data;
+		switch (node.type){
+		case Ast_Integer:
+		PushInteger:
+			PUSH_TOS();
+			if (emit){
+				if (data.integer == (int32_t)data.integer){
+					JIT_EMIT(0x48, 0xc7, 0xc0); // mov rax, simm32
+					jit_emit32((uint32_t)data.integer);
+				} else{
+					JIT_EMIT(0x48, 0xb8);       // mov rax, imm64
+					jit_emit64((uint64_t)data.integer);
+				}
+			}
+			PUSH_TYPE(JT_Int, 0);
+			break;
+		case Ast_True:
+		case Ast_False:
+		PushBool:
+			PUSH_TOS();
+			if (node.type == Ast_True){
+				JIT_CODE(0xb8, 0x01, 0x00, 0x00, 0x00); // mov eax, 1
+			} else{
+				JIT_CODE(0x31, 0xc0);                   // xor eax, eax
+			}
+			PUSH_TYPE(JT_Bool, 0);
+			break;
+		case Ast_Identifier:{
+			const Data *params = (const Data *)(func + 2);
+			size_t k = 0;
+			while (k != param_count && params[k].name_id != data.name_id) k += 1;
+			if (k != param_count){
+				PUSH_TOS();
+				if (emit){
+					JIT_EMIT(0x48, 0x8b, 0x85); // mov rax, [rbp + disp32]
+					jit_emit32(16 + 8*(param_count-1-k));
+				}
+				PUSH_TYPE(JT_Int, 0);
+				break;
+			}
+			uint32_t value = ast_info_stable_value(&global_jit.info, data.name_id);
+			if (value == 0) JIT_FAIL();
+			node = ast.data[value];
+			data = ast.data[value+1].data;
+			switch (node.type){
+			case Ast_Integer: goto PushInteger;
+			case Ast_True:
+			case Ast_False:   goto PushBool;
+			case Ast_Function:
+				if (data.funcnodeinfo.meta == 0) JIT_FAIL();
+				PUSH_TYPE(JT_Func, data.funcnodeinfo.meta);
+				break;
+			default: JIT_FAIL();
+			}
+			break;
+		}
+		case Ast_Call:{
+			size_t n = node.count;
+			if (stack_size < n+1) JIT_FAIL();
+			JitValue callee = stack[stack_size-1-n];
+			if (callee.type != JT_Func) JIT_FAIL();
+			JitFunction *target = global_jit.funcs + callee.meta;
+			if (target->failed) JIT_FAIL();
+			if (ast.data[target->func_index].count != n) JIT_FAIL();
+			for (size_t j=stack_size-n; j!=stack_size; j+=1){
+				if (jit_unify(stack[j].type, JT_Int) != JT_Int) JIT_FAIL();
+			}
+			if (emit){
+				if (n != 0 || depth != 0){
+					JIT_EMIT(0x50);                   // push rax
+				}
+				if (target->in_batch){
+					JIT_EMIT(0xe8);                   // call rel32
+					jit_add_patch(callee.meta);
+				} else{
+					JIT_EMIT(0x49, 0xbb);             // mov r11, imm64
+					jit_emit64((uint64_t)(uintptr_t)target->code);
+					JIT_EMIT(0x41, 0xff, 0xd3);       // call r11
+				}
+				if (n != 0){
+					JIT_EMIT(0x48, 0x81, 0xc4);       // add rsp, imm32
+					jit_emit32(8*n);
+				}
+			}
+			stack_size -= n + 1;
+			depth -= n;
+			PUSH_TYPE(target->ret_type, 0);
+			break;
+		}
+		case Ast_Minus:
+			if (stack_size == 0 || jit_unify(stack[stack_size-1].type, JT_Int) != JT_Int) JIT_FAIL();
+			stack[stack_size-1].type = JT_Int;
+			JIT_CODE(0x48, 0xf7, 0xd8);               // neg rax
+			if (emit){
+				JIT_EMIT(0x0f, 0x80);                 // jo bailout
+				jit_add_patch(0);
+			}
+			break;
+		case Ast_LogicNot:
+			if (stack_size == 0 || jit_unify(stack[stack_size-1].type, JT_Bool) != JT_Bool) JIT_FAIL();
+			stack[stack_size-1].type = JT_Bool;
+			JIT_CODE(0x83, 0xf0, 0x01);               // xor eax, 1
+			break;
+		case Ast_Add:
+		case Ast_Subtract:
+		case Ast_Multiply:
+		case Ast_Divide:
+		case Ast_Less:
+		case Ast_Greater:
+		case Ast_Equal:
+		case Ast_LogicOr:
+		case Ast_LogicAnd:{
+			if (stack_size < 2) JIT_FAIL();
+			uint8_t t = jit_unify(stack[stack_size-2].type, stack[stack_size-1].type);
+			uint8_t operand_type = JT_Int;
+			uint8_t res_type = JT_Int;
+			switch (node.type){
+			case Ast_Less:
+			case Ast_Greater:  res_type = JT_Bool; break;
+			case Ast_Equal:    res_type = JT_Bool; operand_type = t; break;
+			case Ast_LogicOr:
+			case Ast_LogicAnd: res_type = JT_Bool; operand_type = JT_Bool; break;
+			default: break;
+			}
+			if (operand_type == JT_Unknown) operand_type = JT_Int;
+			if (operand_type != JT_Int && operand_type != JT_Bool) JIT_FAIL();
+			if (jit_unify(t, operand_type) != operand_type) JIT_FAIL();
+			if ((node.flags & AstFlag_Negate) && res_type != JT_Bool) JIT_FAIL();
+
+			JIT_CODE(0x48, 0x89, 0xc1, 0x58);         // mov rcx, rax; pop rax
+			switch (node.type){
+			case Ast_Add:      JIT_CODE(0x48, 0x01, 0xc8);       break; // add rax, rcx
+			case Ast_Subtract: JIT_CODE(0x48, 0x29, 0xc8);       break; // sub rax, rcx
+			case Ast_Multiply: JIT_CODE(0x48, 0x0f, 0xaf, 0xc1); break; // imul rax, rcx
+			case Ast_Divide:
+				if (emit){
+					JIT_EMIT(0x48, 0x85, 0xc9, 0x0f, 0x84); // test rcx, rcx; jz bailout
+					jit_add_patch(0);
+					JIT_EMIT(0x48, 0x83, 0xf9, 0xff, 0x0f, 0x84); // cmp rcx, -1; je bailout
+					jit_add_patch(0);
+					JIT_EMIT(0x48, 0x99, 0x48, 0xf7, 0xf9); // cqo; idiv rcx
+				}
+				break;
+			case Ast_Less:     JIT_CODE(0x48, 0x39, 0xc8, 0x0f, 0x9c, 0xc0); break; // setl
+			case Ast_Greater:  JIT_CODE(0x48, 0x39, 0xc8, 0x0f, 0x9f, 0xc0); break; // setg
+			case Ast_Equal:    JIT_CODE(0x48, 0x39, 0xc8, 0x0f, 0x94, 0xc0); break; // sete
+			case Ast_LogicOr:  JIT_CODE(0x48, 0x09, 0xc8);       break; // or rax, rcx
+			case Ast_LogicAnd: JIT_CODE(0x48, 0x21, 0xc8);       break; // and rax, rcx
+			default: break;
+			}
+			// results that don't fit are left for big integers of the interpreter
+			if (emit && (node.type==Ast_Add || node.type==Ast_Subtract || node.type==Ast_Multiply)){
+				JIT_EMIT(0x0f, 0x80);                     // jo bailout
+				jit_add_patch(0);
+			}
+			if (node.type==Ast_Less || node.type==Ast_Greater || node.type==Ast_Equal){
+				JIT_CODE(0x0f, 0xb6, 0xc0);               // movzx eax, al
+			}
+			if (node.flags & AstFlag_Negate){
+				JIT_CODE(0x83, 0xf0, 0x01);               // xor eax, 1
+			}
+			stack_size -= 1;
+			depth -= 1;
+			stack[stack_size-1].type = res_type;
+			break;
+		}
+		case Ast_Conditional:{
+			if (stack_size == 0 || branch_count == SIZE(branches)) JIT_FAIL();
+			if (jit_unify(stack[stack_size-1].type, JT_Bool) != JT_Bool) JIT_FAIL();
+			stack_size -= 1;
+			depth -= 1;
+			JIT_CODE(0x48, 0x89, 0xc1);               // mov rcx, rax
+			if (depth != 0) JIT_CODE(0x58);           // pop rax
+			JIT_CODE(0x85, 0xc9, 0x0f, 0x84);         // test ecx, ecx; jz rel32
+			uint32_t jump = i + node.count;
+			branches[branch_count] = (JitBranch){
+				.false_index = jump + 1,
+				.end_index   = jump + 1 + ast.data[jump].pos,
+				.jz_site     = global_jit.buf.size,
+				.stack_size  = stack_size,
+				.depth       = depth,
+			};
+			branch_count += 1;
+			if (emit) jit_emit32(0);
+			break;
+		}
+		case Ast_Jump:{
+			if (branch_count == 0) JIT_FAIL();
+			JitBranch *br = branches + branch_count - 1;
+			if (br->false_index != i+1 || stack_size != br->stack_size + 1) JIT_FAIL();
+			br->true_type = stack[stack_size-1].type;
+			if (br->true_type == JT_Func) JIT_FAIL();
+			if (emit){
+				JIT_EMIT(0xe9);                       // jmp rel32
+				br->jmp_site = global_jit.buf.size;
+				jit_emit32(0);
+				jit_patch_rel32(br->jz_site, global_jit.buf.size);
+			}
+			stack_size = br->stack_size;
+			depth = br->depth;
+			break;
+		}
+		default: JIT_FAIL();
+		}
+		i += ast_node_size(ast.data + i);
+	}
+
+	if (stack_size != 1 || stack[0].type == JT_Func) JIT_FAIL();
+	JIT_CODE(0xc9, 0xc3); // leave; ret
+	return stack[0].type;
+
+#undef PUSH_TYPE
+#undef PUSH_TOS
+#undef JIT_FAIL
+#undef JIT_CODE
+}
+
+
+// collects the function and all functions it calls that are not compiled yet,
+// sets *failed to the function that calls one which can't be compiled
+static bool jit_collect_batch(uint32_t meta, uint32_t *batch, size_t *batch_size, uint32_t *failed){
+	JitFunction *jf = global_jit.funcs + meta;
+	if (jf->code != NULL || jf->in_batch) return true;
+	jf->in_batch = true;
+	batch[*batch_size] = meta; *batch_size += 1;
+
+	AstArray ast = global_jit.ast;
+	AstNode *func = ast.data + jf->func_index;
+	uint32_t end = jf->func_index + (func+1)->data.funcnodeinfo.node_size;
+	for (uint32_t i=jf->func_index+2+func->count; i!=end; i+=ast_node_size(ast.data + i)){
+		if (ast.data[i].type != Ast_Identifier) continue;
+		NameId name_id = ast.data[i+1].data.name_id;
+		if (function_has_param(func, name_id)) continue;
+		uint32_t value = ast_info_stable_value(&global_jit.info, name_id);
+		if (ast.data[value].type != Ast_Function) continue;
+		uint32_t callee = ast.data[value+1].data.funcnodeinfo.meta;
+		if (callee == 0 || global_jit.funcs[callee].failed){
+			*failed = meta;
+			return false;
+		}
+		if (!jit_collect_batch(callee, batch, batch_size, failed)) return false;
+	}
+	return true;
+}
+
+// only the function whose body can't be compiled is rejected, the rest of
+// the batch is compiled again when one of its functions is called
+static void jit_compile(uint32_t meta){
+	uint32_t *batch = malloc(global_jit.func_count*sizeof(uint32_t));
+	assert(batch != NULL && "jit batch allocation failrule");
+	size_t batch_size = 0;
+	uint32_t failed = 0; // 0 rejects the whole batch
+	bool ok = jit_collect_batch(meta, batch, &batch_size, &failed);
+
+	// infer return types of mutually recursive functions
+	for (size_t i=0; i!=batch_size; i+=1) global_jit.funcs[batch[i]].ret_type = JT_Unknown;
+	for (bool changed=ok; changed;){
+		changed = false;
+		for (size_t i=0; ok && i!=batch_size; i+=1){
+			JitFunction *jf = global_jit.funcs + batch[i];
+			uint8_t t = jit_unify(jf->ret_type, jit_compile_body(batch[i], false));
+			if (t == JT_Error){
+				ok = false;
+				failed = batch[i];
+				break;
+			}
+			if (t != jf->ret_type){ jf->ret_type = t; changed = true; }
+		}
+	}
+	for (size_t i=0; ok && i!=batch_size; i+=1){
+		if (global_jit.funcs[batch[i]].ret_type == JT_Unknown){
+			ok = false;
+			failed = batch[i];
+		}
+	}
+
+	global_jit.buf.size = 0;
+	global_jit.patch_count = 0;
+	for (size_t i=0; ok && i!=batch_size; i+=1){
+		global_jit.funcs[batch[i]].batch_offset = global_jit.buf.size;
+		if (jit_compile_body(batch[i], true) == JT_Error){
+			ok = false;
+			failed = batch[i];
+		}
+	}
+
+	uint8_t *code = NULL;
+	if (ok){
+		size_t bailout_stub = global_jit.buf.size;
+		JIT_EMIT(0x49, 0xbb);                    // mov r11, imm64
+		jit_emit64((uint64_t)(uintptr_t)global_jit.bailout);
+		JIT_EMIT(0x41, 0xff, 0xe3);              // jmp r11
+		for (size_t i=0; i!=global_jit.patch_count; i+=1){
+			JitPatch p = global_jit.patches[i];
+			uint32_t target = p.target == 0 ? bailout_stub : global_jit.funcs[p.target].batch_offset;
+			jit_patch_rel32(p.site, target);
+		}
+		code = jit_place_code(global_jit.buf.data, global_jit.buf.size);
+		ok = code != NULL;
+	}
+
+	for (size_t i=0; i!=batch_size; i+=1){
+		JitFunction *jf = global_jit.funcs + batch[i];
+		jf->in_batch = false;
+		if (ok){
+			jf->code = code + jf->batch_offset;
+			global_jit.compiled += 1;
+		} else if (failed == 0 || failed == batch[i]){
+			jf->failed = true;
+			global_jit.failed += 1;
+		}
+	}
+	if (ok) global_jit.code_bytes += global_jit.buf.size;
+	free(batch);
+}
+
+
+
+// EXECUTION
+// returns false if the call has to be evaluated by the interpreter
+static bool jit_try_call(uint32_t meta, const PackedValue *params, size_t count, Value *res){
+	JitFunction *jf = global_jit.funcs + meta;
+	if (jf->code == NULL){
+		if (jf->failed) return false;
+		jf->calls += 1;
+		if (jf->calls < JIT_CALL_THRESHOLD) return false;
+		jit_compile(meta);
+		if (jf->code == NULL) return false;
+	}
+	if (jf->bailouts >= JIT_MAX_BAILOUTS || count > JIT_MAX_ARGS) return false;
+
+	int64_t args[JIT_MAX_ARGS];
+	for (size_t i=0; i!=count; i+=1){
+		if (value_packed_type(params[i]) != DT_Integer){
+			global_jit.guard_fails += 1;
+			return false;
+		}
+		args[i] = value_unpack(params[i]).data.integer;
+	}
+
+	int64_t result;
+	uint8_t *stack_top = (uint8_t *)global_jit.stack.data + global_jit.stack.size;
+	uint8_t *stack_limit = (uint8_t *)global_jit.stack.data + JIT_STACK_MARGIN;
+	if (global_jit.enter(jf->code, args, count, &result, stack_top, stack_limit) != 0){
+		global_jit.bailouts += 1;
+		jf->bailouts += 1;
+		return false;
+	}
+	global_jit.native_calls += 1;
+	if (jf->ret_type == JT_Bool){
+		*res = (Value){ .type = DT_Bool, .data.boolean = result != 0 };
+	} else{
+		*res = (Value){ .type = DT_Integer, .data.integer = result };
+	}
+	return true;
+}
+
+
+static void print_jit_stats(void){
+	printf("jit compiled    :%10zu\n", global_jit.compiled);
+	printf("jit rejected    :%10zu\n", global_jit.failed);
+	printf("jit native calls:%10zu\n", global_jit.native_calls);
+	printf("jit guard fails :%10zu\n", global_jit.guard_fails);
+	printf("jit bailouts    :%10zu\n", global_jit.bailouts);
+	printf("jit code size   :%10zu [B]\n\n", global_jit.code_bytes);
+}
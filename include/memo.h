@@ -0,0 +1,245 @@
+#pragma once
+
+#include "analysis.h"
+#include "value.h"
+#include "bigint.h"
+
+#ifndef MEMO_MAX_ARGS
+	#define MEMO_MAX_ARGS 4
+#endif
+
+#ifndef MEMO_PROBE_LIMIT
+	#define MEMO_PROBE_LIMIT 8
+#endif
+
+
+
+// MEMOIZATION CACHE
+// open addressed table with a bounded probe window, once the memory cap is
+// reached the table stops growing and the oldest entry of the window is evicted,
+// a big integer result is copied out of the evaluation's heap, the table owns
+// the copy and a hit copies it back, copies share the memory cap with the table
+typedef struct{
+	uint32_t func_index; // 0 marks an empty slot
+	uint32_t stamp;
+	uint8_t  arg_count;
+	uint8_t  arg_types[MEMO_MAX_ARGS];
+	uint8_t  res_type;
+	Data     args[MEMO_MAX_ARGS];
+	Data     result;
+} MemoEntry;
+
+typedef struct{
+	MemoEntry *data;
+	size_t capacity;
+	size_t max_capacity;
+	size_t size;
+	uint32_t stamp;
+	size_t big_bytes;     // of big integer results
+	size_t max_big_bytes;
+
+	size_t lookups;
+	size_t hits;
+	size_t inserts;
+	size_t evictions;
+} MemoTable;
+
+enum MemoResult{
+	Memo_Skip = 0, // call cannot be memoized
+	Memo_Miss,
+	Memo_Hit,
+};
+
+
+static _Thread_local MemoTable global_memo;
+
+static size_t memo_memory_cap = (size_t)64 << 20;
+
+
+static void memo_init(size_t memory_cap){
+	size_t max_capacity = 64;
+	while (2*max_capacity*sizeof(MemoEntry) <= memory_cap) max_capacity *= 2;
+	global_memo = (MemoTable){
+		.capacity = util_min_usize(1024, max_capacity),
+		.max_capacity = max_capacity,
+		.max_big_bytes = memory_cap,
+	};
+	global_memo.data = mem_calloc(global_memo.capacity, sizeof(MemoEntry));
+	assert(global_memo.data != NULL && "memo table allocation failrule");
+}
+
+static void memo_free_result(MemoTable *memo, MemoEntry *entry){
+	if (entry->func_index == 0 || entry->res_type != DT_BigInt) return;
+	BigInt *big = entry->result.ptr;
+	memo->big_bytes -= sizeof(BigInt) + big->size*sizeof(uint64_t);
+	mem_free(big);
+}
+
+static void memo_free(void){
+	for (size_t i=0; global_memo.data!=NULL && i!=global_memo.capacity; i+=1){
+		memo_free_result(&global_memo, global_memo.data + i);
+	}
+	mem_free(global_memo.data);
+	global_memo.data = NULL;
+}
+
+static bool memo_enabled(void){
+	return global_memo.data != NULL;
+}
+
+// booleans only define their lowest byte
+static uint64_t memo_key_bits(enum DataType type, Data data){
+	return type == DT_Bool ? (uint64_t)data.boolean : (uint64_t)data.integer;
+}
+
+static uint64_t memo_hash(uint32_t func_index, const Value *args, size_t arg_count){
+	uint64_t hash = func_index * 0x9e3779b97f4a7c15u;
+	for (size_t i=0; i!=arg_count; i+=1){
+		hash ^= memo_key_bits(args[i].type, args[i].data) + args[i].type;
+		hash *= 0xbf58476d1ce4e5b9u;
+		hash ^= hash >> 31;
+	}
+	return hash ^ (hash >> 29);
+}
+
+static bool memo_entry_matches(
+	const MemoEntry *entry, uint32_t func_index, const Value *args, size_t arg_count
+){
+	if (entry->func_index != func_index || entry->arg_count != arg_count) return false;
+	for (size_t i=0; i!=arg_count; i+=1){
+		if (entry->arg_types[i] != args[i].type) return false;
+		uint64_t key = memo_key_bits(args[i].type, args[i].data);
+		if (memo_key_bits(args[i].type, entry->args[i]) != key) return false;
+	}
+	return true;
+}
+
+// unpacks the arguments if all of them can be used as a key
+static bool memo_unpack_keys(const PackedValue *packed, size_t arg_count, Value *args){
+	if (arg_count > MEMO_MAX_ARGS) return false;
+	for (size_t i=0; i!=arg_count; i+=1){
+		enum DataType t = value_packed_type(packed[i]);
+		if (t != DT_Integer && t != DT_Real && t != DT_Bool) return false;
+		args[i] = value_unpack(packed[i]);
+	}
+	return true;
+}
+
+
+static enum MemoResult memo_lookup(
+	uint32_t func_index, const PackedValue *packed, size_t arg_count, Value *res
+){
+	Value args[MEMO_MAX_ARGS];
+	if (!memo_unpack_keys(packed, arg_count, args)) return Memo_Skip;
+	MemoTable *memo = &global_memo;
+	memo->lookups += 1;
+
+	size_t mask = memo->capacity - 1;
+	size_t index = memo_hash(func_index, args, arg_count) & mask;
+	for (size_t i=0; i!=MEMO_PROBE_LIMIT; i+=1){
+		MemoEntry *entry = memo->data + ((index + i) & mask);
+		if (entry->func_index == 0) break;
+		if (memo_entry_matches(entry, func_index, args, arg_count)){
+			memo->hits += 1;
+			*res = (Value){ .type = entry->res_type, .data = entry->result };
+			if (entry->res_type == DT_BigInt){
+				const BigInt *big = entry->result.ptr;
+				*res = bigint_make(big->limbs, big->size, big->negative);
+			}
+			return Memo_Hit;
+		}
+	}
+	return Memo_Miss;
+}
+
+
+static void memo_put(MemoTable *memo, MemoEntry new_entry, uint64_t hash){
+	size_t mask = memo->capacity - 1;
+	size_t index = hash & mask;
+	MemoEntry *oldest = memo->data + index;
+	for (size_t i=0; i!=MEMO_PROBE_LIMIT; i+=1){
+		MemoEntry *entry = memo->data + ((index + i) & mask);
+		if (entry->func_index == 0){
+			*entry = new_entry;
+			memo->size += 1;
+			return;
+		}
+		if (entry->stamp < oldest->stamp) oldest = entry;
+	}
+	memo_free_result(memo, oldest);
+	*oldest = new_entry;
+	memo->evictions += 1;
+}
+
+static void memo_grow(MemoTable *memo){
+	MemoEntry *old_data = memo->data;
+	size_t old_capacity = memo->capacity;
+	memo->capacity *= 2;
+	memo->data = mem_calloc(memo->capacity, sizeof(MemoEntry));
+	if (memo->data == NULL){
+		// keep working with the old table
+		memo->data = old_data;
+		memo->capacity = old_capacity;
+		memo->max_capacity = old_capacity;
+		return;
+	}
+	memo->size = 0;
+	for (size_t i=0; i!=old_capacity; i+=1){
+		MemoEntry entry = old_data[i];
+		if (entry.func_index == 0) continue;
+		Value args[MEMO_MAX_ARGS];
+		for (size_t j=0; j!=entry.arg_count; j+=1){
+			args[j] = (Value){ .type = entry.arg_types[j], .data = entry.args[j] };
+		}
+		memo_put(memo, entry, memo_hash(entry.func_index, args, entry.arg_count));
+	}
+	mem_free(old_data);
+}
+
+static void memo_insert(
+	uint32_t func_index, const PackedValue *packed, size_t arg_count, Value res
+){
+	if (res.type != DT_Integer && res.type != DT_Real && res.type != DT_Bool && res.type != DT_BigInt) return;
+	Value args[MEMO_MAX_ARGS];
+	if (!memo_unpack_keys(packed, arg_count, args)) return;
+	MemoTable *memo = &global_memo;
+	if (res.type == DT_BigInt){
+		const BigInt *big = res.data.ptr;
+		size_t bytes = sizeof(BigInt) + big->size*sizeof(uint64_t);
+		if (memo->big_bytes + bytes > memo->max_big_bytes) return;
+		BigInt *copy = mem_alloc(bytes);
+		if (copy == NULL) return;
+		memcpy(copy, big, bytes);
+		memo->big_bytes += bytes;
+		res.data.ptr = copy;
+	}
+	if (2*memo->size >= memo->capacity && memo->capacity < memo->max_capacity){
+		memo_grow(memo);
+	}
+	MemoEntry entry = {
+		.func_index = func_index,
+		.stamp      = memo->stamp,
+		.arg_count  = arg_count,
+		.res_type   = res.type,
+		.result     = res.data,
+	};
+	for (size_t i=0; i!=arg_count; i+=1){
+		entry.arg_types[i] = args[i].type;
+		entry.args[i] = args[i].data;
+	}
+	memo->stamp += 1;
+	memo->inserts += 1;
+	memo_put(memo, entry, memo_hash(func_index, args, arg_count));
+}
+
+
+static void print_memo_stats(void){
+	MemoTable memo = global_memo;
+	printf("memo lookups    :%10zu\n", memo.lookups);
+	printf("memo hits       :%10zu\n", memo.hits);
+	printf("memo hit rate   :%10.6lf\n", memo.lookups ? (double)memo.hits/(double)memo.lookups : 0.0);
+	printf("memo inserts    :%10zu\n", memo.inserts);
+	printf("memo evictions  :%10zu\n", memo.evictions);
+	printf("memo entries    :%10zu\n", memo.size);
+	printf("memo table size :%10zu [B]\n\n", memo.capacity*sizeof(MemoEntry));
+}
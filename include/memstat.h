@@ -0,0 +1,253 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include "utils.h"
+
+
+
+// MEMORY ACCOUNTING
+// arrays of the compiler, the name table, the input text, the evaluation
+// stacks and the heaps of values are allocated through these functions, which
+// count them into the current phase, blocks are measured by the allocator, so
+// freeing them doesn't need their size, stacks are counted by the address
+// space they reserve
+enum MemPhase{
+	MemPhase_Read,
+	MemPhase_Lex,
+	MemPhase_Parse,
+	MemPhase_Optimize,
+	MemPhase_Eval,
+	MemPhase_Count,
+};
+
+static const char *const MemPhaseNames[] = { "read", "lex", "parse", "optimize", "eval" };
+
+typedef struct{
+	_Atomic size_t allocated; // bytes
+	_Atomic size_t allocations;
+	_Atomic size_t grows;     // reallocations and tables that were made larger
+	_Atomic size_t copied;    // bytes moved by growing
+	_Atomic size_t peak;      // live bytes
+	_Atomic size_t peak_reserved;
+	// measured when the phase ends
+	size_t live;
+	size_t max_rss;
+	bool   done;
+} MemPhaseStats;
+
+static struct{
+	_Atomic size_t live;
+	_Atomic size_t peak;
+	_Atomic size_t reserved;
+	_Atomic size_t peak_reserved;
+	_Atomic int    phase;
+	MemPhaseStats  phases[MemPhase_Count];
+} global_mem;
+
+
+static void mem_max(_Atomic size_t *peak, size_t value){
+	size_t prev = atomic_load_explicit(peak, memory_order_relaxed);
+	while (prev < value && !atomic_compare_exchange_weak_explicit(
+		peak, &prev, value, memory_order_relaxed, memory_order_relaxed
+	));
+}
+
+static MemPhaseStats *mem_current_phase(void){
+	return global_mem.phases + atomic_load_explicit(&global_mem.phase, memory_order_relaxed);
+}
+
+static void mem_count_alloc(size_t size){
+	MemPhaseStats *phase = mem_current_phase();
+	atomic_fetch_add_explicit(&phase->allocated, size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&phase->allocations, 1, memory_order_relaxed);
+	size_t live = atomic_fetch_add_explicit(&global_mem.live, size, memory_order_relaxed) + size;
+	mem_max(&global_mem.peak, live);
+	mem_max(&phase->peak, live);
+}
+
+static void mem_count_free(size_t size){
+	atomic_fetch_sub_explicit(&global_mem.live, size, memory_order_relaxed);
+}
+
+// for blocks that are grown by allocating a new one and copying the old one
+static void mem_count_grow(size_t copied){
+	MemPhaseStats *phase = mem_current_phase();
+	atomic_fetch_add_explicit(&phase->grows, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&phase->copied, copied, memory_order_relaxed);
+}
+
+static void mem_count_reserve(size_t size){
+	size_t reserved = atomic_fetch_add_explicit(&global_mem.reserved, size, memory_order_relaxed) + size;
+	mem_max(&global_mem.peak_reserved, reserved);
+	mem_max(&mem_current_phase()->peak_reserved, reserved);
+}
+
+static void mem_count_unreserve(size_t size){
+	atomic_fetch_sub_explicit(&global_mem.reserved, size, memory_order_relaxed);
+}
+
+
+// ARENA
+// node arrays of one compilation are placed one after another in a block of
+// reserved address space, freeing them does nothing, the arena is reset when
+// the compilation ends and its pages are used again by the next one, the last
+// array grows in place, blocks have a header with their size for reallocation
+#define MEM_ARENA_ALIGN 16
+
+typedef struct{
+	uint8_t *data;
+	size_t   size;
+	size_t   used;
+	size_t   last; // header of the last block, or SIZE_MAX
+	size_t   resets;
+} MemArena;
+
+static _Thread_local MemArena *global_mem_arena = NULL;
+
+
+static bool mem_arena_owns(const void *ptr){
+	MemArena *arena = global_mem_arena;
+	return arena != NULL && arena->data <= (const uint8_t *)ptr && (const uint8_t *)ptr < arena->data + arena->size;
+}
+
+static size_t mem_arena_block_size(const void *ptr){
+	return *(const size_t *)((const uint8_t *)ptr - MEM_ARENA_ALIGN);
+}
+
+static void mem_arena_reset(MemArena *arena){
+	mem_count_free(arena->used);
+	arena->used = 0;
+	arena->last = SIZE_MAX;
+	arena->resets += 1;
+}
+
+
+static void *mem_alloc(size_t size){
+	void *res = malloc(size);
+	if (res != NULL) mem_count_alloc(malloc_usable_size(res));
+	return res;
+}
+
+// allocates from the thread's arena if there's one with enough space
+static void *mem_arena_alloc(size_t size){
+	MemArena *arena = global_mem_arena;
+	size_t bytes = MEM_ARENA_ALIGN + util_alignsize(size, MEM_ARENA_ALIGN);
+	if (arena == NULL || arena->size - arena->used < bytes) return mem_alloc(size);
+	uint8_t *header = arena->data + arena->used;
+	*(size_t *)header = size;
+	arena->last = arena->used;
+	arena->used += bytes;
+	mem_count_alloc(bytes);
+	return header + MEM_ARENA_ALIGN;
+}
+
+// the last block of the arena grows in place, others are copied
+static void *mem_arena_realloc(void *ptr, size_t size){
+	MemArena *arena = global_mem_arena;
+	uint8_t *header = (uint8_t *)ptr - MEM_ARENA_ALIGN;
+	size_t old_size = mem_arena_block_size(ptr);
+	size_t bytes = MEM_ARENA_ALIGN + util_alignsize(size, MEM_ARENA_ALIGN);
+	if (header == arena->data + arena->last && arena->size - arena->last >= bytes){
+		size_t old_bytes = arena->used - arena->last;
+		if (bytes > old_bytes) mem_count_alloc(bytes - old_bytes);
+		else mem_count_free(old_bytes - bytes);
+		arena->used = arena->last + bytes;
+		*(size_t *)header = size;
+		mem_count_grow(0);
+		return ptr;
+	}
+	void *res = mem_arena_alloc(size);
+	if (res == NULL) return NULL;
+	memcpy(res, ptr, util_min_usize(old_size, size));
+	mem_count_grow(util_min_usize(old_size, size));
+	return res;
+}
+
+static void *mem_calloc(size_t count, size_t size){
+	void *res = calloc(count, size);
+	if (res != NULL) mem_count_alloc(malloc_usable_size(res));
+	return res;
+}
+
+// a block that moved was copied whole
+static void *mem_realloc(void *ptr, size_t size){
+	if (ptr == NULL) return mem_alloc(size);
+	if (mem_arena_owns(ptr)) return mem_arena_realloc(ptr, size);
+	size_t old_size = malloc_usable_size(ptr);
+	void *res = realloc(ptr, size);
+	if (res == NULL) return NULL;
+	size_t new_size = malloc_usable_size(res);
+	mem_count_free(old_size);
+	mem_count_alloc(new_size);
+	mem_count_grow(res != ptr ? util_min_usize(old_size, new_size) : 0);
+	return res;
+}
+
+static void mem_free(void *ptr){
+	if (ptr == NULL || mem_arena_owns(ptr)) return;
+	mem_count_free(malloc_usable_size(ptr));
+	free(ptr);
+}
+
+
+static size_t mem_max_rss(void){
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+	return (size_t)usage.ru_maxrss << 10;
+}
+
+// ends the current phase, phases that are skipped keep no statistics
+static void mem_phase(enum MemPhase next){
+	MemPhaseStats *phase = mem_current_phase();
+	phase->live    = atomic_load(&global_mem.live);
+	phase->max_rss = mem_max_rss();
+	phase->done    = true;
+	if (next == MemPhase_Count) return;
+	atomic_store(&global_mem.phases[next].peak, atomic_load(&global_mem.live));
+	atomic_store(&global_mem.phases[next].peak_reserved, atomic_load(&global_mem.reserved));
+	atomic_store(&global_mem.phase, next);
+}
+
+
+static void print_mem_stats(void){
+	printf("\nmemory          :    allocated  allocations   grows       copied    peak live         live  peak reserved\n");
+	for (size_t i=0; i!=MemPhase_Count; i+=1){
+		MemPhaseStats *phase = global_mem.phases + i;
+		if (!phase->done) continue;
+		printf("  %-14s:%13zu %12zu %7zu %12zu %12zu %12zu %14zu [B]\n", MemPhaseNames[i],
+			atomic_load(&phase->allocated), atomic_load(&phase->allocations),
+			atomic_load(&phase->grows), atomic_load(&phase->copied),
+			atomic_load(&phase->peak), phase->live, atomic_load(&phase->peak_reserved)
+		);
+	}
+	printf("peak live       :%13zu [B]\n", atomic_load(&global_mem.peak));
+	printf("peak reserved   :%13zu [B]\n", atomic_load(&global_mem.peak_reserved));
+	if (global_mem_arena != NULL) printf("arena used      :%13zu [B]\n", global_mem_arena->used);
+	printf("max rss         :%13zu [B]\n", mem_max_rss());
+}
+
+// tab separated values, the first line names the fields
+static bool write_mem_stats(const char *path){
+	FILE *file = fopen(path, "w");
+	if (file == NULL) return false;
+	fprintf(file, "phase\tallocated\tallocations\tgrows\tcopied\tpeak_live\tlive\tpeak_reserved\tmax_rss\n");
+	for (size_t i=0; i!=MemPhase_Count; i+=1){
+		MemPhaseStats *phase = global_mem.phases + i;
+		if (!phase->done) continue;
+		fprintf(file, "%s\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\n", MemPhaseNames[i],
+			atomic_load(&phase->allocated), atomic_load(&phase->allocations),
+			atomic_load(&phase->grows), atomic_load(&phase->copied),
+			atomic_load(&phase->peak), phase->live, atomic_load(&phase->peak_reserved), phase->max_rss
+		);
+	}
+	bool res = ferror(file) == 0;
+	res &= fclose(file) == 0;
+	return res;
+}
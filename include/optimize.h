@@ -0,0 +1,488 @@
+#pragma once
+
+#include "analysis.h"
+#include "eval.h"
+
+#ifndef OPTIMIZE_MAX_PASSES
+	#define OPTIMIZE_MAX_PASSES 8
+#endif
+
+// results that don't fit into 64 bits become big integers, which can't be
+// written as literals, so bigger factorials and powers are left for the evaluator
+#define OPTIMIZE_MAX_FACTORIAL 20
+
+
+
+// AST OPTIMIZATION
+// passes work in place on postfix nodes, removed nodes are first replaced
+// with nops and then squeezed out while jump offsets are recomputed
+typedef struct{
+	size_t passes;
+	size_t folded;
+	size_t propagated;
+	size_t branches;
+	size_t eliminated; // nodes of definitions that nothing used
+} OptimizeStats;
+
+
+static void ast_fill_nops(AstArray ast, size_t begin, size_t end){
+	for (size_t i=begin; i!=end; i+=1){
+		ast.data[i] = (AstNode){ .type = Ast_Nop, .pos = ast.data[i].pos };
+	}
+}
+
+static Value literal_value(const AstNode *node){
+	switch (node->type){
+	case Ast_Integer: return (Value){ .type = DT_Integer, .data = (node+1)->data };
+	case Ast_Real:    return (Value){ .type = DT_Real,    .data = (node+1)->data };
+	case Ast_True:    return (Value){ .type = DT_Bool,    .data.boolean = true };
+	case Ast_False:   return (Value){ .type = DT_Bool,    .data.boolean = false };
+	default:          return (Value){ .type = DT_Null };
+	}
+}
+
+// writes the value as a literal and fills the rest of the range with nops
+static bool ast_write_literal(AstArray ast, size_t begin, size_t end, Value value){
+	uint32_t pos = ast.data[begin].pos;
+	size_t size = value.type == DT_Bool ? 1 : 2;
+	if (end - begin < size) return false;
+	switch (value.type){
+	case DT_Integer:
+		ast.data[begin] = (AstNode){ .type = Ast_Integer, .pos = pos };
+		ast.data[begin+1].data = value.data;
+		break;
+	case DT_Real:
+		ast.data[begin] = (AstNode){ .type = Ast_Real, .pos = pos };
+		ast.data[begin+1].data = value.data;
+		break;
+	case DT_Bool:
+		ast.data[begin] = (AstNode){ .type = value.data.boolean ? Ast_True : Ast_False, .pos = pos };
+		break;
+	default: return false;
+	}
+	ast_fill_nops(ast, begin+size, end);
+	return true;
+}
+
+
+
+// CONSTANT FOLDING
+// in postfix order an operator's last operand is the node right before it,
+// and when that is a literal the node before it is the previous operand, but
+// only if no jump lands between them
+// checked before evaluating, a big integer result would be thrown away
+static bool fold_int_overflows(AstNode node, Value lhs, Value rhs){
+	if (lhs.type != DT_Integer || rhs.type != DT_Integer) return false;
+	int64_t x = lhs.data.integer, e = rhs.data.integer, res;
+	switch (node.type){
+	case Ast_Multiply: return __builtin_mul_overflow(x, e, &res);
+	case Ast_Power:
+		if (e <= 0 || x == 0 || x == 1 || x == -1) return false;
+		// |x| >= 2, so more than 63 factors overflow anyway
+		if (e > 63) return true;
+		res = 1;
+		for (int64_t i=0; i!=e; i+=1){
+			if (__builtin_mul_overflow(res, x, &res)) return true;
+		}
+		return false;
+	default: return false;
+	}
+}
+
+static size_t fold_constants(AstArray ast, const uint8_t *jump_targets){
+	size_t res = 0;
+	uint32_t *prevs = mem_alloc((ast.end - ast.data)*sizeof(uint32_t));
+	assert(prevs != NULL && "optimizer allocation failrule");
+	size_t prev_count = 0;
+
+	for (uint32_t i=1;;){
+		AstNode node = ast.data[i];
+		size_t size = ast_node_size(ast.data + i);
+		if (node.type == Ast_Terminator) break;
+		if (node.type == Ast_Nop){ i += size; continue; }
+
+		switch (node.type){
+		case Ast_Minus:
+		case Ast_AbsValue:
+		case Ast_LogicNot:
+		case Ast_Factorial:{
+			if (prev_count < 1 || jump_targets[i]) break;
+			uint32_t p1 = prevs[prev_count-1];
+			Value arg = literal_value(ast.data + p1);
+			if (arg.type == DT_Null) break;
+			if (
+				node.type == Ast_Factorial && arg.type == DT_Integer &&
+				arg.data.integer > OPTIMIZE_MAX_FACTORIAL
+			) break;
+			Value value;
+			if (eval_unary_op(node, arg, &value) != NULL) break;
+			if (!ast_write_literal(ast, p1, i+size, value)) break;
+			res += 1;
+			i += size;
+			continue;
+		}
+		case Ast_Add:
+		case Ast_Subtract:
+		case Ast_Multiply:
+		case Ast_Divide:
+		case Ast_LogicOr:
+		case Ast_LogicAnd:
+		case Ast_Less:
+		case Ast_Greater:
+		case Ast_Equal:
+		case Ast_Power:{
+			if (prev_count < 2 || jump_targets[i]) break;
+			uint32_t p1 = prevs[prev_count-1];
+			uint32_t p2 = prevs[prev_count-2];
+			if (jump_targets[p1]) break;
+			Value lhs = literal_value(ast.data + p2);
+			Value rhs = literal_value(ast.data + p1);
+			if (lhs.type == DT_Null || rhs.type == DT_Null) break;
+			if (fold_int_overflows(node, lhs, rhs)) break;
+			Value value;
+			if (eval_binary_op(node, lhs, rhs, &value) != NULL) break;
+			if (!ast_write_literal(ast, p2, i+size, value)) break;
+			prev_count -= 1;
+			res += 1;
+			i += size;
+			continue;
+		}
+		default: break;
+		}
+		prevs[prev_count] = i; prev_count += 1;
+		i += size;
+	}
+	mem_free(prevs);
+	return res;
+}
+
+
+
+// CONSTANT PROPAGATION
+// replaces uses of top level names that are bound to a literal exactly once,
+// only uses after the binding are replaced, earlier ones would fail at runtime,
+// inside of functions the name also cannot be shadowed by any parameter
+static size_t propagate_constants(AstArray ast, const AstInfo *info){
+	size_t res = 0;
+	uint32_t func_end = 0; // end of the outermost function containing current node
+	for (uint32_t i=1;;){
+		AstNode node = ast.data[i];
+		if (node.type == Ast_Terminator) break;
+		if (node.type == Ast_Function && i >= func_end){
+			func_end = i + ast.data[i+1].data.funcnodeinfo.node_size;
+		}
+		if (node.type == Ast_Identifier){
+			NameId name_id = ast.data[i+1].data.name_id;
+			uint32_t value = i < func_end
+				? ast_info_stable_value(info, name_id)
+				: ast_info_global_value(info, name_id);
+			if (value != 0 && value < i && ast_is_literal(ast.data[value].type)){
+				ast_write_literal(ast, i, i+2, literal_value(ast.data + value));
+				res += 1;
+			}
+		}
+		i += ast_node_size(ast.data + i);
+	}
+	return res;
+}
+
+
+
+// BRANCH ELIMINATION
+// conditionals with a literal condition keep only the branch that is taken
+static size_t simplify_conditionals(AstArray ast, const uint8_t *jump_targets){
+	size_t res = 0;
+	uint32_t prev = 0;
+	for (uint32_t i=1;;){
+		AstNode node = ast.data[i];
+		if (node.type == Ast_Terminator) break;
+		if (node.type == Ast_Nop){ i += 1; continue; }
+
+		AstNode cond = ast.data[prev];
+		if (
+			node.type == Ast_Conditional && prev != 0 &&
+			(cond.type == Ast_True || cond.type == Ast_False) &&
+			!jump_targets[i] && !jump_targets[prev]
+		){
+			uint32_t jump = i + node.count;
+			uint32_t end = jump + 1 + ast.data[jump].pos;
+			ast_fill_nops(ast, prev, i+1);
+			if (cond.type == Ast_True){
+				ast_fill_nops(ast, jump, end);
+			} else{
+				ast_fill_nops(ast, i, jump+1);
+			}
+			res += 1;
+			prev = 0;
+			i += 1;
+			continue;
+		}
+		prev = i;
+		i += ast_node_size(ast.data + i);
+	}
+	return res;
+}
+
+
+
+// DEAD DEFINITION ELIMINATION
+// a statement that only binds a literal or a function to a name shows nothing,
+// every other statement is a root, names used by a live statement make all of
+// their definitions live, uses inside of a function body count wherever the
+// function is, because names are looked up where it's called
+typedef struct{
+	uint32_t start;
+	uint32_t stop;     // after the semicolon
+	uint32_t uses_begin;
+	uint32_t uses_end;
+	uint32_t nodes;
+	NameId   name;     // bound name of a definition, 0 for roots
+	uint32_t next_def; // earlier definition of the same name + 1
+} DeadStatement;
+
+// returns the name that the statement binds if that is all it does, 0 otherwise
+static NameId statement_definition(AstArray ast, uint32_t start, uint32_t semicolon){
+	AstNode node = ast.data[start];
+	uint32_t value_end;
+	if (node.type == Ast_Function){
+		value_end = start + 1 + ast.data[start+1].data.funcnodeinfo.node_size;
+	} else if (ast_is_literal(node.type) || node.type == Ast_String){
+		value_end = start + AstNodeSizes[node.type];
+	} else{
+		return 0;
+	}
+	if (value_end + 2 != semicolon || ast.data[value_end].type != Ast_Variable) return 0;
+	return ast.data[value_end+1].data.name_id;
+}
+
+static void dead_mark_uses(const DeadStatement *st, const NameId *uses, uint8_t *live, NameId *work, size_t *work_count){
+	for (uint32_t i=st->uses_begin; i!=st->uses_end; i+=1){
+		NameId name = uses[i];
+		if (live[name]) continue;
+		live[name] = 1;
+		work[*work_count] = name;
+		*work_count += 1;
+	}
+}
+
+static void dead_push_use(NameId **uses, size_t *count, size_t *capacity, NameId name){
+	if (*count == *capacity){
+		*capacity *= 2;
+		*uses = mem_realloc(*uses, *capacity*sizeof(NameId));
+		assert(*uses != NULL && "optimizer allocation failrule");
+	}
+	(*uses)[*count] = name;
+	*count += 1;
+}
+
+// moves live statements together and sets the number of nodes that were removed,
+// a semicolon inside of a conditional doesn't end a statement, so no jump crosses
+// a removed statement and offsets inside of the kept ones stay valid
+static AstArray eliminate_dead_definitions(AstArray ast, size_t *eliminated){
+	size_t name_count = global_names.size + 1;
+	size_t stmt_capacity = 64, use_capacity = 64;
+	DeadStatement *stmts = mem_alloc(stmt_capacity*sizeof(DeadStatement));
+	NameId *uses = mem_alloc(use_capacity*sizeof(NameId));
+	uint32_t *last_def = mem_calloc(name_count, sizeof(uint32_t)); // statement index + 1
+	uint8_t *live = mem_calloc(name_count, 1);
+	NameId *work = mem_alloc(name_count*sizeof(NameId));
+	assert(stmts && uses && last_def && live && work && "optimizer allocation failrule");
+	size_t stmt_count = 0, use_count = 0, work_count = 0;
+
+	DeadStatement curr = { .start = 1 };
+	uint32_t cond_end = 0; // end of the outermost conditional around the node
+	for (uint32_t i=1;;){
+		AstNode node = ast.data[i];
+		if (node.type == Ast_Function){
+			uint32_t end = i + 1 + ast.data[i+1].data.funcnodeinfo.node_size;
+			for (uint32_t j=i; j!=end; j+=ast_node_size(ast.data + j)){
+				curr.nodes += 1;
+				if (ast.data[j].type != Ast_Identifier) continue;
+				dead_push_use(&uses, &use_count, &use_capacity, ast.data[j+1].data.name_id);
+			}
+			i = end;
+			continue;
+		}
+		curr.nodes += 1;
+		if (node.type == Ast_Identifier){
+			dead_push_use(&uses, &use_count, &use_capacity, ast.data[i+1].data.name_id);
+		}
+		if (node.type == Ast_Conditional){
+			uint32_t jump = i + node.count;
+			cond_end = util_max_u32(cond_end, jump + 1 + ast.data[jump].pos);
+		}
+		if ((node.type == Ast_Semicolon && i >= cond_end) || node.type == Ast_Terminator){
+			curr.stop = i + 1;
+			curr.uses_end = use_count;
+			// the last statement has no semicolon, its value is shown
+			if (node.type == Ast_Semicolon) curr.name = statement_definition(ast, curr.start, i);
+			if (curr.name != 0){
+				curr.next_def = last_def[curr.name];
+				last_def[curr.name] = stmt_count + 1;
+			}
+			if (stmt_count == stmt_capacity){
+				stmt_capacity *= 2;
+				stmts = mem_realloc(stmts, stmt_capacity*sizeof(DeadStatement));
+				assert(stmts != NULL && "optimizer allocation failrule");
+			}
+			stmts[stmt_count] = curr; stmt_count += 1;
+			if (node.type == Ast_Terminator) break;
+			curr = (DeadStatement){ .start = i + 1, .uses_begin = use_count };
+		}
+		i += ast_node_size(ast.data + i);
+	}
+
+	for (size_t s=0; s!=stmt_count; s+=1){
+		if (stmts[s].name == 0) dead_mark_uses(stmts + s, uses, live, work, &work_count);
+	}
+	while (work_count != 0){
+		work_count -= 1;
+		NameId name = work[work_count];
+		for (uint32_t d=last_def[name]; d!=0; d=stmts[d-1].next_def){
+			dead_mark_uses(stmts + d - 1, uses, live, work, &work_count);
+		}
+	}
+
+	// the last statement ends with the terminator and is always kept
+	*eliminated = 0;
+	uint32_t dest = 1;
+	for (size_t s=0; s!=stmt_count; s+=1){
+		DeadStatement st = stmts[s];
+		if (st.name != 0 && !live[st.name]){
+			*eliminated += st.nodes;
+			continue;
+		}
+		if (dest != st.start) memmove(ast.data + dest, ast.data + st.start, (st.stop - st.start)*sizeof(AstNode));
+		dest += st.stop - st.start;
+	}
+	ast.end = ast.data + dest - 1;
+	mem_free(stmts);
+	mem_free(uses);
+	mem_free(last_def);
+	mem_free(live);
+	mem_free(work);
+	return ast;
+}
+
+
+
+// NOP REMOVAL
+static AstArray remove_nops(AstArray ast){
+	size_t size = ast.end - ast.data + 1;
+	uint32_t *new_index = mem_alloc(size*sizeof(uint32_t));
+	assert(new_index != NULL && "optimizer allocation failrule");
+
+	// removed nodes map to the next node that is kept
+	uint32_t new_i = 1;
+	for (uint32_t i=1;;){
+		AstNode node = ast.data[i];
+		new_index[i] = new_i;
+		if (node.type == Ast_Terminator) break;
+		size_t node_size = ast_node_size(ast.data + i);
+		if (node.type != Ast_Nop) new_i += node_size;
+		i += node_size;
+	}
+
+	for (uint32_t i=1;;){
+		AstNode node = ast.data[i];
+		size_t node_size = ast_node_size(ast.data + i);
+		uint32_t dest = new_index[i];
+		switch (node.type){
+		case Ast_Nop: i += 1; continue;
+		case Ast_Conditional:
+			node.count = new_index[i + 1 + node.count] - (dest + 1);
+			break;
+		case Ast_Jump:
+			node.pos = new_index[i + 1 + node.pos] - (dest + 1);
+			break;
+		case Ast_Function:{
+			uint32_t end = i + ast.data[i+1].data.funcnodeinfo.node_size;
+			ast.data[i+1].data.funcnodeinfo.node_size = new_index[end] - dest;
+			break;
+		}
+		default: break;
+		}
+		memmove(ast.data + dest + 1, ast.data + i + 1, (node_size-1)*sizeof(AstNode));
+		ast.data[dest] = node;
+		if (node.type == Ast_Terminator){
+			ast.end = ast.data + dest;
+			break;
+		}
+		i += node_size;
+	}
+	mem_free(new_index);
+	return ast;
+}
+
+
+
+// CANDIDATE SCAN
+// every pass needs literals right before the node that it changes, an operator
+// after literal operands, a binding of a literal or a conditional after one,
+// one scan without any tables finds out if a pass could change anything
+static bool ast_has_candidates(AstArray ast){
+	uint32_t p1 = 0, p2 = 0; // last two nodes that aren't nops
+	for (uint32_t i=1;;){
+		AstNode node = ast.data[i];
+		if (node.type == Ast_Terminator) return false;
+		if (node.type == Ast_Nop){ i += 1; continue; }
+
+		bool literal1 = p1 != 0 && ast_is_literal(ast.data[p1].type);
+		bool literal2 = p2 != 0 && ast_is_literal(ast.data[p2].type);
+		switch (node.type){
+		case Ast_Minus:
+		case Ast_AbsValue:
+		case Ast_LogicNot:
+		case Ast_Factorial:
+		case Ast_Variable:
+		case Ast_Conditional:
+			if (literal1) return true;
+			break;
+		case Ast_Add:
+		case Ast_Subtract:
+		case Ast_Multiply:
+		case Ast_Divide:
+		case Ast_LogicOr:
+		case Ast_LogicAnd:
+		case Ast_Less:
+		case Ast_Greater:
+		case Ast_Equal:
+		case Ast_Power:
+			if (literal1 && literal2) return true;
+			break;
+		default: break;
+		}
+		p2 = p1;
+		p1 = i;
+		i += ast_node_size(ast.data + i);
+	}
+}
+
+
+
+static AstArray optimize_ast(AstArray ast, OptimizeStats *stats){
+	*stats = (OptimizeStats){0};
+	for (size_t pass=0; pass!=OPTIMIZE_MAX_PASSES; pass+=1){
+		if (!ast_has_candidates(ast)) break;
+		AstInfo info = ast_info_new(ast);
+		size_t folded = fold_constants(ast, info.jump_targets);
+		size_t propagated = propagate_constants(ast, &info);
+		// folding and propagation never remove jump targets
+		size_t branches = simplify_conditionals(ast, info.jump_targets);
+		ast_info_free(&info);
+
+		stats->passes     += 1;
+		stats->folded     += folded;
+		stats->propagated += propagated;
+		stats->branches   += branches;
+		if (folded + propagated + branches == 0) break;
+		ast = remove_nops(ast);
+	}
+	return ast;
+}
+
+// the program has to be complete, a batch function or a daemon request
+// could use names that the program itself doesn't
+static AstArray remove_dead_definitions(AstArray ast, OptimizeStats *stats){
+	return eliminate_dead_definitions(ast, &stats->eliminated);
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include "format.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifndef OUTPUT_BUFFER_SIZE
+	#define OUTPUT_BUFFER_SIZE ((size_t)1 << 20)
+#endif
+
+
+
+// BUFFERED OUTPUT
+// results are formatted straight into a large buffer that is written out when
+// it fills up or when evaluation ends, with an output thread the full buffer
+// is handed over and evaluation continues in a second one, a captured output
+// is collected in memory instead, so it can be written later in a given order
+typedef struct{
+	char  *data;
+	size_t size;
+	int    fd;
+
+	bool   capture;
+	char  *captured;
+	size_t captured_size;
+	size_t captured_capacity;
+
+	bool            threaded;
+	pthread_t       thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	char  *spare;        // buffer that the thread writes, then reused
+	size_t pending_size; // bytes of spare buffer waiting to be written, 0 if idle
+	bool   stop;
+
+	size_t bytes;
+	size_t writes;
+} OutputBuffer;
+
+static _Thread_local OutputBuffer global_output;
+
+
+static void output_write_all(int fd, const char *data, size_t size){
+	while (size != 0){
+		ssize_t written = write(fd, data, size);
+		if (written < 0){
+			if (errno == EINTR) continue;
+			return; // nothing useful can be done when output is closed
+		}
+		data += written;
+		size -= written;
+	}
+}
+
+static void output_sink(OutputBuffer *out, const char *data, size_t size){
+	if (out->fd < 0 && !out->capture) return;
+	if (!out->capture){
+		output_write_all(out->fd, data, size);
+		return;
+	}
+	if (out->captured_capacity - out->captured_size < size){
+		out->captured_capacity = util_max_usize(2*out->captured_capacity, out->captured_size + size);
+		out->captured = realloc(out->captured, out->captured_capacity);
+		assert(out->captured != NULL && "output allocation failrule");
+	}
+	memcpy(out->captured + out->captured_size, data, size);
+	out->captured_size += size;
+}
+
+static void *output_thread_main(void *arg){
+	OutputBuffer *out = arg;
+	pthread_mutex_lock(&out->mutex);
+	for (;;){
+		while (out->pending_size == 0 && !out->stop) pthread_cond_wait(&out->cond, &out->mutex);
+		if (out->pending_size == 0) break;
+		size_t size = out->pending_size;
+		pthread_mutex_unlock(&out->mutex);
+		output_write_all(out->fd, out->spare, size);
+		pthread_mutex_lock(&out->mutex);
+		out->pending_size = 0;
+		pthread_cond_broadcast(&out->cond);
+	}
+	pthread_mutex_unlock(&out->mutex);
+	return NULL;
+}
+
+static void output_init(int fd, bool threaded){
+	OutputBuffer *out = &global_output;
+	// anything printed through stdio before has to come first
+	fflush(stdout);
+	*out = (OutputBuffer){ .fd = fd };
+	out->data = malloc(OUTPUT_BUFFER_SIZE);
+	assert(out->data != NULL && "output buffer allocation failrule");
+	// tables are shared by all threads, so they are made before any starts
+	format_init_tables();
+	if (!threaded) return;
+
+	out->spare = malloc(OUTPUT_BUFFER_SIZE);
+	if (out->spare == NULL) return;
+	pthread_mutex_init(&out->mutex, NULL);
+	pthread_cond_init(&out->cond, NULL);
+	if (pthread_create(&out->thread, NULL, output_thread_main, out) != 0){
+		pthread_mutex_destroy(&out->mutex);
+		pthread_cond_destroy(&out->cond);
+		free(out->spare);
+		out->spare = NULL;
+		return;
+	}
+	out->threaded = true;
+}
+
+static void output_flush(void){
+	OutputBuffer *out = &global_output;
+	if (out->size == 0) return;
+	out->bytes += out->size;
+	out->writes += 1;
+	if (!out->threaded){
+		output_sink(out, out->data, out->size);
+		out->size = 0;
+		return;
+	}
+	pthread_mutex_lock(&out->mutex);
+	while (out->pending_size != 0) pthread_cond_wait(&out->cond, &out->mutex);
+	char *full = out->data;
+	out->data = out->spare;
+	out->spare = full;
+	out->pending_size = out->size;
+	pthread_cond_broadcast(&out->cond);
+	pthread_mutex_unlock(&out->mutex);
+	out->size = 0;
+}
+
+// output of the calling thread is kept until it is taken by output_take
+static void output_init_capture(void){
+	OutputBuffer *out = &global_output;
+	*out = (OutputBuffer){ .fd = -1, .capture = true };
+	out->data = malloc(OUTPUT_BUFFER_SIZE);
+	assert(out->data != NULL && "output buffer allocation failrule");
+}
+
+// output of the calling thread is dropped until output_finish
+static void output_init_discard(void){
+	OutputBuffer *out = &global_output;
+	*out = (OutputBuffer){ .fd = -1 };
+	out->data = malloc(OUTPUT_BUFFER_SIZE);
+	assert(out->data != NULL && "output buffer allocation failrule");
+}
+
+// returns everything captured so far, the caller frees it
+static char *output_take(size_t *size){
+	OutputBuffer *out = &global_output;
+	output_flush();
+	char *res = out->captured;
+	*size = out->captured_size;
+	out->captured = NULL;
+	out->captured_size = 0;
+	out->captured_capacity = 0;
+	return res;
+}
+
+// writes everything and stops the output thread
+static void output_finish(void){
+	OutputBuffer *out = &global_output;
+	output_flush();
+	if (out->threaded){
+		pthread_mutex_lock(&out->mutex);
+		out->stop = true;
+		pthread_cond_broadcast(&out->cond);
+		pthread_mutex_unlock(&out->mutex);
+		pthread_join(out->thread, NULL);
+		pthread_mutex_destroy(&out->mutex);
+		pthread_cond_destroy(&out->cond);
+		free(out->spare);
+		out->spare = NULL;
+		out->threaded = false;
+	}
+	free(out->data);
+	free(out->captured);
+	out->data = NULL;
+	out->captured = NULL;
+}
+
+
+// returns space for at least size bytes
+static inline char *output_reserve(size_t size){
+	if (OUTPUT_BUFFER_SIZE - global_output.size < size) output_flush();
+	return global_output.data + global_output.size;
+}
+
+static inline void output_commit(size_t size){
+	global_output.size += size;
+}
+
+static void output_bytes(const char *data, size_t size){
+	if (size > OUTPUT_BUFFER_SIZE){
+		output_flush();
+		// the thread may still be writing earlier output
+		if (global_output.threaded){
+			pthread_mutex_lock(&global_output.mutex);
+			while (global_output.pending_size != 0)
+				pthread_cond_wait(&global_output.cond, &global_output.mutex);
+			pthread_mutex_unlock(&global_output.mutex);
+		}
+		output_sink(&global_output, data, size);
+		global_output.bytes += size;
+		return;
+	}
+	memcpy(output_reserve(size), data, size);
+	output_commit(size);
+}
+
+static inline void output_char(char c){
+	*output_reserve(1) = c;
+	output_commit(1);
+}
+
+static inline void output_i64(int64_t n){
+	output_commit(format_i64(output_reserve(FORMAT_MAX_NUMBER), n));
+}
+
+static inline void output_f64(double x){
+	output_commit(format_f64(output_reserve(FORMAT_MAX_NUMBER), x));
+}
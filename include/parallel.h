@@ -0,0 +1,458 @@
+#pragma once
+
+#include "eval.h"
+#include "workpool.h"
+
+
+
+// PARALLEL STATEMENTS
+// independent top level statements are evaluated at the same time, a statement
+// depends on the last earlier definition of every name it uses and, because
+// functions look names up where they are called, on the definitions of names
+// used by those definitions, each statement runs with just these variables,
+// outputs are collected and written in source order, so they don't differ
+// from sequential evaluation
+typedef struct{
+	NameId   name;
+	uint32_t def; // statement that defines the name
+} ParBinding;
+
+typedef struct ParProgram ParProgram;
+
+typedef struct{
+	PoolTask    task;
+	ParProgram *program;
+	uint32_t index;
+	uint32_t start;
+	uint32_t stop;      // node after the statement's semicolon
+	NameId   def_name;  // 0 if the statement doesn't define a variable
+	uint32_t uses_begin,  uses_count;  // names used anywhere in the statement
+	uint32_t binds_begin, binds_count; // variables the statement can reach
+	uint32_t users_begin, users_count; // statements that wait for this one
+	_Atomic uint32_t pending;          // definitions that weren't evaluated yet
+
+	EvalError   error;
+	bool        skipped; // an earlier statement failed
+	PackedValue def_value;
+	char       *output;
+	size_t      output_size;
+	_Atomic bool done;
+} ParStatement;
+
+// counters of evaluation threads are added to the ones of the main thread
+typedef struct{
+	size_t boxed;
+	size_t bigints, bigint_bytes;
+	size_t arrays, array_bytes;
+	size_t strings, string_bytes;
+	size_t tables, table_lookups, table_probes;
+	size_t memo_lookups, memo_hits, memo_inserts, memo_evictions;
+} ParStats;
+
+struct ParProgram{
+	AstArray nodes;
+	ParStatement *stmts;
+	size_t        stmt_count;
+	NameId     *uses;
+	ParBinding *binds;
+	uint32_t   *users;
+
+	WorkPool pool;
+	bool     memoize;
+	_Atomic uint32_t first_error; // index of the first failed statement
+	pthread_mutex_t  mutex;       // guards finished statements and stats
+	pthread_cond_t   cond;
+	pthread_barrier_t exit_barrier;
+	ParStats stats;
+};
+
+
+// appends to a malloced array that doubles when it is full
+#define PAR_PUSH(arr, count, capacity, item) do{ \
+		if ((count) == (capacity)){ \
+			(capacity) = util_max_usize(64, 2*(capacity)); \
+			(arr) = realloc((arr), (capacity)*sizeof(*(arr))); \
+			assert((arr) != NULL && "parallel evaluation allocation failrule"); \
+		} \
+		(arr)[(count)] = (item); \
+		(count) += 1; \
+	} while (0)
+
+
+
+// DEPENDENCIES
+// returns false if the program can't be split, that is when it defines
+// a variable anywhere else than at the end of a statement
+static bool par_split(ParProgram *prog){
+	const AstNode *data = prog->nodes.data;
+	size_t stmt_capacity = 0, use_count = 0, use_capacity = 0;
+	ParStatement curr = { .start = 1 };
+	for (size_t i=1;;){
+		AstNode node = data[i];
+		switch (node.type){
+		case Ast_Terminator:
+			// last statement without a semicolon runs to the end
+			if (i != curr.start){
+				curr.uses_count = use_count - curr.uses_begin;
+				curr.index = prog->stmt_count;
+				PAR_PUSH(prog->stmts, prog->stmt_count, stmt_capacity, curr);
+			}
+			return true;
+		case Ast_Function:{
+			// names in function bodies are looked up wherever they are called
+			size_t end = i + 1 + data[i+1].data.funcnodeinfo.node_size;
+			for (size_t j=i+AstNodeSizes[Ast_Function]+node.count; j<end;){
+				AstNode inner = data[j];
+				if (inner.type == Ast_Identifier)
+					PAR_PUSH(prog->uses, use_count, use_capacity, data[j+1].data.name_id);
+				j += AstNodeSizes[inner.type] + (inner.type == Ast_Function ? inner.count : 0);
+			}
+			i = end;
+			continue;
+		}
+		case Ast_Identifier:
+			PAR_PUSH(prog->uses, use_count, use_capacity, data[i+1].data.name_id);
+			break;
+		case Ast_Variable:
+			if (data[i+2].type != Ast_Semicolon) return false;
+			curr.def_name = data[i+1].data.name_id;
+			break;
+		case Ast_Semicolon:
+			curr.stop = i + 1;
+			curr.uses_count = use_count - curr.uses_begin;
+			curr.index = prog->stmt_count;
+			PAR_PUSH(prog->stmts, prog->stmt_count, stmt_capacity, curr);
+			curr = (ParStatement){ .start = i + 1, .uses_begin = use_count };
+			break;
+		default: break;
+		}
+		i += AstNodeSizes[node.type];
+	}
+}
+
+// finds the variables every statement can reach and the statements it waits for
+static void par_link(ParProgram *prog){
+	size_t name_count = global_names.size;
+	uint32_t *last_def   = calloc(name_count, sizeof(uint32_t)); // statement index + 1
+	uint32_t *name_stamp = calloc(name_count, sizeof(uint32_t));
+	uint32_t *def_stamp  = calloc(prog->stmt_count, sizeof(uint32_t));
+	uint32_t *user_count = calloc(prog->stmt_count + 1, sizeof(uint32_t));
+	assert(last_def && name_stamp && def_stamp && user_count && "parallel evaluation allocation failrule");
+	NameId *work = NULL;
+	size_t work_count = 0, work_capacity = 0;
+	size_t bind_count = 0, bind_capacity = 0;
+
+	for (size_t s=0; s!=prog->stmt_count; s+=1){
+		ParStatement *st = prog->stmts + s;
+		uint32_t stamp = s + 1;
+		st->binds_begin = bind_count;
+		for (size_t i=0; i!=st->uses_count; i+=1)
+			PAR_PUSH(work, work_count, work_capacity, prog->uses[st->uses_begin + i]);
+		while (work_count != 0){
+			work_count -= 1;
+			NameId name = work[work_count];
+			if (name_stamp[name] == stamp) continue;
+			name_stamp[name] = stamp;
+			if (last_def[name] == 0) continue; // builtin or not defined yet
+			uint32_t def = last_def[name] - 1;
+			PAR_PUSH(prog->binds, bind_count, bind_capacity, ((ParBinding){ name, def }));
+			if (def_stamp[def] == stamp) continue;
+			def_stamp[def] = stamp;
+			user_count[def] += 1;
+			atomic_fetch_add(&st->pending, 1);
+			const ParStatement *d = prog->stmts + def;
+			for (size_t i=0; i!=d->uses_count; i+=1)
+				PAR_PUSH(work, work_count, work_capacity, prog->uses[d->uses_begin + i]);
+		}
+		st->binds_count = bind_count - st->binds_begin;
+		if (st->def_name != 0) last_def[st->def_name] = s + 1;
+	}
+
+	// users are grouped by the statement they wait for
+	size_t total = 0;
+	for (size_t s=0; s!=prog->stmt_count; s+=1){
+		prog->stmts[s].users_begin = total;
+		total += user_count[s];
+	}
+	prog->users = malloc(util_max_usize(total, 1)*sizeof(uint32_t));
+	assert(prog->users != NULL && "parallel evaluation allocation failrule");
+	memset(def_stamp, 0, prog->stmt_count*sizeof(uint32_t));
+	for (size_t s=0; s!=prog->stmt_count; s+=1){
+		const ParStatement *st = prog->stmts + s;
+		for (size_t i=0; i!=st->binds_count; i+=1){
+			uint32_t def = prog->binds[st->binds_begin + i].def;
+			if (def_stamp[def] == s + 1) continue;
+			def_stamp[def] = s + 1;
+			ParStatement *d = prog->stmts + def;
+			prog->users[d->users_begin + d->users_count] = s;
+			d->users_count += 1;
+		}
+	}
+	free(work);
+	free(last_def);
+	free(name_stamp);
+	free(def_stamp);
+	free(user_count);
+}
+
+
+
+// EVALUATION THREADS
+static void par_stats_add(ParStats *stats, const ParStats *other){
+	size_t *dest = (size_t *)stats;
+	const size_t *src = (const size_t *)other;
+	for (size_t i=0; i!=sizeof(ParStats)/sizeof(size_t); i+=1) dest[i] += src[i];
+}
+
+static ParStats par_stats_of_thread(void){
+	return (ParStats){
+		.boxed          = global_value_heap.boxed,
+		.bigints        = global_bigint_heap.allocations,
+		.bigint_bytes   = global_bigint_heap.bytes,
+		.arrays         = global_array_heap.allocations,
+		.array_bytes    = global_array_heap.bytes,
+		.strings        = global_string_heap.allocations,
+		.string_bytes   = global_string_heap.bytes,
+		.tables         = global_table_stats.tables,
+		.table_lookups  = global_table_stats.lookups,
+		.table_probes   = global_table_stats.probes,
+		.memo_lookups   = global_memo.lookups,
+		.memo_hits      = global_memo.hits,
+		.memo_inserts   = global_memo.inserts,
+		.memo_evictions = global_memo.evictions,
+	};
+}
+
+static void par_stats_to_thread(const ParStats *stats){
+	global_value_heap.boxed          += stats->boxed;
+	global_bigint_heap.allocations   += stats->bigints;
+	global_bigint_heap.bytes         += stats->bigint_bytes;
+	global_array_heap.allocations    += stats->arrays;
+	global_array_heap.bytes          += stats->array_bytes;
+	global_string_heap.allocations   += stats->strings;
+	global_string_heap.bytes         += stats->string_bytes;
+	global_table_stats.tables        += stats->tables;
+	global_table_stats.lookups       += stats->table_lookups;
+	global_table_stats.probes        += stats->table_probes;
+	global_memo.lookups              += stats->memo_lookups;
+	global_memo.hits                 += stats->memo_hits;
+	global_memo.inserts              += stats->memo_inserts;
+	global_memo.evictions            += stats->memo_evictions;
+}
+
+static void par_thread_begin(WorkPool *pool){
+	ParProgram *prog = pool->context;
+	if (prog->memoize) memo_init(memo_memory_cap);
+	output_init_capture();
+}
+
+// values of one thread are used by statements of the others,
+// so no heap is released until every thread has stopped
+static void par_thread_end(WorkPool *pool){
+	ParProgram *prog = pool->context;
+	ParStats stats = par_stats_of_thread();
+	pthread_mutex_lock(&prog->mutex);
+	par_stats_add(&prog->stats, &stats);
+	pthread_mutex_unlock(&prog->mutex);
+	pthread_barrier_wait(&prog->exit_barrier);
+	output_finish();
+	memo_free();
+	eval_stacks_release();
+	value_heap_release();
+	bigint_heap_release();
+	array_heap_release();
+	string_heap_release(&global_string_heap);
+}
+
+static void par_run_statement(PoolTask *task){
+	ParStatement *st = (ParStatement *)task;
+	ParProgram *prog = st->program;
+	// output after a failed statement is never written
+	if (st->index > atomic_load(&prog->first_error)){
+		st->skipped = true;
+		goto Finish;
+	}
+	PackedValue *env_values = mem_alloc(util_max_usize(st->binds_count, 1)*sizeof(PackedValue));
+	NameId      *env_names  = mem_alloc(util_max_usize(st->binds_count, 1)*sizeof(NameId));
+	assert(env_values != NULL && env_names != NULL && "parallel evaluation allocation failrule");
+	for (size_t i=0; i!=st->binds_count; i+=1){
+		ParBinding bind = prog->binds[st->binds_begin + i];
+		env_values[i] = prog->stmts[bind.def].def_value;
+		env_names[i]  = bind.name;
+	}
+	EvalScope scope = {
+		.start = st->start, .stop = st->stop,
+		.env_values = env_values, .env_names = env_names, .env_count = st->binds_count,
+		.keep_heaps = true, .export_defs = st->def_name != 0,
+	};
+	st->error = eval_scope(prog->nodes, &scope);
+	st->def_value = scope.def_value;
+	st->output = output_take(&st->output_size);
+	mem_free(env_values);
+	mem_free(env_names);
+	if (st->error.msg != NULL){
+		uint32_t first = atomic_load(&prog->first_error);
+		while (st->index < first && !atomic_compare_exchange_weak(&prog->first_error, &first, st->index));
+	}
+Finish:
+	for (size_t i=0; i!=st->users_count; i+=1){
+		ParStatement *user = prog->stmts + prog->users[st->users_begin + i];
+		if (atomic_fetch_sub(&user->pending, 1) != 1) continue;
+		if (!pool_push(&user->task)) user->task.run(&user->task);
+	}
+	pthread_mutex_lock(&prog->mutex);
+	atomic_store(&st->done, true);
+	pthread_cond_broadcast(&prog->cond);
+	pthread_mutex_unlock(&prog->mutex);
+}
+
+static void par_free(ParProgram *prog){
+	for (size_t i=0; i!=prog->stmt_count; i+=1) free(prog->stmts[i].output);
+	free(prog->stmts);
+	free(prog->uses);
+	free(prog->binds);
+	free(prog->users);
+}
+
+
+// falls back to sequential evaluation when there is nothing to run in parallel
+EvalError eval_parallel(AstArray nodes, size_t thread_count){
+	ParProgram prog = { .nodes = nodes };
+	if (thread_count <= 1 || !par_split(&prog) || prog.stmt_count < 2){
+		par_free(&prog);
+		return eval_ast(nodes);
+	}
+	par_link(&prog);
+	for (size_t i=0; i!=prog.stmt_count; i+=1){
+		prog.stmts[i].program = &prog;
+		prog.stmts[i].task.run = par_run_statement;
+	}
+	// everything that threads would otherwise initialize on first use
+	vmem_default_reserve();
+	global_string_interning = false;
+	atomic_init(&prog.first_error, UINT32_MAX);
+	prog.memoize = memo_enabled();
+	pthread_mutex_init(&prog.mutex, NULL);
+	pthread_cond_init(&prog.cond, NULL);
+
+	prog.pool = (WorkPool){
+		.context = &prog, .thread_begin = par_thread_begin, .thread_end = par_thread_end,
+	};
+	if (!pool_start(&prog.pool, thread_count)){
+		pthread_mutex_destroy(&prog.mutex);
+		pthread_cond_destroy(&prog.cond);
+		global_string_interning = true;
+		par_free(&prog);
+		return eval_ast(nodes);
+	}
+	pthread_barrier_init(&prog.exit_barrier, NULL, prog.pool.thread_count);
+	// ready statements are found before any of them runs and releases others
+	uint32_t *ready = malloc(prog.stmt_count*sizeof(uint32_t));
+	assert(ready != NULL && "parallel evaluation allocation failrule");
+	size_t ready_count = 0;
+	for (size_t i=0; i!=prog.stmt_count; i+=1){
+		if (atomic_load(&prog.stmts[i].pending) == 0){
+			ready[ready_count] = i;
+			ready_count += 1;
+		}
+	}
+	for (size_t i=0; i!=ready_count; i+=1) pool_submit(&prog.pool, &prog.stmts[ready[i]].task);
+	free(ready);
+
+	// reorder buffer, outputs are written as soon as all earlier ones are
+	EvalError res = {0};
+	for (size_t i=0; i!=prog.stmt_count; i+=1){
+		ParStatement *st = prog.stmts + i;
+		pthread_mutex_lock(&prog.mutex);
+		while (!atomic_load(&st->done)) pthread_cond_wait(&prog.cond, &prog.mutex);
+		pthread_mutex_unlock(&prog.mutex);
+		if (st->output_size != 0) output_bytes(st->output, st->output_size);
+		if (st->error.msg != NULL){
+			res = st->error;
+			break;
+		}
+	}
+
+	pool_stop(&prog.pool);
+	par_stats_to_thread(&prog.stats);
+	pthread_barrier_destroy(&prog.exit_barrier);
+	pthread_mutex_destroy(&prog.mutex);
+	pthread_cond_destroy(&prog.cond);
+	global_string_interning = true;
+	par_free(&prog);
+	return res;
+}
+
+
+
+
+// FORK JOIN
+// the main thread evaluates the program and forks calls to the workers,
+// it is one of the evaluation threads, so the pool has one worker less
+#ifndef FORK_EXTRA_DEPTH
+	#define FORK_EXTRA_DEPTH 8 // levels of calls forked below the ones that give every thread a task
+#endif
+
+typedef struct{
+	WorkPool pool;
+	bool     memoize;
+	pthread_mutex_t mutex; // guards stats
+	ParStats stats;
+} ForkProgram;
+
+
+static size_t fork_default_cutoff(size_t thread_count){
+	size_t res = FORK_EXTRA_DEPTH;
+	for (size_t n=1; n<thread_count; n*=2) res += 1;
+	return res;
+}
+
+static void fork_thread_begin(WorkPool *pool){
+	ForkProgram *prog = pool->context;
+	if (prog->memoize) memo_init(memo_memory_cap);
+	output_init_capture();
+}
+
+// every task was joined before the pool stops, so no value is used anymore
+static void fork_thread_end(WorkPool *pool){
+	ForkProgram *prog = pool->context;
+	ParStats stats = par_stats_of_thread();
+	pthread_mutex_lock(&prog->mutex);
+	par_stats_add(&prog->stats, &stats);
+	pthread_mutex_unlock(&prog->mutex);
+	output_finish();
+	memo_free();
+	eval_stacks_release();
+	value_heap_release();
+	bigint_heap_release();
+	array_heap_release();
+	string_heap_release(&global_string_heap);
+}
+
+// calls deeper than the cutoff are evaluated sequentially
+EvalError eval_forked(AstArray nodes, size_t thread_count, size_t cutoff){
+	if (thread_count <= 1 || cutoff == 0) return eval_ast(nodes);
+	vmem_default_reserve();
+	ForkProgram prog = { .memoize = memo_enabled() };
+	pthread_mutex_init(&prog.mutex, NULL);
+	prog.pool = (WorkPool){
+		.context = &prog, .thread_begin = fork_thread_begin, .thread_end = fork_thread_end,
+	};
+	if (!pool_start(&prog.pool, thread_count - 1)){
+		pthread_mutex_destroy(&prog.mutex);
+		return eval_ast(nodes);
+	}
+	global_string_interning = false;
+	global_fork.pool = &prog.pool;
+	global_fork.cutoff = util_min_usize(cutoff, UINT32_MAX);
+	EvalError res = eval_ast(nodes);
+	global_fork.pool = NULL;
+	pool_stop(&prog.pool);
+	global_fork.steals = atomic_load(&prog.pool.steals);
+	par_stats_to_thread(&prog.stats);
+	pthread_mutex_destroy(&prog.mutex);
+	global_string_interning = true;
+	return res;
+}
+
+#undef PAR_PUSH
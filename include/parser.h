@@ -1,11 +1,19 @@
+#pragma once
+
 #include "utils.h"
 #include "unicode.h"
 #include "files.h"
+#include "memstat.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef __SSE2__
+	#include <immintrin.h>
+#endif
+
 #include "classes.h"
+#include "string_value.h"
 
 
 static bool is_valid_name_char(char);
@@ -17,6 +25,7 @@ static uint32_t parse_character(const char **);
 
 static enum AstType parse_number(void *data_res, const char **src_it);
 
+static void write_codeline(FILE *info, FILE *code, const char *text, size_t position);
 static void print_codeline(const char *text, size_t position);
 
 static void raise_error(const char *text, const char *msg, uint32_t pos);
@@ -42,7 +51,7 @@ typedef struct AstArray{
 static AstArray ast_array_new(size_t capacity){
 	assert(capacity >= 32);
 	AstArray arr;
-	arr.data = malloc(capacity*sizeof(AstNode));
+	arr.data = mem_arena_alloc(capacity*sizeof(AstNode));
 	if (arr.data == NULL){
 		assert(false && "node array allocation failrule");
 	}
@@ -55,7 +64,7 @@ static AstArray ast_array_clone(AstArray ast){
 	if (ast.data == NULL) return ast;
 	AstArray res = {0};
 	size_t size = ast.end - ast.data;
-	res.data = malloc(size*sizeof(AstNode));
+	res.data = mem_arena_alloc(size*sizeof(AstNode));
 	if (res.data == NULL) return res;
 	memcpy(res.data, ast.data, size*sizeof(AstNode));
 	res.end = res.data + size;
@@ -66,7 +75,7 @@ static AstArray ast_array_clone(AstArray ast){
 static void ast_array_grow(AstArray *arr){
 	size_t new_capacity = 2*(arr->maxptr - arr->data);
 	size_t arr_size = arr->end - arr->data;
-	arr->data = realloc(arr->data, new_capacity*sizeof(AstNode));
+	arr->data = mem_realloc(arr->data, new_capacity*sizeof(AstNode));
 	if (arr->data == NULL){
 		assert(false && "node array allocation failrule");
 	}
@@ -91,11 +100,84 @@ static AstNode *ast_array_push2(AstArray *arr, AstNode node, Data data){
 	return res;	
 }
 
+// nodes of the tokens that a text makes, a word of name characters becomes a
+// name or a number with its data, other printable bytes one node and newlines
+// semicolons, the estimate is exact for names and operators and larger for
+// reals and strings, a name takes its bytes and one more in the name data
+static size_t ast_token_estimate(const char *text, size_t size, size_t *words, size_t *name_bytes){
+	size_t word_count = 0, name_chars = 0, others = 0;
+	uint32_t in_word = 0; // previous byte was a name character
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i graph     = _mm_set1_epi8(' ' + 1);
+	const __m128i newline   = _mm_set1_epi8('\n');
+	const __m128i case_bit  = _mm_set1_epi8(0x20);
+	const __m128i before_a  = _mm_set1_epi8('a' - 1);
+	const __m128i after_z   = _mm_set1_epi8('z' + 1);
+	const __m128i before_0  = _mm_set1_epi8('0' - 1);
+	const __m128i after_9   = _mm_set1_epi8('9' + 1);
+	const __m128i underline = _mm_set1_epi8('_');
+	for (; i+16 <= size; i+=16){
+		__m128i c = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i lower = _mm_or_si128(c, case_bit);
+		__m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, before_a), _mm_cmpgt_epi8(after_z, lower));
+		__m128i digit  = _mm_and_si128(_mm_cmpgt_epi8(c, before_0), _mm_cmpgt_epi8(after_9, c));
+		uint32_t names = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(letter, digit), _mm_cmpeq_epi8(c, underline)));
+		uint32_t graphs = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(c, graph), c));
+		uint32_t newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(c, newline));
+		uint32_t starts = names & ~((names << 1) | in_word);
+		in_word = names >> 15;
+		word_count += __builtin_popcount(starts);
+		name_chars += __builtin_popcount(names);
+		others += __builtin_popcount(graphs & ~names) + __builtin_popcount(newlines);
+	}
+#endif
+	for (; i!=size; i+=1){
+		char c = text[i];
+		uint32_t name = is_valid_name_char(c);
+		word_count += name & ~in_word;
+		name_chars += name;
+		others += ((uint8_t)c > ' ' && !name) + (c == '\n');
+		in_word = name;
+	}
+	*words = word_count;
+	*name_bytes = name_chars + word_count;
+	return 2 + 2*word_count + others; // first semicolon and the terminator
+}
+
+// index of the terminator, the last node of a program
+static uint32_t ast_terminator(AstArray ast){
+	uint32_t i = 1;
+	while (ast.data[i].type != Ast_Terminator){
+		AstNode node = ast.data[i];
+		i += AstNodeSizes[node.type] + (node.type == Ast_Function ? node.count : 0);
+	}
+	return i;
+}
+
+// positions of a program that is evaluated after others follow their texts,
+// so an error tells which of them it is in, jumps keep their offsets
+static void ast_shift_positions(AstArray ast, uint32_t offset){
+	for (uint32_t i=1;;){
+		AstNode *node = ast.data + i;
+		if (node->type != Ast_Jump) node->pos += offset;
+		if (node->type == Ast_Terminator) return;
+		i += AstNodeSizes[node->type] + (node->type == Ast_Function ? node->count : 0);
+	}
+}
+
 
 
 static AstArray make_tokens(const char *input){
 	const char *text_begin = input;
-	AstArray res = ast_array_new(1024);
+	// arrays are sized from the text up front, so they rarely grow while lexing,
+	// the token array is the last block of the arena, that grows in place,
+	// about every other word is taken to be a new name
+	size_t text_size = strlen(input);
+	size_t words, name_bytes;
+	size_t estimate = ast_token_estimate(input, text_size, &words, &name_bytes);
+	reserve_compiler_names(name_bytes, words / 2);
+	AstArray res = ast_array_new(util_max_usize(estimate, 32));
 	ast_array_push(&res, (AstNode){ .type = Ast_Semicolon });
 
 #define RETURN_ERROR(arg_error, arg_position) { \
@@ -302,6 +384,22 @@ static AstArray make_tokens(const char *input){
 			goto AddToken;
 		}
 
+		case '{': input += 1;
+			PUSH_SCOPE(Ast_Set);
+			curr.type = Ast_Set;
+			goto AddToken;
+
+		case '}':{ input += 1;
+			if (scope_count == 0)
+				RETURN_ERROR("too many closing braces", position);
+			scope_count -= 1;
+			enum AstType t = scope_types[scope_count];
+			if (t != Ast_Set)
+				RETURN_ERROR("mismatched braces", position);
+			curr.type = Ast_EndScope;
+			goto AddToken;
+		}
+
 		case '@': input += 1;
 			if (*input == '='){
 				curr.type = Ast_Contains;
@@ -316,7 +414,10 @@ static AstArray make_tokens(const char *input){
 			goto AddToken;
 
 		case '.': input += 1;
-			if (is_number(*input)){
+			if (*input == '.'){
+				input += 1;
+				curr.type = Ast_Range;
+			} else if (is_number(*input)){
 				input -= 1;
 				curr.type = parse_number(&curr_data, &input);
 				if (curr.type == Ast_Error)
@@ -335,30 +436,33 @@ static AstArray make_tokens(const char *input){
 		
 		case '\"':{
 			input += 1;
+			const char *begin = input;
+			bool escaped = false;
 			size_t data_size = 0;
-			//BcNode *dest_node = global_bc + global_bc_size;
-			//uint8_t *dest_data = (uint8_t *)(dest_node + 2);
 			while (*input != '\"'){
 				if (*input == '\0')
 					RETURN_ERROR("end of file inside of string literal", input-text_begin);
+				escaped |= *input == '\\';
 				uint32_t c = parse_character(&input);
 				if (c == UINT32_MAX)
 					RETURN_ERROR("invalid character code", input-text_begin);
-				//size_t code_size = utf8_write(dest_data, c);
-				//dest_data += code_size;
-				//data_size += code_size;
+				data_size += utf8_codesize(c);
+			}
+			if (data_size > UINT32_MAX)
+				RETURN_ERROR("string literal is too long", position);
+			if (escaped){
+				// characters are decoded again, this time into their own buffer
+				uint8_t *data = (uint8_t *)string_literal_buffer(data_size);
+				const char *it = begin;
+				for (size_t i=0; i!=data_size;){
+					i += utf8_write(data + i, parse_character(&it));
+				}
+				curr_data.ptr = string_literal((const char *)data, data_size);
+			} else{
+				curr_data.ptr = string_literal(begin, data_size);
 			}
-			//*dest_data = '\0';
 			input += 1;
-			//*dest_node = (BcNode){ .type = BC_Data, };
-			//(dest_node+1)->clas = (Class){ .tag = Class_Bytes, .bytesize = data_size };
-
 			curr.type = Ast_String;
-			//curr_data.bufinfo.index = global_bc_size + 2;
-			curr_data.bufinfo.size = data_size;
-			
-			//global_bc_size += 2 + (data_size + 2 + sizeof(BcNode) - 1)/sizeof(BcNode);
-			assert(false && "strings are unimplemented");
 			goto AddTokenWithData;
 		}
 
@@ -425,7 +529,7 @@ static AstArray make_tokens(const char *input){
 #undef PUSH_SCOPE 
 #undef RETURN_ERROR
 ReturnError:
-	free(res.data);
+	mem_free(res.data);
 	res.data = NULL;
 	return res;
 }
@@ -518,6 +622,34 @@ ExpectValue:{
 			goto SimplePrefixOperator;
 		}
 
+		case Ast_Subscript:{
+			curr.type = Ast_Array;
+			if (it->type == Ast_EndScope){
+				it += 1;
+				*res_it = curr; res_it += 1;
+				goto ExpectOperator;
+			}
+			curr.count = 1;
+			goto SimplePrefixOperator;
+		}
+
+		case Ast_Set:{
+			if (it->type == Ast_EndScope){
+				it += 1;
+				*res_it = curr; res_it += 1;
+				goto ExpectOperator;
+			}
+			// empty dictionary
+			if (it->type == Ast_Colon && (it+1)->type == Ast_EndScope){
+				it += 2;
+				curr.type = Ast_Dict;
+				*res_it = curr; res_it += 1;
+				goto ExpectOperator;
+			}
+			curr.count = 1;
+			goto SimplePrefixOperator;
+		}
+
 		case Ast_Function:{
 			AstNode *head = res_it;
 			res_it += 2;
@@ -536,7 +668,7 @@ ExpectValue:{
 			if (curr.count > 128)
 				RETURN_ERROR("function has too many parameters, max is 128", curr.pos);
 			*head = curr;
-			(head+1)->pos = it->pos;
+			(head+1)->data.funcnodeinfo = (FunctionNodeInfo){0};
 			it += 2; // also skip nop
 			CHECK_OPER_STACK_OVERFLOW(curr.pos);
 			opers[opers_size] = (AstNode){.type = Ast_Function, .pos = head-tokens.data};
@@ -599,8 +731,13 @@ ExpectValue:{
 
 		case Ast_Comma:{
 			enum AstType t = opers[opers_size-1].type;
-			if (t != Ast_Call && t != Ast_Subscript)
+			if (t != Ast_Call && t != Ast_Subscript && t != Ast_Array && t != Ast_Set && t != Ast_Dict)
 				RETURN_ERROR("invalid usage of comma", curr.pos);
+			if (t == Ast_Dict){
+				if (!(opers[opers_size-1].flags & AstFlag_DictValue))
+					RETURN_ERROR("dictionary key is missing its value", curr.pos);
+				opers[opers_size-1].flags &= ~AstFlag_DictValue;
+			}
 			opers[opers_size-1].count += 1;
 			goto ExpectValue;
 		}
@@ -622,6 +759,18 @@ ExpectValue:{
 
 		case Ast_Colon:{
 			AstNode top = opers[opers_size-1];
+			// first colon in braces turns a set into a dictionary
+			if ((top.type == Ast_Set && top.count == 1) || top.type == Ast_Dict){
+				if (top.flags & AstFlag_DictValue)
+					RETURN_ERROR("dictionary entry has more than one colon", curr.pos);
+				top.type = Ast_Dict;
+				top.flags |= AstFlag_DictValue;
+				top.count += 1;
+				opers[opers_size-1] = top;
+				goto ExpectValue;
+			}
+			if (top.type == Ast_Set)
+				RETURN_ERROR("set can't contain dictionary entries", curr.pos);
 			if (top.type != Ast_Conditional)
 				RETURN_ERROR("colon must be a part of ternary expression", curr.pos);
 			size_t jump_size = (res_it - tokens.data) - top.pos;
@@ -681,6 +830,15 @@ ExpectValue:{
 			goto ExpectOperator;
 
 		case Ast_Subscript:
+		case Ast_Array:
+		case Ast_Set:
+			*res_it = sc; res_it += 1;
+			goto ExpectOperator;
+
+		case Ast_Dict:
+			if (!(sc.flags & AstFlag_DictValue))
+				RETURN_ERROR("dictionary key is missing its value", sc.pos);
+			sc.flags = 0;
 			*res_it = sc; res_it += 1;
 			goto ExpectOperator;
 
@@ -895,7 +1053,8 @@ static enum AstType parse_number(void *res_data, const char **src_it){
 	
 	res_integer = parse_number_dec(&src);
 	
-	if (*src == '.'){
+	// two dots after an integer are a range
+	if (*src == '.' && *(src+1) != '.'){
 		src += 1;
 		double res_real = (double)res_integer; // decimal part
 		const char *fraction_str = src;
@@ -922,7 +1081,8 @@ Return:
 
 
 // DEBUG INFORMATION HELPERS
-static void print_codeline(const char *text, size_t position){
+// position goes to info, the lines of the text to code
+static void write_codeline(FILE *info, FILE *code, const char *text, size_t position){
 	size_t row = 0;
 	size_t col = 0;
 	size_t row_position_prev = 0;
@@ -937,39 +1097,43 @@ static void print_codeline(const char *text, size_t position){
 			col = 0;
 		}
 	}
-	fprintf(stderr, " -> row: %lu, column: %lu\n>\n", row, col);
+	fprintf(info, " -> row: %lu, column: %lu\n>\n", row, col);
 
 	if (row != 0){
-		putchar('>');
-		putchar(' ');
-		putchar(' ');
+		putc('>', code);
+		putc(' ', code);
+		putc(' ', code);
 		for (size_t i=row_position_prev;; ++i){
 			char c = text[i];
 			if (c=='\0' || c=='\n' || c=='\v') break;
-			putchar(c);
+			putc(c, code);
 		}
-		putchar('\n');
+		putc('\n', code);
 	}
 
-	putchar('>');
-	putchar(' ');
-	putchar(' ');
+	putc('>', code);
+	putc(' ', code);
+	putc(' ', code);
 	for (size_t i=row_position;; ++i){
 		char c = text[i];
 		if (c=='\0' || c=='\n' || c=='\v') break;
-		putchar(c);
+		putc(c, code);
 	}
-	putchar('\n');
+	putc('\n', code);
 
-	putchar('>');
-	putchar(' ');
-	putchar(' ');
+	putc('>', code);
+	putc(' ', code);
+	putc(' ', code);
 	for (size_t i=0; i!=col; ++i){
-		putchar(text[row_position+i]=='\t' ? '\t' : ' ');
+		putc(text[row_position+i]=='\t' ? '\t' : ' ', code);
 	}
-	putchar('^');
-	putchar('\n');
-	putchar('\n');
+	putc('^', code);
+	putc('\n', code);
+	putc('\n', code);
+}
+
+static void print_codeline(const char *text, size_t position){
+	write_codeline(stderr, stdout, text, position);
 }
 
 
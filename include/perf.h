@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "utils.h"
+
+
+
+// HARDWARE PERFORMANCE COUNTERS
+// every counter is opened on its own, so the ones that the machine or the
+// container doesn't allow are just missing from the report, counters that
+// the kernel multiplexes are scaled by the time they were running
+enum PerfCounter{
+	Perf_Cycles,
+	Perf_Instructions,
+	Perf_BranchMisses,
+	Perf_L1Misses,
+	Perf_LLCMisses,
+	Perf_CounterCount,
+};
+
+static const char *const PerfCounterNames[] = {
+	"cycles", "instructions", "branch misses", "L1 data misses", "LLC misses",
+};
+
+enum PerfPhase{
+	PerfPhase_Read,
+	PerfPhase_Lex,
+	PerfPhase_Parse,
+	PerfPhase_Optimize,
+	PerfPhase_Eval,
+	PerfPhase_Count,
+};
+
+static const char *const PerfPhaseNames[] = { "read", "lex", "parse", "optimize", "eval" };
+
+typedef struct{
+	int      fds[Perf_CounterCount]; // -1 if the counter couldn't be opened
+	uint64_t values[PerfPhase_Count][Perf_CounterCount];
+	bool     measured[PerfPhase_Count];
+} PerfCounters;
+
+static PerfCounters global_perf = {
+	.fds = { [0 ... Perf_CounterCount-1] = -1 },
+};
+
+
+static int perf_open(uint32_t type, uint64_t config){
+	struct perf_event_attr attr = {
+		.type = type,
+		.size = sizeof(struct perf_event_attr),
+		.config = config,
+		.disabled = 1,
+		.inherit = 1, // threads of parallel evaluation are counted too
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+		.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+	};
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// returns the number of counters that could be opened
+static size_t perf_init(void){
+	PerfCounters *perf = &global_perf;
+	const uint64_t L1Miss = PERF_COUNT_HW_CACHE_L1D
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	perf->fds[Perf_Cycles]       = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	perf->fds[Perf_Instructions] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	perf->fds[Perf_BranchMisses] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	perf->fds[Perf_L1Misses]     = perf_open(PERF_TYPE_HW_CACHE, L1Miss);
+	perf->fds[Perf_LLCMisses]    = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	size_t res = 0;
+	for (size_t i=0; i!=Perf_CounterCount; i+=1) res += perf->fds[i] != -1;
+	return res;
+}
+
+static void perf_free(void){
+	for (size_t i=0; i!=Perf_CounterCount; i+=1){
+		if (global_perf.fds[i] != -1) close(global_perf.fds[i]);
+		global_perf.fds[i] = -1;
+	}
+}
+
+static void perf_begin(void){
+	for (size_t i=0; i!=Perf_CounterCount; i+=1){
+		int fd = global_perf.fds[i];
+		if (fd == -1) continue;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+// counters that fail to be read are closed, so later phases don't report them either
+static void perf_end(enum PerfPhase phase){
+	PerfCounters *perf = &global_perf;
+	for (size_t i=0; i!=Perf_CounterCount; i+=1){
+		if (perf->fds[i] != -1) ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	}
+	for (size_t i=0; i!=Perf_CounterCount; i+=1){
+		int fd = perf->fds[i];
+		if (fd == -1) continue;
+		uint64_t data[3]; // value, time enabled, time running
+		if (read(fd, data, sizeof(data)) != sizeof(data)){
+			close(fd);
+			perf->fds[i] = -1;
+			continue;
+		}
+		double scale = data[2] != 0 ? (double)data[1] / (double)data[2] : 0.0;
+		perf->values[phase][i] = (uint64_t)(data[0] * scale);
+	}
+	perf->measured[phase] = true;
+}
+
+
+static void print_perf_value(double value, int decimals, bool available){
+	if (available){
+		printf(" %13.*lf", decimals, value);
+	} else{
+		printf(" %13s", "n/a");
+	}
+}
+
+// misses are given per KB of input and per node of the parsed ast
+static void print_perf_stats(size_t text_size, size_t node_count){
+	PerfCounters *perf = &global_perf;
+	double kb = util_max_usize(text_size, 1) / 1024.0;
+	double nodes = util_max_usize(node_count, 1);
+	printf("\nperformance counters:\n");
+	printf("%-12s", "phase");
+	for (size_t i=0; i!=PerfPhase_Count; i+=1){
+		if (perf->measured[i]) printf(" %13s", PerfPhaseNames[i]);
+	}
+	putchar('\n');
+	for (size_t c=0; c!=Perf_CounterCount; c+=1){
+		printf("%s\n", PerfCounterNames[c]);
+		const char *const Rows[] = { "  total", "  per KB", "  per node" };
+		for (size_t r=0; r!=SIZE(Rows); r+=1){
+			printf("%-12s", Rows[r]);
+			for (size_t i=0; i!=PerfPhase_Count; i+=1){
+				if (!perf->measured[i]) continue;
+				double value = (double)perf->values[i][c];
+				print_perf_value(r == 0 ? value : r == 1 ? value/kb : value/nodes, r == 0 ? 0 : 3, perf->fds[c] != -1);
+			}
+			putchar('\n');
+		}
+	}
+	printf("%-12s", "IPC");
+	for (size_t i=0; i!=PerfPhase_Count; i+=1){
+		if (!perf->measured[i]) continue;
+		uint64_t cycles = perf->values[i][Perf_Cycles];
+		bool available = perf->fds[Perf_Cycles] != -1 && perf->fds[Perf_Instructions] != -1 && cycles != 0;
+		print_perf_value(available ? (double)perf->values[i][Perf_Instructions] / cycles : 0.0, 3, available);
+	}
+	putchar('\n');
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+#include "parser.h"
+#include "value.h"
+#include "bigint.h"
+#include "array.h"
+#include "table.h"
+#include "output.h"
+
+// a pipeline keeps a counter for each of its take stages while it runs
+#ifndef PIPELINE_MAX_STAGES
+	#define PIPELINE_MAX_STAGES 16
+#endif
+
+
+
+// PIPELINE STAGES
+// builtins are ordinary values bound to their names before evaluation,
+// calling one stores its arguments in a new stage, sum, fold, set and dict
+// consume a sequence, the others make a longer one
+enum StageKind{
+	Stage_Map,
+	Stage_Filter,
+	Stage_Take,
+	Stage_Sum,
+	Stage_Fold,
+	Stage_Set,
+	Stage_Dict,
+};
+
+static const struct{
+	const char *name;
+	uint8_t     arity;
+} StageBuiltins[] = {
+	[Stage_Map]    = { "map",    1 },
+	[Stage_Filter] = { "filter", 1 },
+	[Stage_Take]   = { "take",   1 },
+	[Stage_Sum]    = { "sum",    0 },
+	[Stage_Fold]   = { "fold",   2 },
+	[Stage_Set]    = { "set",    0 },
+	[Stage_Dict]   = { "dict",   1 }, // maps every element to the result of a function
+};
+
+typedef struct{
+	uint8_t kind;
+	uint8_t argc; // number of applied arguments, 0 for the builtin itself
+	PackedValue args[2];
+} Stage;
+
+
+static Value stage_builtin(enum StageKind kind){
+	Stage *stage = (Stage *)array_heap_alloc(sizeof(Stage) / sizeof(int64_t));
+	*stage = (Stage){ .kind = kind };
+	return (Value){ .type = DT_Stage, .data.ptr = stage };
+}
+
+static bool stage_is_complete(const Stage *stage){
+	return stage->argc == StageBuiltins[stage->kind].arity;
+}
+
+static bool stage_is_terminal(const Stage *stage){
+	return stage->kind >= Stage_Sum;
+}
+
+static const char *stage_apply(const Stage *stage, const PackedValue *args, size_t count, Value *res){
+	if (stage->argc != 0)
+		return "builtin's arguments were already applied";
+	if (count != StageBuiltins[stage->kind].arity)
+		return "wrong number of arguments";
+	if (stage->kind == Stage_Take){
+		Value limit = value_unpack(args[0]);
+		if (limit.type != DT_Integer || limit.data.integer < 0)
+			return "take expects a non-negative integer";
+	}
+	Stage *applied = (Stage *)array_heap_alloc(sizeof(Stage) / sizeof(int64_t));
+	*applied = (Stage){ .kind = stage->kind, .argc = count };
+	for (size_t i=0; i!=count; i+=1) applied->args[i] = args[i];
+	*res = (Value){ .type = DT_Stage, .data.ptr = applied };
+	return NULL;
+}
+
+
+
+// LAZY SEQUENCES
+// a range, an array or keys of a table followed by stages, elements are produced
+// one by one only when a sequence is consumed, so memory doesn't depend on its length
+typedef struct{
+	int64_t  first;
+	int64_t  last;
+	uint64_t length;
+	const Array *array; // source elements, NULL for a range
+	const Table *table;
+	uint32_t stage_count;
+	const Stage *stages[];
+} Sequence;
+
+static Sequence *sequence_alloc(size_t stage_count){
+	size_t size = sizeof(Sequence) + stage_count*sizeof(const Stage *);
+	Sequence *res = (Sequence *)array_heap_alloc(util_roundup(size, sizeof(int64_t)));
+	res->array = NULL;
+	res->table = NULL;
+	res->stage_count = stage_count;
+	return res;
+}
+
+// inclusive range of integers
+static const char *sequence_range(Value lhs, Value rhs, Value *res){
+	if (lhs.type != DT_Integer || rhs.type != DT_Integer)
+		return "range bounds have to be integers";
+	Sequence *seq = sequence_alloc(0);
+	seq->first = lhs.data.integer;
+	seq->last  = rhs.data.integer;
+	seq->length = 0;
+	if (seq->last >= seq->first){
+		seq->length = (uint64_t)seq->last - (uint64_t)seq->first + 1;
+		// only the range of all integers wraps around
+		if (seq->length == 0) seq->length = UINT64_MAX;
+	}
+	*res = (Value){ .type = DT_Sequence, .data.ptr = seq };
+	return NULL;
+}
+
+// arrays and tables become sequences without any stages
+static const char *sequence_from(Value source, const Sequence **res){
+	if (source.type == DT_Sequence){
+		*res = source.data.ptr;
+		return NULL;
+	}
+	if (source.type != DT_Array && source.type != DT_Set && source.type != DT_Dict)
+		return "pipeline has to start with a range, an array or a table";
+	Sequence *seq = sequence_alloc(0);
+	seq->first = 0;
+	if (source.type == DT_Array){
+		seq->array = source.data.ptr;
+		seq->length = seq->array->length;
+	} else{
+		seq->table = source.data.ptr;
+		seq->length = seq->table->count;
+	}
+	seq->last = (int64_t)seq->length - 1;
+	*res = seq;
+	return NULL;
+}
+
+static const char *sequence_append(Value source, const Stage *stage, Value *res){
+	if (!stage_is_complete(stage))
+		return "builtin is missing its arguments";
+	const Sequence *seq;
+	const char *msg = sequence_from(source, &seq);
+	if (msg != NULL) return msg;
+	if (seq->stage_count == PIPELINE_MAX_STAGES)
+		return "pipeline has too many stages";
+	Sequence *longer = sequence_alloc(seq->stage_count + 1);
+	longer->first  = seq->first;
+	longer->last   = seq->last;
+	longer->length = seq->length;
+	longer->array  = seq->array;
+	longer->table  = seq->table;
+	memcpy(longer->stages, seq->stages, seq->stage_count*sizeof(const Stage *));
+	longer->stages[seq->stage_count] = stage;
+	*res = (Value){ .type = DT_Sequence, .data.ptr = longer };
+	return NULL;
+}
+
+static inline PackedValue sequence_element(const Sequence *seq, uint64_t index){
+	const Array *arr = seq->array;
+	if (seq->table != NULL) return seq->table->entries[index].key;
+	if (arr == NULL){
+		return value_pack((Value){ .type = DT_Integer, .data.integer = seq->first + index });
+	}
+	Value res = { .type = arr->type };
+	if (arr->type == DT_Bool){
+		res.data.boolean = arr->items[index];
+	} else{
+		res.data.integer = arr->items[index];
+	}
+	return value_pack(res);
+}
+
+static const char *sequence_length(const Sequence *seq, Value *res){
+	if (seq->stage_count != 0)
+		return "length of a sequence with stages is not known before it is consumed";
+	if (seq->length > INT64_MAX)
+		return "integer is too large";
+	*res = (Value){ .type = DT_Integer, .data.integer = seq->length };
+	return NULL;
+}
+
+
+
+// PIPELINE RUNS
+// state of a sequence being consumed, elements pass through the stages one
+// at a time, when a stage calls a function the evaluator continues in its
+// body and comes back to the run when the function returns, values that
+// were boxed for an element are released before the next one is fetched
+typedef struct{
+	const Sequence *seq;
+	const Stage    *terminal; // sum, fold, set or dict
+	uint64_t next;            // index of the next source element
+	uint32_t stage;           // stage that receives the current element, 0 fetches a new one
+	uint32_t ast_index;       // where evaluation continues after the run
+	uint32_t pos;
+	bool     stop;            // a take stage is satisfied, no more elements are fetched
+	bool     has_acc;
+	PackedValue value;        // element passing through the stages
+	PackedValue acc;
+	HeapMark value_mark;      // heaps when the run started
+	HeapMark big_mark;
+	int64_t  taken[PIPELINE_MAX_STAGES];
+} PipeRun;
+
+
+static void pipe_run_mark(PipeRun *run){
+	run->value_mark = value_heap_mark();
+	run->big_mark = bigint_heap_mark();
+}
+
+// once an element went through the stages only the accumulator can refer to
+// what was made for it, a scalar one is copied into the released space,
+// tables and other accumulators may hold anything, so their heaps are kept
+static void pipe_run_release(PipeRun *run){
+	enum StageKind kind = run->terminal->kind;
+	if (kind == Stage_Set || kind == Stage_Dict) return;
+	Value acc = { .type = DT_Null };
+	if (run->has_acc) acc = value_unpack(run->acc);
+	if (
+		acc.type != DT_Null && acc.type != DT_Integer && acc.type != DT_Real &&
+		acc.type != DT_Bool && acc.type != DT_Function && acc.type != DT_BigInt
+	) return;
+	uint64_t small[8];
+	uint64_t *limbs = NULL;
+	size_t size = 0;
+	bool negative = false;
+	if (acc.type == DT_BigInt){
+		const BigInt *big = acc.data.ptr;
+		size = big->size;
+		negative = big->negative;
+		limbs = size <= SIZE(small) ? small : bigint_scratch(size);
+		memcpy(limbs, big->limbs, size*sizeof(uint64_t));
+	}
+	value_heap_reset(run->value_mark);
+	bigint_heap_reset(run->big_mark);
+	if (limbs != NULL){
+		acc = bigint_make(limbs, size, negative);
+		if (limbs != small) mem_free(limbs);
+	}
+	if (run->has_acc) run->acc = value_pack(acc);
+}
+
+
+
+// PRINTING
+static void sequence_output(const Sequence *seq){
+	if (seq->array == NULL && seq->table == NULL && seq->stage_count == 0){
+		output_i64(seq->first);
+		output_bytes("..", 2);
+		output_i64(seq->last);
+		return;
+	}
+	output_bytes("sequence of ", 12);
+	output_i64(seq->stage_count);
+	output_bytes(seq->stage_count == 1 ? " stage" : " stages", seq->stage_count == 1 ? 6 : 7);
+}
+
+static void stage_output(const Stage *stage){
+	const char *name = StageBuiltins[stage->kind].name;
+	output_bytes("builtin \"", 9);
+	output_bytes(name, strlen(name));
+	output_char('"');
+}
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+#endif
+
+#include "parser.h"
+#include "vmem.h"
+
+#ifndef SAMPLER_INTERVAL_US
+	#define SAMPLER_INTERVAL_US 1000
+#endif
+
+// deeper stacks keep their innermost calls
+#ifndef SAMPLER_MAX_DEPTH
+	#define SAMPLER_MAX_DEPTH 256
+#endif
+
+#ifndef SAMPLER_BUFFER_SIZE
+	#define SAMPLER_BUFFER_SIZE ((size_t)256 << 20)
+#endif
+
+#define SAMPLER_TRUNCATED 0x80000000u
+
+
+
+// return address of a call, kept apart from values so they can stay small
+typedef struct{
+	uint32_t ast_index;
+	uint32_t vars_size;
+	uint32_t memo_func; // index of memoized function, 0 if result is not stored
+	uint32_t value_used; // boxed cells when the call began
+} CallFrame;
+
+
+
+// CALL PROFILER
+// calls of every function are counted and timed in ticks of the time stamp
+// counter, the outermost call of a recursion adds to the inclusive time and
+// every call adds its time without the calls it made to the exclusive time
+typedef struct{
+	uint32_t func;    // node of the function
+	NameId   name_id; // name of its first call, 0 for an anonymous function
+	uint32_t depth;   // calls that haven't returned yet
+	uint32_t max_depth;
+	uint64_t calls;
+	uint64_t inclusive;
+	uint64_t exclusive;
+} ProfileEntry;
+
+typedef struct{
+	uint32_t entry;
+	uint64_t start;
+	uint64_t children; // ticks of the calls it made
+} ProfileFrame;
+
+typedef struct{
+	bool enabled;
+	ProfileEntry *entries;
+	size_t        entry_count;
+	size_t        entry_capacity;
+	uint32_t     *slots; // entry's index plus 1 by function, 0 marks an empty slot
+	size_t        slot_capacity;
+	ProfileFrame *frames;
+	size_t        frame_count;
+	size_t        frame_capacity;
+	uint64_t start_ticks; // ticks are converted to seconds by the time since the start
+	uint64_t start_ns;
+} Profiler;
+
+static _Thread_local Profiler global_profiler;
+
+
+static uint64_t profile_ns(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec*1000000000u + t.tv_nsec;
+}
+
+static inline uint64_t profile_ticks(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return profile_ns();
+#endif
+}
+
+static void profile_init(void){
+	global_profiler = (Profiler){ .enabled = true, .slot_capacity = 256 };
+	global_profiler.slots = calloc(global_profiler.slot_capacity, sizeof(uint32_t));
+	assert(global_profiler.slots != NULL && "profiler allocation failrule");
+	global_profiler.start_ns = profile_ns();
+	global_profiler.start_ticks = profile_ticks();
+}
+
+static void profile_free(void){
+	free(global_profiler.entries);
+	free(global_profiler.slots);
+	free(global_profiler.frames);
+	global_profiler = (Profiler){0};
+}
+
+static bool profile_enabled(void){
+	return global_profiler.enabled;
+}
+
+static size_t profile_slot(const Profiler *prof, uint32_t func){
+	size_t mask = prof->slot_capacity - 1;
+	size_t i = (func * 0x9e3779b97f4a7c15u) >> 32 & mask;
+	while (prof->slots[i] != 0 && prof->entries[prof->slots[i]-1].func != func) i = (i + 1) & mask;
+	return i;
+}
+
+static uint32_t profile_entry(uint32_t func, NameId name_id){
+	Profiler *prof = &global_profiler;
+	size_t slot = profile_slot(prof, func);
+	if (prof->slots[slot] != 0) return prof->slots[slot] - 1;
+
+	if (prof->entry_count == prof->entry_capacity){
+		prof->entry_capacity = util_max_usize(64, 2*prof->entry_capacity);
+		prof->entries = realloc(prof->entries, prof->entry_capacity*sizeof(ProfileEntry));
+		assert(prof->entries != NULL && "profiler allocation failrule");
+	}
+	uint32_t res = prof->entry_count;
+	prof->entries[res] = (ProfileEntry){ .func = func, .name_id = name_id };
+	prof->entry_count += 1;
+	prof->slots[slot] = res + 1;
+
+	if (2*prof->entry_count > prof->slot_capacity){
+		free(prof->slots);
+		prof->slot_capacity *= 2;
+		prof->slots = calloc(prof->slot_capacity, sizeof(uint32_t));
+		assert(prof->slots != NULL && "profiler allocation failrule");
+		for (uint32_t i=0; i!=prof->entry_count; i+=1){
+			prof->slots[profile_slot(prof, prof->entries[i].func)] = i + 1;
+		}
+	}
+	return res;
+}
+
+static void profile_enter(uint32_t func, NameId name_id){
+	Profiler *prof = &global_profiler;
+	if (prof->frame_count == prof->frame_capacity){
+		prof->frame_capacity = util_max_usize(256, 2*prof->frame_capacity);
+		prof->frames = realloc(prof->frames, prof->frame_capacity*sizeof(ProfileFrame));
+		assert(prof->frames != NULL && "profiler allocation failrule");
+	}
+	uint32_t index = profile_entry(func, name_id);
+	ProfileEntry *entry = prof->entries + index;
+	entry->calls += 1;
+	entry->depth += 1;
+	entry->max_depth = entry->depth > entry->max_depth ? entry->depth : entry->max_depth;
+	prof->frames[prof->frame_count] = (ProfileFrame){ .entry = index, .start = profile_ticks() };
+	prof->frame_count += 1;
+}
+
+static void profile_leave(void){
+	uint64_t now = profile_ticks();
+	Profiler *prof = &global_profiler;
+	prof->frame_count -= 1;
+	ProfileFrame frame = prof->frames[prof->frame_count];
+	ProfileEntry *entry = prof->entries + frame.entry;
+	uint64_t elapsed = now - frame.start;
+	entry->exclusive += elapsed - frame.children;
+	entry->depth -= 1;
+	if (entry->depth == 0) entry->inclusive += elapsed;
+	if (prof->frame_count != 0) prof->frames[prof->frame_count-1].children += elapsed;
+}
+
+
+static int profile_compare_exclusive(const void *a, const void *b){
+	uint64_t x = ((const ProfileEntry *)a)->exclusive, y = ((const ProfileEntry *)b)->exclusive;
+	return (x < y) - (x > y);
+}
+
+// anonymous functions are named by where they are defined in the text
+static void print_profile(const char *text, AstArray nodes){
+	Profiler *prof = &global_profiler;
+	double ns_per_tick = (double)(profile_ns() - prof->start_ns) / (double)(profile_ticks() - prof->start_ticks);
+	uint64_t total = 0;
+	for (size_t i=0; i!=prof->entry_count; i+=1) total += prof->entries[i].exclusive;
+	qsort(prof->entries, prof->entry_count, sizeof(ProfileEntry), profile_compare_exclusive);
+	// entries are sorted, so the table doesn't find them anymore
+	memset(prof->slots, 0, prof->slot_capacity*sizeof(uint32_t));
+
+	fprintf(stderr, "\n      calls | inclusive [ms] | exclusive [ms] |      %% | max depth | function\n");
+	fprintf(stderr, "------------+----------------+----------------+--------+-----------+----------------------\n");
+	for (size_t i=0; i!=prof->entry_count; i+=1){
+		ProfileEntry entry = prof->entries[i];
+		fprintf(stderr, " %10lu | %14.3lf | %14.3lf | %6.2lf | %9u | ",
+			entry.calls, entry.inclusive*ns_per_tick*0.000001, entry.exclusive*ns_per_tick*0.000001,
+			total != 0 ? 100.0*entry.exclusive/total : 0.0, entry.max_depth
+		);
+		if (entry.name_id != 0){
+			const uint8_t *name = global_names.data + entry.name_id;
+			fprintf(stderr, "%.*s\n", (int)*(name-1), (const char *)name);
+			continue;
+		}
+		size_t row = 0, col = 0;
+		for (size_t j=0; j!=nodes.data[entry.func].pos && text[j]!='\0'; j+=1){
+			col += 1;
+			if (text[j] == '\n' || text[j] == '\v'){
+				row += 1;
+				col = 0;
+			}
+		}
+		fprintf(stderr, "anonymous at row: %zu, column: %zu\n", row, col);
+	}
+	fprintf(stderr, "------------+----------------+----------------+--------+-----------+----------------------\n");
+}
+
+
+
+// SAMPLING PROFILER
+// a timer signal copies where the evaluation is and the call sites of its
+// frames into a buffer that was reserved up front, the sampled evaluator only
+// publishes its current node and the number of its frames, samples are mapped
+// to functions and positions in the text when they are written as folded stacks
+typedef struct{
+	// state of the evaluation, the signal handler reads it between any two stores
+	const AstNode   *volatile nodes;
+	const AstNode   *volatile ast; // NULL outside of evaluation
+	const CallFrame *volatile frames;
+	volatile size_t frame_count;
+
+	// every sample is its word count with the truncated bit, call sites from
+	// the outermost one and the node that was evaluated
+	VmemBlock buffer;
+	size_t    size; // in words
+	volatile size_t samples;
+	volatile size_t dropped; // buffer was full
+	volatile size_t idle;    // nothing was evaluated
+	bool enabled;
+	struct sigaction previous;
+} Sampler;
+
+// signals are delivered to any thread, so the state isn't thread local
+static Sampler global_sampler;
+
+
+static bool sampler_enabled(void){
+	return global_sampler.enabled;
+}
+
+static void sampler_signal(int signal){
+	Sampler *s = &global_sampler;
+	const AstNode *ast = s->ast;
+	if (ast == NULL){
+		s->idle += 1;
+		return;
+	}
+	size_t depth = s->frame_count;
+	size_t first = depth > SAMPLER_MAX_DEPTH ? depth - SAMPLER_MAX_DEPTH : 0;
+	size_t words = depth - first + 2;
+	if ((s->size + words)*sizeof(uint32_t) > s->buffer.size){
+		s->dropped += 1;
+		return;
+	}
+	uint32_t *sample = (uint32_t *)s->buffer.data + s->size;
+	sample[0] = words | (first != 0 ? SAMPLER_TRUNCATED : 0);
+	for (size_t i=first; i!=depth; i+=1) sample[1 + i - first] = s->frames[i].ast_index;
+	sample[words-1] = ast - s->nodes;
+	s->size += words;
+	s->samples += 1;
+}
+
+// returns false if the timer can't be started
+static bool sampler_start(void){
+	Sampler *s = &global_sampler;
+	*s = (Sampler){ .buffer = vmem_reserve(SAMPLER_BUFFER_SIZE) };
+	if (s->buffer.data == NULL) return false;
+	struct sigaction action = { .sa_handler = sampler_signal, .sa_flags = SA_RESTART };
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, &s->previous) != 0){
+		vmem_release(s->buffer);
+		return false;
+	}
+	s->enabled = true;
+	struct itimerval timer = {
+		.it_interval = { .tv_usec = SAMPLER_INTERVAL_US },
+		.it_value    = { .tv_usec = SAMPLER_INTERVAL_US },
+	};
+	if (setitimer(ITIMER_PROF, &timer, NULL) != 0){
+		sigaction(SIGPROF, &s->previous, NULL);
+		vmem_release(s->buffer);
+		s->enabled = false;
+		return false;
+	}
+	return true;
+}
+
+static void sampler_stop(void){
+	Sampler *s = &global_sampler;
+	if (!s->enabled) return;
+	struct itimerval timer = {0};
+	setitimer(ITIMER_PROF, &timer, NULL);
+	sigaction(SIGPROF, &s->previous, NULL);
+	s->enabled = false;
+}
+
+static void sampler_free(void){
+	vmem_release(global_sampler.buffer);
+	global_sampler.buffer = (VmemBlock){0};
+}
+
+
+typedef struct{
+	const char *text;
+	AstArray    nodes;
+	uint32_t   *owners; // innermost function of every node, 0 for the top level
+	uint32_t   *rows;   // positions where the rows of the text start
+	size_t      row_count;
+	char       *data;   // stacks of all samples, every one ends with a zero
+	size_t      size;
+	size_t      capacity;
+} SamplerReport;
+
+static void sampler_append(SamplerReport *rep, const char *format, ...){
+	for (;;){
+		va_list args;
+		va_start(args, format);
+		size_t space = rep->capacity - rep->size;
+		int length = vsnprintf(rep->data + rep->size, space, format, args);
+		va_end(args);
+		assert(length >= 0);
+		if ((size_t)length < space){
+			rep->size += length;
+			return;
+		}
+		rep->capacity = util_max_usize(4096, 2*rep->capacity + length);
+		rep->data = realloc(rep->data, rep->capacity);
+		assert(rep->data != NULL && "sampler allocation failrule");
+	}
+}
+
+// frame is the function's name, row and column of the node, like print_codeline counts them
+static void sampler_append_frame(SamplerReport *rep, uint32_t index){
+	uint32_t func = rep->owners[index];
+	// position of a jump is its offset, it is counted to the node that takes the conditional's value
+	while (rep->nodes.data[index].type == Ast_Jump) index += rep->nodes.data[index].pos + 1;
+	uint32_t pos = rep->nodes.data[index].pos;
+	size_t low = 0, high = rep->row_count;
+	while (high - low > 1){
+		size_t mid = (low + high) / 2;
+		if (rep->rows[mid] <= pos) low = mid; else high = mid;
+	}
+	size_t col = pos - rep->rows[low];
+	if (func == 0){
+		sampler_append(rep, "top level:%zu:%zu", low, col);
+		return;
+	}
+	const AstNode *after = rep->nodes.data + func + 1 + (rep->nodes.data + func + 1)->data.funcnodeinfo.node_size;
+	if (after->type != Ast_Variable){
+		sampler_append(rep, "anonymous:%zu:%zu", low, col);
+		return;
+	}
+	const uint8_t *name = global_names.data + (after+1)->data.name_id;
+	sampler_append(rep, "%.*s:%zu:%zu", (int)*(name-1), (const char *)name, low, col);
+}
+
+static int sampler_compare_stacks(const void *a, const void *b){
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// writes a line of frames from the outermost one and the number of its samples for every stack
+static bool sampler_write(const char *path, const char *text, AstArray nodes){
+	FILE *file = fopen(path, "w");
+	if (file == NULL) return false;
+	Sampler *s = &global_sampler;
+	size_t node_count = nodes.end - nodes.data + 1;
+	SamplerReport rep = {
+		.text = text, .nodes = nodes,
+		.owners = calloc(node_count, sizeof(uint32_t)),
+		.rows = malloc((strlen(text) + 1)*sizeof(uint32_t)),
+	};
+	assert(rep.owners != NULL && rep.rows != NULL && "sampler allocation failrule");
+	// functions come before the functions inside of them, which overwrite their part
+	for (uint32_t i=1; i<node_count;){
+		AstNode node = nodes.data[i];
+		if (node.type == Ast_Terminator) break;
+		if (node.type == Ast_Function){
+			uint32_t end = i + 1 + nodes.data[i+1].data.funcnodeinfo.node_size;
+			for (uint32_t j=i; j!=end; j+=1) rep.owners[j] = i;
+		}
+		i += AstNodeSizes[node.type] + (node.type == Ast_Function ? node.count : 0);
+	}
+	rep.rows[rep.row_count] = 0;
+	rep.row_count += 1;
+	for (uint32_t i=0; text[i]!='\0'; i+=1){
+		if (text[i] != '\n' && text[i] != '\v') continue;
+		rep.rows[rep.row_count] = i + 1;
+		rep.row_count += 1;
+	}
+
+	const uint32_t *data = s->buffer.data;
+	size_t *offsets = malloc(util_max_usize(1, s->samples)*sizeof(size_t));
+	assert(offsets != NULL && "sampler allocation failrule");
+	size_t count = 0;
+	for (size_t i=0; i<s->size; i+=data[i] & ~SAMPLER_TRUNCATED){
+		size_t words = data[i] & ~SAMPLER_TRUNCATED;
+		offsets[count] = rep.size;
+		count += 1;
+		if (data[i] & SAMPLER_TRUNCATED) sampler_append(&rep, "(truncated);");
+		for (size_t j=1; j!=words; j+=1){
+			uint32_t index = data[i+j];
+			// calls made by pipelines return to index 0
+			if (index == 0) continue;
+			// call sites are the nodes after the calls
+			sampler_append_frame(&rep, j+1 == words ? index : index - 1);
+			sampler_append(&rep, j+1 == words ? "" : ";");
+		}
+		rep.size += 1;
+	}
+	const char **stacks = malloc(util_max_usize(1, count)*sizeof(const char *));
+	assert(stacks != NULL && "sampler allocation failrule");
+	for (size_t i=0; i!=count; i+=1) stacks[i] = rep.data + offsets[i];
+	qsort(stacks, count, sizeof(const char *), sampler_compare_stacks);
+	for (size_t i=0; i!=count;){
+		size_t same = 1;
+		while (i + same != count && strcmp(stacks[i], stacks[i + same]) == 0) same += 1;
+		fprintf(file, "%s %zu\n", stacks[i], same);
+		i += same;
+	}
+	bool res = ferror(file) == 0;
+	res &= fclose(file) == 0;
+	free(stacks);
+	free(offsets);
+	free(rep.owners);
+	free(rep.rows);
+	free(rep.data);
+	return res;
+}
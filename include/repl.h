@@ -0,0 +1,187 @@
+#pragma once
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "eval.h"
+
+
+
+// INTERACTIVE EVALUATION
+// lines are collected until a statement ends outside of brackets, strings
+// and comments, then only they are compiled and their nodes go where the nodes
+// of earlier lines end, so indices of functions defined before stay valid,
+// variables are kept on the session's stacks, names in the name table and
+// values in the heaps, so a line costs as much as its own statements
+typedef struct{
+	char    *text;   // literals without escapes point into it
+	uint32_t offset; // positions of the chunk's nodes start here
+} ReplChunk;
+
+typedef struct{
+	AstArray   nodes;
+	uint32_t   end;       // terminator of the nodes that were evaluated so far
+	EvalStacks stacks;
+	size_t     kept_vars;
+	ReplChunk *chunks;    // ordered by their offsets
+	size_t     chunk_count;
+	size_t     chunk_capacity;
+	uint32_t   text_size; // positions of the next chunk start here
+} ReplSession;
+
+
+// brackets that are still open at the end of the text, strings and comments are skipped
+static int64_t repl_open_brackets(const char *text){
+	int64_t depth = 0;
+	for (const char *c=text; *c!='\0'; c+=1){
+		switch (*c){
+		case '(': case '[': case '{': depth += 1; break;
+		case ')': case ']': case '}': depth -= 1; break;
+		case '"':
+			for (c+=1; *c!='"'; c+=1){
+				if (*c == '\0') return depth;
+				if (*c == '\\' && c[1] != '\0') c += 1;
+			}
+			break;
+		case '/':
+			if (c[1] == '/'){
+				while (c[1] != '\0' && c[1] != '\n') c += 1;
+			} else if (c[1] == '*'){
+				c += 1;
+				for (size_t nested=1; nested!=0;){
+					c += 1;
+					if (*c == '\0') return depth;
+					if (c[0] == '*' && c[1] == '/'){ c += 1; nested -= 1; }
+					else if (c[0] == '/' && c[1] == '*'){ c += 1; nested += 1; }
+				}
+			}
+			break;
+		default: break;
+		}
+	}
+	return depth;
+}
+
+// errors that more lines can fix, any error while a bracket is open could be one
+static bool repl_unfinished(const char *msg, const char *text){
+	return strcmp(msg, "unexpected end of file") == 0
+		|| strcmp(msg, "end of file inside of string literal") == 0
+		|| strcmp(msg, "unfinished comment") == 0
+		|| repl_open_brackets(text) > 0;
+}
+
+static void repl_print_error(const ReplSession *repl, EvalError err){
+	size_t low = 0, high = repl->chunk_count;
+	while (high - low > 1){
+		size_t mid = (low + high) / 2;
+		if (repl->chunks[mid].offset <= err.pos) low = mid; else high = mid;
+	}
+	fprintf(stderr, "error: \"%s\"", err.msg);
+	print_codeline(repl->chunks[low].text, err.pos - repl->chunks[low].offset);
+	fflush(stdout);
+}
+
+// the session takes the text and the nodes, returns the error of the evaluation
+static EvalError repl_eval(ReplSession *repl, char *text, size_t size, AstArray ast){
+	// later lines may bind the names again, so nothing is propagated by the optimizer
+	ast_shift_positions(ast, repl->text_size);
+	if (repl->chunk_count == repl->chunk_capacity){
+		repl->chunk_capacity = util_max_usize(16, 2*repl->chunk_capacity);
+		repl->chunks = realloc(repl->chunks, repl->chunk_capacity*sizeof(ReplChunk));
+		assert(repl->chunks != NULL && "repl allocation failrule");
+	}
+	repl->chunks[repl->chunk_count] = (ReplChunk){ text, repl->text_size };
+	repl->chunk_count += 1;
+	repl->text_size += size + 1;
+
+	uint32_t length = ast_terminator(ast);
+	while ((size_t)(repl->nodes.maxptr - repl->nodes.data) < repl->end + length){
+		ast_array_grow(&repl->nodes);
+	}
+	memcpy(repl->nodes.data + repl->end, ast.data + 1, length*sizeof(AstNode));
+	repl->nodes.end = repl->nodes.data + repl->end + length;
+	mem_free(ast.data);
+
+	EvalScope scope = {
+		.start = repl->end, .keep_heaps = true,
+		.stacks = &repl->stacks, .keep_vars = true, .kept_vars = repl->kept_vars,
+	};
+	EvalError err = eval_scope(repl->nodes, &scope);
+	repl->kept_vars = scope.kept_vars;
+	repl->end += length - 1;
+	output_flush();
+	return err;
+}
+
+// prompts are written when both ends are a terminal, an empty line ends an
+// unfinished statement, returns the number of lines that failed
+static size_t eval_repl(FILE *input){
+	bool prompt = isatty(fileno(input)) && isatty(STDOUT_FILENO);
+	ReplSession repl = { .nodes = ast_array_new(1024), .end = 1, .stacks = eval_stacks_get() };
+	repl.nodes.data[0] = (AstNode){ .type = Ast_Semicolon };
+	repl.nodes.data[1] = (AstNode){ .type = Ast_Terminator };
+	repl.nodes.end = repl.nodes.data + 2;
+	// nodes of a chunk are copied to the session's, so the arena is reset before every chunk
+	MemArena *prev_arena = global_mem_arena;
+	MemArena arena = vmem_arena(vmem_default_reserve());
+	global_mem_arena = &arena;
+
+	size_t errors = 0;
+	char  *line = NULL;
+	size_t line_capacity = 0;
+	char  *text = NULL; // lines of the unfinished statement
+	size_t text_size = 0;
+	size_t text_capacity = 0;
+	for (;;){
+		if (prompt){
+			fputs(text_size == 0 ? "> " : ". ", stdout);
+			fflush(stdout);
+		}
+		ssize_t length = getline(&line, &line_capacity, input);
+		bool blank = length <= 0 || strspn(line, " \t\r\n\v\f") == (size_t)length;
+		if (length <= 0 && text_size == 0) break;
+		if (blank && text_size == 0) continue;
+		if (length > 0){
+			if (text_capacity < text_size + length + 1){
+				text_capacity = util_max_usize(2*text_capacity, text_size + length + 1);
+				text = realloc(text, text_capacity);
+				assert(text != NULL && "repl allocation failrule");
+			}
+			memcpy(text + text_size, line, length + 1);
+			text_size += length;
+		}
+
+		mem_arena_reset(&arena);
+		AstArray ast = make_tokens(text);
+		AstNode *buffer = ast.data;
+		if (ast.data != NULL) ast = parse_tokens(ast);
+		if (ast.data == NULL){
+			mem_free(buffer);
+			if (!blank && repl_unfinished(ast.error, text)) continue;
+			errors += 1;
+			output_flush();
+			fprintf(stderr, "error: \"%s\"", ast.error);
+			print_codeline(text, ast.position);
+			fflush(stdout);
+		} else{
+			EvalError err = repl_eval(&repl, text, text_size, ast);
+			text = NULL;
+			text_capacity = 0;
+			if (err.msg != NULL){
+				errors += 1;
+				repl_print_error(&repl, err);
+			}
+		}
+		text_size = 0;
+		if (length <= 0) break;
+	}
+	free(line);
+	free(text);
+	eval_stacks_free(repl.stacks);
+	for (size_t i=0; i!=repl.chunk_count; i+=1) free(repl.chunks[i].text);
+	free(repl.chunks);
+	mem_free(repl.nodes.data);
+	vmem_arena_release(&arena);
+	global_mem_arena = prev_arena;
+	return errors;
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "optimize.h"
+#include "eval.h"
+#include "workpool.h"
+
+
+
+// SCRIPT BATCHES
+// many independent scripts are compiled and evaluated by one process, every
+// worker has its own name table, arena, heaps and stacks, which are emptied
+// between scripts, so nothing of one script is seen by the next one, output
+// and errors of a script are captured and written in the order of the files,
+// workers take the next file from a shared counter, so the pool's queue is
+// only used to start them
+typedef struct{
+	const char *path;
+	char  *output;
+	size_t output_size;
+	char  *errors; // messages with positions, written to stderr
+	size_t errors_size;
+	size_t bytes;
+	bool   failed;
+	_Atomic bool done;
+} ScriptFile;
+
+typedef struct{
+	ScriptFile *files;
+	size_t      file_count;
+	bool        optimize;
+	_Atomic size_t next; // file that no worker took yet
+
+	WorkPool        pool;
+	pthread_mutex_t mutex; // guards finished files
+	pthread_cond_t  cond;
+} ScriptBatch;
+
+typedef struct{
+	PoolTask     task;
+	ScriptBatch *batch;
+} ScriptRunner;
+
+typedef struct{
+	size_t files;
+	size_t failed;
+	size_t bytes;
+	double seconds;
+} ScriptStats;
+
+static _Thread_local NameTable scripts_names;
+static _Thread_local MemArena  scripts_arena;
+
+
+static int scripts_compare_paths(const void *a, const void *b){
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void scripts_push_path(char ***paths, size_t *count, size_t *capacity, char *path){
+	if (*count == *capacity){
+		*capacity = util_max_usize(64, 2*(*capacity));
+		*paths = realloc(*paths, *capacity*sizeof(char *));
+		assert(*paths != NULL && "script allocation failrule");
+	}
+	(*paths)[*count] = path;
+	*count += 1;
+}
+
+// files of a directory are added in the order of their names, hidden ones and
+// subdirectories are skipped, the caller frees the paths and the array
+static bool scripts_add_path(const char *path, char ***paths, size_t *count, size_t *capacity){
+	struct stat s;
+	if (stat(path, &s) != 0) return false;
+	size_t first = *count;
+	if (S_ISDIR(s.st_mode)){
+		DIR *dir = opendir(path);
+		if (dir == NULL) return false;
+		for (struct dirent *entry; (entry = readdir(dir)) != NULL;){
+			if (entry->d_name[0] == '.') continue;
+			char *file = NULL;
+			if (asprintf(&file, "%s/%s", path, entry->d_name) < 0) continue;
+			if (stat(file, &s) != 0 || !S_ISREG(s.st_mode)){
+				free(file);
+				continue;
+			}
+			scripts_push_path(paths, count, capacity, file);
+		}
+		closedir(dir);
+		qsort(*paths + first, *count - first, sizeof(char *), scripts_compare_paths);
+		return true;
+	}
+	char *file = strdup(path);
+	assert(file != NULL && "script allocation failrule");
+	scripts_push_path(paths, count, capacity, file);
+	return true;
+}
+
+
+static void scripts_thread_begin(WorkPool *pool){
+	(void)pool;
+	global_name_table = &scripts_names;
+	initialize_compiler_globals();
+	scripts_arena = vmem_arena(vmem_default_reserve());
+	global_mem_arena = &scripts_arena;
+	output_init_capture();
+}
+
+static void scripts_thread_end(WorkPool *pool){
+	(void)pool;
+	output_finish();
+	eval_stacks_release();
+	global_mem_arena = NULL;
+	vmem_arena_release(&scripts_arena);
+	free_compiler_globals();
+	global_name_table = &global_default_names;
+}
+
+static void scripts_error(FILE *errors, const char *path, const char *text, const char *msg, uint32_t pos){
+	fprintf(errors, "%s: error: \"%s\"", path, msg);
+	write_codeline(errors, errors, text, pos);
+}
+
+static void scripts_run_file(ScriptBatch *batch, ScriptFile *file){
+	FILE *errors = open_memstream(&file->errors, &file->errors_size);
+	assert(errors != NULL && "script allocation failrule");
+	FILE *input = fopen(file->path, "r");
+	StringView text = {0};
+	if (input != NULL){
+		text = read_file(input);
+		fclose(input);
+	}
+	if (text.data == NULL){
+		fprintf(errors, "error while reading the file: \"%s\"\n", file->path);
+		file->failed = true;
+		fclose(errors);
+		return;
+	}
+	file->bytes = text.size;
+
+	// the script sees only the builtins
+	reset_compiler_globals();
+	eval_init_builtins();
+	mem_arena_reset(&scripts_arena);
+	AstArray ast = make_tokens(text.data);
+	AstNode *buffer = ast.data;
+	if (ast.data != NULL) ast = parse_tokens(ast);
+	if (ast.data == NULL){
+		mem_free(buffer);
+		scripts_error(errors, file->path, text.data, ast.error, ast.position);
+		file->failed = true;
+	} else{
+		if (batch->optimize){
+			OptimizeStats stats;
+			ast = optimize_ast(ast, &stats);
+			ast = remove_dead_definitions(ast, &stats);
+		}
+		EvalScope scope = {0};
+		EvalError err = eval_scope(ast, &scope);
+		if (err.msg != NULL){
+			scripts_error(errors, file->path, text.data, err.msg, err.pos);
+			file->failed = true;
+		}
+		mem_free(ast.data);
+	}
+	file->output = output_take(&file->output_size);
+	string_heap_release(&global_literal_heap);
+	mem_free(text.data);
+	fclose(errors);
+}
+
+static void scripts_run(PoolTask *task){
+	ScriptBatch *batch = ((ScriptRunner *)task)->batch;
+	for (;;){
+		size_t index = atomic_fetch_add(&batch->next, 1);
+		if (index >= batch->file_count) return;
+		ScriptFile *file = batch->files + index;
+		scripts_run_file(batch, file);
+		pthread_mutex_lock(&batch->mutex);
+		atomic_store(&file->done, true);
+		pthread_cond_broadcast(&batch->cond);
+		pthread_mutex_unlock(&batch->mutex);
+	}
+}
+
+
+// output goes to the calling thread's output, errors to stderr,
+// returns the number of scripts that failed
+static size_t eval_scripts(const char *const *paths, size_t count, size_t thread_count, bool optimize, ScriptStats *stats){
+	struct timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ScriptBatch batch = {
+		.files = calloc(util_max_usize(count, 1), sizeof(ScriptFile)),
+		.file_count = count, .optimize = optimize,
+	};
+	assert(batch.files != NULL && "script allocation failrule");
+	for (size_t i=0; i!=count; i+=1) batch.files[i].path = paths[i];
+	// everything that threads would otherwise initialize on first use
+	vmem_default_reserve();
+	format_init_tables();
+	pthread_mutex_init(&batch.mutex, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+
+	thread_count = util_clamp_usize(thread_count, 1, util_max_usize(count, 1));
+	batch.pool = (WorkPool){ .thread_begin = scripts_thread_begin, .thread_end = scripts_thread_end };
+	ScriptRunner *runners = malloc(thread_count*sizeof(ScriptRunner));
+	assert(runners != NULL && "script allocation failrule");
+	bool started = pool_start(&batch.pool, thread_count);
+	for (size_t i=0; started && i!=batch.pool.thread_count; i+=1){
+		runners[i] = (ScriptRunner){ .task.run = scripts_run, .batch = &batch };
+		pool_submit(&batch.pool, &runners[i].task);
+	}
+
+	// reorder buffer, a script is written as soon as all earlier ones are
+	size_t failed = 0;
+	*stats = (ScriptStats){ .files = count };
+	for (size_t i=0; started && i!=count; i+=1){
+		ScriptFile *file = batch.files + i;
+		pthread_mutex_lock(&batch.mutex);
+		while (!atomic_load(&file->done)) pthread_cond_wait(&batch.cond, &batch.mutex);
+		pthread_mutex_unlock(&batch.mutex);
+		if (file->output_size != 0) output_bytes(file->output, file->output_size);
+		if (file->errors_size != 0){
+			output_flush();
+			fwrite(file->errors, 1, file->errors_size, stderr);
+			fflush(stderr);
+		}
+		failed += file->failed;
+		stats->bytes += file->bytes;
+		free(file->output);
+		free(file->errors);
+		file->output = NULL;
+		file->errors = NULL;
+	}
+	if (started){
+		pool_stop(&batch.pool);
+	} else{
+		fprintf(stderr, "error: no thread could be started\n");
+		failed = count;
+	}
+
+	pthread_mutex_destroy(&batch.mutex);
+	pthread_cond_destroy(&batch.cond);
+	free(runners);
+	free(batch.files);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	stats->failed = failed;
+	stats->seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 0.000000001;
+	return failed;
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "classes.h"
+#include "output.h"
+
+#define STRING_CHUNK_SIZE ((size_t)64 << 10)
+
+// strings up to this length are stored in the name table, so equal ones share an id
+#ifndef STRING_INTERN_MAX
+	#define STRING_INTERN_MAX 64
+#endif
+
+// name ids have 24 bits, interning stops before the name data gets that big
+#define STRING_NAMES_LIMIT ((size_t)1 << 24)
+
+// names table can't grow while several threads evaluate, strings made
+// during evaluation are then not interned
+static bool global_string_interning = true;
+
+// ropes shallower than this are traversed without allocating a stack
+#define STRING_SMALL_DEPTH 64
+
+
+
+// STRINGS
+// flat strings point to their bytes, which are in the source text for
+// literals without escapes, in the name table for interned strings and in
+// the string heap otherwise, concatenation of longer strings makes a rope
+// node, so repeated concatenation never copies what was already joined,
+// every string knows its hash, that is the djb2 hash of the name table,
+// it can be combined from the hashes of both halves of a rope
+typedef struct String{
+	uint32_t length;
+	uint32_t depth;    // 0 for flat strings, rope nodes are deeper than their children
+	uint64_t hash;
+	NameId   name_id;  // id of an interned string, 0 otherwise
+	union{
+		const char *text;
+		struct{
+			const struct String *left;
+			const struct String *right;
+		};
+	};
+} String;
+
+
+
+// STRING HEAPS
+// literals are made by the tokenizer and live as long as the program,
+// strings made during evaluation are released when it ends
+typedef struct StringChunk{
+	struct StringChunk *next;
+	size_t size;
+	size_t capacity;
+	uint64_t data[];
+} StringChunk;
+
+typedef struct{
+	StringChunk *chunks;
+	size_t allocations;
+	size_t bytes;
+} StringHeap;
+
+// literals live as long as their program
+static _Thread_local StringHeap global_literal_heap;
+static _Thread_local StringHeap global_string_heap;
+
+
+static void *string_heap_alloc(StringHeap *heap, size_t size){
+	size_t words = util_roundup(size, sizeof(uint64_t));
+	StringChunk *chunk = heap->chunks;
+	if (chunk == NULL || chunk->capacity - chunk->size < words){
+		size_t capacity = util_max_usize(STRING_CHUNK_SIZE / sizeof(uint64_t), words);
+		chunk = mem_alloc(sizeof(StringChunk) + capacity*sizeof(uint64_t));
+		assert(chunk != NULL && "string allocation failrule");
+		chunk->size = 0;
+		chunk->capacity = capacity;
+		// a dedicated chunk of an oversized string goes behind the current one
+		if (heap->chunks != NULL && capacity > STRING_CHUNK_SIZE / sizeof(uint64_t)){
+			chunk->next = heap->chunks->next;
+			heap->chunks->next = chunk;
+		} else{
+			chunk->next = heap->chunks;
+			heap->chunks = chunk;
+		}
+	}
+	void *res = chunk->data + chunk->size;
+	chunk->size += words;
+	heap->allocations += 1;
+	heap->bytes += words*sizeof(uint64_t);
+	return res;
+}
+
+static void string_heap_release(StringHeap *heap){
+	StringChunk *chunk = heap->chunks;
+	while (chunk != NULL){
+		StringChunk *next = chunk->next;
+		mem_free(chunk);
+		chunk = next;
+	}
+	heap->chunks = NULL;
+}
+
+
+
+// FLAT STRINGS
+static inline const char *string_text(const String *str){
+	if (str->name_id != 0) return (const char *)global_names.data + str->name_id;
+	return str->text;
+}
+
+// text has to outlive the string, short strings are interned instead
+static String *string_flat(StringHeap *heap, const char *text, size_t length){
+	String *res = string_heap_alloc(heap, sizeof(String));
+	*res = (String){ .length = length, .hash = name_hash(text, length), .text = text };
+	if (
+		global_string_interning && length != 0 && length <= STRING_INTERN_MAX &&
+		global_names.size + length < STRING_NAMES_LIMIT
+	){
+		res->name_id = get_name_id(text, length);
+		res->text = NULL;
+	}
+	return res;
+}
+
+// literal without escapes is used straight from the source text
+static String *string_literal(const char *text, size_t length){
+	return string_flat(&global_literal_heap, text, length);
+}
+
+// returns a buffer for decoded literal of given size
+static char *string_literal_buffer(size_t size){
+	return string_heap_alloc(&global_literal_heap, size);
+}
+
+
+
+// ROPES
+// pieces of a rope are visited from left to right with an explicit stack
+typedef struct{
+	const String  *small[STRING_SMALL_DEPTH];
+	const String **stack;
+	size_t count;
+} StringIter;
+
+static void string_iter_init(StringIter *it, const String *str){
+	it->stack = it->small;
+	if (str->depth >= STRING_SMALL_DEPTH){
+		it->stack = mem_alloc((str->depth + 1)*sizeof(const String *));
+		assert(it->stack != NULL && "string allocation failrule");
+	}
+	it->stack[0] = str;
+	it->count = 1;
+}
+
+// returns the next flat piece or NULL at the end
+static const String *string_iter_next(StringIter *it){
+	while (it->count != 0){
+		it->count -= 1;
+		const String *str = it->stack[it->count];
+		if (str->depth == 0) return str;
+		it->stack[it->count] = str->right;
+		it->stack[it->count+1] = str->left;
+		it->count += 2;
+	}
+	return NULL;
+}
+
+static void string_iter_free(StringIter *it){
+	if (it->stack != it->small) mem_free(it->stack);
+}
+
+static void string_copy(char *dest, const String *str){
+	StringIter it;
+	string_iter_init(&it, str);
+	for (const String *piece; (piece = string_iter_next(&it)) != NULL;){
+		memcpy(dest, string_text(piece), piece->length);
+		dest += piece->length;
+	}
+	string_iter_free(&it);
+}
+
+// djb2 hash of the joined string from the hashes of both parts
+static uint64_t string_hash_join(uint64_t lhs, uint64_t rhs, size_t rhs_length){
+	uint64_t scale = 1;
+	for (uint64_t base=33, n=rhs_length; n!=0; n>>=1, base*=base){
+		if (n & 1) scale *= base;
+	}
+	return lhs*scale + rhs - 5381*scale;
+}
+
+static const char *string_concat(const String *lhs, const String *rhs, const String **res){
+	if (lhs->length == 0){ *res = rhs; return NULL; }
+	if (rhs->length == 0){ *res = lhs; return NULL; }
+	size_t length = (size_t)lhs->length + rhs->length;
+	if (length > UINT32_MAX) return "string is too large";
+	if (length <= STRING_INTERN_MAX){
+		char text[STRING_INTERN_MAX];
+		string_copy(text, lhs);
+		string_copy(text + lhs->length, rhs);
+		String *str = string_flat(&global_string_heap, text, length);
+		// name table keeps its own copy of the bytes
+		if (str->name_id == 0){
+			char *copy = string_heap_alloc(&global_string_heap, length);
+			memcpy(copy, text, length);
+			str->text = copy;
+		}
+		*res = str;
+		return NULL;
+	}
+	String *node = string_heap_alloc(&global_string_heap, sizeof(String));
+	*node = (String){
+		.length = length,
+		.depth  = 1 + util_max_u32(lhs->depth, rhs->depth),
+		.hash   = string_hash_join(lhs->hash, rhs->hash, rhs->length),
+		.left   = lhs,
+		.right  = rhs,
+	};
+	*res = node;
+	return NULL;
+}
+
+
+
+// COMPARISON
+static bool string_equal(const String *lhs, const String *rhs){
+	if (lhs == rhs) return true;
+	if (lhs->length != rhs->length || lhs->hash != rhs->hash) return false;
+	if (lhs->name_id != 0 && rhs->name_id != 0) return lhs->name_id == rhs->name_id;
+	if (lhs->depth == 0 && rhs->depth == 0)
+		return memcmp(string_text(lhs), string_text(rhs), lhs->length) == 0;
+	char *a = mem_alloc(lhs->length);
+	char *b = mem_alloc(rhs->length);
+	assert(a != NULL && b != NULL && "string allocation failrule");
+	string_copy(a, lhs);
+	string_copy(b, rhs);
+	bool res = memcmp(a, b, lhs->length) == 0;
+	mem_free(a);
+	mem_free(b);
+	return res;
+}
+
+static const char *string_binary_op(AstNode node, Value lhs, Value rhs, Value *res_ptr){
+	if (lhs.type != DT_String || rhs.type != DT_String)
+		return "opperator's arguments have different types";
+	switch (node.type){
+	case Ast_Concat:{
+		const String *str;
+		const char *msg = string_concat(lhs.data.ptr, rhs.data.ptr, &str);
+		if (msg != NULL) return msg;
+		*res_ptr = (Value){ .type = DT_String, .data.ptr = (void *)str };
+		return NULL;
+	}
+	case Ast_Equal:{
+		bool equal = string_equal(lhs.data.ptr, rhs.data.ptr);
+		if (node.flags & AstFlag_Negate) equal = !equal;
+		*res_ptr = (Value){ .type = DT_Bool, .data.boolean = equal };
+		return NULL;
+	}
+	default: return "argument's type is not supported by this operator";
+	}
+}
+
+
+
+// PRINTING
+static void string_output(const String *str){
+	StringIter it;
+	string_iter_init(&it, str);
+	for (const String *piece; (piece = string_iter_next(&it)) != NULL;){
+		output_bytes(string_text(piece), piece->length);
+	}
+	string_iter_free(&it);
+}
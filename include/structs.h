@@ -10,7 +10,6 @@ typedef int32_t  VarIndex;
 
 enum DataType{
 	DT_Null =  0,
-	DT_CallInfo,
 	DT_Error,
 	DT_Real,
 	DT_Integer,
@@ -18,6 +17,11 @@ enum DataType{
 	DT_String,
 	DT_Array,
 	DT_Function,
+	DT_BigInt,
+	DT_Sequence,
+	DT_Stage,
+	DT_Set,
+	DT_Dict,
 };
 
 typedef struct{
@@ -25,9 +29,14 @@ typedef struct{
 	uint32_t size;
 } StaticBufInfo;
 
+enum FunctionFlags{
+	FuncFlag_Pure = 1 << 0, // result depends only on the arguments
+};
+
 typedef struct{
 	uint32_t node_size;
-	uint32_t flags;
+	uint32_t flags : 8;
+	uint32_t meta  : 24; // index of function's runtime data, 0 if it has none
 } FunctionNodeInfo;
 
 typedef struct{
@@ -35,11 +44,6 @@ typedef struct{
 	uint32_t name_id;
 } FunctionInfo;
 
-typedef struct{
-	uint32_t ast_index;
-	uint32_t vars_size;
-} CallInfo;
-
 typedef union Data{
 	uint8_t  bytes[8];
 	double   real;
@@ -51,7 +55,6 @@ typedef union Data{
 	StaticBufInfo bufinfo;
 	FunctionNodeInfo funcnodeinfo;	
 	FunctionInfo     funcinfo;	
-	CallInfo         callinfo;
 } Data;
 
 
@@ -59,9 +62,12 @@ typedef union Data{
 // PARSE TREE
 enum AstFlags{
 // general flags
+	AstFlag_DictValue = 1 << 0, // dictionary literal is reading a value, not a key
+	AstFlag_Fork      = 1 << 1, // call can run as a task while its right sibling is evaluated
 
 // operator flags
 	AstFlag_Negate = 1 << 3,
+	AstFlag_Join   = 1 << 4, // left operand may still be computed by a forked call
 };
 
 typedef union AstNode{
@@ -78,7 +84,6 @@ typedef union AstNode{
 
 typedef struct{
 	enum DataType type : 8;
-	NameId name_id; // only for variables
 	Data data;
 } Value;
 
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "parser.h"
+#include "value.h"
+#include "array.h"
+#include "string_value.h"
+#include "output.h"
+
+// smallest number of slots of a table that grows while it is built
+#define TABLE_MIN_SLOTS 8
+
+
+
+// HASH TABLES
+// sets and dictionaries are open addressed tables with linear probing, slots
+// only hold indices into a dense array of entries, so the slot array stays
+// small and entries are kept in the order they were inserted, that is also
+// the order in which tables are printed and iterated
+typedef struct{
+	uint64_t    hash;
+	PackedValue key;
+	PackedValue value; // unused by sets
+} TableEntry;
+
+typedef struct{
+	uint32_t count;
+	uint32_t mask;        // number of slots - 1, that is a power of two
+	uint8_t  type;        // DT_Set or DT_Dict
+	uint32_t *slots;      // index of an entry + 1, 0 marks an empty slot
+	TableEntry *entries;
+} Table;
+
+static _Thread_local struct{
+	size_t tables;
+	size_t lookups;
+	size_t probes;
+} global_table_stats;
+
+
+// tables are at most 3/4 full
+static inline size_t table_capacity(const Table *table){
+	return (table->mask + 1) / 4 * 3;
+}
+
+static void table_alloc_slots(Table *table, size_t slot_count){
+	size_t entry_count = slot_count / 4 * 3;
+	table->mask = slot_count - 1;
+	table->slots = (uint32_t *)array_heap_alloc(
+		util_roundup(slot_count*sizeof(uint32_t), sizeof(int64_t))
+	);
+	memset(table->slots, 0, slot_count*sizeof(uint32_t));
+	table->entries = (TableEntry *)array_heap_alloc(
+		util_roundup(entry_count*sizeof(TableEntry), sizeof(int64_t))
+	);
+}
+
+// table that holds count entries without growing
+static Table *table_new(enum DataType type, size_t count){
+	size_t slot_count = TABLE_MIN_SLOTS;
+	while (slot_count / 4 * 3 < count) slot_count *= 2;
+	Table *res = (Table *)array_heap_alloc(util_roundup(sizeof(Table), sizeof(int64_t)));
+	*res = (Table){ .type = type };
+	table_alloc_slots(res, slot_count);
+	global_table_stats.tables += 1;
+	return res;
+}
+
+// old arrays stay in the array heap, all of them together aren't larger than the last ones
+static void table_grow(Table *table){
+	const TableEntry *entries = table->entries;
+	table_alloc_slots(table, 2*((size_t)table->mask + 1));
+	memcpy(table->entries, entries, table->count*sizeof(TableEntry));
+	for (size_t i=0; i!=table->count; i+=1){
+		size_t slot = entries[i].hash & table->mask;
+		while (table->slots[slot] != 0) slot = (slot + 1) & table->mask;
+		table->slots[slot] = i + 1;
+	}
+}
+
+
+
+// KEYS
+// integers, reals, booleans and strings can be keys, keys of different types
+// are never equal, so 1 and 1.0 are two keys
+static inline uint64_t table_mix(uint64_t x){
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdu;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53u;
+	return x ^ (x >> 33);
+}
+
+static const char *table_key_hash(Value key, uint64_t *res){
+	uint64_t bits;
+	switch (key.type){
+	case DT_Integer: bits = key.data.integer; break;
+	case DT_Bool:    bits = key.data.boolean; break;
+	// zero and negative zero are equal
+	case DT_Real:    bits = key.data.real == 0.0 ? 0 : (uint64_t)key.data.integer; break;
+	case DT_String:  bits = ((const String *)key.data.ptr)->hash; break;
+	default: return "value can't be used as a key";
+	}
+	*res = table_mix(bits + ((uint64_t)key.type << 56));
+	return NULL;
+}
+
+static inline bool table_key_equal(Value lhs, Value rhs){
+	if (lhs.type != rhs.type) return false;
+	switch (lhs.type){
+	case DT_Integer: return lhs.data.integer == rhs.data.integer;
+	case DT_Bool:    return lhs.data.boolean == rhs.data.boolean;
+	case DT_Real:    return lhs.data.real == rhs.data.real;
+	case DT_String:  return string_equal(lhs.data.ptr, rhs.data.ptr);
+	default: return false;
+	}
+}
+
+
+
+// LOOKUP AND INSERTION
+// returns the slot of the key or the empty slot where it would be inserted
+static size_t table_probe(const Table *table, Value key, uint64_t hash){
+	size_t slot = hash & table->mask;
+	global_table_stats.lookups += 1;
+	for (;;){
+		global_table_stats.probes += 1;
+		uint32_t index = table->slots[slot];
+		if (index == 0) return slot;
+		const TableEntry *entry = table->entries + index - 1;
+		if (entry->hash == hash && table_key_equal(value_unpack(entry->key), key)) return slot;
+		slot = (slot + 1) & table->mask;
+	}
+}
+
+static const char *table_find(const Table *table, Value key, const TableEntry **res){
+	uint64_t hash;
+	const char *msg = table_key_hash(key, &hash);
+	if (msg != NULL) return msg;
+	uint32_t index = table->slots[table_probe(table, key, hash)];
+	*res = index == 0 ? NULL : table->entries + index - 1;
+	return NULL;
+}
+
+// value of a key that is already in a dictionary is replaced
+static const char *table_insert(Table *table, Value key, PackedValue value){
+	uint64_t hash;
+	const char *msg = table_key_hash(key, &hash);
+	if (msg != NULL) return msg;
+	size_t slot = table_probe(table, key, hash);
+	if (table->slots[slot] != 0){
+		table->entries[table->slots[slot] - 1].value = value;
+		return NULL;
+	}
+	if (table->count == table_capacity(table)){
+		if (table->mask >= UINT32_MAX / 4) return "table is too large";
+		table_grow(table);
+		slot = table_probe(table, key, hash);
+	}
+	table->entries[table->count] = (TableEntry){ .hash = hash, .key = value_pack(key), .value = value };
+	table->count += 1;
+	table->slots[slot] = table->count;
+	return NULL;
+}
+
+
+
+// OPERATIONS
+// dictionary literals alternate keys and values
+static const char *table_from_values(
+	enum DataType type, const PackedValue *values, size_t count, Value *res
+){
+	size_t step = type == DT_Dict ? 2 : 1;
+	Table *table = table_new(type, count / step);
+	for (size_t i=0; i!=count; i+=step){
+		PackedValue value = step == 2 ? values[i+1] : value_pack((Value){ .type = DT_Null });
+		const char *msg = table_insert(table, value_unpack(values[i]), value);
+		if (msg != NULL) return msg;
+	}
+	*res = (Value){ .type = type, .data.ptr = table };
+	return NULL;
+}
+
+static const char *table_subscript(Value dict, Value key, Value *res){
+	const TableEntry *entry;
+	const char *msg = table_find(dict.data.ptr, key, &entry);
+	if (msg != NULL) return msg;
+	if (entry == NULL) return "key is not in the dictionary";
+	*res = value_unpack(entry->value);
+	return NULL;
+}
+
+// keys that can't be in a table are simply not there
+static bool table_contains(const Table *table, Value key){
+	const TableEntry *entry;
+	return table_find(table, key, &entry) == NULL && entry != NULL;
+}
+
+// every element of an array is looked up on its own
+static Value table_contains_array(const Table *table, const Array *arr, bool negate){
+	Array *found = array_alloc(arr->length, DT_Bool);
+	for (size_t i=0; i!=arr->length; i+=1){
+		Value key = { .type = arr->type };
+		if (arr->type == DT_Bool){
+			key.data.boolean = arr->items[i];
+		} else{
+			key.data.integer = arr->items[i];
+		}
+		found->items[i] = table_contains(table, key) ^ negate;
+	}
+	return (Value){ .type = DT_Array, .data.ptr = found };
+}
+
+
+
+// PRINTING
+static void table_output_value(Value value){
+	switch (value.type){
+	case DT_Integer: output_i64(value.data.integer); break;
+	case DT_Real:    output_f64(value.data.real); break;
+	case DT_String:
+		output_char('"');
+		string_output(value.data.ptr);
+		output_char('"');
+		break;
+	case DT_Bool:
+		if (value.data.boolean){
+			output_bytes("true", 4);
+		} else{
+			output_bytes("false", 5);
+		}
+		break;
+	case DT_Array: array_output(value.data.ptr); break;
+	case DT_Set:
+	case DT_Dict:
+		output_bytes(value.type == DT_Set ? "set of " : "dictionary of ", value.type == DT_Set ? 7 : 14);
+		output_i64(((const Table *)value.data.ptr)->count);
+		break;
+	default: output_bytes("...", 3); break;
+	}
+}
+
+static void table_output(const Table *table){
+	output_char('{');
+	for (size_t i=0; i!=table->count; i+=1){
+		if (i != 0) output_bytes(", ", 2);
+		table_output_value(value_unpack(table->entries[i].key));
+		if (table->type == DT_Dict){
+			output_bytes(": ", 2);
+			table_output_value(value_unpack(table->entries[i].value));
+		}
+	}
+	// empty dictionary is written as {:}
+	if (table->count == 0 && table->type == DT_Dict) output_char(':');
+	output_char('}');
+}
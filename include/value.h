@@ -0,0 +1,254 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "parser.h"
+
+// 1 stores values on evaluation stacks in 8 bytes, 0 keeps the plain 16 byte layout
+#ifndef VALUE_NANBOX
+	#define VALUE_NANBOX 1
+#endif
+
+#define VALUE_HEAP_CHUNK 4096
+
+
+
+// BOXED VALUE HEAP
+// values that don't fit into a packed value are stored here, cells are never
+// freed one by one, whole heap is released at the end of evaluation, or back
+// to a mark once nothing that was boxed after it can be reached, like when
+// a call returns a scalar
+typedef struct ValueChunk{
+	struct ValueChunk *next;
+	size_t size;
+	Data data[VALUE_HEAP_CHUNK];
+} ValueChunk;
+
+typedef struct{
+	ValueChunk *chunks;
+	ValueChunk *spare; // released by a reset, so the next one doesn't allocate it again
+	size_t boxed; // number of values that were boxed so far
+	size_t used; // cells in all chunks, a call frame keeps it as its mark
+} ValueHeap;
+
+// chunk that was the newest one and its size, heaps of big integers
+// also keep the chunk after it, oversized chunks are put in between
+typedef struct{
+	void  *chunk;
+	size_t size;
+	void  *next;
+} HeapMark;
+
+static _Thread_local ValueHeap global_value_heap;
+
+
+static Data *value_heap_alloc(void){
+	ValueHeap *heap = &global_value_heap;
+	if (heap->chunks == NULL || heap->chunks->size == VALUE_HEAP_CHUNK){
+		ValueChunk *chunk = heap->spare != NULL ? heap->spare : mem_alloc(sizeof(ValueChunk));
+		assert(chunk != NULL && "value heap allocation failrule");
+		heap->spare = NULL;
+		chunk->next = heap->chunks;
+		chunk->size = 0;
+		heap->chunks = chunk;
+	}
+	heap->boxed += 1;
+	heap->used += 1;
+	Data *res = heap->chunks->data + heap->chunks->size;
+	heap->chunks->size += 1;
+	return res;
+}
+
+static void value_heap_release(void){
+	ValueChunk *chunk = global_value_heap.chunks;
+	while (chunk != NULL){
+		ValueChunk *next = chunk->next;
+		mem_free(chunk);
+		chunk = next;
+	}
+	mem_free(global_value_heap.spare);
+	global_value_heap.chunks = NULL;
+	global_value_heap.spare = NULL;
+	global_value_heap.used = 0;
+}
+
+static HeapMark value_heap_mark(void){
+	ValueChunk *chunk = global_value_heap.chunks;
+	return (HeapMark){ .chunk = chunk, .size = chunk != NULL ? chunk->size : 0 };
+}
+
+static void value_heap_reset(HeapMark mark){
+	ValueHeap *heap = &global_value_heap;
+	while (heap->chunks != mark.chunk){
+		ValueChunk *next = heap->chunks->next;
+		heap->used -= heap->chunks->size;
+		if (heap->spare == NULL){
+			heap->spare = heap->chunks;
+		} else{
+			mem_free(heap->chunks);
+		}
+		heap->chunks = next;
+	}
+	if (heap->chunks != NULL){
+		heap->used -= heap->chunks->size - mark.size;
+		heap->chunks->size = mark.size;
+	}
+}
+
+// frees the newest count cells
+static void value_heap_drop(size_t count){
+	ValueHeap *heap = &global_value_heap;
+	heap->used -= count;
+	while (count != 0 && count >= heap->chunks->size){
+		ValueChunk *next = heap->chunks->next;
+		count -= heap->chunks->size;
+		if (heap->spare == NULL){
+			heap->spare = heap->chunks;
+		} else{
+			mem_free(heap->chunks);
+		}
+		heap->chunks = next;
+	}
+	if (count != 0) heap->chunks->size -= count;
+}
+
+
+
+#if VALUE_NANBOX
+// NAN-BOXED VALUES
+// doubles are stored as they are, every other value lives inside of a negative
+// quiet nan, the rare doubles that collide with this range are boxed
+//   63..51  all ones
+//   50..47  data type
+//   46      payload is a pointer to a boxed Data
+//   45..0   payload, pointers are stored without their 3 low zero bits
+typedef struct{
+	uint64_t bits;
+} PackedValue;
+
+#define VALUE_TAG_MASK     0xfff8000000000000u
+#define VALUE_TYPE_SHIFT   47
+#define VALUE_BOXED_BIT    ((uint64_t)1 << 46)
+#define VALUE_PAYLOAD_BITS 46
+#define VALUE_PAYLOAD_MASK (((uint64_t)1 << VALUE_PAYLOAD_BITS) - 1)
+
+// function's index and name share the payload
+#define VALUE_FUNC_INDEX_BITS 23
+#define VALUE_FUNC_INDEX_MASK (((uint64_t)1 << VALUE_FUNC_INDEX_BITS) - 1)
+
+
+// payload of these types is a pointer that is stored shifted by 3 bits
+static inline bool value_type_is_pointer(enum DataType type){
+	return type == DT_BigInt || type == DT_Array || type == DT_Sequence || type == DT_Stage
+		|| type == DT_String || type == DT_Set || type == DT_Dict;
+}
+
+static inline PackedValue value_tagged(enum DataType type, uint64_t payload){
+	return (PackedValue){ VALUE_TAG_MASK | ((uint64_t)type << VALUE_TYPE_SHIFT) | payload };
+}
+
+static inline enum DataType value_packed_type(PackedValue value){
+	if ((value.bits & VALUE_TAG_MASK) != VALUE_TAG_MASK) return DT_Real;
+	return (value.bits >> VALUE_TYPE_SHIFT) & 0xf;
+}
+
+static inline bool value_is_small_int(PackedValue value){
+	return (value.bits >> VALUE_PAYLOAD_BITS) == (value_tagged(DT_Integer, 0).bits >> VALUE_PAYLOAD_BITS);
+}
+
+static inline int64_t value_small_int(PackedValue value){
+	return (int64_t)(value.bits << (64-VALUE_PAYLOAD_BITS)) >> (64-VALUE_PAYLOAD_BITS);
+}
+
+static PackedValue value_box(Value value){
+	Data *cell = value_heap_alloc();
+	*cell = value.data;
+	return value_tagged(value.type, VALUE_BOXED_BIT | ((uintptr_t)cell >> 3));
+}
+
+// checks are ordered by how often types appear in arithmetic
+static inline PackedValue value_pack(Value value){
+	if (value.type == DT_Integer){
+		int64_t n = value.data.integer;
+		if (((int64_t)((uint64_t)n << (64-VALUE_PAYLOAD_BITS)) >> (64-VALUE_PAYLOAD_BITS)) != n) return value_box(value);
+		return value_tagged(DT_Integer, (uint64_t)n & VALUE_PAYLOAD_MASK);
+	}
+	if (value.type == DT_Bool){
+		return value_tagged(DT_Bool, value.data.boolean);
+	}
+	if (value.type == DT_Real){
+		if (((uint64_t)value.data.integer & VALUE_TAG_MASK) == VALUE_TAG_MASK) return value_box(value);
+		return (PackedValue){ (uint64_t)value.data.integer };
+	}
+	if (value.type == DT_Function){
+		FunctionInfo info = value.data.funcinfo;
+		if ((info.index | info.name_id) > VALUE_FUNC_INDEX_MASK) return value_box(value);
+		return value_tagged(
+			DT_Function, info.index | ((uint64_t)info.name_id << VALUE_FUNC_INDEX_BITS)
+		);
+	}
+	if (value.type == DT_Null){
+		return value_tagged(DT_Null, 0);
+	}
+	uintptr_t ptr = (uintptr_t)value.data.ptr;
+	if (value_type_is_pointer(value.type) && (ptr & 7) == 0 && (ptr >> (VALUE_PAYLOAD_BITS+3)) == 0){
+		return value_tagged(value.type, ptr >> 3);
+	}
+	return value_box(value);
+}
+
+static inline Value value_unpack(PackedValue value){
+	Value res;
+	if ((value.bits & VALUE_TAG_MASK) != VALUE_TAG_MASK){
+		res.type = DT_Real;
+		res.data.integer = (int64_t)value.bits;
+		return res;
+	}
+	res.type = (value.bits >> VALUE_TYPE_SHIFT) & 0xf;
+	uint64_t payload = value.bits & VALUE_PAYLOAD_MASK;
+	if (value.bits & VALUE_BOXED_BIT){
+		res.data = *(Data *)(uintptr_t)(payload << 3);
+		return res;
+	}
+	// integers and booleans only need the sign extension
+	res.data.integer = value_small_int(value);
+	if (res.type == DT_Function){
+		res.data.funcinfo.index = payload & VALUE_FUNC_INDEX_MASK;
+		res.data.funcinfo.name_id = payload >> VALUE_FUNC_INDEX_BITS;
+	} else if (value_type_is_pointer(res.type)){
+		res.data.ptr = (void *)(uintptr_t)(payload << 3);
+	}
+	return res;
+}
+
+#else
+// PLAIN VALUES
+typedef Value PackedValue;
+
+static inline enum DataType value_packed_type(PackedValue value){ return value.type; }
+static inline PackedValue value_pack(Value value){ return value; }
+static inline Value value_unpack(PackedValue value){ return value; }
+
+#endif
+
+
+
+// CALL FRAMES
+// a call keeps the number of cells in the heap, a scalar result is all that
+// a call leaves behind, so cells boxed during the call are reused once it
+// returns and only the result is boxed again
+static inline uint32_t value_heap_used(void){
+	return (uint32_t)global_value_heap.used;
+}
+
+static inline void value_heap_return(uint32_t used, PackedValue *res){
+#if VALUE_NANBOX
+	// wraps around like the mark, a call doesn't box 2^32 values
+	uint32_t count = (uint32_t)global_value_heap.used - used;
+	if (count == 0) return;
+	if (value_type_is_pointer(value_packed_type(*res))) return;
+	Value value = value_unpack(*res);
+	value_heap_drop(count);
+	*res = value_pack(value);
+#endif
+}
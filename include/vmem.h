@@ -0,0 +1,106 @@
+#pragma once
+
+#include "utils.h"
+#include "memstat.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#ifndef VMEM_MAX_RESERVE
+	#define VMEM_MAX_RESERVE ((size_t)16 << 30)
+#endif
+
+#ifndef VMEM_MIN_RESERVE
+	#define VMEM_MIN_RESERVE ((size_t)64 << 10)
+#endif
+
+// a default reservation takes this part of the address space that is still
+// free under a limit, a thread's evaluation stacks take a bit over 3 of them
+#ifndef VMEM_LIMIT_SHARES
+	#define VMEM_LIMIT_SHARES 64
+#endif
+
+
+
+// RESERVED VIRTUAL MEMORY
+// a block reserves address space up front and the kernel commits its pages
+// only when they are touched, so the block never moves while it grows and
+// small workloads only pay for the pages they use, a guard page after the
+// block turns any unchecked overrun into a fault instead of silent corruption
+typedef struct{
+	void  *data;
+	size_t size; // usable bytes, without the guard page
+} VmemBlock;
+
+
+static size_t vmem_page_size(void){
+	static size_t page_size = 0;
+	if (page_size == 0) page_size = (size_t)sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+// address space that is still free under the limit, SIZE_MAX without one,
+// thread stacks and the allocator's arenas take from it too
+static size_t vmem_free_address_space(void){
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_AS, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) return SIZE_MAX;
+	size_t used = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL){
+		if (fscanf(statm, "%zu", &used) != 1) used = 0;
+		fclose(statm);
+	}
+	used *= vmem_page_size();
+	return (size_t)limit.rlim_cur > used ? (size_t)limit.rlim_cur - used : 0;
+}
+
+// reservation limit that follows the amount of physical memory, and a share
+// of the free address space if that is limited, so every later block gets some
+static size_t vmem_default_reserve(void){
+	long pages = sysconf(_SC_PHYS_PAGES);
+	size_t res = pages > 0 ? (size_t)pages*vmem_page_size() : VMEM_MAX_RESERVE;
+	size_t avail = vmem_free_address_space();
+	if (avail != SIZE_MAX) res = util_min_usize(res, avail / VMEM_LIMIT_SHARES);
+	return util_clamp_usize(res, VMEM_MIN_RESERVE, VMEM_MAX_RESERVE);
+}
+
+static VmemBlock vmem_reserve(size_t size){
+	size_t page = vmem_page_size();
+	size = util_alignsize(util_max_usize(size, page), page);
+	// address space may be limited, so back off until the reservation succeeds,
+	// a small block is still better than failing the evaluation
+	for (;;){
+		uint8_t *mem = mmap(
+			0, size + page, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0
+		);
+		if (mem != MAP_FAILED){
+			mprotect(mem + size, page, PROT_NONE);
+			mem_count_reserve(size);
+			return (VmemBlock){ mem, size };
+		}
+		if (size <= page) return (VmemBlock){0};
+		size = util_alignsize(size / 2, page);
+	}
+}
+
+static void vmem_release(VmemBlock block){
+	if (block.data == NULL) return;
+	munmap(block.data, block.size + vmem_page_size());
+	mem_count_unreserve(block.size);
+}
+
+// arena for node arrays, a failed reservation leaves it empty and its
+// allocations fall back to the heap
+static MemArena vmem_arena(size_t size){
+	VmemBlock block = vmem_reserve(size);
+	return (MemArena){ .data = block.data, .size = block.size, .last = SIZE_MAX };
+}
+
+static void vmem_arena_release(MemArena *arena){
+	mem_arena_reset(arena);
+	vmem_release((VmemBlock){ arena->data, arena->size });
+	*arena = (MemArena){ .last = SIZE_MAX };
+}
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// tasks that don't fit into a full deque are run by the thread that made them
+#ifndef POOL_DEQUE_SIZE
+	#define POOL_DEQUE_SIZE 4096
+#endif
+
+#ifndef POOL_MAX_THREADS
+	#define POOL_MAX_THREADS 256
+#endif
+
+// rounds of stealing before an idle worker goes to sleep
+#define POOL_SPIN_ROUNDS 64
+
+
+
+// TASKS
+typedef struct PoolTask{
+	void (*run)(struct PoolTask *task);
+} PoolTask;
+
+
+
+// WORK STEALING DEQUES
+// the owner pushes and pops at the bottom, other workers steal from the top,
+// this is the deque of Chase and Lev with C11 atomics as given by Le et al.
+typedef struct{
+	_Alignas(64) _Atomic int64_t top;
+	_Alignas(64) _Atomic int64_t bottom;
+	_Atomic(PoolTask *) items[POOL_DEQUE_SIZE];
+} PoolDeque;
+
+
+static bool pool_deque_push(PoolDeque *deque, PoolTask *task){
+	int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+	if (b - t >= POOL_DEQUE_SIZE) return false;
+	atomic_store_explicit(&deque->items[b % POOL_DEQUE_SIZE], task, memory_order_relaxed);
+	// the task is published with the bottom that a thief reads
+	atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+	return true;
+}
+
+static PoolTask *pool_deque_pop(PoolDeque *deque){
+	int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	if (t > b){
+		atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+		return NULL;
+	}
+	PoolTask *task = atomic_load_explicit(&deque->items[b % POOL_DEQUE_SIZE], memory_order_relaxed);
+	if (t == b){
+		// last task, a thief may be taking it at the same time
+		if (!atomic_compare_exchange_strong_explicit(
+			&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed
+		)) task = NULL;
+		atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+	}
+	return task;
+}
+
+static PoolTask *pool_deque_steal(PoolDeque *deque){
+	int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	if (t >= b) return NULL;
+	PoolTask *task = atomic_load_explicit(&deque->items[t % POOL_DEQUE_SIZE], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(
+		&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed
+	)) return NULL;
+	return task;
+}
+
+
+
+// THREAD POOL
+// every worker owns a deque, tasks submitted from outside of the pool go to
+// a shared queue, idle workers sleep until a new task is published
+typedef struct WorkPool WorkPool;
+
+typedef struct{
+	WorkPool  *pool;
+	size_t     index;
+	pthread_t  thread;
+	uint64_t   seed;   // for picking victims
+	PoolDeque  deque;
+} PoolWorker;
+
+struct WorkPool{
+	PoolWorker *workers;
+	size_t      worker_count;
+	size_t      thread_count; // workers whose thread was started
+
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	PoolTask **queue;     // tasks from outside of the pool
+	size_t     queue_size;
+	size_t     queue_capacity;
+	_Atomic size_t queued;
+
+	_Atomic uint64_t epoch;    // changes whenever there may be new work
+	_Atomic size_t   sleepers;
+	_Atomic bool     stop;
+
+	void *context;
+	void (*thread_begin)(WorkPool *pool); // called by every worker before it runs any task
+	void (*thread_end)(WorkPool *pool);   // and after it runs the last one
+
+	_Atomic size_t steals;
+	size_t sleeps;
+};
+
+static _Thread_local PoolWorker *pool_current_worker;
+
+
+static void pool_notify(WorkPool *pool){
+	atomic_fetch_add(&pool->epoch, 1);
+	if (atomic_load(&pool->sleepers) != 0){
+		pthread_mutex_lock(&pool->mutex);
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+}
+
+// called from a worker, returns false when the deque is full
+static bool pool_push(PoolTask *task){
+	PoolWorker *self = pool_current_worker;
+	if (!pool_deque_push(&self->deque, task)) return false;
+	pool_notify(self->pool);
+	return true;
+}
+
+// called from outside of the pool
+static void pool_submit(WorkPool *pool, PoolTask *task){
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->queue_size == pool->queue_capacity){
+		pool->queue_capacity = util_max_usize(64, 2*pool->queue_capacity);
+		pool->queue = realloc(pool->queue, pool->queue_capacity*sizeof(PoolTask *));
+		assert(pool->queue != NULL && "pool queue allocation failrule");
+	}
+	pool->queue[pool->queue_size] = task;
+	pool->queue_size += 1;
+	atomic_fetch_add(&pool->queued, 1);
+	pthread_mutex_unlock(&pool->mutex);
+	pool_notify(pool);
+}
+
+static PoolTask *pool_take_queued(WorkPool *pool){
+	if (atomic_load(&pool->queued) == 0) return NULL;
+	PoolTask *task = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->queue_size != 0){
+		// oldest task first, queued tasks are usually in source order
+		task = pool->queue[0];
+		pool->queue_size -= 1;
+		memmove(pool->queue, pool->queue + 1, pool->queue_size*sizeof(PoolTask *));
+		atomic_fetch_sub(&pool->queued, 1);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return task;
+}
+
+static PoolTask *pool_steal(PoolWorker *self){
+	WorkPool *pool = self->pool;
+	size_t count = pool->worker_count;
+	// xorshift picks where the round starts, so thieves don't all hit one victim
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 7;
+	self->seed ^= self->seed << 17;
+	size_t first = self->seed % count;
+	for (size_t i=0; i!=count; i+=1){
+		PoolWorker *victim = pool->workers + (first + i) % count;
+		if (victim == self) continue;
+		PoolTask *task = pool_deque_steal(&victim->deque);
+		if (task != NULL){
+			atomic_fetch_add_explicit(&pool->steals, 1, memory_order_relaxed);
+			return task;
+		}
+	}
+	return NULL;
+}
+
+// own tasks first, then the shared queue, then other workers' deques
+static PoolTask *pool_find_task(PoolWorker *self){
+	PoolTask *task = pool_deque_pop(&self->deque);
+	if (task == NULL) task = pool_take_queued(self->pool);
+	if (task == NULL) task = pool_steal(self);
+	return task;
+}
+
+// runs one task that waits anywhere in the pool, threads that wait for
+// a task to finish call it instead of idling, returns false if there was none
+static bool pool_help(WorkPool *pool){
+	PoolWorker *self = pool_current_worker;
+	PoolTask *task;
+	if (self != NULL && self->pool == pool){
+		task = pool_find_task(self);
+	} else{
+		task = pool_take_queued(pool);
+		for (size_t i=0; task==NULL && i!=pool->thread_count; i+=1){
+			task = pool_deque_steal(&pool->workers[i].deque);
+		}
+	}
+	if (task == NULL) return false;
+	task->run(task);
+	return true;
+}
+
+static void *pool_worker_main(void *arg){
+	PoolWorker *self = arg;
+	WorkPool *pool = self->pool;
+	pool_current_worker = self;
+	if (pool->thread_begin != NULL) pool->thread_begin(pool);
+	size_t idle = 0;
+	while (!atomic_load(&pool->stop)){
+		uint64_t epoch = atomic_load(&pool->epoch);
+		PoolTask *task = pool_find_task(self);
+		if (task != NULL){
+			task->run(task);
+			idle = 0;
+			continue;
+		}
+		if (idle < POOL_SPIN_ROUNDS){
+			idle += 1;
+			sched_yield();
+			continue;
+		}
+		pthread_mutex_lock(&pool->mutex);
+		atomic_fetch_add(&pool->sleepers, 1);
+		while (epoch == atomic_load(&pool->epoch) && !atomic_load(&pool->stop)){
+			pool->sleeps += 1;
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		}
+		atomic_fetch_sub(&pool->sleepers, 1);
+		pthread_mutex_unlock(&pool->mutex);
+		idle = 0;
+	}
+	if (pool->thread_end != NULL) pool->thread_end(pool);
+	return NULL;
+}
+
+static size_t pool_default_threads(void){
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores > 0 ? (size_t)cores : 1;
+}
+
+// returns false if no thread could be started
+static bool pool_start(WorkPool *pool, size_t thread_count){
+	thread_count = util_clamp_usize(thread_count, 1, POOL_MAX_THREADS);
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->workers = aligned_alloc(64, util_alignsize(thread_count*sizeof(PoolWorker), 64));
+	assert(pool->workers != NULL && "pool allocation failrule");
+	pool->worker_count = thread_count;
+	for (size_t i=0; i!=thread_count; i+=1){
+		PoolWorker *worker = pool->workers + i;
+		atomic_init(&worker->deque.top, 0);
+		atomic_init(&worker->deque.bottom, 0);
+		worker->pool = pool;
+		worker->index = i;
+		worker->seed = 0x9e3779b97f4a7c15u * (i + 1);
+	}
+	// deques of workers that couldn't be started just stay empty
+	for (size_t i=0; i!=thread_count; i+=1){
+		if (pthread_create(&pool->workers[i].thread, NULL, pool_worker_main, pool->workers + i) != 0) break;
+		pool->thread_count += 1;
+	}
+	return pool->thread_count != 0;
+}
+
+// waits for the workers to finish their current tasks
+static void pool_stop(WorkPool *pool){
+	atomic_store(&pool->stop, true);
+	pool_notify(pool);
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (size_t i=0; i!=pool->thread_count; i+=1){
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->workers);
+	free(pool->queue);
+	pool->workers = NULL;
+	pool->queue = NULL;
+}
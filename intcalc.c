@@ -1,8 +1,17 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <time.h>
 
 #include "files.h"
 #include "eval.h"
+#include "parallel.h"
+#include "optimize.h"
+#include "batch.h"
+#include "daemon.h"
+#include "repl.h"
+#include "scripts.h"
+#include "perf.h"
 
 
 void print_tokens(AstArray tokens);
@@ -18,16 +27,36 @@ size_t count_ast(AstArray ast);
 bool show_tokens = false;
 bool show_ast    = false;
 bool show_stats  = false;
+bool show_perf   = false;
 bool show_nops   = false;
 bool show_sets   = false;
 bool show_names  = false;
 bool quiet_mode  = false;
 bool evaluate    = true;
+bool optimize    = true;
+bool memoize     = false;
+bool jit_compile_hot = false;
+bool output_thread   = false;
+bool profile_calls   = false;
+const char *sample_file    = NULL;
+const char *memory_file    = NULL;
+size_t eval_threads  = 0; // 0 if -T was not given
+bool   fork_calls    = false;
+size_t fork_depth    = 0;
+const char *batch_function = NULL;
+bool        batch_binary   = false;
+const char *daemon_socket  = NULL;
+const char *client_socket  = NULL;
+bool        interactive    = false;
+bool        script_batch   = false;
 
 
 
 int main(int argc, char **argv){
 	char *input = NULL;
+	const char **inputs = malloc(argc*sizeof(char *)); // all of them for -f
+	size_t input_count = 0;
+	assert(inputs != NULL && "argument allocation failrule");
 	for (size_t i=1; i!=argc; i+=1){
 		if (argv[i][0] == '-'){
 			for (size_t j=1;; j+=1){
@@ -41,16 +70,39 @@ int main(int argc, char **argv){
 						"  -t     show tokens\n"
 						"  -a     show ast nodes\n"
 						"  -s     show statistics\n"
+						"  -P     show hardware performance counters of every phase\n"
+						"  -u <f> write memory statistics of every phase to file f as tab\n"
+						"         separated values\n"
 						"  -S     print hash set info\n"
 						"  -N     print name table\n"
 						"  -e     don't evaluate\n"
+						"  -o     don't optimize\n"
 						"  -q     quiet\n"
 						"  -n     show nops\n"
+						"  -m     memoize pure functions\n"
+						"  -M <n> memoize with memory cap of n MiB\n"
+						"  -j     compile hot integer functions to machine code\n"
+						"  -w     write results from a separate thread\n"
+						"  -p     profile calls of functions, the table is written to stderr\n"
+						"  -g <f> sample evaluation with a timer, write folded stacks to file f\n"
+						"  -T <n> evaluate independent statements on n threads, 0 uses all cores,\n"
+						"         without -T -F, -d and -f use all cores and the rest one thread\n"
+						"  -F <n> evaluate sibling calls of pure functions on -T threads down to\n"
+						"         call depth n, 0 picks the depth from the number of threads\n"
+						"  -b <f> call function f with arguments read from standard input\n"
+						"  -B <f> same with arguments as binary 64 bit integers\n"
+						"  -d <s> load the script and evaluate requests from unix socket s on\n"
+						"         -T threads, until SIGINT or SIGTERM\n"
+						"  -c <s> send the script to the daemon at socket s and print the result\n"
+						"  -i     evaluate standard input line by line, definitions persist\n"
+						"  -f     evaluate every input file on its own, on -T threads, directories\n"
+						"         add their files, outputs are written in the order of the files\n"
 					);
 					return 0;
 				case 't': show_tokens = true; break;
 				case 'a': show_ast    = true; break;
 				case 's': show_stats  = true; break;
+				case 'P': show_perf   = true; break;
 				case 'n': show_nops   = true; break;
 				case 'S': show_sets   = true; break;
 				case 'N': show_names  = true; break;
@@ -58,21 +110,161 @@ int main(int argc, char **argv){
 					quiet_mode  = true;
 					break;
 				case 'e': evaluate = false; break;
+				case 'o': optimize = false; break;
+				case 'm': memoize  = true;  break;
+				case 'j': jit_compile_hot = true; break;
+				case 'w': output_thread   = true; break;
+				case 'p': profile_calls   = true; break;
+				case 'i': interactive     = true; break;
+				case 'f': script_batch    = true; break;
+				case 'T':
+					if (i+1 == (size_t)argc){
+						fprintf(stderr, "option -T expects number of threads\n");
+						return 10;
+					}
+					i += 1;
+					eval_threads = (size_t)strtoull(argv[i], NULL, 10);
+					if (eval_threads == 0) eval_threads = pool_default_threads();
+					goto NextArgument;
+				case 'F':
+					if (i+1 == (size_t)argc){
+						fprintf(stderr, "option -F expects call depth\n");
+						return 10;
+					}
+					i += 1;
+					fork_calls = true;
+					fork_depth = (size_t)strtoull(argv[i], NULL, 10);
+					goto NextArgument;
+				case 'b':
+				case 'B':
+					if (i+1 == (size_t)argc || argv[i+1][0] == '\0' || strlen(argv[i+1]) > 255){
+						fprintf(stderr, "option -%c expects function name\n", opt);
+						return 10;
+					}
+					i += 1;
+					batch_function = argv[i];
+					batch_binary = opt == 'B';
+					goto NextArgument;
+				case 'g':
+					if (i+1 == (size_t)argc){
+						fprintf(stderr, "option -g expects output file\n");
+						return 10;
+					}
+					i += 1;
+					sample_file = argv[i];
+					goto NextArgument;
+				case 'u':
+					if (i+1 == (size_t)argc){
+						fprintf(stderr, "option -u expects output file\n");
+						return 10;
+					}
+					i += 1;
+					memory_file = argv[i];
+					goto NextArgument;
+				case 'd':
+				case 'c':
+					if (i+1 == (size_t)argc){
+						fprintf(stderr, "option -%c expects socket path\n", opt);
+						return 10;
+					}
+					i += 1;
+					if (opt == 'd'){
+						daemon_socket = argv[i];
+					} else{
+						client_socket = argv[i];
+					}
+					goto NextArgument;
+				case 'M':
+					if (i+1 == (size_t)argc){
+						fprintf(stderr, "option -M expects memory cap in MiB\n");
+						return 10;
+					}
+					i += 1;
+					memo_memory_cap = (size_t)strtoull(argv[i], NULL, 10) << 20;
+					memoize = true;
+					goto NextArgument;
 				default:
 					fprintf(stderr, "unknown option: -%c\n", opt);
 					return 10;
 				}
 			}
 		} else{
-			if (input != NULL){
-				fprintf(stderr, "input file already specified\n");
-				return 20;
+			if (input == NULL) input = argv[i];
+			inputs[input_count] = argv[i];
+			input_count += 1;
+		}
+	NextArgument:;
+	}
+
+	if (input_count > 1 && !script_batch){
+		fprintf(stderr, "input file already specified\n");
+		return 20;
+	}
+
+	if (batch_function != NULL && input == NULL){
+		fprintf(stderr, "batch mode reads arguments from standard input, script has to be a file\n");
+		return 20;
+	}
+
+	if (interactive){
+		if (input != NULL){
+			fprintf(stderr, "interactive mode reads standard input, input file can't be specified\n");
+			return 20;
+		}
+		initialize_compiler_globals();
+		eval_init_builtins();
+		output_init(STDOUT_FILENO, false);
+		size_t errors = eval_repl(stdin);
+		output_finish();
+		return errors != 0 ? 1 : 0;
+	}
+
+	if (script_batch){
+		if (input_count == 0){
+			fprintf(stderr, "option -f expects input files or directories\n");
+			return 20;
+		}
+		if (batch_function != NULL || daemon_socket != NULL || client_socket != NULL){
+			fprintf(stderr, "option -f can't be combined with -b, -B, -d or -c\n");
+			return 20;
+		}
+		if (memoize | jit_compile_hot | profile_calls | fork_calls | (sample_file != NULL)){
+			fprintf(stderr, "warning: memoization, jit, profiler and forking are not used by -f\n");
+		}
+		char **paths = NULL;
+		size_t path_count = 0, path_capacity = 0;
+		for (size_t i=0; i!=input_count; i+=1){
+			if (!scripts_add_path(inputs[i], &paths, &path_count, &path_capacity)){
+				fprintf(stderr, "error while reading the file: \"%s\"\n", inputs[i]);
+				return 21;
 			}
-			input = argv[i];
 		}
+		if (eval_threads == 0) eval_threads = pool_default_threads();
+		output_init(STDOUT_FILENO, output_thread);
+		ScriptStats stats;
+		size_t failed = eval_scripts((const char *const *)paths, path_count, eval_threads, optimize, &stats);
+		output_finish();
+		if (show_stats){
+			printf("\nscripts         :%10zu\n", stats.files);
+			printf("failed scripts  :%10zu\n", stats.failed);
+			printf("script bytes    :%10zu\n", stats.bytes);
+			printf("batch time      :%10.6lf [s]\n", stats.seconds);
+			printf("scripts speed   :%13.2lf [files/s]\n", stats.files/stats.seconds);
+		}
+		for (size_t i=0; i!=path_count; i+=1) free(paths[i]);
+		free(paths);
+		free(inputs);
+		return failed != 0 ? 1 : 0;
+	}
+	free(inputs);
+
+	if (show_perf && perf_init() == 0){
+		fprintf(stderr, "warning: performance counters are unavailable\n");
+		show_perf = false;
 	}
 
 	StringView text;
+	if (show_perf) perf_begin();
 	time_t read_time = clock();
 	if (input == NULL){
 		text = read_file(stdin);
@@ -88,12 +280,24 @@ int main(int argc, char **argv){
 		}
 	}
 	read_time = clock() - read_time;
+	if (show_perf) perf_end(PerfPhase_Read);
+
+	if (client_socket != NULL){
+		return daemon_request(client_socket, text.data, text.size);
+	}
 
+	mem_phase(MemPhase_Lex);
+	// node arrays live until the end, so they are placed in one arena
+	MemArena arena = vmem_arena(vmem_default_reserve());
+	global_mem_arena = &arena;
 	initialize_compiler_globals();
+	eval_init_builtins();
 
+	if (show_perf) perf_begin();
 	time_t tok_time = clock();
 	AstArray tokens = make_tokens(text.data);
 	tok_time = clock() - tok_time; 
+	if (show_perf) perf_end(PerfPhase_Lex);
 	if (tokens.data == NULL){
 		raise_error(text.data, tokens.error, tokens.position);
 	}
@@ -104,15 +308,30 @@ int main(int argc, char **argv){
 		putchar('\n');
 	}
 
+	mem_phase(MemPhase_Parse);
 	AstArray ast = ast_array_clone(tokens);
 
+	if (show_perf) perf_begin();
 	time_t parse_time = clock();
 	ast = parse_tokens(ast);
 	parse_time = clock() - parse_time;
+	if (show_perf) perf_end(PerfPhase_Parse);
 	if (ast.data == NULL){
 		raise_error(text.data, ast.error, ast.position);
 	}
 
+	size_t parsed_ast_count = show_stats | show_perf ? count_ast(ast) : 0;
+	OptimizeStats opt_stats = {0};
+	time_t opt_time = clock();
+	if (optimize){
+		mem_phase(MemPhase_Optimize);
+		if (show_perf) perf_begin();
+		ast = optimize_ast(ast, &opt_stats);
+		if (batch_function == NULL && daemon_socket == NULL) ast = remove_dead_definitions(ast, &opt_stats);
+		if (show_perf) perf_end(PerfPhase_Optimize);
+	}
+	opt_time = clock() - opt_time;
+
 	if (show_ast){
 		puts("ast:");
 		print_ast(ast);
@@ -131,16 +350,27 @@ int main(int argc, char **argv){
 		double text_size_mb = text.size * 0.000001;
 
 		printf("token count    :%10zu\n", token_count);
-		printf("ast node count :%10zu\n", ast_count);
-		printf("node/token count ratio : %8.6lf\n\n", (double)ast_count/(double)token_count);
+		printf("ast node count :%10zu\n", parsed_ast_count);
+		printf("node/token count ratio : %8.6lf\n\n", (double)parsed_ast_count/(double)token_count);
+
+		if (optimize){
+			printf("optimized ast node count :%10zu\n", ast_count);
+			printf("optimized/parsed ratio   : %8.6lf\n", (double)ast_count/(double)parsed_ast_count);
+			printf("folded operations        :%10zu\n", opt_stats.folded);
+			printf("propagated constants     :%10zu\n", opt_stats.propagated);
+			printf("eliminated branches      :%10zu\n", opt_stats.branches);
+			printf("eliminated nodes         :%10zu\n", opt_stats.eliminated);
+			printf("optimization passes      :%10zu\n", opt_stats.passes);
+			printf("optimization time        :%10.6lf [s]\n\n", (double)opt_time * 0.000001);
+		}
 		
 		printf("tokens size    :%10zu\n", token_size);
 		printf("ast nodes size :%10zu\n", ast_size);
 		printf("nodes/tokens size ratio : %8.6lf\n\n", (double)ast_size/(double)token_size);
 		
 		printf("lexing speed     :%13.2lf [tokens/s]\n", (double)token_count/tok_time_s);
-		printf("parsing speed    :%13.2lf [nodes/s]\n", (double)ast_count/parse_time_s);
-		printf("making ast speed :%13.2lf [nodes/s]\n\n", (double)ast_count/making_ast_time_s);
+		printf("parsing speed    :%13.2lf [nodes/s]\n", (double)parsed_ast_count/parse_time_s);
+		printf("making ast speed :%13.2lf [nodes/s]\n\n", (double)parsed_ast_count/making_ast_time_s);
 		
 		printf("reading time    :%10.6lf [s]\n", read_time_s);
 		printf("lexing time     :%10.6lf [s]\n", tok_time_s);
@@ -152,6 +382,8 @@ int main(int argc, char **argv){
 		printf("parsing speed    :%11.2lf [MB/s]\n", text_size_mb/parse_time_s);
 		printf("making ast speed :%11.2lf [MB/s]\n\n", text_size_mb/making_ast_time_s);
 	}
+	// nothing reads the tokens after this
+	mem_free(tokens.data);
 
 	if (show_sets){
 		printf("uniuqe names:         %zu\n", global_name_set.size);
@@ -167,15 +399,158 @@ int main(int argc, char **argv){
 	}
 
 	if (evaluate){
+		mem_phase(MemPhase_Eval);
 		if (show_tokens | show_ast | show_stats | show_sets | show_names){
 			printf("evaluation:\n");
 		}
-		EvalError err = eval_ast(ast);
+		size_t pure_count = 0;
+		size_t fork_points = 0;
+		if (fork_calls){
+			// statements are evaluated in order, threads work on the forked calls
+			if (eval_threads == 0) eval_threads = pool_default_threads();
+			if (fork_depth == 0) fork_depth = fork_default_cutoff(eval_threads);
+		}
+		if (daemon_socket != NULL && eval_threads == 0) eval_threads = pool_default_threads();
+		if (eval_threads == 0) eval_threads = 1;
+		if ((eval_threads > 1 || fork_calls || daemon_socket != NULL) && jit_compile_hot){
+			fprintf(stderr, "warning: jit is not used by parallel evaluation\n");
+			jit_compile_hot = false;
+		}
+		if ((eval_threads > 1 || fork_calls || daemon_socket != NULL) && (profile_calls || sample_file != NULL)){
+			fprintf(stderr, "warning: profiler is not used by parallel evaluation\n");
+			profile_calls = false;
+			sample_file = NULL;
+		}
+		if (profile_calls && sample_file != NULL){
+			fprintf(stderr, "warning: sampling is not used by profiled evaluation\n");
+			sample_file = NULL;
+		}
+		if (profile_calls && jit_compile_hot){
+			fprintf(stderr, "warning: jit is not used by profiled evaluation\n");
+			jit_compile_hot = false;
+		}
+		if (memoize | jit_compile_hot | fork_calls){
+			AstInfo info = ast_info_new(ast);
+			pure_count = mark_pure_functions(ast, &info);
+			if (fork_calls) fork_points = mark_fork_points(ast, &info);
+			if (memoize) memo_init(memo_memory_cap);
+			if (jit_compile_hot){
+				if (!jit_init(ast, info)){
+					fprintf(stderr, "warning: jit initialization failed\n");
+				}
+			} else{
+				ast_info_free(&info);
+			}
+		}
+		if (profile_calls) profile_init();
+		if (sample_file != NULL && !sampler_start()){
+			fprintf(stderr, "warning: sampling timer couldn't be started\n");
+			sample_file = NULL;
+		}
+		output_init(STDOUT_FILENO, output_thread);
+		if (show_perf) perf_begin();
+		EvalError err;
+		BatchStatus batch = {0};
+		DaemonResult daemon = {0};
+		if (daemon_socket != NULL){
+			daemon = eval_daemon(ast, text.data, text.size, daemon_socket, eval_threads, optimize);
+			err = daemon.error;
+		} else if (batch_function != NULL){
+			batch = eval_batch(ast, batch_function, STDIN_FILENO, batch_binary);
+			err = batch.error;
+		} else if (fork_calls){
+			err = eval_forked(ast, eval_threads, fork_depth);
+		} else{
+			err = eval_parallel(ast, eval_threads);
+		}
+		sampler_stop();
+		output_finish();
+		if (show_perf) perf_end(PerfPhase_Eval);
+		if (sample_file != NULL){
+			if (!sampler_write(sample_file, text.data, ast)){
+				fprintf(stderr, "error while writing the samples: \"%s\"\n", sample_file);
+			}
+			if (show_stats){
+				printf("samples         :%10zu\n", global_sampler.samples);
+				printf("dropped samples :%10zu\n", global_sampler.dropped);
+				printf("idle samples    :%10zu\n", global_sampler.idle);
+			}
+			sampler_free();
+		}
+		if (profile_calls){
+			print_profile(text.data, ast);
+			profile_free();
+		}
+		if (err.msg != NULL && batch_function != NULL){
+			switch (batch.kind){
+			case BatchError_Setup:
+				fprintf(stderr, "error: \"%s\"\n", err.msg);
+				return 1;
+			case BatchError_Input:
+				fprintf(stderr, "error: \"%s\" in batch tuple %zu\n", err.msg, batch.tuple + 1);
+				return 1;
+			case BatchError_Script:
+				fprintf(stderr, "batch tuple %zu:\n", batch.tuple + 1);
+				break;
+			case BatchError_Load:
+				break;
+			}
+		}
+		if (err.msg != NULL && daemon.setup){
+			fprintf(stderr, "error: \"%s\"\n", err.msg);
+			return 1;
+		}
 		if (err.msg != NULL){
 			raise_error(text.data, err.msg, err.pos);
 		}
+		if (show_stats){
+			printf("\nvalue size      :%10zu [B]\n", sizeof(PackedValue));
+			printf("boxed values    :%10zu\n", global_value_heap.boxed);
+			printf("big integers    :%10zu\n", global_bigint_heap.allocations);
+			printf("big int memory  :%10zu [B]\n", global_bigint_heap.bytes);
+			printf("arrays          :%10zu\n", global_array_heap.allocations);
+			printf("array memory    :%10zu [B]\n", global_array_heap.bytes);
+			printf("strings         :%10zu\n", global_string_heap.allocations);
+			printf("string memory   :%10zu [B]\n", global_string_heap.bytes);
+			printf("hash tables     :%10zu\n", global_table_stats.tables);
+			printf("table lookups   :%10zu\n", global_table_stats.lookups);
+			printf("table probes    :%10zu\n", global_table_stats.probes);
+			printf("output bytes    :%10zu\n", global_output.bytes);
+			printf("output writes   :%10zu\n", global_output.writes);
+		}
+		if (show_stats && batch_function != NULL){
+			printf("batch tuples    :%10zu\n", global_batch_stats.tuples);
+			printf("vector chunks   :%10zu\n", global_batch_stats.vector_chunks);
+			printf("scalar chunks   :%10zu\n", global_batch_stats.scalar_chunks);
+		}
+		if (show_stats && daemon_socket != NULL){
+			printf("connections     :%10zu\n", atomic_load(&global_daemon_stats.connections));
+			printf("requests        :%10zu\n", atomic_load(&global_daemon_stats.requests));
+			printf("failed requests :%10zu\n", atomic_load(&global_daemon_stats.errors));
+		}
+		if (show_stats && fork_calls){
+			printf("fork points     :%10zu\n", fork_points);
+			printf("forked calls    :%10zu\n", atomic_load(&global_fork.forks));
+			printf("helping tasks   :%10zu\n", atomic_load(&global_fork.helped));
+			printf("stolen tasks    :%10zu\n", global_fork.steals);
+		}
+		if (show_stats && (memoize | jit_compile_hot | fork_calls)){
+			printf("pure functions  :%10zu\n", pure_count);
+			if (memoize) print_memo_stats();
+			if (jit_compile_hot) print_jit_stats();
+		}
 	}
 
+	mem_phase(MemPhase_Count);
+	if (show_stats) print_mem_stats();
+	if (memory_file != NULL && !write_mem_stats(memory_file)){
+		fprintf(stderr, "error while writing the memory statistics: \"%s\"\n", memory_file);
+	}
+
+	if (show_perf){
+		print_perf_stats(text.size, parsed_ast_count);
+		perf_free();
+	}
 	return 0;
 }
 
@@ -216,6 +591,8 @@ void print_tokens(AstArray tokens){
 			printf("\" ");
 			break;
 		case Ast_String:{
+			const String *str = data.ptr;
+			printf(": \"%.*s\"", (int)str->length, string_text(str));
 			break;
 		}
 		default: break;
@@ -258,6 +635,9 @@ void print_ast(AstArray ast){
 			break;
 		case Ast_Call:
 		case Ast_Subscript:
+		case Ast_Array:
+		case Ast_Set:
+		case Ast_Dict:
 			printf(": arg_count = %lu", node.count);
 			break;
 		case Ast_Conditional:
@@ -287,6 +667,8 @@ void print_ast(AstArray ast){
 			printf("\" ");
 			break;
 		case Ast_String:{
+			const String *str = data.ptr;
+			printf(": \"%.*s\"", (int)str->length, string_text(str));
 			break;
 		}
 		default: break;
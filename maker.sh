@@ -1,9 +1,10 @@
 #!/bin/bash
 
-FILE=intcalc
-
-clang ${FILE}.c -o ${FILE} -O2 -mavx -std=c2x\
-	-Iinclude -lm \
-	-Wall -Wextra -Wno-attributes -Wno-unused-function -Wno-unused-variable \
-	-Wno-unused-label -Wno-unused-parameter -Wno-unused-but-set-variable \
-	$1 $2 $3 $4
+# the embedding test is built with the interpreter so the API can't break unnoticed
+for FILE in intcalc embed_test; do
+	clang ${FILE}.c -o ${FILE} -O2 -mavx -std=c2x\
+		-Iinclude -lm -lpthread \
+		-Wall -Wextra -Wno-attributes -Wno-unused-function -Wno-unused-variable \
+		-Wno-unused-label -Wno-unused-parameter -Wno-unused-but-set-variable \
+		$1 $2 $3 $4 || exit 1
+done